@@ -0,0 +1,582 @@
+// Benchmarks for vmap, against std::map, std::unordered_map and a sorted
+// std::vector of pairs.
+//
+// Sweeps the table size (from fits-in-L1 to DRAM), the key type (int,
+// uint64_t and std::string), the access pattern (uniform, Zipf and
+// sequential) and the hit ratio, timing find, lower_bound, equal_range,
+// construction and iteration. One row per measurement, as CSV (or JSON,
+// with --json) on stdout; progress goes to stderr.
+//
+// Every container sees exactly the same keys and queries, and the
+// checksum column (the sum of the mapped values found, counting -1 for a
+// miss) should agree between containers for the same row; if it doesn't,
+// something is broken.
+//
+// Build with VMAP_CONFIG_THREADS (and -pthread) to add vmap_publisher
+// reader throughput for 1, 2, 4... threads.
+//
+// Needs c++11.
+#include "vmap.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#ifdef VMAP_CONFIG_THREADS
+#include <thread>
+#include <atomic>
+#endif
+
+namespace
+{
+    struct options
+    {
+        options()
+          : json( false )
+          , max_size( std::size_t(1) << 22 )
+          , ops( std::size_t(1) << 20 )
+          , seed( 42 )
+        {}
+        bool json;
+        std::size_t max_size;
+        std::size_t ops;         // Lookups per measurement
+        uint64_t seed;
+        std::string filter;      // Only containers whose "name/key_type" contains this
+    };
+
+    // The largest string tables we bother with (they're ~100 bytes a key
+    // in std::map, before we've built the others)
+    const std::size_t max_string_size = std::size_t(1) << 20;
+
+    // Queries are drawn from a buffer of this many keys, cyclically
+    const std::size_t query_count = std::size_t(1) << 18;
+
+    typedef std::chrono::steady_clock clock_type;
+
+    double elapsed_ns( clock_type::time_point start )
+    {
+        return std::chrono::duration<double,std::nano>( clock_type::now() - start ).count();
+    }
+
+    //
+    // Output
+    //
+    class output
+    {
+    public:
+        explicit output( bool json )
+          : json_( json )
+          , rows_( 0 )
+        {
+            if( json_ )
+                std::printf( "[\n" );
+            else
+                std::printf( "operation,container,key_type,size,pattern,hit_ratio,threads,ns_per_op,ops,checksum\n" );
+        }
+        ~output()
+        {
+            if( json_ )
+                std::printf( "\n]\n" );
+        }
+
+        void row( const char* operation, const std::string& container, const char* key_type,
+                  std::size_t size, const char* pattern, double hit_ratio, unsigned threads,
+                  double ns_per_op, std::size_t ops, long long checksum )
+        {
+            if( json_ )
+                std::printf( "%s  {\"operation\": \"%s\", \"container\": \"%s\", \"key_type\": \"%s\", "
+                             "\"size\": %zu, \"pattern\": \"%s\", \"hit_ratio\": %.2f, \"threads\": %u, "
+                             "\"ns_per_op\": %.3f, \"ops\": %zu, \"checksum\": %lld}",
+                             rows_ ? ",\n" : "", operation, container.c_str(), key_type,
+                             size, pattern, hit_ratio, threads, ns_per_op, ops, checksum );
+            else
+                std::printf( "%s,%s,%s,%zu,%s,%.2f,%u,%.3f,%zu,%lld\n",
+                             operation, container.c_str(), key_type,
+                             size, pattern, hit_ratio, threads, ns_per_op, ops, checksum );
+            std::fflush( stdout );
+            ++rows_;
+        }
+    private:
+        bool json_;
+        std::size_t rows_;
+    };
+
+    //
+    // Keys
+    //
+    // Bijective mixes of a counter, so that 2N of them are all different
+    uint32_t fmix32( uint32_t h )
+    {
+        h ^= h >> 16; h *= 0x85ebca6bu;
+        h ^= h >> 13; h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
+    }
+    uint64_t mix64( uint64_t z )
+    {
+        z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+        z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebull;
+        return z ^ ( z >> 31 );
+    }
+
+    template<typename Key> struct key_maker;
+
+    template<> struct key_maker<int>
+    {
+        static const char* name() { return "int"; }
+        static int make( uint64_t i ) { return int( fmix32( uint32_t(i) ) ); }
+    };
+    template<> struct key_maker<uint64_t>
+    {
+        static const char* name() { return "uint64"; }
+        static uint64_t make( uint64_t i ) { return mix64( i ); }
+    };
+    // Paths and URLs, with a shared prefix or two (as string keys tend to
+    // have). The hex part never contains a '/', so they're all different.
+    template<> struct key_maker<std::string>
+    {
+        static const char* name() { return "string"; }
+        static std::string make( uint64_t i )
+        {
+            static const char* const prefixes[] = { "https://www.example.com/catalogue/", "user/", "/usr/local/share/", "" };
+            char hex[17];
+            std::snprintf( hex, sizeof(hex), "%016llx", (unsigned long long)mix64( i ) );
+            return std::string( prefixes[i % 4] ) + hex;
+        }
+    };
+
+    // A table of size keys, the same number of keys which aren't in it
+    // (interleaved with them, so misses are spread about), and the
+    // queries. An entry's mapped value is its rank.
+    template<typename Key>
+    struct dataset
+    {
+        typedef std::pair<Key,int> entry_type;
+
+        struct queries
+        {
+            const char* pattern;
+            double hit_ratio;
+            std::vector<Key> keys;
+        };
+
+        dataset( std::size_t size, uint64_t seed )
+          : size( size )
+          , rng( seed ^ mix64( size ) )
+        {
+            std::vector<Key> all;
+            all.reserve( 2 * size );
+            for( std::size_t i = 0 ; i < 2 * size ; ++i )
+                all.push_back( key_maker<Key>::make( i ) );
+            std::sort( all.begin(), all.end() );
+            present.reserve( size );
+            missing.reserve( size );
+            for( std::size_t i = 0 ; i < 2 * size ; i += 2 )
+            {
+                present.push_back( all[i] );
+                missing.push_back( all[i+1] );
+            }
+            entries.reserve( size );
+            for( std::size_t i = 0 ; i < size ; ++i )
+                entries.push_back( entry_type( present[i], int(i) ) );
+            std::shuffle( entries.begin(), entries.end(), rng );
+
+            add_queries( "uniform", 1.0 );
+            add_queries( "zipf", 1.0 );
+            add_queries( "sequential", 1.0 );
+            add_queries( "uniform", 0.5 );
+            add_queries( "uniform", 0.0 );
+        }
+
+        const queries& find_queries( const char* pattern, double hit_ratio ) const
+        {
+            for( std::size_t i = 0 ; i < query_sets.size() ; ++i )
+                if( std::strcmp( query_sets[i].pattern, pattern ) == 0 && query_sets[i].hit_ratio == hit_ratio )
+                    return query_sets[i];
+            std::abort();
+        }
+
+        std::size_t size;
+        std::mt19937_64 rng;
+        std::vector<Key> present;          // Sorted
+        std::vector<Key> missing;          // Sorted
+        std::vector<entry_type> entries;   // Shuffled
+        std::vector<queries> query_sets;
+    private:
+        void add_queries( const char* pattern, double hit_ratio )
+        {
+            queries q;
+            q.pattern = pattern;
+            q.hit_ratio = hit_ratio;
+            const std::size_t count = std::min( query_count, std::max( size, std::size_t(4096) ) );
+            q.keys.reserve( count );
+            std::uniform_int_distribution<std::size_t> uniform( 0, size - 1 );
+            std::bernoulli_distribution hit( hit_ratio );
+            // Zipf(0.99) over the ranks; which entry gets which rank is
+            // random, so the hot keys aren't all at one end
+            std::vector<double> cdf;
+            std::vector<std::size_t> ranked;
+            if( std::strcmp( pattern, "zipf" ) == 0 )
+            {
+                cdf.resize( size );
+                double total = 0;
+                for( std::size_t i = 0 ; i < size ; ++i )
+                    cdf[i] = total += 1.0 / std::pow( double(i + 1), 0.99 );
+                ranked.resize( size );
+                for( std::size_t i = 0 ; i < size ; ++i )
+                    ranked[i] = i;
+                std::shuffle( ranked.begin(), ranked.end(), rng );
+            }
+            std::uniform_real_distribution<double> unit( 0.0, cdf.empty() ? 1.0 : cdf.back() );
+            for( std::size_t i = 0 ; i < count ; ++i )
+            {
+                std::size_t index;
+                if( !cdf.empty() )
+                    index = ranked[ std::min( std::size_t( std::lower_bound( cdf.begin(), cdf.end(), unit( rng ) ) - cdf.begin() ), size - 1 ) ];
+                else if( std::strcmp( pattern, "sequential" ) == 0 )
+                    index = i % size;
+                else
+                    index = uniform( rng );
+                q.keys.push_back( hit( rng ) ? present[index] : missing[index] );
+            }
+            query_sets.push_back( q );
+        }
+    };
+
+    //
+    // Baselines
+    //
+    // The usual hand-rolled alternative: a sorted vector of pairs, and
+    // std::lower_bound
+    template<typename Key, typename Mapped>
+    class sorted_vector
+    {
+    public:
+        typedef std::pair<Key,Mapped> value_type;
+        typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+        template<typename InputIterator>
+        sorted_vector( InputIterator first, InputIterator last )
+          : entries_( first, last )
+        {
+            std::stable_sort( entries_.begin(), entries_.end(), key_less() );
+            entries_.erase( std::unique( entries_.begin(), entries_.end(), key_equal() ), entries_.end() );
+        }
+
+        std::size_t size() const { return entries_.size(); }
+        const_iterator begin() const { return entries_.begin(); }
+        const_iterator end() const { return entries_.end(); }
+
+        const_iterator lower_bound( const Key& key ) const
+        { return std::lower_bound( entries_.begin(), entries_.end(), key, key_less() ); }
+        const_iterator upper_bound( const Key& key ) const
+        { return std::upper_bound( entries_.begin(), entries_.end(), key, key_less() ); }
+        const_iterator find( const Key& key ) const
+        {
+            const_iterator iter = lower_bound( key );
+            return iter != end() && !( key < iter->first ) ? iter : end();
+        }
+        std::pair<const_iterator,const_iterator> equal_range( const Key& key ) const
+        { return std::make_pair( lower_bound( key ), upper_bound( key ) ); }
+    private:
+        struct key_less
+        {
+            bool operator()( const value_type& lhs, const value_type& rhs ) const { return lhs.first < rhs.first; }
+            bool operator()( const value_type& lhs, const Key& rhs ) const { return lhs.first < rhs; }
+            bool operator()( const Key& lhs, const value_type& rhs ) const { return lhs < rhs.first; }
+        };
+        struct key_equal
+        {
+            bool operator()( const value_type& lhs, const value_type& rhs ) const { return lhs.first == rhs.first; }
+        };
+
+        std::vector<value_type> entries_;
+    };
+
+    // Whether the container has lower_bound (and a meaningful equal_range)
+    template<typename Container> struct is_ordered { enum { value = 1 }; };
+    template<typename Key, typename Mapped>
+    struct is_ordered<std::unordered_map<Key,Mapped> > { enum { value = 0 }; };
+
+    template<typename Container, typename Key>
+    long long lower_bound_value( const Container& container, const Key& key )
+    {
+        typename Container::const_iterator iter = container.lower_bound( key );
+        return iter == container.end() ? -1 : iter->second;
+    }
+
+    //
+    // Measurements
+    //
+    // Runs lookup over opt.ops queries (cycling through the query buffer),
+    // after a short warm up
+    template<typename Lookup, typename Key>
+    double time_lookups( const std::vector<Key>& keys, std::size_t ops, long long& checksum, Lookup lookup )
+    {
+        const std::size_t warm = std::min( ops, keys.size() );
+        long long discard = 0;
+        for( std::size_t i = 0 ; i < warm ; ++i )
+            discard += lookup( keys[i] );
+        checksum = 0;
+        const clock_type::time_point start = clock_type::now();
+        for( std::size_t i = 0, k = 0 ; i < ops ; ++i )
+        {
+            checksum += lookup( keys[k] );
+            if( ++k == keys.size() )
+                k = 0;
+        }
+        const double ns = elapsed_ns( start );
+        if( discard == 0x7fffffffffffffffll )
+            std::fputc( ' ', stderr );
+        return ns / double( ops );
+    }
+
+    template<typename Container, typename Key>
+    void bench_ordered( const Container& container, const std::string& name, const dataset<Key>& data,
+                        const options& opt, output& out, std::true_type )
+    {
+        const char* key_type = key_maker<Key>::name();
+        const typename dataset<Key>::queries& q = data.find_queries( "uniform", 0.5 );
+        long long checksum;
+        double ns = time_lookups( q.keys, opt.ops, checksum,
+                                  [&]( const Key& key ) { return lower_bound_value( container, key ); } );
+        out.row( "lower_bound", name, key_type, data.size, q.pattern, q.hit_ratio, 1, ns, opt.ops, checksum );
+
+        ns = time_lookups( q.keys, opt.ops, checksum, [&]( const Key& key )
+        {
+            long long sum = 0;
+            bool found = false;
+            std::pair<typename Container::const_iterator,typename Container::const_iterator> range = container.equal_range( key );
+            for( ; range.first != range.second ; ++range.first, found = true )
+                sum += range.first->second;
+            return found ? sum : -1;
+        } );
+        out.row( "equal_range", name, key_type, data.size, q.pattern, q.hit_ratio, 1, ns, opt.ops, checksum );
+    }
+    template<typename Container, typename Key>
+    void bench_ordered( const Container&, const std::string&, const dataset<Key>&,
+                        const options&, output&, std::false_type )
+    {}
+
+    template<typename Container, typename Key>
+    void bench_container( const std::string& name, const dataset<Key>& data, const options& opt, output& out )
+    {
+        const char* key_type = key_maker<Key>::name();
+        if( !opt.filter.empty() && ( name + "/" + key_type ).find( opt.filter ) == std::string::npos )
+            return;
+        std::fprintf( stderr, "  %s\n", name.c_str() );
+
+        // Construction, from the shuffled entries. Small tables are built a
+        // few times over, to get a measurable time.
+        const std::size_t builds = std::max( std::size_t(1), std::min( opt.ops, std::size_t(1) << 20 ) / data.size );
+        std::unique_ptr<Container> container;
+        clock_type::time_point start = clock_type::now();
+        for( std::size_t i = 0 ; i < builds ; ++i )
+            container.reset( new Container( data.entries.begin(), data.entries.end() ) );
+        double ns = elapsed_ns( start );
+        out.row( "build", name, key_type, data.size, "shuffled", 1.0, 1,
+                 ns / double( builds * data.size ), builds * data.size, (long long)container->size() );
+
+        // Iteration: the sum of the mapped values
+        long long checksum = 0;
+        start = clock_type::now();
+        for( std::size_t i = 0 ; i < builds ; ++i )
+            for( typename Container::const_iterator iter = container->begin() ; iter != container->end() ; ++iter )
+                checksum += iter->second;
+        ns = elapsed_ns( start );
+        out.row( "iterate", name, key_type, data.size, "sequential", 1.0, 1,
+                 ns / double( builds * data.size ), builds * data.size, checksum );
+
+        const Container& lookup = *container;
+        for( std::size_t i = 0 ; i < data.query_sets.size() ; ++i )
+        {
+            const typename dataset<Key>::queries& q = data.query_sets[i];
+            ns = time_lookups( q.keys, opt.ops, checksum, [&]( const Key& key ) -> long long
+            {
+                typename Container::const_iterator iter = lookup.find( key );
+                return iter == lookup.end() ? -1 : iter->second;
+            } );
+            out.row( "find", name, key_type, data.size, q.pattern, q.hit_ratio, 1, ns, opt.ops, checksum );
+        }
+
+        bench_ordered( lookup, name, data, opt, out,
+                       std::integral_constant<bool,is_ordered<Container>::value>() );
+    }
+
+    // The containers which take any key type
+    template<typename Key>
+    void bench_common( const dataset<Key>& data, const options& opt, output& out )
+    {
+        typedef std::allocator<std::pair<Key,int> > allocator;
+        bench_container<std::map<Key,int> >( "std::map", data, opt, out );
+        bench_container<std::unordered_map<Key,int> >( "std::unordered_map", data, opt, out );
+        bench_container<sorted_vector<Key,int> >( "sorted_vector", data, opt, out );
+        bench_container<vmap<Key,int> >( "vmap", data, opt, out );
+        bench_container<vmap<Key,int,std::less<Key>,allocator,vmap_split> >( "vmap_split", data, opt, out );
+        bench_container<vmap<Key,int,std::less<Key>,allocator,vmap_pairs,vmap_eytzinger_search> >( "vmap_eytzinger", data, opt, out );
+        bench_container<vmap<Key,int,std::less<Key>,allocator,vmap_pairs,vmap_btree_search<> > >( "vmap_btree", data, opt, out );
+        bench_container<vmap<Key,int,std::less<Key>,allocator,vmap_pairs,vmap_hashed_search<> > >( "vmap_hashed", data, opt, out );
+        bench_container<vmap<Key,int,std::less<Key>,allocator,vmap_pairs,vmap_filtered_search<> > >( "vmap_filtered", data, opt, out );
+    }
+
+    template<typename Key>
+    void bench_specific( const dataset<Key>& data, const options& opt, output& out )
+    {
+        typedef std::allocator<std::pair<Key,int> > allocator;
+        bench_container<vmap<Key,int,std::less<Key>,allocator,vmap_split,vmap_kary_search> >( "vmap_split_kary", data, opt, out );
+        bench_container<vmap<Key,int,std::less<Key>,allocator,vmap_split,vmap_learned_search<> > >( "vmap_split_learned", data, opt, out );
+        bench_container<vmap<Key,int,std::less<Key>,vmap_huge_page_allocator<std::pair<Key,int> > > >( "vmap_huge_pages", data, opt, out );
+        bench_container<vmap<Key,int,std::less<Key>,allocator,vmap_packed<> > >( "vmap_packed", data, opt, out );
+    }
+    void bench_specific( const dataset<std::string>& data, const options& opt, output& out )
+    {
+        typedef std::allocator<std::pair<std::string,int> > allocator;
+        bench_container<vmap<std::string,int,std::less<std::string>,allocator,vmap_string_keys> >( "vmap_string_keys", data, opt, out );
+        bench_container<vmap<std::string,int,std::less<std::string>,allocator,vmap_front_coded<> > >( "vmap_front_coded", data, opt, out );
+    }
+
+    template<typename Key>
+    void bench_key_type( const std::vector<std::size_t>& sizes, const options& opt, output& out )
+    {
+        for( std::size_t i = 0 ; i < sizes.size() ; ++i )
+        {
+            std::fprintf( stderr, "%s, %zu keys\n", key_maker<Key>::name(), sizes[i] );
+            const dataset<Key> data( sizes[i], opt.seed );
+            bench_common( data, opt, out );
+            bench_specific( data, opt, out );
+        }
+    }
+
+#ifdef VMAP_CONFIG_THREADS
+    // Reader throughput through a vmap_publisher, while a writer publishes
+    // a fresh copy of the table every millisecond. Each snapshot covers 64
+    // lookups. ns_per_op is wall time over all the threads' lookups.
+    void bench_publisher( std::size_t size, const options& opt, output& out )
+    {
+        typedef vmap<uint64_t,int> table_type;
+        const std::string name = "vmap_publisher";
+        if( !opt.filter.empty() && ( name + "/uint64" ).find( opt.filter ) == std::string::npos )
+            return;
+        std::fprintf( stderr, "publisher, %zu keys\n", size );
+        const dataset<uint64_t> data( size, opt.seed );
+        const table_type table( data.entries.begin(), data.entries.end() );
+        const std::vector<uint64_t>& keys = data.find_queries( "uniform", 0.5 ).keys;
+        const unsigned max_threads = std::max( 4u, std::thread::hardware_concurrency() );
+        for( unsigned threads = 1 ; threads <= max_threads ; threads *= 2 )
+        {
+            vmap_publisher<table_type> publisher( table );
+            std::atomic<bool> done( false );
+            std::thread writer( [&]
+            {
+                while( !done.load() )
+                {
+                    publisher.publish( table );
+                    std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+                }
+            } );
+            const std::size_t per_thread = opt.ops / threads;
+            std::vector<long long> sums( threads );
+            std::vector<std::thread> readers;
+            const clock_type::time_point start = clock_type::now();
+            for( unsigned t = 0 ; t < threads ; ++t )
+                readers.push_back( std::thread( [&,t]
+                {
+                    vmap_publisher<table_type>::reader reader( publisher );
+                    long long sum = 0;
+                    std::size_t k = ( t * keys.size() ) / threads;
+                    for( std::size_t i = 0 ; i < per_thread ; i += 64 )
+                    {
+                        const vmap_publisher<table_type>::snapshot snapshot( reader );
+                        for( std::size_t j = i ; j < i + 64 && j < per_thread ; ++j )
+                        {
+                            table_type::const_iterator iter = snapshot->find( keys[k] );
+                            sum += iter == snapshot->end() ? -1 : iter->second;
+                            if( ++k == keys.size() )
+                                k = 0;
+                        }
+                    }
+                    sums[t] = sum;
+                } ) );
+            for( unsigned t = 0 ; t < threads ; ++t )
+                readers[t].join();
+            const double ns = elapsed_ns( start );
+            done.store( true );
+            writer.join();
+            long long checksum = 0;
+            for( unsigned t = 0 ; t < threads ; ++t )
+                checksum += sums[t];
+            out.row( "find", name, "uint64", size, "uniform", 0.5, threads,
+                     ns / double( per_thread * threads ), per_thread * threads, checksum );
+        }
+    }
+#endif
+
+    void usage( const char* program )
+    {
+        std::fprintf( stderr,
+                      "usage: %s [--json] [--quick] [--max-size N] [--ops N] [--seed N] [--filter TEXT]\n"
+                      "  --json        JSON rather than CSV\n"
+                      "  --quick       tables of up to 64K keys, 64K lookups a measurement\n"
+                      "  --max-size N  largest table (default 4M keys; 1M for strings)\n"
+                      "  --ops N       lookups a measurement (default 1M)\n"
+                      "  --seed N      for the keys and queries (default 42)\n"
+                      "  --filter TEXT only containers whose 'name/key_type' contains TEXT\n",
+                      program );
+        std::exit( 2 );
+    }
+}
+
+int main( int argc, char** argv )
+{
+    options opt;
+    for( int i = 1 ; i < argc ; ++i )
+    {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if( arg == "--json" )
+            opt.json = true;
+        else if( arg == "--quick" )
+        {
+            opt.max_size = std::size_t(1) << 16;
+            opt.ops = std::size_t(1) << 16;
+        }
+        else if( arg == "--max-size" && has_value )
+            opt.max_size = std::strtoull( argv[++i], 0, 0 );
+        else if( arg == "--ops" && has_value )
+            opt.ops = std::strtoull( argv[++i], 0, 0 );
+        else if( arg == "--seed" && has_value )
+            opt.seed = std::strtoull( argv[++i], 0, 0 );
+        else if( arg == "--filter" && has_value )
+            opt.filter = argv[++i];
+        else
+            usage( argv[0] );
+    }
+    if( opt.ops == 0 )
+        usage( argv[0] );
+
+    // 8KB, 64KB, 512KB, 4MB and 32MB of int/int pairs: L1, L2, L2/L3,
+    // L3 and DRAM on most machines
+    std::vector<std::size_t> sizes, string_sizes;
+    for( std::size_t size = std::size_t(1) << 10 ; size <= opt.max_size ; size <<= 3 )
+    {
+        sizes.push_back( size );
+        if( size <= max_string_size )
+            string_sizes.push_back( size );
+    }
+
+    output out( opt.json );
+    bench_key_type<int>( sizes, opt, out );
+    bench_key_type<uint64_t>( sizes, opt, out );
+    bench_key_type<std::string>( string_sizes, opt, out );
+#ifdef VMAP_CONFIG_THREADS
+    bench_publisher( std::min( opt.max_size, std::size_t(1) << 20 ), opt, out );
+#endif
+    return 0;
+}
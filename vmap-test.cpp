@@ -1,7 +1,11 @@
 #include "vmap.h"
+#include <string>
+#include <limits>
 // For sanity's sake
 template
 class vmap<int,int>;
+template
+class vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,vmap_split>;
 
 #define CATCH_CONFIG_MAIN
 #include "Catch/single_include/catch.hpp"
@@ -30,6 +34,45 @@ bool maps_equal( const VmapT& vmap, const MapT& map )
     return true;
 }
 
+// Check the vmap lookup functions against the map's, for keys in [low,high]
+template<typename VmapT,
+         typename MapT>
+bool lookups_equal( const VmapT& vmap, const MapT& map, int low, int high )
+{
+    for( int key = low ; key <= high ; ++key )
+    {
+        typename MapT::const_iterator miter = map.lower_bound(key);
+        typename VmapT::const_iterator viter = vmap.lower_bound(key);
+        REQUIRE( std::distance(map.begin(),miter) == std::distance(vmap.begin(),viter) );
+
+        miter = map.upper_bound(key);
+        viter = vmap.upper_bound(key);
+        REQUIRE( std::distance(map.begin(),miter) == std::distance(vmap.begin(),viter) );
+
+        miter = map.find(key);
+        viter = vmap.find(key);
+        REQUIRE( (miter == map.end()) == (viter == vmap.end()) );
+        if( miter != map.end() )
+        {
+            REQUIRE( std::distance(map.begin(),miter) == std::distance(vmap.begin(),viter) );
+            REQUIRE( vmap.at(key) == miter->second );
+        }
+        else
+        {
+            REQUIRE_THROWS_AS( vmap.at(key), std::out_of_range );
+        }
+
+        const std::pair<typename VmapT::const_iterator,
+                        typename VmapT::const_iterator> range = vmap.equal_range(key);
+        REQUIRE( std::distance(range.first,range.second) == (miter == map.end() ? 0 : 1) );
+        if( miter != map.end() )
+        {
+            REQUIRE( range.first == viter );
+        }
+    }
+    return true;
+}
+
 
 
 TEST_CASE( "vmap/ctor/default", "Default construct a vmap" )
@@ -428,6 +471,8 @@ TEST_CASE( "vmap/get/fail", "get : key not present" )
     REQUIRE( maps_equal( vmap, amap ) );
     REQUIRE( vmap.get(-99) == key_type() );
     REQUIRE( vmap.get(-99,-99) == -99 );
+    // A miss doesn't make a new mapped_type each time
+    REQUIRE( &vmap.get(-99) == &vmap.get(-98) );
 }
 
 TEST_CASE( "vmap/get/pass", "get : key not present" )
@@ -550,3 +595,2135 @@ TEST_CASE( "vmap/at/fail", "at: Key not present" )
     REQUIRE_THROWS_AS( vmap.at(-7), std::out_of_range );
     REQUIRE_THROWS_AS( vmap.at(25), std::out_of_range );
 }
+
+
+TEST_CASE( "vmap/split/from_map", "Split layout: construct from a map" )
+{
+    typedef int key_type;
+    typedef int mapped_type;
+    typedef std::map<key_type,mapped_type> map_type;
+    typedef vmap<key_type,mapped_type,std::less<key_type>,
+                 std::allocator<std::pair<key_type,mapped_type> >,vmap_split> vmap_type;
+
+    map_type amap(bounds_map());
+    vmap_type vmap1(amap);
+    REQUIRE( maps_equal( vmap1, amap ) );
+    REQUIRE( vmap1.rbegin()->first == 10 );
+    REQUIRE( vmap1.rbegin()->second == 5 );
+    REQUIRE( (vmap1.end() - vmap1.begin()) == 5 );
+
+    vmap_type vmap2( vmap1 );
+    REQUIRE( maps_equal( vmap2, amap ) );
+    vmap_type vmap3;
+    REQUIRE( vmap3.empty() );
+    REQUIRE( vmap3.begin() == vmap3.end() );
+    vmap3.swap( vmap2 );
+    REQUIRE( vmap2.empty() );
+    REQUIRE( maps_equal( vmap3, amap ) );
+}
+
+TEST_CASE( "vmap/split/lookup", "Split layout: lookups agree with std::map" )
+{
+    typedef int key_type;
+    typedef std::vector<int> mapped_type;
+    typedef std::map<key_type,mapped_type> map_type;
+    typedef vmap<key_type,mapped_type,std::less<key_type>,
+                 std::allocator<std::pair<key_type,mapped_type> >,vmap_split> vmap_type;
+
+    map_type amap;
+    for( int i = 0 ; i < 100 ; ++i )
+    {
+        amap[i*3] = mapped_type( 8, i );
+    }
+    vmap_type vmap1(amap);
+    REQUIRE( maps_equal( vmap1, amap ) );
+    REQUIRE( lookups_equal( vmap1, amap, -5, 305 ) );
+    REQUIRE( vmap1.get(42) == amap[42] );
+    REQUIRE( vmap1.get(43).empty() );
+
+    // The proxy converts to a real pair
+    const std::pair<key_type,mapped_type> entry = *vmap1.find(99);
+    REQUIRE( entry.first == 99 );
+    REQUIRE( entry.second == amap[99] );
+}
+
+TEST_CASE( "vmap/eytzinger/sizes", "Eytzinger search: lookups agree with std::map for all small sizes" )
+{
+    typedef int key_type;
+    typedef int mapped_type;
+    typedef std::map<key_type,mapped_type> map_type;
+    typedef vmap<key_type,mapped_type,std::less<key_type>,
+                 std::allocator<std::pair<key_type,mapped_type> >,
+                 vmap_pairs,vmap_eytzinger_search> vmap_type;
+
+    map_type amap;
+    for( int count = 0 ; count < 70 ; ++count )
+    {
+        vmap_type vmap1(amap);
+        REQUIRE( maps_equal( vmap1, amap ) );
+        REQUIRE( lookups_equal( vmap1, amap, -2, 2*count+2 ) );
+        amap[2*count] = count;
+    }
+}
+
+TEST_CASE( "vmap/eytzinger/greater", "Eytzinger search with a reversed predicate and split layout" )
+{
+    typedef int key_type;
+    typedef int mapped_type;
+    typedef std::greater<key_type> key_compare;
+    typedef std::map<key_type,mapped_type,key_compare> map_type;
+    typedef vmap<key_type,mapped_type,key_compare,
+                 std::allocator<std::pair<key_type,mapped_type> >,
+                 vmap_split,vmap_eytzinger_search> vmap_type;
+
+    map_type amap;
+    for( int i = 0 ; i < 1000 ; ++i )
+    {
+        amap[(i*7919) % 3001] = i;
+    }
+    vmap_type vmap1(amap);
+    REQUIRE( maps_equal( vmap1, amap ) );
+    REQUIRE( lookups_equal( vmap1, amap, -1, 3002 ) );
+
+    vmap_type vmap2;
+    vmap2.swap( vmap1 );
+    REQUIRE( vmap1.empty() );
+    REQUIRE( vmap1.find(5) == vmap1.end() );
+    REQUIRE( lookups_equal( vmap2, amap, -1, 3002 ) );
+}
+
+TEST_CASE( "vmap/eytzinger/string", "Eytzinger search with string keys" )
+{
+    typedef std::string key_type;
+    typedef int mapped_type;
+    typedef std::map<key_type,mapped_type> map_type;
+    typedef vmap<key_type,mapped_type,std::less<key_type>,
+                 std::allocator<std::pair<key_type,mapped_type> >,
+                 vmap_pairs,vmap_eytzinger_search> vmap_type;
+
+    map_type amap;
+    amap["delta"] = 4;
+    amap["alpha"] = 1;
+    amap["echo"] = 5;
+    amap["charlie"] = 3;
+    vmap_type vmap1(amap);
+    REQUIRE( maps_equal( vmap1, amap ) );
+    REQUIRE( vmap1.at("alpha") == 1 );
+    REQUIRE( vmap1.at("echo") == 5 );
+    REQUIRE( vmap1.find("bravo") == vmap1.end() );
+    REQUIRE( vmap1.lower_bound("bravo")->first == "charlie" );
+    REQUIRE( vmap1.upper_bound("delta")->first == "echo" );
+    REQUIRE( vmap1.upper_bound("echo") == vmap1.end() );
+    REQUIRE( vmap1.lower_bound("a") == vmap1.begin() );
+}
+
+// Compare a vmap with the given search policy and layout with std::map,
+// probing with each key, each midpoint between neighbouring keys, and
+// the extremes
+template<typename Search, typename Layout, typename KeyType>
+void check_against_map( const std::vector<KeyType>& keys )
+{
+    typedef std::map<KeyType,int> map_type;
+    typedef vmap<KeyType,int,std::less<KeyType>,
+                 std::allocator<std::pair<KeyType,int> >,
+                 Layout,Search> vmap_type;
+    map_type amap;
+    for( std::size_t i = 0 ; i < keys.size() ; ++i )
+    {
+        amap[keys[i]] = static_cast<int>(i);
+    }
+    const vmap_type vmap1(amap);
+    REQUIRE( maps_equal( vmap1, amap ) );
+
+    std::vector<KeyType> probes;
+    probes.push_back( std::numeric_limits<KeyType>::min() );
+    probes.push_back( std::numeric_limits<KeyType>::max() );
+    for( typename map_type::const_iterator iter = amap.begin() ; iter != amap.end() ; ++iter )
+    {
+        probes.push_back( iter->first );
+        typename map_type::const_iterator next = iter;
+        if( ++next != amap.end() )
+            probes.push_back( iter->first + (next->first - iter->first)/2 );
+    }
+    for( std::size_t i = 0 ; i < probes.size() ; ++i )
+    {
+        const KeyType key = probes[i];
+        REQUIRE( std::distance( amap.begin(), amap.lower_bound(key) ) == (vmap1.lower_bound(key) - vmap1.begin()) );
+        REQUIRE( std::distance( amap.begin(), amap.upper_bound(key) ) == (vmap1.upper_bound(key) - vmap1.begin()) );
+        REQUIRE( (amap.find(key) == amap.end()) == (vmap1.find(key) == vmap1.end()) );
+    }
+}
+
+TEST_CASE( "vmap/kary/sizes", "k-ary search: every tree shape up to three levels" )
+{
+    std::vector<int> keys;
+    for( int count = 0 ; count < 300 ; ++count )
+    {
+        check_against_map<vmap_kary_search,vmap_split>( keys );
+        keys.push_back( 3*count - 100 );
+    }
+}
+
+TEST_CASE( "vmap/kary/types", "k-ary search: each of the SIMD key types" )
+{
+    std::vector<unsigned int> u32;
+    std::vector<long long> i64;
+    std::vector<unsigned long long> u64;
+    std::vector<float> f32;
+    std::vector<double> f64;
+    unsigned long long seed = 12345;
+    for( int i = 0 ; i < 5000 ; ++i )
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        u32.push_back( static_cast<unsigned int>( seed >> 32 ) );
+        i64.push_back( static_cast<long long>( seed ) );
+        u64.push_back( seed );
+        f32.push_back( static_cast<float>( static_cast<int>( seed >> 40 ) - (1 << 23) ) / 1024.0f );
+        f64.push_back( static_cast<double>( static_cast<long long>( seed >> 2 ) ) * 1e-9 );
+    }
+    f32.push_back( std::numeric_limits<float>::infinity() );
+    f64.push_back( -std::numeric_limits<double>::infinity() );
+    check_against_map<vmap_kary_search,vmap_split>( u32 );
+    check_against_map<vmap_kary_search,vmap_split>( i64 );
+    check_against_map<vmap_kary_search,vmap_split>( u64 );
+    check_against_map<vmap_kary_search,vmap_split>( f32 );
+    check_against_map<vmap_kary_search,vmap_split>( f64 );
+}
+
+TEST_CASE( "vmap/kary/fallback", "k-ary search: other keys and predicates fall back to binary search" )
+{
+    typedef int key_type;
+    typedef int mapped_type;
+    typedef std::greater<key_type> key_compare;
+    typedef std::map<key_type,mapped_type,key_compare> map_type;
+    typedef vmap<key_type,mapped_type,key_compare,
+                 std::allocator<std::pair<key_type,mapped_type> >,
+                 vmap_pairs,vmap_kary_search> vmap_type;
+
+    map_type amap;
+    for( int i = 0 ; i < 100 ; ++i )
+    {
+        amap[i*5] = i;
+    }
+    vmap_type vmap1(amap);
+    REQUIRE( maps_equal( vmap1, amap ) );
+    REQUIRE( lookups_equal( vmap1, amap, -5, 505 ) );
+
+    typedef vmap<std::string,int,std::less<std::string>,
+                 std::allocator<std::pair<std::string,int> >,
+                 vmap_pairs,vmap_kary_search> svmap_type;
+    std::map<std::string,int> smap;
+    smap["one"] = 1;
+    smap["two"] = 2;
+    svmap_type svmap(smap);
+    REQUIRE( svmap.at("two") == 2 );
+    REQUIRE( svmap.find("three") == svmap.end() );
+}
+
+TEST_CASE( "vmap/binary/branchless", "Branch-free binary search: lookups agree with std::map for all small sizes" )
+{
+    typedef int key_type;
+    typedef int mapped_type;
+    typedef std::greater<key_type> key_compare;
+    typedef std::map<key_type,mapped_type,key_compare> map_type;
+    typedef vmap<key_type,mapped_type,key_compare> vmap_type;
+
+    map_type amap;
+    for( int count = 0 ; count < 70 ; ++count )
+    {
+        vmap_type vmap1(amap);
+        REQUIRE( maps_equal( vmap1, amap ) );
+        REQUIRE( lookups_equal( vmap1, amap, -2, 2*count+2 ) );
+        amap[2*count] = count;
+    }
+}
+
+// find_many and lower_bound_many should give the same answers as find and
+// lower_bound, key by key
+template<typename VmapT>
+bool batch_lookups_equal( const VmapT& vmap, const std::vector<typename VmapT::key_type>& keys )
+{
+    typedef typename VmapT::const_iterator const_iterator;
+    std::vector<const_iterator> found;
+    std::vector<const_iterator> bounds;
+    vmap.find_many( keys.begin(), keys.end(), std::back_inserter(found) );
+    vmap.lower_bound_many( keys.begin(), keys.end(), std::back_inserter(bounds) );
+    REQUIRE( found.size() == keys.size() );
+    REQUIRE( bounds.size() == keys.size() );
+    for( std::size_t i = 0 ; i < keys.size() ; ++i )
+    {
+        REQUIRE( found[i] == vmap.find(keys[i]) );
+        REQUIRE( bounds[i] == vmap.lower_bound(keys[i]) );
+    }
+    return true;
+}
+
+TEST_CASE( "vmap/batch/int", "find_many/lower_bound_many: each search policy" )
+{
+    typedef int key_type;
+    typedef int mapped_type;
+    typedef std::map<key_type,mapped_type> map_type;
+    typedef std::allocator<std::pair<key_type,mapped_type> > allocator_type;
+
+    std::vector<key_type> keys;
+    for( int i = 0 ; i < 1000 ; ++i )
+    {
+        keys.push_back( (i*7919) % 2003 - 1 );
+    }
+    map_type amap;
+    for( int count = 0 ; count < 600 ; count += 37 )
+    {
+        vmap<key_type,mapped_type> vmap1(amap);
+        vmap<key_type,mapped_type,std::less<key_type>,allocator_type,vmap_split,vmap_eytzinger_search> vmap2(amap);
+        vmap<key_type,mapped_type,std::less<key_type>,allocator_type,vmap_pairs,vmap_kary_search> vmap3(amap);
+        REQUIRE( batch_lookups_equal( vmap1, keys ) );
+        REQUIRE( batch_lookups_equal( vmap2, keys ) );
+        REQUIRE( batch_lookups_equal( vmap3, keys ) );
+        for( int i = count ; i < count+37 ; ++i )
+        {
+            amap[3*i] = i;
+        }
+    }
+}
+
+TEST_CASE( "vmap/batch/string", "find_many: string keys, and an empty range" )
+{
+    typedef std::string key_type;
+    typedef int mapped_type;
+    typedef std::map<key_type,mapped_type> map_type;
+    typedef vmap<key_type,mapped_type> vmap_type;
+
+    map_type amap;
+    amap["b"] = 1;
+    amap["d"] = 2;
+    amap["f"] = 3;
+    vmap_type vmap1(amap);
+
+    std::vector<key_type> keys;
+    keys.push_back("a");
+    keys.push_back("b");
+    keys.push_back("e");
+    keys.push_back("f");
+    keys.push_back("g");
+    REQUIRE( batch_lookups_equal( vmap1, keys ) );
+
+    std::vector<vmap_type::const_iterator> found( keys.size() );
+    REQUIRE( vmap1.find_many( keys.begin(), keys.begin(), found.begin() ) == found.begin() );
+    REQUIRE( vmap1.find_many( keys.begin(), keys.end(), found.begin() ) == found.end() );
+    REQUIRE( found[0] == vmap1.end() );
+    REQUIRE( found[1]->second == 1 );
+    REQUIRE( found[3]->second == 3 );
+}
+
+TEST_CASE( "vmap/ctor/range", "Construct from an unsorted range with repeated keys" )
+{
+    typedef int key_type;
+    typedef int mapped_type;
+    typedef std::map<key_type,mapped_type> map_type;
+    typedef vmap<key_type,mapped_type> vmap_type;
+    typedef std::vector<std::pair<key_type,mapped_type> > vector_type;
+
+    vector_type entries;
+    for( int i = 0 ; i < 300000 ; ++i )
+    {
+        entries.push_back( std::make_pair( static_cast<int>( (i*7919LL) % 100003 ), i ) );
+    }
+    // std::map's range ctor keeps the first of any repeated keys; so should we
+    const map_type amap( entries.begin(), entries.end() );
+    const vmap_type vmap1( entries.begin(), entries.end() );
+    REQUIRE( maps_equal( vmap1, amap ) );
+
+    typedef vmap<key_type,mapped_type,std::greater<key_type>,
+                 std::allocator<std::pair<key_type,mapped_type> >,vmap_split> rvmap_type;
+    const std::map<key_type,mapped_type,std::greater<key_type> > rmap( entries.begin(), entries.begin()+1000 );
+    const rvmap_type vmap2( entries.begin(), entries.begin()+1000 );
+    REQUIRE( maps_equal( vmap2, rmap ) );
+
+    const vmap_type vmap3( entries.begin(), entries.begin() );
+    REQUIRE( vmap3.empty() );
+}
+
+TEST_CASE( "vmap/ctor/sorted_unique", "Construct from entries which are already sorted" )
+{
+    typedef int key_type;
+    typedef int mapped_type;
+    typedef std::map<key_type,mapped_type> map_type;
+    typedef vmap<key_type,mapped_type> vmap_type;
+
+    const map_type amap( bounds_map() );
+    const vmap_type::vector_type entries( amap.begin(), amap.end() );
+    const vmap_type vmap1( vmap_sorted_unique, entries );
+    REQUIRE( maps_equal( vmap1, amap ) );
+    REQUIRE( vmap1.at(5) == 4 );
+}
+
+TEST_CASE( "vmap/ctor/adopt", "Move-construct from vectors and maps" )
+{
+#ifdef VMAP_CONFIG_MOVE
+    typedef int key_type;
+    typedef std::string mapped_type;
+    typedef std::map<key_type,mapped_type> map_type;
+    typedef vmap<key_type,mapped_type> vmap_type;
+    typedef vmap<key_type,mapped_type,std::less<key_type>,
+                 std::allocator<std::pair<key_type,mapped_type> >,vmap_split> svmap_type;
+
+    map_type amap;
+    amap[3] = "three";
+    amap[1] = "one";
+    amap[2] = "two";
+
+    // A sorted vector's entries are moved out of it
+    vmap_type::vector_type entries( amap.begin(), amap.end() );
+    vmap_type vmap1( vmap_sorted_unique, std::move(entries) );
+    REQUIRE( entries.empty() );
+    REQUIRE( maps_equal( vmap1, amap ) );
+
+    // An unsorted one is sorted in place
+    vmap_type::vector_type unsorted( amap.rbegin(), amap.rend() );
+    unsorted.push_back( std::make_pair( 2, std::string("deux") ) );
+    vmap_type vmap2( std::move(unsorted) );
+    REQUIRE( maps_equal( vmap2, amap ) );
+
+    svmap_type::vector_type sentries( amap.begin(), amap.end() );
+    svmap_type vmap3( vmap_sorted_unique, std::move(sentries) );
+    REQUIRE( maps_equal( vmap3, amap ) );
+
+    map_type bmap( amap );
+    vmap_type vmap4( std::move(bmap) );
+    REQUIRE( bmap.empty() );
+    REQUIRE( maps_equal( vmap4, amap ) );
+#else
+    WARN( "Move semantics not enabled" );
+#endif
+}
+
+template<typename VmapT>
+static void check_updates()
+{
+    std::map<int,int> amap;
+    for( int i = 0 ; i < 100 ; ++i )
+        amap[i*3] = i;
+    VmapT vmap1( amap );
+
+    // Through iterators, at() and []
+    for( typename VmapT::iterator iter = vmap1.begin() ; iter != vmap1.end() ; ++iter )
+        iter->second += 1000;
+    vmap1.find( 3 )->second = -1;
+    vmap1.at( 6 ) = -2;
+    vmap1[9] = -3;
+    REQUIRE_THROWS_AS( vmap1[10], std::out_of_range );
+    REQUIRE( vmap1.size() == amap.size() );
+    REQUIRE( vmap1.at( 0 ) == 1000 );
+    REQUIRE( vmap1.at( 3 ) == -1 );
+    REQUIRE( vmap1.at( 6 ) == -2 );
+    REQUIRE( vmap1.at( 9 ) == -3 );
+    REQUIRE( vmap1.at( 297 ) == 1099 );
+
+    // iterator -> const_iterator
+    const typename VmapT::const_iterator citer = vmap1.lower_bound( 4 );
+    REQUIRE( citer == vmap1.find( 6 ) );
+    REQUIRE( citer->first == 6 );
+
+    // Copies are independent
+    VmapT vmap2( vmap1 );
+    vmap2[0] = 7;
+    REQUIRE( vmap1.at( 0 ) == 1000 );
+    REQUIRE( vmap2.at( 0 ) == 7 );
+    vmap2 = vmap1;
+    REQUIRE( vmap2.at( 0 ) == 1000 );
+
+    // Swapping swaps the arrays
+    const int* data = &vmap1.at( 0 );
+    VmapT vmap3;
+    vmap3.swap( vmap1 );
+    REQUIRE( vmap1.empty() );
+    REQUIRE( &vmap3.at( 0 ) == data );
+#ifdef VMAP_CONFIG_MOVE
+    VmapT vmap4( std::move(vmap3) );
+    REQUIRE( &vmap4.at( 0 ) == data );
+#endif
+}
+
+TEST_CASE( "vmap/update", "Mapped values can be updated in place" )
+{
+    check_updates<vmap<int,int> >();
+    check_updates<vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,vmap_split> >();
+    check_updates<vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,vmap_pairs,vmap_eytzinger_search> >();
+}
+
+TEST_CASE( "vmap/view/roundtrip", "Save a vmap, and look things up in a vmap_view of the file" )
+{
+    typedef int key_type;
+    typedef double mapped_type;
+    typedef std::map<key_type,mapped_type> map_type;
+    typedef vmap<key_type,mapped_type> vmap_type;
+    typedef vmap_view<key_type,mapped_type> view_type;
+    const char* path = "vmap-test.view";
+
+    map_type amap;
+    for( int i = 0 ; i < 10000 ; ++i )
+    {
+        amap[i*3] = i * 0.5;
+    }
+    vmap_save( vmap_type(amap), path );
+    {
+        const view_type view( path );
+        REQUIRE( maps_equal( view, amap ) );
+        REQUIRE( lookups_equal( view, amap, -2, 30002 ) );
+        REQUIRE( view.get( 4, -1.0 ) == -1.0 );
+        REQUIRE( view.get( 6 ) == 1.0 );
+    }
+
+    // Split layout, reversed order
+    typedef std::map<key_type,mapped_type,std::greater<key_type> > rmap_type;
+    typedef vmap<key_type,mapped_type,std::greater<key_type>,
+                 std::allocator<std::pair<key_type,mapped_type> >,vmap_split> rvmap_type;
+    const rmap_type rmap( amap.begin(), amap.end() );
+    vmap_save( rvmap_type(rmap), path );
+    {
+        const vmap_view<key_type,mapped_type,std::greater<key_type> > view( path );
+        REQUIRE( maps_equal( view, rmap ) );
+        REQUIRE( lookups_equal( view, rmap, -2, 302 ) );
+    }
+
+    // Empty
+    vmap_save( vmap_type(), path );
+    {
+        view_type view( path );
+        REQUIRE( view.empty() );
+        REQUIRE( view.begin() == view.end() );
+        REQUIRE( view.find( 1 ) == view.end() );
+#ifdef VMAP_CONFIG_MOVE
+        view_type view2( std::move(view) );
+        REQUIRE( view2.empty() );
+#endif
+    }
+    std::remove( path );
+}
+
+TEST_CASE( "vmap/view/bad", "vmap_view refuses files which aren't what it expects" )
+{
+    const char* path = "vmap-test.view";
+    std::map<int,int> amap;
+    amap[1] = 2;
+    vmap_save( vmap<int,int>(amap), path );
+
+    // Different sizes of key or mapped type
+    REQUIRE_THROWS_AS( (vmap_view<long long,int>( path )), std::runtime_error );
+    REQUIRE_THROWS_AS( (vmap_view<int,double>( path )), std::runtime_error );
+    REQUIRE( (vmap_view<int,int>( path )).at( 1 ) == 2 );
+
+    // Not a vmap file at all
+    std::FILE* file = std::fopen( path, "wb" );
+    std::fputs( "This is not a vmap file. It isn't even long enough to be one, really", file );
+    std::fclose( file );
+    REQUIRE_THROWS_AS( (vmap_view<int,int>( path )), std::runtime_error );
+    std::remove( path );
+
+    REQUIRE_THROWS_AS( (vmap_view<int,int>( path )), std::runtime_error );
+}
+
+TEST_CASE( "vmap/learned/sizes", "Learned search: lookups agree with std::map for all small sizes" )
+{
+    typedef std::map<int,int> map_type;
+    typedef vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,
+                 vmap_split,vmap_learned_search<> > vmap_type;
+    map_type amap;
+    for( int count = 0 ; count < 70 ; ++count )
+    {
+        vmap_type vmap1(amap);
+        REQUIRE( maps_equal( vmap1, amap ) );
+        REQUIRE( lookups_equal( vmap1, amap, -2, count*count+2 ) );
+        amap[count*count] = count;
+    }
+}
+
+TEST_CASE( "vmap/learned/distributions", "Learned search: even, skewed and clustered keys of various types" )
+{
+    std::vector<int> even;
+    std::vector<long long> squares;
+    std::vector<unsigned long long> random;
+    std::vector<double> clustered;
+    std::vector<short> dense;
+    unsigned long long seed = 54321;
+    for( int i = 0 ; i < 5000 ; ++i )
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        even.push_back( i*10 + static_cast<int>( seed >> 61 ) );
+        squares.push_back( static_cast<long long>(i) * i * i );
+        random.push_back( seed );
+        clustered.push_back( (i % 3 == 0 ? 1e12 : 0.0) + static_cast<double>( seed >> 40 ) * 1e-3 );
+        dense.push_back( static_cast<short>( i - 2500 ) );
+    }
+    check_against_map<vmap_learned_search<4>,vmap_pairs>( even );
+    check_against_map<vmap_learned_search<4>,vmap_pairs>( squares );
+    check_against_map<vmap_learned_search<4>,vmap_pairs>( random );
+    check_against_map<vmap_learned_search<4>,vmap_pairs>( clustered );
+    check_against_map<vmap_learned_search<4>,vmap_pairs>( dense );
+}
+
+TEST_CASE( "vmap/learned/fallback", "Learned search: other keys and predicates fall back to binary search" )
+{
+    typedef std::map<int,int,std::greater<int> > map_type;
+    typedef vmap<int,int,std::greater<int>,std::allocator<std::pair<int,int> >,
+                 vmap_pairs,vmap_learned_search<> > vmap_type;
+    map_type amap;
+    for( int i = 0 ; i < 100 ; ++i )
+    {
+        amap[i*5] = i;
+    }
+    vmap_type vmap1(amap);
+    REQUIRE( maps_equal( vmap1, amap ) );
+    REQUIRE( lookups_equal( vmap1, amap, -5, 505 ) );
+
+    std::map<std::string,int> smap;
+    smap["one"] = 1;
+    smap["two"] = 2;
+    const vmap<std::string,int,std::less<std::string>,std::allocator<std::pair<std::string,int> >,
+               vmap_pairs,vmap_learned_search<> > svmap(smap);
+    REQUIRE( svmap.at("two") == 2 );
+    REQUIRE( svmap.find("three") == svmap.end() );
+}
+
+TEST_CASE( "vmap/hashed/sizes", "Hashed search: lookups agree with std::map for all small sizes" )
+{
+    typedef std::map<int,int> map_type;
+    typedef vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,
+                 vmap_pairs,vmap_hashed_search<> > vmap_type;
+    typedef vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,
+                 vmap_split,vmap_hashed_search<vmap_eytzinger_search> > evmap_type;
+    map_type amap;
+    for( int count = 0 ; count < 70 ; ++count )
+    {
+        const vmap_type vmap1(amap);
+        const evmap_type vmap2(amap);
+        REQUIRE( maps_equal( vmap1, amap ) );
+        REQUIRE( lookups_equal( vmap1, amap, -2, 3*count+2 ) );
+        REQUIRE( lookups_equal( vmap2, amap, -2, 3*count+2 ) );
+        amap[3*count] = count;
+    }
+}
+
+TEST_CASE( "vmap/hashed/large", "Hashed search: a big table, string keys, and its memory cost" )
+{
+    typedef std::map<int,int> map_type;
+    typedef vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,
+                 vmap_pairs,vmap_hashed_search<> > vmap_type;
+    map_type amap;
+    for( int i = 0 ; i < 100000 ; ++i )
+    {
+        amap[(i*7919) % 1000003] = i;
+    }
+    vmap_type vmap1(amap);
+    REQUIRE( lookups_equal( vmap1, amap, -10, 20000 ) );
+    for( map_type::const_iterator iter = amap.begin() ; iter != amap.end() ; ++iter )
+    {
+        REQUIRE( vmap1.find( iter->first )->second == iter->second );
+    }
+    // About 5 bytes per key; the binary search costs nothing
+    REQUIRE( vmap1.index_memory() < 6 * amap.size() );
+    REQUIRE( vmap<int,int>(amap).index_memory() == 0 );
+
+    vmap_type vmap2;
+    vmap2.swap( vmap1 );
+    REQUIRE( vmap1.find( 0 ) == vmap1.end() );
+    REQUIRE( vmap2.at( 0 ) == 0 );
+
+#if __cplusplus >= 201103L
+    typedef vmap<std::string,int,std::less<std::string>,std::allocator<std::pair<std::string,int> >,
+                 vmap_pairs,vmap_hashed_search<> > svmap_type;
+    std::map<std::string,int> smap;
+    smap["alpha"] = 1;
+    smap["bravo"] = 2;
+    smap["charlie"] = 3;
+    const svmap_type svmap(smap);
+    REQUIRE( svmap.at("bravo") == 2 );
+    REQUIRE( svmap.find("delta") == svmap.end() );
+    REQUIRE( svmap.lower_bound("b")->first == "bravo" );
+#endif
+}
+
+// Sends everything to the same place, so there's no perfect hash
+struct useless_hash
+{
+    std::size_t operator()( int ) const { return 42; }
+};
+
+TEST_CASE( "vmap/hashed/fallback", "Hashed search: without a perfect hash, find still works" )
+{
+    typedef std::map<int,int> map_type;
+    typedef vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,
+                 vmap_pairs,vmap_hashed_search<vmap_binary_search,useless_hash> > vmap_type;
+    map_type amap;
+    for( int i = 0 ; i < 50 ; ++i )
+    {
+        amap[i*2] = i;
+    }
+    const vmap_type vmap1(amap);
+    REQUIRE( lookups_equal( vmap1, amap, -2, 102 ) );
+    REQUIRE( vmap1.index_memory() == 0 );
+}
+
+TEST_CASE( "vmap/filter/lookup", "Filtered search: lookups agree with std::map, whatever the search behind it" )
+{
+    typedef std::map<int,int> map_type;
+    typedef std::allocator<std::pair<int,int> > allocator_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,vmap_pairs,vmap_filtered_search<> > vmap_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,
+                 vmap_split,vmap_filtered_search<vmap_eytzinger_search,4> > evmap_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,
+                 vmap_pairs,vmap_filtered_search<vmap_hashed_search<>,16> > hvmap_type;
+    map_type amap;
+    for( int count = 0 ; count < 70 ; ++count )
+    {
+        const vmap_type vmap1(amap);
+        const evmap_type vmap2(amap);
+        const hvmap_type vmap3(amap);
+        REQUIRE( maps_equal( vmap1, amap ) );
+        REQUIRE( lookups_equal( vmap1, amap, -2, 3*count+2 ) );
+        REQUIRE( lookups_equal( vmap2, amap, -2, 3*count+2 ) );
+        REQUIRE( lookups_equal( vmap3, amap, -2, 3*count+2 ) );
+        amap[3*count] = count;
+    }
+
+    for( int i = 0 ; i < 20000 ; ++i )
+        amap[(i*7919) % 1000003] = i;
+    vmap_type vmap1(amap);
+    for( int key = -10 ; key < 50000 ; ++key )
+    {
+        REQUIRE( vmap1.count( key ) == amap.count( key ) );
+        if( amap.count( key ) )
+        {
+            REQUIRE( vmap1.at( key ) == amap[key] );
+            REQUIRE( vmap1.get( key ) == amap[key] );
+        }
+        else
+        {
+            REQUIRE_THROWS_AS( vmap1.at( key ), std::out_of_range );
+            REQUIRE( vmap1.get( key, -1 ) == -1 );
+        }
+    }
+    // Ten bits a key, and a cache line to spare
+    REQUIRE( vmap1.index_memory() <= 10 * amap.size() / 8 + 128 );
+
+    // Copies (whose words needn't be aligned as the original's were), and
+    // copies of copies
+    std::vector<vmap_type> copies;
+    for( int i = 0 ; i < 16 ; ++i )
+        copies.push_back( i == 0 ? vmap1 : copies.back() );
+    for( std::size_t i = 0 ; i < copies.size() ; i += 5 )
+        REQUIRE( lookups_equal( copies[i], amap, -10, 50000 ) );
+    vmap_type assigned;
+    for( std::size_t i = 0 ; i < copies.size() ; ++i )
+    {
+        assigned = copies[i];
+        REQUIRE( assigned.at( 0 ) == 0 );
+        REQUIRE( assigned.count( 7919 ) == 1 );
+    }
+    REQUIRE( lookups_equal( assigned, amap, -10, 50000 ) );
+
+    vmap_type vmap2;
+    REQUIRE( vmap2.find( 0 ) == vmap2.end() );
+    vmap2.swap( vmap1 );
+    REQUIRE( vmap1.count( 0 ) == 0 );
+    REQUIRE( vmap2.at( 0 ) == 0 );
+#ifdef VMAP_CONFIG_MOVE
+    // What's left behind by a move is empty, filter and all
+    vmap_type vmap3( std::move(vmap2) );
+    REQUIRE( vmap3.at( 0 ) == 0 );
+    REQUIRE( vmap2.find( 0 ) == vmap2.end() );
+    REQUIRE( vmap2.count( 4 ) == 0 );
+    REQUIRE( vmap2.get( 4, -1 ) == -1 );
+    REQUIRE_THROWS_AS( vmap2.at( 4 ), std::out_of_range );
+    vmap1 = std::move(vmap3);
+    REQUIRE( vmap1.count( 0 ) == 1 );
+    REQUIRE( vmap3.count( 0 ) == 0 );
+#endif
+
+#if __cplusplus >= 201103L
+    typedef vmap<std::string,int,std::less<std::string>,std::allocator<std::pair<std::string,int> >,
+                 vmap_string_keys,vmap_filtered_search<> > svmap_type;
+    std::map<std::string,int> smap;
+    smap["alpha"] = 1;
+    smap["bravo"] = 2;
+    smap["charlie"] = 3;
+    const svmap_type svmap(smap);
+    REQUIRE( svmap.at("bravo") == 2 );
+    REQUIRE( svmap.count("charlie") == 1 );
+    REQUIRE( svmap.find("delta") == svmap.end() );
+    REQUIRE( svmap.lower_bound("b")->first == "bravo" );
+#endif
+}
+
+TEST_CASE( "vmap/filter/stats", "Filtered search: misses mostly skip the search, and the stats say how often" )
+{
+    typedef std::allocator<std::pair<int,int> > allocator_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,
+                 vmap_pairs,vmap_filtered_search<>,vmap_lookup_stats> vmap_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,
+                 vmap_pairs,vmap_filtered_search<vmap_binary_search,4>,vmap_lookup_stats> small_type;
+
+    std::map<int,int> amap;
+    for( int i = 0 ; i < 10000 ; ++i )
+        amap[4*i] = i;
+    vmap_type vmap1( amap );
+    small_type vmap2( amap );
+    for( int key = 0 ; key < 400000 ; ++key )
+    {
+        vmap1.find( key );
+        vmap2.find( key );
+    }
+    const vmap_stats stats1 = vmap1.stats();
+    REQUIRE( stats1.hits == 10000 );
+    REQUIRE( stats1.misses == 390000 );
+    REQUIRE( stats1.filter_rejects + stats1.filter_false_positives == stats1.misses );
+    // About 1% at ten bits a key, and rejected misses make no comparisons
+    REQUIRE( stats1.false_positive_rate() < 0.02 );
+    REQUIRE( stats1.comparison_histogram[0] == stats1.filter_rejects );
+    // Fewer bits, more false positives
+    const vmap_stats stats2 = vmap2.stats();
+    REQUIRE( stats2.filter_rejects + stats2.filter_false_positives == stats2.misses );
+    REQUIRE( stats2.false_positive_rate() > stats1.false_positive_rate() );
+    REQUIRE( stats2.false_positive_rate() < 0.25 );
+
+    // Hits, and lower_bound, go through
+    REQUIRE( vmap1.at( 4 ) == 1 );
+    REQUIRE( vmap1.lower_bound( 5 )->first == 8 );
+    REQUIRE( vmap1.stats().hits == 10001 );
+    vmap1.reset_stats();
+    REQUIRE( vmap1.stats().filter_rejects == 0 );
+    REQUIRE( vmap1.stats().false_positive_rate() == 0.0 );
+
+    // Without a filter, there's nothing to count
+    typedef vmap<int,int,std::less<int>,allocator_type,vmap_pairs,vmap_binary_search,vmap_lookup_stats> plain_type;
+    plain_type vmap3( amap );
+    vmap3.find( 1 );
+    REQUIRE( vmap3.stats().misses == 1 );
+    REQUIRE( vmap3.stats().filter_rejects + vmap3.stats().filter_false_positives == 0 );
+}
+
+// Check a vmap_delta against a std::map: contents, and lookups of every
+// key in [low,high]
+template<typename DeltaT, typename MapT>
+bool delta_equal( const DeltaT& delta, const MapT& map, int low, int high )
+{
+    REQUIRE( delta.size() == map.size() );
+    REQUIRE( delta.empty() == map.empty() );
+    typename DeltaT::const_iterator diter = delta.begin();
+    for( typename MapT::const_iterator miter = map.begin() ; miter != map.end() ; ++miter, ++diter )
+    {
+        REQUIRE( diter != delta.end() );
+        REQUIRE( diter->first == miter->first );
+        REQUIRE( diter->second == miter->second );
+    }
+    REQUIRE( diter == delta.end() );
+    for( int key = low ; key <= high ; ++key )
+    {
+        const typename MapT::const_iterator miter = map.find(key);
+        REQUIRE( delta.count(key) == map.count(key) );
+        REQUIRE( (delta.find(key) == delta.end()) == (miter == map.end()) );
+        if( miter != map.end() )
+        {
+            REQUIRE( delta.at(key) == miter->second );
+            REQUIRE( delta.find(key)->second == miter->second );
+        }
+        else
+        {
+            REQUIRE_THROWS_AS( delta.at(key), std::out_of_range );
+        }
+        const typename MapT::const_iterator mlower = map.lower_bound(key);
+        const typename DeltaT::const_iterator dlower = delta.lower_bound(key);
+        REQUIRE( (mlower == map.end()) == (dlower == delta.end()) );
+        if( mlower != map.end() )
+            REQUIRE( dlower->first == mlower->first );
+        const typename MapT::const_iterator mupper = map.upper_bound(key);
+        const typename DeltaT::const_iterator dupper = delta.upper_bound(key);
+        REQUIRE( (mupper == map.end()) == (dupper == delta.end()) );
+        if( mupper != map.end() )
+            REQUIRE( dupper->first == mupper->first );
+    }
+    return true;
+}
+
+TEST_CASE( "vmap/delta/basic", "vmap_delta: insert, update and erase, before and after merging" )
+{
+    typedef std::map<int,int> map_type;
+    typedef vmap_delta<int,int> delta_type;
+
+    map_type amap;
+    for( int i = 0 ; i < 20 ; ++i )
+    {
+        amap[i*2] = i;
+    }
+    delta_type delta( (delta_type::vmap_type(amap)) );
+    REQUIRE( delta_equal( delta, amap, -2, 42 ) );
+
+    REQUIRE( delta.insert( 5, 50 ) );
+    REQUIRE( !delta.insert( 6, 60 ) );
+    REQUIRE( delta.insert_or_assign( 8, 80 ) == false );
+    REQUIRE( delta.insert_or_assign( 41, 410 ) );
+    REQUIRE( delta.insert( -1, -10 ) );
+    REQUIRE( delta.erase( 0 ) == 1 );
+    REQUIRE( delta.erase( 0 ) == 0 );
+    REQUIRE( delta.erase( 7 ) == 0 );
+    REQUIRE( delta.erase( 38 ) == 1 );
+    REQUIRE( delta.erase( 5 ) == 1 );
+    REQUIRE( delta.insert( 10, 100 ) == false );
+    delta.at( 12 ) = 120;
+    amap[8] = 80;
+    amap[41] = 410;
+    amap[-1] = -10;
+    amap.erase( 0 );
+    amap.erase( 38 );
+    amap[12] = 120;
+    REQUIRE( delta.pending() == 4 );
+    REQUIRE( delta_equal( delta, amap, -2, 42 ) );
+
+    // Erase and re-insert something from the base
+    REQUIRE( delta.insert( 38, 380 ) );
+    amap[38] = 380;
+    REQUIRE( delta.pending() == 3 );
+    REQUIRE( delta_equal( delta, amap, -2, 42 ) );
+
+    delta.merge();
+    REQUIRE( delta.pending() == 0 );
+    REQUIRE( delta.base().size() == amap.size() );
+    REQUIRE( maps_equal( delta.base(), amap ) );
+    REQUIRE( delta_equal( delta, amap, -2, 42 ) );
+}
+
+TEST_CASE( "vmap/delta/threshold", "vmap_delta: merges itself when the buffer gets big" )
+{
+    typedef std::map<int,int> map_type;
+    typedef vmap_delta<int,int,std::less<int>,std::allocator<std::pair<int,int> >,
+                       vmap_split,vmap_eytzinger_search> delta_type;
+
+    map_type amap;
+    delta_type delta( 16 );
+    REQUIRE( delta.merge_threshold() == 16 );
+    unsigned long long seed = 999;
+    for( int i = 0 ; i < 3000 ; ++i )
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        const int key = static_cast<int>( seed >> 54 );
+        if( (seed >> 20) % 3 == 0 )
+        {
+            REQUIRE( delta.erase( key ) == amap.erase( key ) );
+        }
+        else
+        {
+            REQUIRE( delta.insert( key, i ) == amap.insert( std::make_pair( key, i ) ).second );
+        }
+        REQUIRE( delta.pending() <= 16 );
+    }
+    REQUIRE( delta_equal( delta, amap, -1, 1025 ) );
+
+    // The automatic threshold grows with the table
+    REQUIRE( vmap_delta<int,int>().merge_threshold() == 64 );
+    map_type big;
+    for( int i = 0 ; i < 100000 ; ++i )
+    {
+        big[i] = i;
+    }
+    const vmap_delta<int,int> delta2( (vmap<int,int>(big)) );
+    REQUIRE( delta2.merge_threshold() * delta2.merge_threshold() >= big.size() );
+}
+
+#ifdef VMAP_CONFIG_THREADS
+TEST_CASE( "vmap/publisher/stress", "vmap_publisher: readers always see a whole, live table" )
+{
+    typedef vmap<int,int> vmap_type;
+    typedef vmap_publisher<vmap_type> publisher_type;
+    const int keys = 1000;
+
+    // Version v maps every key to v
+    struct build
+    {
+        static vmap_type version( int v, int keys )
+        {
+            std::map<int,int> amap;
+            for( int key = 0 ; key < keys ; ++key )
+                amap[key] = v;
+            return vmap_type( amap );
+        }
+    };
+
+    publisher_type publisher( build::version( 0, keys ) );
+    std::atomic<bool> done( false );
+    std::atomic<int> failures( 0 );
+    std::atomic<long> snapshots( 0 );
+    std::vector<std::thread> readers;
+    for( int t = 0 ; t < 4 ; ++t )
+    {
+        readers.push_back( std::thread( [&,t]
+        {
+            publisher_type::reader reader( publisher );
+            int last = 0;
+            unsigned key = static_cast<unsigned>( t );
+            while( !done.load() )
+            {
+                publisher_type::snapshot table( reader );
+                const int version = table->at( 0 );
+                // Versions only go up, and a table never changes under us
+                if( version < last || table->size() != static_cast<std::size_t>( keys ) )
+                    ++failures;
+                for( int i = 0 ; i < 50 ; ++i )
+                {
+                    key = key * 1103515245u + 12345u;
+                    if( table->at( static_cast<int>( key % keys ) ) != version )
+                        ++failures;
+                }
+                last = version;
+                ++snapshots;
+            }
+        } ) );
+    }
+    for( int v = 1 ; v <= 200 ; ++v )
+    {
+        publisher.publish( build::version( v, keys ) );
+    }
+    done.store( true );
+    for( std::size_t t = 0 ; t < readers.size() ; ++t )
+    {
+        readers[t].join();
+    }
+    REQUIRE( failures.load() == 0 );
+    REQUIRE( snapshots.load() > 0 );
+
+    publisher_type::reader reader( publisher );
+    publisher_type::snapshot table( reader );
+    REQUIRE( table->at( keys-1 ) == 200 );
+}
+#endif
+
+// Keys which share long prefixes, differ only past the first eight bytes,
+// or only in trailing (or embedded) NULs
+std::vector<std::string> awkward_strings()
+{
+    static const char* const words[] = { "", "a", "ab", "abcdefg", "abcdefgh", "abcdefghi",
+                                         "abcdefgh0", "abcdefgi", "b", "zzzzzzzzzzzzzzzzzz",
+                                         "\xff", "\xff\xff", "mid" };
+    std::vector<std::string> keys( words, words + sizeof(words)/sizeof(words[0]) );
+    keys.push_back( std::string( "a\0", 2 ) );
+    keys.push_back( std::string( "abcdefgh\0", 9 ) );
+    keys.push_back( std::string( "abc\0efghij", 10 ) );
+    for( int i = 0 ; i < 200 ; ++i )
+    {
+        keys.push_back( "common/prefix/" + std::to_string( i * 7 ) );
+    }
+    return keys;
+}
+
+// Compare a vmap with the given layout and search policy (and a copy of
+// it) with std::map: lookups with each of the probes; iteration forwards,
+// backwards and at random
+template<typename Layout, typename Search, typename KeyType>
+void check_lookups( const std::vector<KeyType>& keys, const std::vector<KeyType>& probes )
+{
+    typedef std::map<KeyType,int> map_type;
+    typedef vmap<KeyType,int,std::less<KeyType>,
+                 std::allocator<std::pair<KeyType,int> >,
+                 Layout,Search> vmap_type;
+    map_type amap;
+    for( std::size_t i = 0 ; i < keys.size() ; ++i )
+    {
+        amap[keys[i]] = static_cast<int>(i);
+    }
+    vmap_type original(amap);
+    const vmap_type vmap1( original );
+    original = vmap_type();
+    REQUIRE( maps_equal( vmap1, amap ) );
+
+    for( std::size_t i = 0 ; i < probes.size() ; ++i )
+    {
+        const KeyType& key = probes[i];
+        REQUIRE( std::distance( amap.begin(), amap.lower_bound(key) ) == (vmap1.lower_bound(key) - vmap1.begin()) );
+        REQUIRE( std::distance( amap.begin(), amap.upper_bound(key) ) == (vmap1.upper_bound(key) - vmap1.begin()) );
+        const typename map_type::const_iterator miter = amap.find(key);
+        const typename vmap_type::const_iterator viter = vmap1.find(key);
+        REQUIRE( (miter == amap.end()) == (viter == vmap1.end()) );
+        if( miter != amap.end() )
+        {
+            REQUIRE( viter->first == key );
+            REQUIRE( vmap1.at(key) == miter->second );
+        }
+    }
+    REQUIRE( batch_lookups_equal( vmap1, probes ) );
+
+    typename vmap_type::const_reverse_iterator riter = vmap1.rbegin();
+    for( typename map_type::const_reverse_iterator miter = amap.rbegin() ; miter != amap.rend() ; ++miter, ++riter )
+    {
+        REQUIRE( riter->first == miter->first );
+        REQUIRE( riter->second == miter->second );
+    }
+    REQUIRE( riter == vmap1.rend() );
+    const std::vector<std::pair<KeyType,int> > entries( amap.begin(), amap.end() );
+    for( std::size_t i = 0 ; i < entries.size() ; i += 1 + i / 3 )
+    {
+        REQUIRE( vmap1.begin()[i].first == entries[i].first );
+        REQUIRE( (vmap1.end() - (entries.size() - i))->first == entries[i].first );
+    }
+}
+
+// ...for string keys, probing with every key, cut short and extended
+template<typename Search, typename Layout = vmap_string_keys>
+void check_strings( const std::vector<std::string>& keys )
+{
+    std::vector<std::string> probes;
+    for( std::size_t i = 0 ; i < keys.size() ; ++i )
+    {
+        probes.push_back( keys[i] );
+        probes.push_back( keys[i] + '\0' );
+        probes.push_back( keys[i] + "~" );
+        if( !keys[i].empty() )
+            probes.push_back( keys[i].substr( 0, keys[i].size() - 1 ) );
+    }
+    check_lookups<Layout,Search>( keys, probes );
+}
+
+TEST_CASE( "vmap/strings/lookup", "String keys: lookups agree with std::map for each search policy" )
+{
+    const std::vector<std::string> keys = awkward_strings();
+    check_strings<vmap_binary_search>( keys );
+    check_strings<vmap_eytzinger_search>( keys );
+    check_strings<vmap_hashed_search<> >( keys );
+    check_strings<vmap_filtered_search<> >( keys );
+    check_strings<vmap_filtered_search<>,vmap_pairs>( keys );
+    check_strings<vmap_binary_search>( std::vector<std::string>() );
+    check_strings<vmap_eytzinger_search>( std::vector<std::string>( 1, "" ) );
+}
+
+TEST_CASE( "vmap/strings/keys", "String keys: the keys are references into one arena" )
+{
+    typedef vmap<std::string,std::string,std::less<std::string>,
+                 std::allocator<std::pair<std::string,std::string> >,
+                 vmap_string_keys> vmap_type;
+
+    std::vector<std::pair<std::string,std::string> > entries;
+    entries.push_back( std::make_pair( std::string("pear"), std::string("green") ) );
+    entries.push_back( std::make_pair( std::string("apple"), std::string("red") ) );
+    entries.push_back( std::make_pair( std::string("banana"), std::string("yellow") ) );
+    entries.push_back( std::make_pair( std::string("apple"), std::string("green") ) );
+    vmap_type vmap1( entries.begin(), entries.end() );
+    REQUIRE( vmap1.size() == 3 );
+    REQUIRE( vmap1.begin()->first == "apple" );
+    REQUIRE( vmap1.begin()->first == std::string("apple") );
+    REQUIRE( vmap1.begin()->first != "apples" );
+    REQUIRE( vmap1.begin()->first < (vmap1.begin()+1)->first );
+    REQUIRE( vmap1.at("apple") == "red" );
+    REQUIRE( vmap1.get("cherry").empty() );
+    vmap1["pear"] = "brown";
+    REQUIRE( vmap1.at("pear") == "brown" );
+
+    // All the characters are in one block, in key order
+    const char* arena = vmap1.begin()->first.data();
+    REQUIRE( (vmap1.begin()+1)->first.data() == arena + 5 );
+    REQUIRE( (vmap1.begin()+2)->first.data() == arena + 11 );
+
+    // A real pair, with a real std::string in it
+    const std::pair<std::string,std::string> entry = *vmap1.find("banana");
+    REQUIRE( entry.first == "banana" );
+    REQUIRE( entry.second == "yellow" );
+    const std::string key = vmap1.rbegin()->first;
+    REQUIRE( key == "pear" );
+
+    // Copies get their own arena; moves keep it
+    vmap_type vmap2( vmap1 );
+    REQUIRE( vmap2.begin()->first.data() != arena );
+    REQUIRE( vmap2.at("banana") == "yellow" );
+#ifdef VMAP_CONFIG_MOVE
+    vmap_type vmap3( std::move(vmap1) );
+    REQUIRE( vmap3.begin()->first.data() == arena );
+    REQUIRE( vmap3.at("banana") == "yellow" );
+#endif
+}
+
+// URL-ish keys: long shared prefixes, in runs
+std::vector<std::string> url_strings( int count )
+{
+    static const char* const hosts[] = { "http://example.com/", "https://example.com/",
+                                         "https://example.com/a/b/c/", "https://example.org/" };
+    std::vector<std::string> keys;
+    for( int i = 0 ; i < count ; ++i )
+    {
+        keys.push_back( hosts[i % 4] + std::to_string( (i * 7919) % 1000 ) + "/page" + std::to_string( i % 13 ) );
+    }
+    return keys;
+}
+
+TEST_CASE( "vmap/front_coded/lookup", "Front coded keys: lookups and iteration agree with std::map" )
+{
+    check_strings<vmap_binary_search,vmap_front_coded<32> >( awkward_strings() );
+    check_strings<vmap_binary_search,vmap_front_coded<16> >( url_strings( 1000 ) );
+    check_strings<vmap_binary_search,vmap_front_coded<64> >( url_strings( 1000 ) );
+    check_strings<vmap_binary_search,vmap_front_coded<1> >( url_strings( 50 ) );
+    check_strings<vmap_binary_search,vmap_front_coded<32> >( std::vector<std::string>() );
+    check_strings<vmap_binary_search,vmap_front_coded<32> >( std::vector<std::string>( 1, "" ) );
+}
+
+TEST_CASE( "vmap/front_coded/update", "Front coded keys: mapped values can be updated, and entries copied out" )
+{
+    typedef vmap<std::string,std::string,std::less<std::string>,
+                 std::allocator<std::pair<std::string,std::string> >,
+                 vmap_front_coded<> > vmap_type;
+    std::map<std::string,std::string> amap;
+    amap["https://example.com/"] = "home";
+    amap["https://example.com/about"] = "about";
+    amap["https://example.com/about/team"] = "team";
+    vmap_type vmap1( amap );
+    vmap1["https://example.com/about"] = "us";
+    REQUIRE( vmap1.at("https://example.com/about") == "us" );
+    REQUIRE( vmap1.get("https://example.com/contact").empty() );
+    REQUIRE_THROWS_AS( vmap1["https://example.com/contact"], std::out_of_range );
+
+    for( vmap_type::iterator iter = vmap1.begin() ; iter != vmap1.end() ; ++iter )
+    {
+        iter->second += "!";
+    }
+    const std::pair<std::string,std::string> entry = *vmap1.find("https://example.com/about/team");
+    REQUIRE( entry.first == "https://example.com/about/team" );
+    REQUIRE( entry.second == "team!" );
+    REQUIRE( vmap1.index_memory() == 0 );
+}
+
+// ...for packed integer keys, probing with every key and its neighbours,
+// and the extremes
+template<typename KeyType, std::size_t BlockSize>
+void check_packed( const std::vector<KeyType>& keys )
+{
+    std::vector<KeyType> probes;
+    for( std::size_t i = 0 ; i < keys.size() ; ++i )
+    {
+        probes.push_back( keys[i] );
+        if( keys[i] != std::numeric_limits<KeyType>::min() )
+            probes.push_back( keys[i] - 1 );
+        if( keys[i] != std::numeric_limits<KeyType>::max() )
+            probes.push_back( keys[i] + 1 );
+    }
+    probes.push_back( std::numeric_limits<KeyType>::min() );
+    probes.push_back( std::numeric_limits<KeyType>::max() );
+    check_lookups<vmap_packed<BlockSize>,vmap_binary_search>( keys, probes );
+}
+
+TEST_CASE( "vmap/packed/lookup", "Packed keys: lookups and iteration agree with std::map" )
+{
+    // Close together, a long way from zero
+    std::vector<uint64_t> ids;
+    for( uint64_t i = 0 ; i < 5000 ; ++i )
+        ids.push_back( 0x123456789000ULL + i * i % 7919 * 3 );
+    check_packed<uint64_t,64>( ids );
+    check_packed<uint64_t,1>( std::vector<uint64_t>( ids.begin(), ids.begin() + 100 ) );
+    check_packed<uint64_t,7>( ids );
+
+    // Either side of zero, and with the widest possible gaps
+    std::vector<int> ints;
+    for( int i = -3000 ; i < 3000 ; i += 1 + (i & 7) )
+        ints.push_back( i * 1000 );
+    ints.push_back( std::numeric_limits<int>::min() );
+    ints.push_back( std::numeric_limits<int>::max() );
+    check_packed<int,32>( ints );
+    std::vector<int64_t> extremes;
+    extremes.push_back( std::numeric_limits<int64_t>::min() );
+    extremes.push_back( -1 );
+    extremes.push_back( 0 );
+    extremes.push_back( std::numeric_limits<int64_t>::max() );
+    check_packed<int64_t,4>( extremes );
+    check_packed<int64_t,2>( extremes );
+
+    std::vector<unsigned char> bytes;
+    for( int i = 0 ; i < 256 ; i += 3 )
+        bytes.push_back( static_cast<unsigned char>( i ) );
+    check_packed<unsigned char,16>( bytes );
+    check_packed<int,64>( std::vector<int>() );
+    check_packed<int,64>( std::vector<int>( 1, 42 ) );
+}
+
+TEST_CASE( "vmap/packed/update", "Packed keys: mapped values can be updated, and entries copied out" )
+{
+    typedef vmap<uint64_t,uint32_t,std::less<uint64_t>,
+                 std::allocator<std::pair<uint64_t,uint32_t> >,
+                 vmap_packed<> > vmap_type;
+    std::vector<std::pair<uint64_t,uint32_t> > entries;
+    for( uint32_t i = 0 ; i < 100000 ; ++i )
+        entries.push_back( std::make_pair( 1000000000000ULL + 5 * uint64_t(i), i & 0xfffff ) );
+    vmap_type vmap1( entries.begin(), entries.end() );
+    REQUIRE( vmap1.size() == entries.size() );
+    REQUIRE( vmap1.index_memory() == 0 );
+    for( std::size_t i = 0 ; i < entries.size() ; i += 97 )
+        REQUIRE( vmap1.at( entries[i].first ) == entries[i].second );
+
+    vmap1[entries[10].first] = 7;
+    REQUIRE( vmap1.get( entries[10].first ) == 7 );
+    for( vmap_type::iterator iter = vmap1.begin() ; iter != vmap1.end() ; ++iter )
+        iter->second += 1;
+    REQUIRE( vmap1.find( entries[11].first )->second == entries[11].second + 1 );
+    const std::pair<uint64_t,uint32_t> entry = *vmap1.find( entries[12].first );
+    REQUIRE( entry == std::make_pair( entries[12].first, entries[12].second + 1 ) );
+    REQUIRE( vmap1.get( 5 ) == 0 );
+}
+
+TEST_CASE( "vmap/packed/table", "Packed table: keys and values both packed, lookups agree with std::map" )
+{
+    // Ids close together, with values of up to 20 bits
+    std::map<uint64_t,uint32_t> amap;
+    for( uint32_t i = 0 ; i < 100000 ; ++i )
+        amap[1000000000000ULL + 5 * uint64_t(i) + i % 3] = ( i * 7919 ) & 0xfffff;
+    typedef vmap_packed_table<uint64_t,uint32_t> table_type;
+    const table_type table1( amap );
+    REQUIRE( table1.size() == amap.size() );
+    // Under 6 bytes an entry, rather than 16
+    REQUIRE( table1.memory() < 6 * amap.size() );
+
+    std::map<uint64_t,uint32_t>::const_iterator miter = amap.begin();
+    for( table_type::const_iterator iter = table1.begin() ; iter != table1.end() ; ++iter, ++miter )
+    {
+        REQUIRE( iter->first == miter->first );
+        REQUIRE( iter->second == miter->second );
+    }
+    REQUIRE( miter == amap.end() );
+    REQUIRE( table1.rbegin()->first == amap.rbegin()->first );
+    REQUIRE( ( table1.begin() + 1000 )->second == ( *table1.find( table1.begin()[1000].first ) ).second );
+
+    for( uint64_t key = 999999999990ULL ; key < 1000000000000ULL + 5000 ; ++key )
+    {
+        REQUIRE( std::distance( amap.begin(), amap.lower_bound(key) ) == (table1.lower_bound(key) - table1.begin()) );
+        REQUIRE( std::distance( amap.begin(), amap.upper_bound(key) ) == (table1.upper_bound(key) - table1.begin()) );
+        REQUIRE( table1.count( key ) == amap.count( key ) );
+        if( amap.count( key ) )
+        {
+            REQUIRE( table1.find( key )->second == amap[key] );
+            REQUIRE( table1.at( key ) == amap[key] );
+            REQUIRE( table1.get( key ) == amap[key] );
+            REQUIRE( table1.equal_range( key ).second - table1.equal_range( key ).first == 1 );
+        }
+        else
+        {
+            REQUIRE( table1.find( key ) == table1.end() );
+            REQUIRE_THROWS_AS( table1.at( key ), std::out_of_range );
+            REQUIRE( table1.get( key, 12345678 ) == 12345678 );
+        }
+    }
+
+    // Signed values either side of zero, from a vmap; one value, and none
+    std::map<int,int64_t> smap;
+    for( int i = -500 ; i < 500 ; ++i )
+        smap[i * 3] = i % 2 ? -int64_t(i) * 1000000 : int64_t(i);
+    smap[5000] = std::numeric_limits<int64_t>::min();
+    smap[5001] = std::numeric_limits<int64_t>::max();
+    const vmap<int,int64_t> svmap( smap );
+    vmap_packed_table<int,int64_t,16> table2( svmap );
+    for( std::map<int,int64_t>::const_iterator iter = smap.begin() ; iter != smap.end() ; ++iter )
+        REQUIRE( table2.at( iter->first ) == iter->second );
+    std::map<int,short> one;
+    one[-7] = -7;
+    const vmap_packed_table<int,short> table3( one );
+    REQUIRE( table3.at( -7 ) == -7 );
+    REQUIRE( table3.find( 7 ) == table3.end() );
+    vmap_packed_table<int,int64_t,16> table4;
+    REQUIRE( table4.empty() );
+    REQUIRE( table4.find( 0 ) == table4.end() );
+    REQUIRE( table4.get( 0 ) == 0 );
+    table4.swap( table2 );
+    REQUIRE( table2.empty() );
+    REQUIRE( table4.at( 3 ) == -1000000 );
+
+    const std::vector<std::pair<unsigned char,bool> > flags( 1, std::make_pair( (unsigned char)200, true ) );
+    const vmap_packed_table<unsigned char,bool> table5( vmap_sorted_unique, flags.begin(), flags.end() );
+    REQUIRE( table5.at( 200 ) );
+    REQUIRE_FALSE( table5.get( 201 ) );
+}
+
+TEST_CASE( "vmap/btree/sizes", "B+tree search: lookups agree with std::map for all sizes up to four levels" )
+{
+    typedef int key_type;
+    typedef int mapped_type;
+    typedef std::map<key_type,mapped_type> map_type;
+    typedef std::allocator<std::pair<key_type,mapped_type> > allocator_type;
+    // Three keys a node: four children each
+    typedef vmap<key_type,mapped_type,std::less<key_type>,allocator_type,
+                 vmap_pairs,vmap_btree_search<12> > narrow_type;
+    typedef vmap<key_type,mapped_type,std::greater<key_type>,allocator_type,
+                 vmap_split,vmap_btree_search<12> > reversed_type;
+
+    map_type amap;
+    std::map<key_type,mapped_type,std::greater<key_type> > rmap;
+    for( int count = 0 ; count < 300 ; ++count )
+    {
+        const narrow_type vmap1(amap);
+        REQUIRE( maps_equal( vmap1, amap ) );
+        REQUIRE( lookups_equal( vmap1, amap, -2, 2*count+2 ) );
+        const reversed_type vmap2(rmap);
+        REQUIRE( lookups_equal( vmap2, rmap, -2, 2*count+2 ) );
+        amap[2*count] = count;
+        rmap[2*count] = count;
+    }
+}
+
+// Check a big int vmap's lookups against std::lower_bound/upper_bound on
+// its keys (std::map's would need std::distance, which is linear)
+template<typename VmapT>
+bool ranks_equal( const VmapT& vmap, const std::vector<int>& keys, int low, int high )
+{
+    for( int key = low ; key <= high ; ++key )
+    {
+        const std::vector<int>::const_iterator lower = std::lower_bound( keys.begin(), keys.end(), key );
+        REQUIRE( (lower - keys.begin()) == (vmap.lower_bound(key) - vmap.begin()) );
+        REQUIRE( (std::upper_bound( keys.begin(), keys.end(), key ) - keys.begin()) == (vmap.upper_bound(key) - vmap.begin()) );
+        const bool present = lower != keys.end() && *lower == key;
+        REQUIRE( (vmap.find(key) == vmap.end()) == !present );
+    }
+    return true;
+}
+
+TEST_CASE( "vmap/btree/large", "B+tree search: cache line nodes, big tables, and string keys" )
+{
+    typedef std::allocator<std::pair<int,int> > allocator_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,vmap_pairs,vmap_btree_search<> > line_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,vmap_split,vmap_btree_search<128> > pair_type;
+
+    std::vector<int> keys;
+    std::vector<std::pair<int,int> > entries;
+    for( int i = 0 ; i < 100000 ; ++i )
+    {
+        keys.push_back( i*3 );
+        entries.push_back( std::make_pair( i*3, i ) );
+    }
+    const line_type vmap1( entries.begin(), entries.end() );
+    const pair_type vmap2( entries.begin(), entries.end() );
+    REQUIRE( ranks_equal( vmap1, keys, -5, 300005 ) );
+    REQUIRE( ranks_equal( vmap2, keys, -5, 300005 ) );
+    // Only the separators: about one key in sixteen
+    REQUIRE( vmap1.index_memory() < keys.size() * sizeof(int) / 8 );
+    const line_type vmap3( vmap1 );
+    REQUIRE( ranks_equal( vmap3, keys, 299000, 300005 ) );
+
+    check_strings<vmap_btree_search<> >( awkward_strings() );
+    const std::vector<std::string> urls = url_strings( 5000 );
+    std::map<std::string,int> smap;
+    for( std::size_t i = 0 ; i < urls.size() ; ++i )
+    {
+        smap[urls[i]] = static_cast<int>(i);
+    }
+    const vmap<std::string,int,std::less<std::string>,
+               std::allocator<std::pair<std::string,int> >,
+               vmap_pairs,vmap_btree_search<> > vmap4(smap);
+    REQUIRE( maps_equal( vmap4, smap ) );
+    for( std::map<std::string,int>::const_iterator iter = smap.begin() ; iter != smap.end() ; ++iter )
+    {
+        REQUIRE( vmap4.at(iter->first) == iter->second );
+        REQUIRE( vmap4.lower_bound(iter->first + '\0') == vmap4.find(iter->first) + 1 );
+    }
+}
+
+// Check a vmultimap against a std::multimap: contents, in order, and the
+// lookups for keys in [low,high]
+template<typename VmultimapT, typename MultimapT>
+bool multimaps_equal( const VmultimapT& vmm, const MultimapT& mm, int low, int high )
+{
+    REQUIRE( maps_equal( vmm, mm ) );
+    for( int key = low ; key <= high ; ++key )
+    {
+        REQUIRE( std::distance( mm.begin(), mm.lower_bound(key) ) == std::distance( vmm.begin(), vmm.lower_bound(key) ) );
+        REQUIRE( std::distance( mm.begin(), mm.upper_bound(key) ) == std::distance( vmm.begin(), vmm.upper_bound(key) ) );
+        REQUIRE( mm.count(key) == vmm.count(key) );
+        const typename VmultimapT::const_iterator found = vmm.find(key);
+        REQUIRE( (mm.find(key) == mm.end()) == (found == vmm.end()) );
+        if( found != vmm.end() )
+        {
+            REQUIRE( found == vmm.lower_bound(key) );
+        }
+
+        typedef typename VmultimapT::const_iterator const_iterator;
+        const std::pair<const_iterator,const_iterator> range = vmm.equal_range(key);
+        const std::pair<const typename VmultimapT::mapped_type*,
+                        const typename VmultimapT::mapped_type*> run = vmm.mapped_range(key);
+        REQUIRE( static_cast<std::size_t>( run.second - run.first ) == mm.count(key) );
+        typename MultimapT::const_iterator miter = mm.lower_bound(key);
+        const typename VmultimapT::mapped_type* mapped = run.first;
+        for( const_iterator iter = range.first ; iter != range.second ; ++iter, ++miter, ++mapped )
+        {
+            REQUIRE( iter->first == key );
+            REQUIRE( iter->second == miter->second );
+            REQUIRE( *mapped == miter->second );
+        }
+        REQUIRE( miter == mm.upper_bound(key) );
+    }
+    return true;
+}
+
+TEST_CASE( "vmultimap/lookup", "vmultimap: agrees with std::multimap, whatever the runs" )
+{
+    typedef std::multimap<int,int> multimap_type;
+    typedef vmultimap<int,int> vmultimap_type;
+    typedef vmultimap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,vmap_eytzinger_search> eytzinger_type;
+
+    multimap_type amap;
+    for( int count = 0 ; count < 60 ; ++count )
+    {
+        const vmultimap_type vmm1(amap);
+        REQUIRE( multimaps_equal( vmm1, amap, -2, 22 ) );
+        REQUIRE( vmm1.key_count() == static_cast<std::size_t>( count < 20 ? count : 20 ) );
+        const eytzinger_type vmm2(amap);
+        REQUIRE( multimaps_equal( vmm2, amap, -2, 22 ) );
+        // Runs of 1, 2, 3... values; the keys wrap around at 20
+        amap.insert( std::make_pair( count % 20, count ) );
+    }
+
+    const vmultimap_type empty;
+    REQUIRE( empty.begin() == empty.end() );
+    REQUIRE( empty.count(1) == 0 );
+    REQUIRE( empty.equal_range(1).first == empty.end() );
+    REQUIRE( empty.mapped_range(1).first == empty.mapped_range(1).second );
+}
+
+TEST_CASE( "vmultimap/range", "vmultimap: from an unsorted range, keeping each key's values in order" )
+{
+    typedef vmultimap<std::string,int> vmultimap_type;
+    std::vector<std::pair<std::string,int> > entries;
+    std::multimap<std::string,int> amap;
+    static const char* const words[] = { "pear", "apple", "fig", "apple", "pear", "kiwi", "apple", "fig" };
+    for( int i = 0 ; i < 8 ; ++i )
+    {
+        entries.push_back( std::make_pair( std::string( words[i] ), i ) );
+        amap.insert( entries.back() );
+    }
+    vmultimap_type vmm1( entries.begin(), entries.end() );
+    REQUIRE( maps_equal( vmm1, amap ) );
+    REQUIRE( vmm1.size() == 8 );
+    REQUIRE( vmm1.key_count() == 4 );
+    REQUIRE( vmm1.count("apple") == 3 );
+    REQUIRE( vmm1.count("banana") == 0 );
+
+    // Backwards, too
+    std::multimap<std::string,int>::const_reverse_iterator miter = amap.rbegin();
+    for( vmultimap_type::const_reverse_iterator iter = vmm1.rbegin() ; iter != vmm1.rend() ; ++iter, ++miter )
+    {
+        REQUIRE( iter->first == miter->first );
+        REQUIRE( iter->second == miter->second );
+    }
+
+    // The mapped values can be changed, in place
+    std::pair<int*,int*> run = vmm1.mapped_range("pear");
+    REQUIRE( run.second - run.first == 2 );
+    run.first[1] = 42;
+    REQUIRE( (--vmm1.end())->second == 42 );
+    vmm1.find("fig")->second = 7;
+    REQUIRE( vmm1.equal_range("fig").first->second == 7 );
+
+    vmultimap_type vmm2( vmm1 );
+    vmultimap_type vmm3;
+    vmm3.swap( vmm2 );
+    REQUIRE( vmm2.empty() );
+    REQUIRE( vmm3.count("pear") == 2 );
+    REQUIRE( vmm3.upper_bound("kiwi")->first == "pear" );
+#ifdef VMAP_CONFIG_MOVE
+    vmultimap_type vmm4( std::move(entries) );
+    REQUIRE( entries.empty() );
+    REQUIRE( vmm4.count("apple") == 3 );
+    REQUIRE( vmm4.find("apple")->second == 1 );
+#endif
+}
+
+TEST_CASE( "vmap/stats/counts", "Lookup stats: searches, hits and misses, at() misses and the histograms" )
+{
+    typedef std::allocator<std::pair<int,int> > allocator_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,vmap_pairs,vmap_binary_search,vmap_lookup_stats> vmap_type;
+
+    std::map<int,int> amap;
+    for( int i = 0 ; i < 1024 ; ++i )
+        amap[2*i] = i;
+    vmap_type vmap1( amap );
+    REQUIRE( vmap1.stats().searches == 0 );
+
+    // Hits on the first quarter of the keys, and misses in between
+    for( int key = 0 ; key < 512 ; ++key )
+        vmap1.find( key );
+    vmap_stats stats = vmap1.stats();
+    REQUIRE( stats.searches == 512 );
+    REQUIRE( stats.hits == 256 );
+    REQUIRE( stats.misses == 256 );
+    REQUIRE( stats.miss_rate() == 0.5 );
+    // A branch-free search of 1024 entries: ten steps, one more to finish,
+    // and one to see if it's a hit
+    REQUIRE( stats.comparisons == 512 * 12 );
+    REQUIRE( stats.comparison_histogram[12] == 512 );
+    for( std::size_t i = 0 ; i < vmap_stats::histogram_size ; ++i )
+        REQUIRE( stats.position_histogram[i] == ( i < 16 ? 16u : 0u ) );
+
+    // at() and get() are finds; lower_bound and upper_bound are searches,
+    // but neither hits nor misses
+    REQUIRE_THROWS_AS( vmap1.at(1), std::out_of_range );
+    REQUIRE( vmap1.get(3) == 0 );
+    REQUIRE( vmap1.get(2046) == 1023 );
+    vmap1.lower_bound(5);
+    vmap1.upper_bound(5);
+    stats = vmap1.stats();
+    REQUIRE( stats.searches == 517 );
+    REQUIRE( stats.hits == 257 );
+    REQUIRE( stats.misses == 258 );
+    REQUIRE( stats.at_misses == 1 );
+    REQUIRE( stats.position_histogram[63] == 1 );
+
+    // Batch lookups count their searches, but not in the histogram
+    std::vector<int> keys;
+    keys.push_back( 4 );
+    keys.push_back( 5 );
+    std::vector<vmap_type::const_iterator> found;
+    vmap1.find_many( keys.begin(), keys.end(), std::back_inserter( found ) );
+    stats = vmap1.stats();
+    REQUIRE( stats.searches == 519 );
+    REQUIRE( stats.hits == 258 );
+    REQUIRE( stats.misses == 259 );
+    std::size_t histogram = 0;
+    for( std::size_t i = 0 ; i < vmap_stats::histogram_size ; ++i )
+        histogram += stats.comparison_histogram[i];
+    REQUIRE( histogram == 517 );
+
+    // The counts stay with the object
+    vmap_type vmap2( vmap1 );
+    REQUIRE( vmap2.stats().searches == 0 );
+    REQUIRE( vmap2.find(0)->second == 0 );
+    REQUIRE( vmap2.stats().hits == 1 );
+    vmap1.reset_stats();
+    REQUIRE( vmap1.stats().searches == 0 );
+    REQUIRE( vmap1.stats().comparison_histogram[12] == 0 );
+
+    // Without stats, there's nothing to see
+    const vmap<int,int> vmap3( amap );
+    vmap3.find(0);
+    REQUIRE( vmap3.stats().searches == 0 );
+}
+
+TEST_CASE( "vmap/stats/policies", "Lookup stats: each search policy and layout still agrees with std::map" )
+{
+    typedef std::allocator<std::pair<int,int> > allocator_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,vmap_split,vmap_eytzinger_search,vmap_lookup_stats> eytzinger_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,vmap_pairs,vmap_kary_search,vmap_lookup_stats> kary_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,vmap_pairs,vmap_btree_search<>,vmap_lookup_stats> btree_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,vmap_split,vmap_learned_search<>,vmap_lookup_stats> learned_type;
+    typedef vmap<int,int,std::greater<int>,allocator_type,vmap_pairs,vmap_hashed_search<>,vmap_lookup_stats> hashed_type;
+
+    std::map<int,int> amap;
+    std::map<int,int,std::greater<int> > rmap;
+    for( int i = 0 ; i < 500 ; ++i )
+    {
+        amap[3*i] = i;
+        rmap[3*i] = i;
+    }
+    const eytzinger_type vmap1( amap );
+    REQUIRE( lookups_equal( vmap1, amap, -2, 1502 ) );
+    const kary_type vmap2( amap );
+    REQUIRE( lookups_equal( vmap2, amap, -2, 1502 ) );
+    const btree_type vmap3( amap );
+    REQUIRE( lookups_equal( vmap3, amap, -2, 1502 ) );
+    const learned_type vmap4( amap );
+    REQUIRE( lookups_equal( vmap4, amap, -2, 1502 ) );
+    const hashed_type vmap5( rmap );
+    REQUIRE( lookups_equal( vmap5, rmap, -2, 1502 ) );
+
+    // Roughly log2(500) comparisons a search - except for find with a
+    // perfect hash, which needs two at most
+    REQUIRE( vmap1.stats().comparisons_per_search() > 8 );
+    REQUIRE( vmap1.stats().comparisons_per_search() < 12 );
+    const vmap_stats stats5 = vmap5.stats();
+    REQUIRE( stats5.comparison_histogram[0] + stats5.comparison_histogram[1] + stats5.comparison_histogram[2]
+             == stats5.hits + stats5.misses );
+    REQUIRE( stats5.hits == 3 * 500 );
+
+    typedef vmap<std::string,int,std::less<std::string>,std::allocator<std::pair<std::string,int> >,
+                 vmap_string_keys,vmap_binary_search,vmap_lookup_stats> string_type;
+    std::map<std::string,int> smap;
+    smap["apple"] = 1;
+    smap["banana"] = 2;
+    const string_type vmap6( smap );
+    REQUIRE( vmap6.at("banana") == 2 );
+    REQUIRE( vmap6.find("cherry") == vmap6.end() );
+    REQUIRE( vmap6.stats().hits == 1 );
+    REQUIRE( vmap6.stats().misses == 1 );
+    REQUIRE( vmap6.stats().comparisons > 0 );
+}
+
+// Orders std::strings, and compares them with C strings (without making
+// std::strings of them)
+struct transparent_string_less
+{
+    typedef void is_transparent;
+    bool operator()( const std::string& lhs, const std::string& rhs ) const { return lhs < rhs; }
+    bool operator()( const std::string& lhs, const char* rhs ) const { return lhs.compare( rhs ) < 0; }
+    bool operator()( const char* lhs, const std::string& rhs ) const { return rhs.compare( lhs ) > 0; }
+};
+
+// A key which only the comparator knows how to look up by its id
+struct account
+{
+    int id;
+    std::string owner;
+    account( int id_, const std::string& owner_ ) : id( id_ ), owner( owner_ ) {}
+};
+struct account_less
+{
+    typedef void is_transparent;
+    bool operator()( const account& lhs, const account& rhs ) const { return lhs.id < rhs.id; }
+    bool operator()( const account& lhs, int rhs ) const { return lhs.id < rhs; }
+    bool operator()( int lhs, const account& rhs ) const { return lhs < rhs.id; }
+};
+
+TEST_CASE( "vmap/transparent/strings", "Transparent comparators: look up string keys by C string" )
+{
+    typedef std::map<std::string,int,transparent_string_less> map_type;
+    typedef std::allocator<std::pair<std::string,int> > allocator_type;
+    typedef vmap<std::string,int,transparent_string_less> vmap_type;
+    typedef vmap<std::string,int,transparent_string_less,allocator_type,vmap_split,vmap_eytzinger_search,vmap_lookup_stats> split_type;
+
+    static const char* const words[] = { "", "apple", "banana", "cherry", "damson", "elderberry", "fig", "grape" };
+    static const char* const probes[] = { "", "a", "apple", "apples", "banana", "c", "elderberry", "fig", "zebra" };
+    map_type amap;
+    for( int i = 0 ; i < 8 ; i += 2 )
+        amap[words[i]] = i;
+    vmap_type vmap1( amap );
+    const split_type vmap2( amap );
+    for( int i = 0 ; i < 9 ; ++i )
+    {
+        const char* const key = probes[i];
+        const map_type::const_iterator miter = amap.find( std::string( key ) );
+        REQUIRE( (vmap1.find( key ) == vmap1.end()) == (miter == amap.end()) );
+        REQUIRE( (vmap2.find( key ) == vmap2.end()) == (miter == amap.end()) );
+        REQUIRE( vmap1.lower_bound( key ) - vmap1.begin() == std::distance( amap.begin(), amap.lower_bound( std::string( key ) ) ) );
+        REQUIRE( vmap2.upper_bound( key ) - vmap2.begin() == std::distance( amap.begin(), amap.upper_bound( std::string( key ) ) ) );
+        REQUIRE( std::distance( vmap2.equal_range( key ).first, vmap2.equal_range( key ).second ) == (miter == amap.end() ? 0 : 1) );
+        if( miter != amap.end() )
+        {
+            REQUIRE( vmap1.at( key ) == miter->second );
+            REQUIRE( vmap2.get( key ) == miter->second );
+        }
+        else
+        {
+            REQUIRE_THROWS_AS( vmap2.at( key ), std::out_of_range );
+            REQUIRE( vmap1.get( key, -1 ) == -1 );
+            REQUIRE( &vmap1.get( key ) == &vmap1.get( std::string( key ) ) );
+        }
+    }
+    vmap1.at( "banana" ) = 42;
+    REQUIRE( vmap1.find( std::string( "banana" ) )->second == 42 );
+    // The stats count them like any other lookup: find, equal_range twice,
+    // and at or get, for each
+    REQUIRE( vmap2.stats().at_misses == 6 );
+    REQUIRE( vmap2.stats().hits == 3 * 4 );
+    REQUIRE( vmap2.stats().misses == 6 * 4 );
+}
+
+TEST_CASE( "vmap/transparent/records", "Transparent comparators: look up a record key by a field of it" )
+{
+    std::vector<std::pair<account,double> > entries;
+    for( int id = 0 ; id < 100 ; ++id )
+        entries.push_back( std::make_pair( account( 7*id % 100, "someone" ), id * 1.5 ) );
+    const vmap<account,double,account_less> vmap1( entries.begin(), entries.end() );
+    REQUIRE( vmap1.size() == 100 );
+    for( int id = -1 ; id <= 100 ; ++id )
+    {
+        const bool present = id >= 0 && id < 100;
+        REQUIRE( (vmap1.find( id ) != vmap1.end()) == present );
+        REQUIRE( vmap1.lower_bound( id ) - vmap1.begin() == (id < 0 ? 0 : id) );
+        REQUIRE( vmap1.upper_bound( id ) - vmap1.begin() == (id < 0 ? 0 : present ? id + 1 : 100) );
+        if( present )
+            REQUIRE( vmap1.find( id )->first.id == id );
+    }
+    REQUIRE( vmap1.at( 7 ) == 1.5 );
+    REQUIRE( vmap1.get( 1000 ) == 0.0 );
+}
+
+TEST_CASE( "vmap/huge_pages", "Huge page allocator: big and small tables, and as a vector's allocator" )
+{
+    typedef vmap_huge_page_allocator<std::pair<int,int> > allocator_type;
+    typedef vmap<int,int,std::less<int>,allocator_type> vmap_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,vmap_split,vmap_eytzinger_search> split_type;
+
+    // 8MB of entries: huge pages (or at least, 2MB aligned ones)
+    std::vector<int> keys;
+    std::vector<std::pair<int,int> > entries;
+    for( int i = 0 ; i < 1 << 20 ; ++i )
+    {
+        keys.push_back( 3*i );
+        entries.push_back( std::make_pair( 3*i, i ) );
+    }
+    std::reverse( entries.begin(), entries.end() );
+    const vmap_type vmap1( entries.begin(), entries.end() );
+#if VMAP_MMAP
+    REQUIRE( reinterpret_cast<uintptr_t>( &*vmap1.begin() ) % (2 << 20) == 0 );
+#endif
+    REQUIRE( ranks_equal( vmap1, keys, -2, 3000 ) );
+    REQUIRE( ranks_equal( vmap1, keys, 3*(1 << 20) - 3000, 3*(1 << 20) + 2 ) );
+    const split_type vmap2( entries.begin(), entries.end() );
+    REQUIRE( ranks_equal( vmap2, keys, 3*(1 << 19) - 3000, 3*(1 << 19) + 3000 ) );
+    REQUIRE( vmap2.at( 3*12345 ) == 12345 );
+
+    // Small ones come from operator new
+    std::map<int,int> amap;
+    for( int i = 0 ; i < 100 ; ++i )
+        amap[i] = -i;
+    vmap_type vmap3( amap );
+    REQUIRE( maps_equal( vmap3, amap ) );
+    vmap_type vmap4( vmap3 );
+    vmap4.swap( vmap3 );
+    REQUIRE( maps_equal( vmap3, amap ) );
+
+    std::vector<std::string,vmap_huge_page_allocator<std::string> > strings( 1 << 17, "huge" );
+    strings.push_back( "pages" );
+    REQUIRE( strings.back() == "pages" );
+    REQUIRE( vmap_huge_page_allocator<int>() == vmap_huge_page_allocator<char>() );
+}
+
+TEST_CASE( "vmap/replicated", "NUMA replicas: one copy per node, and the local one works" )
+{
+    typedef vmap<int,int,std::less<int>,vmap_huge_page_allocator<std::pair<int,int> > > vmap_type;
+    std::map<int,int> amap;
+    for( int i = 0 ; i < 1000 ; ++i )
+        amap[2*i] = i;
+    const vmap_type vmap1( amap );
+    const vmap_replicated<vmap_type> replicated( vmap1 );
+    REQUIRE( replicated.replicas() >= 1 );
+    for( std::size_t i = 0 ; i < replicated.replicas() ; ++i )
+    {
+        REQUIRE( maps_equal( replicated.replica(i), amap ) );
+        REQUIRE( &*replicated.replica(i).begin() != &*vmap1.begin() );
+    }
+    REQUIRE( lookups_equal( replicated.local(), amap, -2, 2002 ) );
+}
+
+// Check a cursor's lookups, for ascending keys in [low,high] with the
+// given stride, against the map's
+template<typename VmapT>
+bool cursor_equal( const VmapT& vmap, int low, int high, int stride )
+{
+    vmap_cursor<VmapT> cursor( vmap );
+    for( int key = low ; key <= high ; key += stride )
+    {
+        REQUIRE( cursor.lower_bound( key ) == vmap.lower_bound( key ) );
+        REQUIRE( cursor.lower_bound( key ) == vmap.lower_bound( key ) );
+        REQUIRE( cursor.find( key ) == vmap.find( key ) );
+    }
+    REQUIRE( cursor.find( high + 1 ) == vmap.end() );
+    cursor.reset();
+    REQUIRE( cursor.find( low ) == vmap.find( low ) );
+    return true;
+}
+
+TEST_CASE( "vmap/cursor/lookup", "Sorted cursor: agrees with lower_bound and find, for every stride and layout" )
+{
+    typedef std::allocator<std::pair<int,int> > allocator_type;
+    typedef vmap<int,int,std::less<int>,allocator_type,vmap_split,vmap_eytzinger_search> split_type;
+    typedef vmap<int,int,std::greater<int>,allocator_type,vmap_pairs,vmap_btree_search<> > reversed_type;
+
+    std::map<int,int> amap;
+    std::map<int,int,std::greater<int> > rmap;
+    for( int count = 0 ; count < 100 ; ++count )
+    {
+        const vmap<int,int> vmap1( amap );
+        const split_type vmap2( amap );
+        const reversed_type vmap3( rmap );
+        for( int stride = 1 ; stride < 40 ; stride += 7 )
+        {
+            REQUIRE( cursor_equal( vmap1, -2, 3*count + 2, stride ) );
+            REQUIRE( cursor_equal( vmap2, -2, 3*count + 2, stride ) );
+            vmap_cursor<reversed_type> cursor( vmap3 );
+            for( int key = 3*count + 2 ; key >= -2 ; key -= stride )
+                REQUIRE( cursor.find( key ) == vmap3.find( key ) );
+        }
+        amap[3*count] = count;
+        rmap[3*count] = count;
+    }
+
+    std::vector<std::string> words;
+    std::map<std::string,int> smap;
+    for( int i = 0 ; i < 500 ; ++i )
+    {
+        char word[16];
+        std::sprintf( word, "w%05d", i * 7 );
+        words.push_back( word );
+        if( i % 3 == 0 )
+            smap[word] = i;
+    }
+    typedef std::allocator<std::pair<std::string,int> > string_allocator;
+    const vmap<std::string,int,std::less<std::string>,string_allocator,vmap_string_keys> vmap4( smap );
+    const vmap<std::string,int,std::less<std::string>,string_allocator,vmap_front_coded<8> > vmap5( smap );
+    vmap_cursor<vmap<std::string,int,std::less<std::string>,string_allocator,vmap_string_keys> > cursor4( vmap4 );
+    vmap_cursor<vmap<std::string,int,std::less<std::string>,string_allocator,vmap_front_coded<8> > > cursor5( vmap5 );
+    for( std::size_t i = 0 ; i < words.size() ; ++i )
+    {
+        REQUIRE( cursor4.find( words[i] ) == vmap4.find( words[i] ) );
+        REQUIRE( cursor5.find( words[i] ) == vmap5.find( words[i] ) );
+    }
+}
+
+TEST_CASE( "vmap/cursor/cost", "Sorted cursor: nearby keys take a few comparisons, not log(N)" )
+{
+    typedef vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,vmap_pairs,vmap_binary_search,vmap_lookup_stats> vmap_type;
+    std::vector<std::pair<int,int> > entries;
+    for( int i = 0 ; i < 1 << 16 ; ++i )
+        entries.push_back( std::make_pair( 2*i, i ) );
+    const vmap_type vmap1( entries.begin(), entries.end() );
+    vmap_cursor<vmap_type> cursor( vmap1 );
+    long long sum = 0;
+    for( int key = 0 ; key < 1 << 17 ; ++key )
+    {
+        const vmap_type::const_iterator iter = cursor.find( key );
+        if( iter != vmap1.end() )
+            sum += iter->second;
+    }
+    REQUIRE( sum == (long long)( (1 << 16) - 1 ) * (1 << 15) );
+    // One search a find, and a comparison or two each
+    REQUIRE( vmap1.stats().searches == 1 << 17 );
+    REQUIRE( vmap1.stats().comparisons_per_search() < 3 );
+}
+
+TEST_CASE( "vmap/join", "Joins: intersect and semi-join with sorted keys, and the join of two vmaps" )
+{
+    std::map<int,int> amap, bmap;
+    for( int i = 0 ; i < 1000 ; ++i )
+        amap[2*i] = i;
+    for( int i = 0 ; i < 100 ; ++i )
+        bmap[3*i] = -i;
+    const vmap<int,int> avmap( amap );
+    const vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,vmap_split> bvmap( bmap );
+
+    std::vector<int> keys;
+    for( int key = -5 ; key < 2100 ; key += 5 )
+        keys.push_back( key );
+    std::vector<vmap<int,int>::const_iterator> found;
+    vmap_intersect( avmap, keys.begin(), keys.end(), std::back_inserter( found ) );
+    std::vector<int> present;
+    vmap_semi_join( avmap, keys.begin(), keys.end(), std::back_inserter( present ) );
+    // Multiples of 10, from 0 to 1990
+    REQUIRE( found.size() == 200 );
+    REQUIRE( present.size() == 200 );
+    for( std::size_t i = 0 ; i < found.size() ; ++i )
+    {
+        REQUIRE( present[i] == int(10 * i) );
+        REQUIRE( found[i]->first == present[i] );
+        REQUIRE( found[i]->second == int(5 * i) );
+    }
+
+    // Multiples of 6, below 300; whichever way round
+    typedef std::pair<vmap<int,int>::const_iterator,
+                      vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,vmap_split>::const_iterator> ab_type;
+    std::vector<ab_type> ab;
+    vmap_join( avmap, bvmap, std::back_inserter( ab ) );
+    REQUIRE( ab.size() == 50 );
+    for( std::size_t i = 0 ; i < ab.size() ; ++i )
+    {
+        REQUIRE( ab[i].first->first == int(6 * i) );
+        REQUIRE( ab[i].second->first == int(6 * i) );
+        REQUIRE( ab[i].first->second == int(3 * i) );
+        REQUIRE( ab[i].second->second == -int(2 * i) );
+    }
+    std::vector<std::pair<ab_type::second_type,ab_type::first_type> > ba;
+    vmap_join( bvmap, avmap, std::back_inserter( ba ) );
+    REQUIRE( ba.size() == 50 );
+    REQUIRE( ba.back().first->first == 294 );
+    REQUIRE( ba.back().second->first == 294 );
+
+    const vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,vmap_split> empty;
+    ab.clear();
+    vmap_join( avmap, empty, std::back_inserter( ab ) );
+    ba.clear();
+    vmap_join( empty, avmap, std::back_inserter( ba ) );
+    REQUIRE( ab.empty() );
+    REQUIRE( ba.empty() );
+}
+
+TEST_CASE( "vmap/merge/policies", "Merge: repeated keys, by each duplicate policy" )
+{
+    std::vector<std::map<int,int> > shards( 4 );
+    for( int i = 0 ; i < 4 ; ++i )
+        for( int key = i ; key < 40 ; key += i + 1 )
+            shards[i][key] = 100*i + key;
+    shards.push_back( std::map<int,int>() );
+
+    std::map<int,int> first, last, sum;
+    for( std::size_t i = 0 ; i < shards.size() ; ++i )
+    {
+        for( std::map<int,int>::const_iterator iter = shards[i].begin() ; iter != shards[i].end() ; ++iter )
+        {
+            first.insert( *iter );
+            last[iter->first] = iter->second;
+            sum[iter->first] += iter->second;
+        }
+    }
+
+    vmap<int,int> result;
+    vmap_merge( shards.begin(), shards.end(), result );
+    REQUIRE( maps_equal( result, first ) );
+    vmap_merge( shards.begin(), shards.end(), result, vmap_keep_last() );
+    REQUIRE( maps_equal( result, last ) );
+    vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,vmap_split> split;
+    vmap_merge( shards.begin(), shards.end(), split, vmap_combine<std::plus<int> >() );
+    REQUIRE( maps_equal( split, sum ) );
+
+    vmap_merge( shards.end() - 1, shards.end(), result );
+    REQUIRE( result.empty() );
+    vmap_merge( shards.begin(), shards.begin() + 1, result );
+    REQUIRE( maps_equal( result, shards[0] ) );
+
+    // In parts, which may have no entries at all
+    for( std::size_t parts = 2 ; parts < 100 ; parts += 13 )
+    {
+        vmap_merge( shards.begin(), shards.end(), result, vmap_keep_first(), parts );
+        REQUIRE( maps_equal( result, first ) );
+        vmap_merge( shards.begin(), shards.end(), result, vmap_keep_last(), parts );
+        REQUIRE( maps_equal( result, last ) );
+        vmap_merge( shards.begin(), shards.end(), split, vmap_combine<std::plus<int> >(), parts );
+        REQUIRE( maps_equal( split, sum ) );
+    }
+}
+
+TEST_CASE( "vmap/merge/sources", "Merge: big merges of maps, vmaps and sorted vectors" )
+{
+    std::vector<std::map<int,int> > shards( 7 );
+    std::map<int,int> expect;
+    unsigned seed = 1;
+    for( int count = 0 ; count < 200000 ; ++count )
+    {
+        seed = seed * 1103515245 + 12345;
+        const int key = int( (seed >> 8) % 150000 );
+        // Shards cover different ranges, so the parts take from a few each
+        const std::size_t shard = ( key / 25000 + count % 2 ) % shards.size();
+        shards[shard].insert( std::make_pair( key, count ) );
+    }
+    for( std::size_t i = 0 ; i < shards.size() ; ++i )
+        expect.insert( shards[i].begin(), shards[i].end() );
+
+    vmap<int,int> result;
+    vmap_merge( shards.begin(), shards.end(), result );
+    REQUIRE( maps_equal( result, expect ) );
+
+    std::vector<vmap<int,int> > vmaps;
+    std::vector<std::vector<std::pair<int,int> > > vectors;
+    for( std::size_t i = 0 ; i < shards.size() ; ++i )
+    {
+        vmaps.push_back( vmap<int,int>( shards[i] ) );
+        vectors.push_back( std::vector<std::pair<int,int> >( shards[i].begin(), shards[i].end() ) );
+    }
+    vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,vmap_split,vmap_eytzinger_search> split;
+    vmap_merge( vmaps.begin(), vmaps.end(), split );
+    REQUIRE( maps_equal( split, expect ) );
+    REQUIRE( lookups_equal( split, expect, -1, 2000 ) );
+    vmap_merge( vectors.begin(), vectors.end(), result );
+    REQUIRE( maps_equal( result, expect ) );
+    vmap_merge( shards.begin(), shards.end(), result, vmap_keep_first(), 5 );
+    REQUIRE( maps_equal( result, expect ) );
+    vmap_merge( vectors.begin(), vectors.end(), result, vmap_keep_first(), 16 );
+    REQUIRE( maps_equal( result, expect ) );
+
+    // Descending
+    std::vector<std::map<int,int,std::greater<int> > > reversed( 3 );
+    std::map<int,int,std::greater<int> > rexpect;
+    for( int key = 0 ; key < 100000 ; ++key )
+        reversed[key % 3][key/2] = key;
+    for( std::size_t i = 0 ; i < reversed.size() ; ++i )
+        rexpect.insert( reversed[i].begin(), reversed[i].end() );
+    vmap<int,int,std::greater<int> > rresult;
+    vmap_merge( reversed.begin(), reversed.end(), rresult );
+    REQUIRE( maps_equal( rresult, rexpect ) );
+    vmap_merge( reversed.begin(), reversed.end(), rresult, vmap_keep_first(), 3 );
+    REQUIRE( maps_equal( rresult, rexpect ) );
+}
+
+TEST_CASE( "vmap/hot_cache/lookup", "Hot key cache: agrees with find, seeded or learning" )
+{
+    std::map<int,int> amap;
+    for( int i = 0 ; i < 10000 ; ++i )
+        amap[3*i] = i;
+    const vmap<int,int> vmap1( amap );
+    typedef vmap<int,int,std::less<int>,std::allocator<std::pair<int,int> >,vmap_split,vmap_eytzinger_search> split_type;
+    const split_type vmap2( amap );
+
+    std::vector<int> hot;
+    for( int i = 0 ; i < 100 ; ++i )
+        hot.push_back( 300 * i );
+    hot.push_back( 1 );  // (Not there)
+    const vmap_hot_cache<vmap<int,int> > cache1( vmap1, hot.begin(), hot.end() );
+    vmap_hot_cache<split_type,4> cache2( vmap2, 64 );
+    for( int key = -1 ; key < 30002 ; ++key )
+    {
+        REQUIRE( cache1.find( key ) == vmap1.find( key ) );
+        REQUIRE( cache2.find_caching( key ) == vmap2.find( key ) );
+    }
+    // find writes nothing, counts included
+    REQUIRE( cache1.hits() == 0 );
+    REQUIRE( cache1.misses() == 0 );
+    REQUIRE( cache2.misses() == 30003 - cache2.hits() );
+    REQUIRE( cache1.at( 300 ) == 100 );
+    REQUIRE_THROWS_AS( cache1.at( 301 ), std::out_of_range );
+
+    // A copy has the same keys, and its own counts
+    vmap_hot_cache<vmap<int,int> > copy( cache1 );
+    REQUIRE( copy.find_caching( 600 )->second == 200 );
+    REQUIRE( copy.hits() == 1 );
+    REQUIRE( cache1.hits() == 0 );
+    copy.clear();
+    REQUIRE( copy.find( 600 )->second == 200 );
+    REQUIRE( copy.insert( 600 ) );
+    REQUIRE_FALSE( copy.insert( 601 ) );
+    REQUIRE( copy.find_caching( 600 )->second == 200 );
+    REQUIRE( copy.find_caching( 601 ) == vmap1.end() );
+    REQUIRE( copy.hits() == 2 );
+    REQUIRE( copy.misses() == 1 );
+    copy.reset_stats();
+    REQUIRE( copy.hit_rate() == 0.0 );
+}
+
+TEST_CASE( "vmap/hot_cache/replacement", "Hot key cache: full sets keep the hottest seeds and the most recent keys" )
+{
+    std::map<std::string,int> smap;
+    smap["apple"] = 1;
+    smap["banana"] = 2;
+    smap["cherry"] = 3;
+    smap["damson"] = 4;
+    // (The map's stats show which finds got past the cache)
+    typedef vmap<std::string,int,std::less<std::string>,std::allocator<std::pair<std::string,int> >,
+                 vmap_pairs,vmap_binary_search,vmap_lookup_stats> vmap_type;
+    vmap_type vmap1( smap );
+
+    // One set of two ways
+    const char* seeds[] = { "cherry", "apple", "banana" };
+    const vmap_hot_cache<vmap_type,2> seeded( vmap1, seeds, seeds + 3, 1 );
+    vmap1.reset_stats();
+    REQUIRE( seeded.find( "banana" )->second == 2 );
+    REQUIRE( vmap1.stats().searches == 1 );
+    REQUIRE( seeded.find( "cherry" )->second == 3 );
+    REQUIRE( seeded.find( "apple" )->second == 1 );
+    REQUIRE( vmap1.stats().searches == 1 );
+
+    vmap_hot_cache<vmap_type,2> learning( vmap1, 1 );
+    learning.find_caching( "apple" );
+    learning.find_caching( "banana" );
+    learning.find_caching( "apple" );
+    learning.find_caching( "cherry" );  // Evicts banana
+    REQUIRE( learning.misses() == 3 );
+    REQUIRE( learning.hits() == 1 );
+    vmap1.reset_stats();
+    REQUIRE( learning.find( "apple" )->second == 1 );
+    REQUIRE( learning.find( "cherry" )->second == 3 );
+    REQUIRE( vmap1.stats().searches == 0 );
+    REQUIRE( learning.find( "banana" )->second == 2 );
+    REQUIRE( vmap1.stats().searches == 1 );
+    REQUIRE( learning.find_caching( "elder" ) == vmap1.end() );
+    REQUIRE( learning.find_caching( "apple" )->second == 1 );
+    REQUIRE( learning.hits() == 2 );
+    REQUIRE( learning.misses() == 4 );
+
+    // A skewed stream: a handful of keys, most of the time
+    std::map<int,int> amap;
+    for( int i = 0 ; i < 100000 ; ++i )
+        amap[i] = -i;
+    const vmap<int,int> vmap2( amap );
+    vmap_hot_cache<vmap<int,int> > cache( vmap2 );
+    unsigned seed = 1;
+    for( int i = 0 ; i < 100000 ; ++i )
+    {
+        seed = seed * 1103515245 + 12345;
+        const int key = (seed >> 8) % 10 ? int( (seed >> 12) % 50 ) : int( (seed >> 12) % 100000 );
+        REQUIRE( cache.find_caching( key )->second == -key );
+    }
+    REQUIRE( cache.hit_rate() > 0.85 );
+}
@@ -3,221 +3,7046 @@
 /*
   A vectorize version of std::map
 
-  Has the read-only functionality of std::map, most things are still
-  O(logN), but because the underlying implementation is a vector,
-  things go a little bit quicker.
+  Has the lookup functionality of std::map, most things are still
+  O(logN), but because the underlying implementation is an array,
+  things go a little bit quicker. Entries can't be added or removed,
+  but the mapped values can be updated in place.
 
   Primary use-case is:
   1) Build a std::map in the usual fashion
   2) Convert it to a vmap
   3) use vmap for lookup
 
+Storage layouts (the fifth template parameter):
+  vmap_pairs  -- (default) a single array of key/mapped pairs
+  vmap_split  -- keys and mapped values in two parallel arrays. Searches
+                 only touch the (dense) key array, which is a win when
+                 mapped_type is large. Iterators yield pair-like proxies
+                 with 'first' and 'second' reference members.
+  vmap_string_keys -- std::string keys (with std::less) without the
+                 std::strings: the characters all go in one arena, and
+                 each key is a reference into it plus its first eight
+                 bytes, inline, which settle most comparisons. Iterators
+                 yield vmap_string_ref keys. Lookups take std::strings.
+  vmap_front_coded<B> -- std::string keys (with std::less), front coded in
+                 blocks of B (default 32): each block has one whole key,
+                 the rest are stored as what they share with the key before
+                 plus the remainder. A lookup binary searches the blocks'
+                 first keys, then decodes one block. Much smaller for keys
+                 with long common prefixes (URLs, paths). Ignores the search
+                 policy. Iterators yield a copy of the key (and a
+                 reference to the mapped value).
+  vmap_packed<B> -- integral keys (with std::less), frame of reference
+                 coded in blocks of B (default 64): each block's first key
+                 is kept to one side, and each key as its difference from
+                 that, in as few bits as the block needs. A lookup binary
+                 searches the first keys, then the block's bit fields.
+                 Keys which are close together take a byte or two. Ignores
+                 the search policy; mapped values are a parallel array, as
+                 vmap_split. Iterators yield a copy of the key.
+                 vmap_packed_table<K,M,B> is a read-only table with keys
+                 coded the same way, and integral mapped values packed
+                 too, at one fixed width; at, get and its iterators hand
+                 out copies.
+
+Search policies (the sixth template parameter):
+  vmap_binary_search    -- (default) binary search over the sorted entries.
+                           Arithmetic and pointer keys (with std::less or
+                           std::greater) get a branch-free search which
+                           prefetches the next probe.
+  vmap_eytzinger_search -- keeps a second copy of the keys, laid out in
+                           BFS (Eytzinger) order, which is much kinder to
+                           the cache on large tables. Costs an extra
+                           sizeof(key_type) per entry. Iteration order is
+                           unaffected.
+  vmap_kary_search      -- for integer and floating point keys compared
+                           with std::less: a 17-ary search tree over a copy
+                           of the keys, searched 16 keys at a time with
+                           SSE2/AVX2 (picked at runtime). Other keys get a
+                           binary search.
+  vmap_btree_search<B>  -- an implicit static B+tree over the sorted
+                           entries: nodes of B bytes (default 64, a cache
+                           line) of separator keys, above leaf blocks which
+                           are the entries themselves. About log(N)/log(B/
+                           sizeof(key)+1) cache misses a search, and only
+                           the separators are copied (about one key in
+                           B/sizeof(key)). Any key type and predicate.
+  vmap_learned_search<E> -- for numeric keys compared with std::less: a
+                           piecewise linear model of where each key is,
+                           good to within E (default 16) entries, then a
+                           binary search of that window. Roughly constant
+                           time for evenly spread keys (timestamps, IDs).
+                           Costs a key, a double and a size_t per segment.
+                           Other keys get a binary search.
+  vmap_hashed_search<S,H> -- find (and so at and get) goes through a
+                           perfect hash of the keys: one probe, whatever
+                           the size. Everything else uses search policy S
+                           (default vmap_binary_search). H defaults to
+                           std::hash<key_type>, and must agree with the
+                           predicate. Costs about 5 bytes per key.
+  vmap_filtered_search<S,B,H> -- a blocked Bloom filter of the keys, B
+                           bits (default 10) per key, in front of S's find
+                           (and so at, get and count): most lookups of a
+                           key that isn't there touch one cache line and
+                           make no comparisons. The false positive rate is
+                           about 2% at 8 bits, 1% at 10, 0.1% at 16. Hits
+                           and everything else go through S. H as above.
+
+  index_memory() says how many bytes the search policy uses, over and
+  above the entries themselves.
+
+Stats policies (the seventh template parameter):
+  vmap_no_stats         -- (default) nothing is counted, and it costs
+                           nothing.
+  vmap_lookup_stats     -- each vmap counts its searches, the comparator
+                           calls they make (and a histogram of how many
+                           each one took), find/at/get hits and misses,
+                           at() throws, and a histogram of where in the
+                           table the hits were. stats() returns a snapshot
+                           (a vmap_stats); reset_stats() zeroes them. The
+                           counts are atomic with VMAP_CONFIG_THREADS.
+                           Comparisons made without the comparator (the
+                           SIMD nodes of vmap_kary_search, and everything
+                           vmap_front_coded and vmap_packed do) aren't
+                           counted. With vmap_filtered_search, it also
+                           counts the misses the filter turned away, and
+                           those it let through; false_positive_rate() is
+                           the second over both.
+
+Transparent comparators:
+  If the comparator has an is_transparent member type (as std::less<>
+  does), lower_bound, upper_bound, equal_range, find, at and get also
+  take anything it can compare with key_type - a C string or string_view
+  for std::string keys, say - without making a key_type. Those lookups
+  are a binary search of the entries, whatever the search policy.
+
 Feature macros:
   #define VMAP_CONFIG_NOEXCEPT   -- compile supports 'noexcept' function decorator
-  #define VMAP_CONFIG_CBEGIN     -- std::containers have cbegin/cend/crbegin/crend
   #define VMAP_CONFIG_MOVE       -- enable move sematics
+  #define VMAP_CONFIG_NO_SIMD    -- don't use the SSE/AVX search kernels
+  #define VMAP_CONFIG_THREADS    -- use std::thread to sort large inputs,
+                                    and provide vmap_publisher (needs c++11)
+
+Repeated keys:
+  vmultimap<key,mapped,compare,allocator,search> stands in for std::multimap.
+  Each distinct key is stored once, with its mapped values in a contiguous
+  run, so equal_range and count are one search; mapped_range(key) gives
+  the run as a pair of pointers.
+
+Occasional changes:
+  vmap_delta<...> (same template parameters as vmap) layers a small
+  sorted buffer of inserted entries, and a list of erased keys, over a
+  vmap. Lookups check both; the buffer is folded into a new vmap in one
+  linear pass by merge(), or when it outgrows merge_threshold().
+
+Concurrent readers (VMAP_CONFIG_THREADS):
+  vmap_publisher<table> hands successive versions of a table to reader
+  threads, RCU style: readers take wait-free snapshots, the writer swaps
+  in a new table atomically and frees the old one once nobody can see it.
+
+Big tables:
+  vmap_huge_page_allocator<T> puts each allocation of 2MB or more in huge
+  pages (explicit ones if any are reserved, else transparent ones), so
+  that lookups don't miss the TLB all the time. vmap_replicated<table>
+  keeps a copy of a read-only table on each NUMA node (placed by first
+  touch, so no libnuma), and local() picks the one for the calling
+  thread's node. Both quietly do the ordinary thing where they can't.
+
+Sorted probes and joins:
+  vmap_cursor<map> looks up keys given in ascending order, galloping on
+  from the last position (1, 2, 4, ... entries, then a binary search of
+  the last step), so each lookup costs log(distance) rather than log(N).
+  vmap_intersect and vmap_semi_join run a sorted range of keys against a
+  map; vmap_join pairs up the equal keys of two maps, walking the smaller
+  and galloping through the larger.
+
+Building from shards:
+  vmap_merge(first,last,vmap,duplicates) replaces a vmap's entries with
+  the merge of a range of sorted sources (std::maps, vmaps or sorted
+  std::vectors of pairs). A key in more than one is resolved by the
+  duplicates policy: vmap_keep_first (the default), vmap_keep_last or
+  vmap_combine<op>. It's split at merge path partition points, and with
+  VMAP_CONFIG_THREADS the parts are merged in parallel.
+
+Hot keys:
+  vmap_hot_cache<map,ways,hash> is a small set-associative cache of key
+  positions in front of a map's find, for lookups which mostly want a
+  few keys. Seed it with a list of hot keys and share it between threads
+  (find doesn't write to it at all), or let find_caching learn the hot
+  keys, one cache per thread, counting its hits and misses.
+
+On-disk tables:
+  vmap_save(vmap,path) writes a vmap (with trivially copyable key and
+  mapped types) to a file; vmap_view<key,mapped,compare> mmaps such a
+  file and does the read-only lookups straight out of it. The file is the
+  keys followed by the mapped values (as vmap_split), so the searches
+  only touch the key pages. It's in the writer's byte order, which the
+  view checks, along with the version and the key and mapped sizes.
 */
 #include <functional>
 #include <memory>
 #include <vector>
 #include <map>
+#include <string>
 #include <stdexcept>
+#include <iterator>
+#include <algorithm>
+#include <numeric>
+#include <cstddef>
+#include <stdint.h>
+#include <limits>
+#include <new>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(VMAP_CONFIG_NO_SIMD)
+#define VMAP_SIMD_X86 1
+#include <immintrin.h>
+#else
+#define VMAP_SIMD_X86 0
+#endif
+
+#ifdef VMAP_CONFIG_THREADS
+#include <thread>
+#include <atomic>
+#include <mutex>
+#endif
+
+#include <cstdio>
+#include <cstring>
+#if defined(__unix__) || defined(__APPLE__)
+#define VMAP_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#define VMAP_MMAP 0
+#endif
+#if defined(__linux__)
+#define VMAP_NUMA 1
+#include <sched.h>
+#else
+#define VMAP_NUMA 0
+#endif
+#if __cplusplus >= 201103L
+#include <type_traits>
+#endif
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 #ifndef VMAP_CONFIG_NOEXCEPT
 #define noexcept
 #endif
 
-template<typename KeyType
-        ,typename MappedType
-        ,typename Predicate = std::less<KeyType>
-        ,typename Allocator = std::allocator<std::pair<KeyType,MappedType> >
-        >
-class vmap
+// A string which lives somewhere else: the keys of a vmap_string_keys
+// table, which are all kept in one arena. Compares with std::strings, C
+// strings and string_views, and converts to std::string.
+class vmap_string_ref
+{
+public:
+    typedef std::size_t size_type;
+    typedef const char* const_iterator;
+
+    vmap_string_ref() noexcept
+      : data_( 0 )
+      , size_( 0 )
+    {}
+    vmap_string_ref( const char* data, size_type size ) noexcept
+      : data_( data )
+      , size_( size )
+    {}
+
+    const char* data() const noexcept   { return data_; }
+    size_type size() const noexcept     { return size_; }
+    size_type length() const noexcept   { return size_; }
+    bool empty() const noexcept         { return size_ == 0; }
+    const_iterator begin() const noexcept { return data_; }
+    const_iterator end() const noexcept   { return data_ + size_; }
+    char operator[]( size_type index ) const noexcept { return data_[index]; }
+
+    std::string str() const
+    { return std::string( data_, size_ ); }
+    operator std::string() const
+    { return str(); }
+#if __cplusplus >= 201703L
+    operator std::string_view() const noexcept
+    { return std::string_view( data_, size_ ); }
+#endif
+
+    // <0, 0 or >0, as std::string::compare
+    int compare( const char* data, size_type size ) const noexcept
+    {
+        const size_type common = size_ < size ? size_ : size;
+        const int result = common > 0 ? std::memcmp( data_, data, common ) : 0;
+        if( result != 0 )
+            return result;
+        return size_ < size ? -1 : size_ > size ? 1 : 0;
+    }
+    int compare( const vmap_string_ref& that ) const noexcept
+    { return compare( that.data_, that.size_ ); }
+
+    friend bool operator==( const vmap_string_ref& lhs, const vmap_string_ref& rhs ) noexcept
+    { return lhs.size_ == rhs.size_ && lhs.compare( rhs ) == 0; }
+    friend bool operator!=( const vmap_string_ref& lhs, const vmap_string_ref& rhs ) noexcept
+    { return !( lhs == rhs ); }
+    friend bool operator< ( const vmap_string_ref& lhs, const vmap_string_ref& rhs ) noexcept
+    { return lhs.compare( rhs ) < 0; }
+    friend bool operator> ( const vmap_string_ref& lhs, const vmap_string_ref& rhs ) noexcept
+    { return lhs.compare( rhs ) > 0; }
+    friend bool operator<=( const vmap_string_ref& lhs, const vmap_string_ref& rhs ) noexcept
+    { return lhs.compare( rhs ) <= 0; }
+    friend bool operator>=( const vmap_string_ref& lhs, const vmap_string_ref& rhs ) noexcept
+    { return lhs.compare( rhs ) >= 0; }
+
+    // (These spare the std::string and C string comparisons a conversion)
+    friend bool operator==( const vmap_string_ref& lhs, const std::string& rhs ) noexcept
+    { return lhs == vmap_string_ref( rhs.data(), rhs.size() ); }
+    friend bool operator==( const std::string& lhs, const vmap_string_ref& rhs ) noexcept
+    { return rhs == lhs; }
+    friend bool operator!=( const vmap_string_ref& lhs, const std::string& rhs ) noexcept
+    { return !( lhs == rhs ); }
+    friend bool operator!=( const std::string& lhs, const vmap_string_ref& rhs ) noexcept
+    { return !( rhs == lhs ); }
+    friend bool operator< ( const vmap_string_ref& lhs, const std::string& rhs ) noexcept
+    { return lhs.compare( rhs.data(), rhs.size() ) < 0; }
+    friend bool operator< ( const std::string& lhs, const vmap_string_ref& rhs ) noexcept
+    { return rhs.compare( lhs.data(), lhs.size() ) > 0; }
+
+    friend bool operator==( const vmap_string_ref& lhs, const char* rhs ) noexcept
+    { return lhs == vmap_string_ref( rhs, std::strlen( rhs ) ); }
+    friend bool operator==( const char* lhs, const vmap_string_ref& rhs ) noexcept
+    { return rhs == lhs; }
+    friend bool operator!=( const vmap_string_ref& lhs, const char* rhs ) noexcept
+    { return !( lhs == rhs ); }
+    friend bool operator!=( const char* lhs, const vmap_string_ref& rhs ) noexcept
+    { return !( rhs == lhs ); }
+private:
+    const char* data_;
+    size_type size_;
+};
+
+namespace vmap_detail
 {
+    template<typename T> struct remove_const          { typedef T type; };
+    template<typename T> struct remove_const<const T> { typedef T type; };
+
+#ifdef VMAP_CONFIG_MOVE
+    template<typename T> T&& move_from( T& value ) noexcept { return std::move( value ); }
+#else
+    template<typename T> const T& move_from( T& value ) noexcept { return value; }
+#endif
+
+    // allocator_type::rebind went away in C++20
+    template<typename Allocator, typename T>
+    struct rebind_alloc
+    {
+#if __cplusplus >= 201103L
+        typedef typename std::allocator_traits<Allocator>::template rebind_alloc<T> type;
+#else
+        typedef typename Allocator::template rebind<T>::other type;
+#endif
+    };
+
+    // Projections for fixed_array::assign
+    struct select_self
+    {
+        template<typename T> T& operator()( T& value ) const noexcept { return value; }
+        template<typename T> const T& operator()( const T& value ) const noexcept { return value; }
+    };
+
+    struct select_first
+    {
+        template<typename Pair> typename Pair::first_type& operator()( Pair& pair ) const noexcept
+        { return pair.first; }
+        template<typename Pair> const typename Pair::first_type& operator()( const Pair& pair ) const noexcept
+        { return pair.first; }
+    };
+
+    struct select_second
+    {
+        template<typename Pair> typename Pair::second_type& operator()( Pair& pair ) const noexcept
+        { return pair.second; }
+        template<typename Pair> const typename Pair::second_type& operator()( const Pair& pair ) const noexcept
+        { return pair.second; }
+    };
+
+    // A fixed-size, allocator-aware array. Unlike std::vector, it doesn't
+    // need assignable elements (so it can hold std::pair<const key,mapped>)
+    // and carries no spare capacity. Moves and swaps are O(1).
+    template<typename T, typename Allocator>
+    class fixed_array : private Allocator
+    {
+        struct copying {};
+        struct moving {};
+    public:
+        typedef T value_type;
+        typedef Allocator allocator_type;
+        typedef std::size_t size_type;
+        typedef T*       iterator;
+        typedef const T* const_iterator;
+
+        fixed_array() : data_( 0 ), size_( 0 ) {}
+        explicit fixed_array( const allocator_type& allocator )
+          : allocator_type( allocator )
+          , data_( 0 )
+          , size_( 0 )
+        {}
+        fixed_array( const fixed_array& that )
+          : allocator_type( that.get_allocator() )
+          , data_( 0 )
+          , size_( 0 )
+        {
+            assign( that.begin(), that.size(), select_self() );
+        }
+        fixed_array& operator=( const fixed_array& that )
+        {
+            fixed_array copy( that );
+            swap( copy );
+            return *this;
+        }
+#ifdef VMAP_CONFIG_MOVE
+        fixed_array( fixed_array&& that ) noexcept
+          : allocator_type( std::move( that.allocator() ) )
+          , data_( that.data_ )
+          , size_( that.size_ )
+        {
+            that.data_ = 0;
+            that.size_ = 0;
+        }
+        fixed_array& operator=( fixed_array&& that ) noexcept
+        {
+            fixed_array( std::move(that) ).swap( *this );
+            return *this;
+        }
+#endif
+        ~fixed_array()
+        { release( data_, size_, size_ ); }
+
+        // Replace the contents with the count elements project(*first),
+        // project(*++first)... (Either all of them, or none of them.)
+        template<typename InputIterator, typename Project>
+        void assign( InputIterator first, size_type count, const Project& project )
+        { fill( first, count, project, copying() ); }
+
+        // As assign, but moving the elements out of the source
+        template<typename InputIterator, typename Project>
+        void assign_moved( InputIterator first, size_type count, const Project& project )
+        { fill( first, count, project, moving() ); }
+
+        size_type size() const noexcept { return size_; }
+        bool empty() const noexcept     { return size_ == 0; }
+        size_type max_size() const noexcept
+        {
+#if __cplusplus >= 201103L
+            return std::allocator_traits<allocator_type>::max_size( allocator() );
+#else
+            return allocator().max_size();
+#endif
+        }
+        allocator_type get_allocator() const noexcept
+        { return allocator(); }
+
+        T&       operator[]( size_type index ) noexcept       { return data_[index]; }
+        const T& operator[]( size_type index ) const noexcept { return data_[index]; }
+
+        iterator       begin() noexcept       { return data_; }
+        iterator       end() noexcept         { return data_ + size_; }
+        const_iterator begin() const noexcept { return data_; }
+        const_iterator end() const noexcept   { return data_ + size_; }
+
+        void swap( fixed_array& that ) noexcept
+        {
+            using std::swap;
+            swap( allocator(), that.allocator() );
+            swap( data_, that.data_ );
+            swap( size_, that.size_ );
+        }
+    private:
+        allocator_type& allocator() noexcept             { return *this; }
+        const allocator_type& allocator() const noexcept { return *this; }
+
+        template<typename U> static const U& pass( const U& value, copying ) noexcept { return value; }
+#ifdef VMAP_CONFIG_MOVE
+        template<typename U> static U&& pass( U& value, moving ) noexcept { return std::move( value ); }
+#else
+        template<typename U> static const U& pass( const U& value, moving ) noexcept { return value; }
+#endif
+
+        template<typename InputIterator, typename Project, typename How>
+        void fill( InputIterator first, size_type count, const Project& project, How how )
+        {
+            T* data = count > 0 ? allocator().allocate( count ) : 0;
+            size_type built = 0;
+            try
+            {
+                for( ; built < count ; ++built, ++first )
+                    construct( data + built, pass( project( *first ), how ) );
+            }
+            catch( ... )
+            {
+                release( data, built, count );
+                throw;
+            }
+            release( data_, size_, size_ );
+            data_ = data;
+            size_ = count;
+        }
+
+#if __cplusplus >= 201103L
+        template<typename U>
+        void construct( T* place, U&& value )
+        { std::allocator_traits<allocator_type>::construct( allocator(), place, std::forward<U>( value ) ); }
+        void destroy( T* place ) noexcept
+        { std::allocator_traits<allocator_type>::destroy( allocator(), place ); }
+#else
+        template<typename U>
+        void construct( T* place, const U& value )
+        { ::new( static_cast<void*>( place ) ) T( value ); }
+        void destroy( T* place ) noexcept
+        { place->~T(); }
+#endif
+
+        // Destroy the first 'built' elements of data, and free it
+        void release( T* data, size_type built, size_type count ) noexcept
+        {
+            while( built > 0 )
+                destroy( data + --built );
+            if( data )
+                allocator().deallocate( data, count );
+        }
+
+        T* data_;
+        size_type size_;
+    };
+
+    // Pair-like reference to an entry which isn't actually stored as a pair.
+    // MappedType may be const-qualified.
+    template<typename KeyType, typename MappedType>
+    struct pair_reference
+    {
+        typedef KeyType    first_type;
+        typedef MappedType second_type;
+
+        const KeyType& first;
+        MappedType&    second;
+
+        pair_reference( const KeyType& key, MappedType& mapped ) noexcept
+          : first( key )
+          , second( mapped )
+        {}
+
+        template<typename T1, typename T2>
+        operator std::pair<T1,T2>() const
+        { return std::pair<T1,T2>( first, second ); }
+    };
+
+    // Something for operator-> to return when there's no real object
+    template<typename Reference>
+    struct arrow_proxy
+    {
+        Reference ref;
+        explicit arrow_proxy( const Reference& r ) noexcept : ref( r ) {}
+        const Reference* operator->() const noexcept { return &ref; }
+    };
+
+    // Random-access iterator over parallel key/mapped arrays
+    template<typename KeyType, typename MappedType>
+    class split_iterator
+    {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef std::pair<KeyType,typename remove_const<MappedType>::type> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef pair_reference<KeyType,MappedType> reference;
+        typedef arrow_proxy<reference> pointer;
+
+        split_iterator() noexcept : key_( 0 ), mapped_( 0 ) {}
+        split_iterator( const KeyType* key, MappedType* mapped ) noexcept
+          : key_( key )
+          , mapped_( mapped )
+        {}
+        // iterator -> const_iterator (and, when they're the same, the copy ctor)
+        split_iterator( const split_iterator<KeyType,typename remove_const<MappedType>::type>& that ) noexcept
+          : key_( that.key_ )
+          , mapped_( that.mapped_ )
+        {}
+
+        reference operator*() const noexcept { return reference( *key_, *mapped_ ); }
+        pointer operator->() const noexcept { return pointer( **this ); }
+        reference operator[]( difference_type n ) const noexcept
+        { return reference( key_[n], mapped_[n] ); }
+
+        split_iterator& operator++() noexcept { ++key_; ++mapped_; return *this; }
+        split_iterator& operator--() noexcept { --key_; --mapped_; return *this; }
+        split_iterator operator++(int) noexcept { split_iterator t( *this ); ++*this; return t; }
+        split_iterator operator--(int) noexcept { split_iterator t( *this ); --*this; return t; }
+        split_iterator& operator+=( difference_type n ) noexcept { key_ += n; mapped_ += n; return *this; }
+        split_iterator& operator-=( difference_type n ) noexcept { key_ -= n; mapped_ -= n; return *this; }
+        split_iterator operator+( difference_type n ) const noexcept { split_iterator t( *this ); return t += n; }
+        split_iterator operator-( difference_type n ) const noexcept { split_iterator t( *this ); return t -= n; }
+        friend split_iterator operator+( difference_type n, const split_iterator& i ) noexcept { return i + n; }
+        difference_type operator-( const split_iterator& that ) const noexcept { return key_ - that.key_; }
+
+        // Friends, so that an iterator and a const_iterator compare
+        friend bool operator==( const split_iterator& lhs, const split_iterator& rhs ) noexcept { return lhs.key_ == rhs.key_; }
+        friend bool operator!=( const split_iterator& lhs, const split_iterator& rhs ) noexcept { return lhs.key_ != rhs.key_; }
+        friend bool operator< ( const split_iterator& lhs, const split_iterator& rhs ) noexcept { return lhs.key_ <  rhs.key_; }
+        friend bool operator> ( const split_iterator& lhs, const split_iterator& rhs ) noexcept { return lhs.key_ >  rhs.key_; }
+        friend bool operator<=( const split_iterator& lhs, const split_iterator& rhs ) noexcept { return lhs.key_ <= rhs.key_; }
+        friend bool operator>=( const split_iterator& lhs, const split_iterator& rhs ) noexcept { return lhs.key_ >= rhs.key_; }
+    private:
+        template<typename,typename> friend class split_iterator;
+
+        const KeyType* key_;
+        MappedType*    mapped_;
+    };
+
+    // A comparator which counts how often it's called, for
+    // vmap_lookup_stats
+    template<typename Predicate>
+    class counting_compare
+    {
+    public:
+        counting_compare( const Predicate& compare, std::size_t& count )
+          : compare_( compare )
+          , count_( &count )
+        {}
+        template<typename Lhs, typename Rhs>
+        bool operator()( const Lhs& lhs, const Rhs& rhs ) const
+        {
+            ++*count_;
+            return compare_( lhs, rhs );
+        }
+    private:
+        Predicate compare_;
+        std::size_t* count_;
+    };
+
+    // How the search policies see a storage's keys, and what they compare
+    // them with: usually, just as they are. probe() turns a key_type into
+    // the policies' key type; probes() does a batch of them. index picks
+    // the index type for a search policy (and comparator, if it isn't
+    // compare_type).
+    template<typename KeyType, typename Predicate>
+    struct plain_search
+    {
+        typedef KeyType key_type;
+        typedef Predicate compare_type;
+        template<typename Search, typename Allocator, typename Compare = Predicate>
+        struct index { typedef typename Search::template index<KeyType,Compare,Allocator>::type type; };
+
+        static const KeyType& probe( const KeyType& key ) noexcept
+        { return key; }
+        template<typename Probes>
+        static const KeyType* probes( const std::vector<KeyType>& keys, Probes& ) noexcept
+        { return &keys[0]; }
+        static const Predicate& compare( const Predicate& compare ) noexcept
+        { return compare; }
+    };
+
+    // vmap_pairs: a single array of std::pair<const key,mapped>
+    template<typename KeyType, typename MappedType, typename Allocator>
+    class pair_storage
+    {
+    public:
+        typedef KeyType key_type;
+        typedef MappedType mapped_type;
+        typedef std::pair<const key_type,mapped_type> value_type;
+        typedef Allocator allocator_type;
+        typedef fixed_array<value_type,typename rebind_alloc<Allocator,value_type>::type> impl_type;
+        // The (sortable) std::vector we can be built from
+        typedef std::pair<key_type,mapped_type> entry_type;
+        typedef std::vector<entry_type,typename rebind_alloc<Allocator,entry_type>::type> vector_type;
+        typedef typename impl_type::size_type size_type;
+        typedef typename impl_type::iterator       iterator;
+        typedef typename impl_type::const_iterator const_iterator;
+        typedef std::reverse_iterator<iterator>       reverse_iterator;
+        typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+        // How the search policies see the keys
+        template<typename Predicate> struct search : plain_search<key_type,Predicate> {};
+        enum { index_copies_keys = false };
+
+        pair_storage() {}
+        explicit pair_storage( const allocator_type& allocator )
+          : array_( allocator )
+        {}
+
+        // Replace the contents with count (sorted) entries from [first,last)
+        template<typename InputIterator>
+        void assign( InputIterator first, InputIterator, size_type count )
+        { array_.assign( first, count, select_self() ); }
+
+        // Take over the (sorted) contents of entries, leaving it empty.
+        // (The entries are moved, one by one, rather than copied.)
+        void adopt( vector_type& entries )
+        {
+            array_.assign_moved( entries.begin(), entries.size(), select_self() );
+            vector_type( entries.get_allocator() ).swap( entries );
+        }
+
+        size_type size() const noexcept     { return array_.size(); }
+        bool empty() const noexcept         { return array_.empty(); }
+        size_type max_size() const noexcept { return array_.max_size(); }
+        allocator_type get_allocator() const noexcept
+        { return allocator_type( array_.get_allocator() ); }
+
+        const key_type& key( size_type index ) const noexcept
+        { return array_[index].first; }
+
+        iterator               begin()        noexcept { return array_.begin(); }
+        iterator               end()          noexcept { return array_.end();   }
+        reverse_iterator       rbegin()       noexcept { return reverse_iterator( end() );   }
+        reverse_iterator       rend()         noexcept { return reverse_iterator( begin() ); }
+        const_iterator         begin()  const noexcept { return array_.begin(); }
+        const_iterator         end()    const noexcept { return array_.end();   }
+        const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator( end() );   }
+        const_reverse_iterator rend()   const noexcept { return const_reverse_iterator( begin() ); }
+
+        void swap( pair_storage& that ) noexcept
+        { array_.swap( that.array_ ); }
+    private:
+        impl_type array_;
+    };
+
+    // vmap_split: keys in one array, mapped values in a parallel array
+    template<typename KeyType, typename MappedType, typename Allocator>
+    class split_storage
+    {
+    public:
+        typedef KeyType key_type;
+        typedef MappedType mapped_type;
+        typedef std::pair<const key_type,mapped_type> value_type;
+        typedef Allocator allocator_type;
+        typedef fixed_array<key_type,typename rebind_alloc<Allocator,key_type>::type> keys_type;
+        typedef fixed_array<mapped_type,typename rebind_alloc<Allocator,mapped_type>::type> mapped_values_type;
+        typedef std::pair<key_type,mapped_type> entry_type;
+        typedef std::vector<entry_type,typename rebind_alloc<Allocator,entry_type>::type> vector_type;
+        typedef typename keys_type::size_type size_type;
+        typedef split_iterator<key_type,mapped_type>       iterator;
+        typedef split_iterator<key_type,const mapped_type> const_iterator;
+        typedef std::reverse_iterator<iterator>            reverse_iterator;
+        typedef std::reverse_iterator<const_iterator>      const_reverse_iterator;
+        template<typename Predicate> struct search : plain_search<key_type,Predicate> {};
+        enum { index_copies_keys = false };
+
+        split_storage() {}
+        explicit split_storage( const allocator_type& allocator )
+          : keys_( allocator )
+          , values_( allocator )
+        {}
+
+        // (Two passes over [first,last), so it had better be a forward range)
+        template<typename ForwardIterator>
+        void assign( ForwardIterator first, ForwardIterator, size_type count )
+        {
+            keys_type keys( keys_.get_allocator() );
+            mapped_values_type values( values_.get_allocator() );
+            keys.assign( first, count, select_first() );
+            values.assign( first, count, select_second() );
+            keys_.swap( keys );
+            values_.swap( values );
+        }
+
+        // Take over the (sorted) contents of entries, leaving it empty.
+        // (We have to split them up, but we move rather than copy.)
+        void adopt( vector_type& entries )
+        {
+            keys_type keys( keys_.get_allocator() );
+            mapped_values_type values( values_.get_allocator() );
+            keys.assign_moved( entries.begin(), entries.size(), select_first() );
+            values.assign_moved( entries.begin(), entries.size(), select_second() );
+            vector_type( entries.get_allocator() ).swap( entries );
+            keys_.swap( keys );
+            values_.swap( values );
+        }
+
+        size_type size() const noexcept     { return keys_.size(); }
+        bool empty() const noexcept         { return keys_.empty(); }
+        size_type max_size() const noexcept { return keys_.max_size(); }
+        allocator_type get_allocator() const noexcept
+        { return allocator_type( keys_.get_allocator() ); }
+
+        const key_type& key( size_type index ) const noexcept
+        { return keys_[index]; }
+
+        iterator begin() noexcept
+        { return iterator( keys_.begin(), values_.begin() ); }
+        iterator end() noexcept
+        { return begin() + keys_.size(); }
+        const_iterator begin() const noexcept
+        { return const_iterator( keys_.begin(), values_.begin() ); }
+        const_iterator end() const noexcept
+        { return begin() + keys_.size(); }
+        reverse_iterator       rbegin()       noexcept { return reverse_iterator( end() );   }
+        reverse_iterator       rend()         noexcept { return reverse_iterator( begin() ); }
+        const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator( end() );   }
+        const_reverse_iterator rend()   const noexcept { return const_reverse_iterator( begin() ); }
+
+        void swap( split_storage& that ) noexcept
+        {
+            keys_.swap( that.keys_ );
+            values_.swap( that.values_ );
+        }
+    private:
+        keys_type keys_;
+        mapped_values_type values_;
+    };
+
+    // A vmap_string_keys key: a reference into the arena, plus the first
+    // eight bytes of the string (zero padded), big-endian. Comparing the
+    // prefixes as integers orders the strings as std::string would, unless
+    // they're equal, so most comparisons never look at the arena.
+    struct string_key : vmap_string_ref
+    {
+        uint64_t prefix;
+
+        string_key() noexcept
+          : prefix( 0 )
+        {}
+        string_key( const char* data, std::size_t size ) noexcept
+          : vmap_string_ref( data, size )
+          , prefix( make_prefix( data, size ) )
+        {}
+        // that, moved to data (a copy of the arena)
+        string_key( const string_key& that, const char* data ) noexcept
+          : vmap_string_ref( data, that.size() )
+          , prefix( that.prefix )
+        {}
+
+        static uint64_t make_prefix( const char* data, std::size_t size ) noexcept
+        {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            if( size >= 8 )
+            {
+                uint64_t word;
+                std::memcpy( &word, data, 8 );
+                return __builtin_bswap64( word );
+            }
+#endif
+            uint64_t prefix = 0;
+            for( std::size_t i = 0 ; i < 8 ; ++i )
+                prefix = ( prefix << 8 ) | ( i < size ? static_cast<unsigned char>( data[i] ) : 0u );
+            return prefix;
+        }
+    };
+
+    struct string_key_less
+    {
+        bool operator()( const string_key& lhs, const string_key& rhs ) const noexcept
+        {
+            if( lhs.prefix != rhs.prefix )
+                return lhs.prefix < rhs.prefix;
+            // The prefixes match, so we can skip as much of them as both
+            // strings actually have
+            std::size_t skip = lhs.size() < rhs.size() ? lhs.size() : rhs.size();
+            if( skip > 8 )
+                skip = 8;
+            return vmap_string_ref( lhs.data() + skip, lhs.size() - skip )
+                .compare( rhs.data() + skip, rhs.size() - skip ) < 0;
+        }
+    };
+
+    // Only std::less will do: the prefixes are in memcmp order
+    template<typename Predicate> struct string_search;
+    template<>
+    struct string_search<std::less<std::string> >
+    {
+        typedef string_key key_type;
+        typedef string_key_less compare_type;
+        template<typename Search, typename Allocator, typename Compare = string_key_less>
+        struct index { typedef typename Search::template index<string_key,Compare,Allocator>::type type; };
+
+        static string_key probe( const std::string& key ) noexcept
+        { return string_key( key.data(), key.size() ); }
+        static const string_key* probes( const std::vector<std::string>& keys, std::vector<string_key>& probes )
+        {
+            probes.clear();
+            for( std::size_t i = 0 ; i < keys.size() ; ++i )
+                probes.push_back( probe( keys[i] ) );
+            return &probes[0];
+        }
+        static string_key_less compare( const std::less<std::string>& ) noexcept
+        { return string_key_less(); }
+    };
+
+    // Projections for string_storage: each key's characters, one after the
+    // other; and the string_keys for them, once they're in the arena
+    template<typename Iterator>
+    class key_chars
+    {
+    public:
+        explicit key_chars( Iterator entry ) noexcept
+          : entry_( entry )
+          , offset_( 0 )
+        {}
+        // (Empty keys are skipped here rather than in ++, so that we never
+        // step past the last entry)
+        const char& operator*() const noexcept
+        {
+            while( offset_ == entry_->first.size() )
+            {
+                ++entry_;
+                offset_ = 0;
+            }
+            return entry_->first[offset_];
+        }
+        key_chars& operator++() noexcept
+        {
+            ++offset_;
+            return *this;
+        }
+    private:
+        mutable Iterator entry_;
+        mutable std::size_t offset_;
+    };
+
+    struct arena_key
+    {
+        explicit arena_key( const char* arena ) noexcept
+          : next( arena )
+        {}
+        template<typename Entry>
+        string_key operator()( const Entry& entry ) const noexcept
+        {
+            const string_key key( next, entry.first.size() );
+            next += entry.first.size();
+            return key;
+        }
+        mutable const char* next;
+    };
+
+    struct rebased_key
+    {
+        rebased_key( const char* from, const char* to ) noexcept
+          : from( from )
+          , to( to )
+        {}
+        string_key operator()( const string_key& key ) const noexcept
+        { return string_key( key, to + ( key.data() - from ) ); }
+        const char* from;
+        const char* to;
+    };
+
+    // vmap_string_keys: std::string keys, without the std::strings. All the
+    // characters go in one arena; each key is a string_key pointing into
+    // it, in an array parallel to the mapped values (as vmap_split).
+    template<typename KeyType, typename MappedType, typename Allocator>
+    class string_storage
+    {
+    public:
+        typedef KeyType key_type;
+        typedef MappedType mapped_type;
+        typedef std::pair<const key_type,mapped_type> value_type;
+        typedef Allocator allocator_type;
+        typedef fixed_array<string_key,typename rebind_alloc<Allocator,string_key>::type> keys_type;
+        typedef fixed_array<char,typename rebind_alloc<Allocator,char>::type> arena_type;
+        typedef fixed_array<mapped_type,typename rebind_alloc<Allocator,mapped_type>::type> mapped_values_type;
+        typedef std::pair<key_type,mapped_type> entry_type;
+        typedef std::vector<entry_type,typename rebind_alloc<Allocator,entry_type>::type> vector_type;
+        typedef typename keys_type::size_type size_type;
+        typedef split_iterator<string_key,mapped_type>       iterator;
+        typedef split_iterator<string_key,const mapped_type> const_iterator;
+        typedef std::reverse_iterator<iterator>              reverse_iterator;
+        typedef std::reverse_iterator<const_iterator>        const_reverse_iterator;
+        template<typename Predicate> struct search : string_search<Predicate> {};
+        // A copy has its own arena, so copies of its keys are out of date
+        enum { index_copies_keys = true };
+
+        string_storage() {}
+        explicit string_storage( const allocator_type& allocator )
+          : keys_( allocator )
+          , arena_( allocator )
+          , values_( allocator )
+        {}
+        string_storage( const string_storage& that )
+          : keys_( that.keys_.get_allocator() )
+          , arena_( that.arena_ )
+          , values_( that.values_ )
+        {
+            keys_.assign( that.keys_.begin(), that.keys_.size(),
+                          rebased_key( that.arena_.begin(), arena_.begin() ) );
+        }
+        string_storage& operator=( const string_storage& that )
+        {
+            string_storage copy( that );
+            swap( copy );
+            return *this;
+        }
+#ifdef VMAP_CONFIG_MOVE
+        // (The arena doesn't move, so the keys stay put)
+        string_storage( string_storage&& that ) noexcept
+          : keys_( std::move(that.keys_) )
+          , arena_( std::move(that.arena_) )
+          , values_( std::move(that.values_) )
+        {}
+        string_storage& operator=( string_storage&& that ) noexcept
+        {
+            string_storage( std::move(that) ).swap( *this );
+            return *this;
+        }
+#endif
+
+        template<typename ForwardIterator>
+        void assign( ForwardIterator first, ForwardIterator, size_type count )
+        {
+            mapped_values_type values( values_.get_allocator() );
+            values.assign( first, count, select_second() );
+            assign_keys( first, count, values );
+        }
+
+        void adopt( vector_type& entries )
+        {
+            mapped_values_type values( values_.get_allocator() );
+            values.assign_moved( entries.begin(), entries.size(), select_second() );
+            assign_keys( entries.begin(), entries.size(), values );
+            vector_type( entries.get_allocator() ).swap( entries );
+        }
+
+        size_type size() const noexcept     { return keys_.size(); }
+        bool empty() const noexcept         { return keys_.empty(); }
+        size_type max_size() const noexcept { return keys_.max_size(); }
+        allocator_type get_allocator() const noexcept
+        { return allocator_type( keys_.get_allocator() ); }
+
+        const string_key& key( size_type index ) const noexcept
+        { return keys_[index]; }
+
+        iterator begin() noexcept
+        { return iterator( keys_.begin(), values_.begin() ); }
+        iterator end() noexcept
+        { return begin() + keys_.size(); }
+        const_iterator begin() const noexcept
+        { return const_iterator( keys_.begin(), values_.begin() ); }
+        const_iterator end() const noexcept
+        { return begin() + keys_.size(); }
+        reverse_iterator       rbegin()       noexcept { return reverse_iterator( end() );   }
+        reverse_iterator       rend()         noexcept { return reverse_iterator( begin() ); }
+        const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator( end() );   }
+        const_reverse_iterator rend()   const noexcept { return const_reverse_iterator( begin() ); }
+
+        void swap( string_storage& that ) noexcept
+        {
+            keys_.swap( that.keys_ );
+            arena_.swap( that.arena_ );
+            values_.swap( that.values_ );
+        }
+    private:
+        // Copy the keys of count entries from first into a new arena, and
+        // install them (and values)
+        template<typename ForwardIterator>
+        void assign_keys( ForwardIterator first, size_type count, mapped_values_type& values )
+        {
+            size_type bytes = 0;
+            ForwardIterator entry = first;
+            for( size_type i = 0 ; i < count ; ++i, ++entry )
+                bytes += entry->first.size();
+            arena_type arena( arena_.get_allocator() );
+            arena.assign( key_chars<ForwardIterator>( first ), bytes, select_self() );
+            keys_type keys( keys_.get_allocator() );
+            keys.assign( first, count, arena_key( arena.begin() ) );
+            keys_.swap( keys );
+            arena_.swap( arena );
+            values_.swap( values );
+        }
+
+        keys_type keys_;
+        arena_type arena_;
+        mapped_values_type values_;
+    };
+
+    // LEB128 lengths, for vmap_front_coded
+    inline std::size_t varint_size( std::size_t value ) noexcept
+    {
+        std::size_t size = 1;
+        for( ; value >= 0x80 ; value >>= 7 )
+            ++size;
+        return size;
+    }
+
+    template<typename Bytes>
+    void put_varint( Bytes& bytes, std::size_t value )
+    {
+        for( ; value >= 0x80 ; value >>= 7 )
+            bytes.push_back( static_cast<unsigned char>( value | 0x80 ) );
+        bytes.push_back( static_cast<unsigned char>( value ) );
+    }
+
+    inline std::size_t get_varint( const unsigned char*& bytes ) noexcept
+    {
+        std::size_t value = 0;
+        unsigned shift = 0;
+        for( ; *bytes & 0x80 ; shift += 7 )
+            value |= static_cast<std::size_t>( *bytes++ & 0x7f ) << shift;
+        return value | static_cast<std::size_t>( *bytes++ ) << shift;
+    }
+
+    // The length of the common prefix of [lhs,lhs+lsize) and [rhs,rhs+rsize)
+    inline std::size_t common_prefix( const unsigned char* lhs, std::size_t lsize,
+                                      const unsigned char* rhs, std::size_t rsize ) noexcept
+    {
+        const std::size_t size = lsize < rsize ? lsize : rsize;
+        std::size_t common = 0;
+        while( common < size && lhs[common] == rhs[common] )
+            ++common;
+        return common;
+    }
+
+    inline const unsigned char* bytes_of( const std::string& s ) noexcept
+    { return reinterpret_cast<const unsigned char*>( s.data() ); }
+
+    // The searches all go through front_coded_storage::bound
+    struct front_coded_index
+    {
+        template<typename Storage, typename Predicate>
+        void build( const Storage&, const Predicate& )
+        {}
+
+        template<typename Storage, typename Predicate>
+        typename Storage::size_type lower_bound( const Storage& storage, const std::string& key, const Predicate& ) const noexcept
+        {
+            bool equal;
+            return storage.bound( key, false, equal );
+        }
+
+        template<typename Storage, typename Predicate>
+        typename Storage::size_type upper_bound( const Storage& storage, const std::string& key, const Predicate& ) const noexcept
+        {
+            bool equal;
+            return storage.bound( key, true, equal );
+        }
+
+        template<typename Storage, typename Predicate>
+        typename Storage::size_type find( const Storage& storage, const std::string& key, const Predicate& ) const noexcept
+        {
+            bool equal;
+            const typename Storage::size_type rank = storage.bound( key, false, equal );
+            return equal ? rank : storage.size();
+        }
+
+        template<typename Storage, typename Predicate>
+        void lower_bound_batch( const Storage& storage,
+                                const std::string* keys,
+                                typename Storage::size_type count,
+                                typename Storage::size_type* ranks,
+                                const Predicate& compare ) const noexcept
+        {
+            for( typename Storage::size_type i = 0 ; i < count ; ++i )
+                ranks[i] = lower_bound( storage, keys[i], compare );
+        }
+
+        std::size_t memory() const noexcept
+        { return 0; }
+
+        void swap( front_coded_index& ) noexcept
+        {}
+    };
+
+    // vmap_front_coded does its own searching, whatever the search policy
+    template<typename Predicate> struct front_coded_search;
+    template<>
+    struct front_coded_search<std::less<std::string> > : plain_search<std::string,std::less<std::string> >
+    {
+        template<typename Search, typename Allocator, typename Compare = std::less<std::string> >
+        struct index { typedef front_coded_index type; };
+    };
+
+    // Pair-like entry whose key had to be made, rather than found: it's a
+    // copy. MappedType may be const-qualified.
+    template<typename KeyType, typename MappedType>
+    struct decoded_reference
+    {
+        typedef KeyType    first_type;
+        typedef MappedType second_type;
+
+        const KeyType first;
+        MappedType&   second;
+
+        decoded_reference( const KeyType& key, MappedType& mapped )
+          : first( key )
+          , second( mapped )
+        {}
+
+        template<typename T1, typename T2>
+        operator std::pair<T1,T2>() const
+        { return std::pair<T1,T2>( first, second ); }
+    };
+
+    // Random-access iterator over a front_coded_storage. It keeps the last
+    // key it decoded, so stepping forwards decodes one entry at a time;
+    // jumping about means decoding from the start of a block.
+    template<typename Storage, typename MappedType>
+    class front_coded_iterator
+    {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef std::pair<std::string,typename remove_const<MappedType>::type> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef decoded_reference<std::string,MappedType> reference;
+        typedef arrow_proxy<reference> pointer;
+
+        front_coded_iterator() noexcept
+          : storage_( 0 )
+          , mapped_( 0 )
+          , rank_( 0 )
+          , decoded_( none )
+          , next_( 0 )
+        {}
+        front_coded_iterator( const Storage* storage, MappedType* mapped ) noexcept
+          : storage_( storage )
+          , mapped_( mapped )
+          , rank_( 0 )
+          , decoded_( none )
+          , next_( 0 )
+        {}
+        // iterator -> const_iterator (and, when they're the same, the copy ctor)
+        front_coded_iterator( const front_coded_iterator<Storage,typename remove_const<MappedType>::type>& that )
+          : storage_( that.storage_ )
+          , mapped_( that.mapped_ )
+          , rank_( that.rank_ )
+          , key_( that.key_ )
+          , decoded_( that.decoded_ )
+          , next_( that.next_ )
+        {}
+
+        reference operator*() const
+        {
+            storage_->decode( static_cast<std::size_t>( rank_ ), key_, decoded_, next_ );
+            return reference( key_, mapped_[rank_] );
+        }
+        pointer operator->() const { return pointer( **this ); }
+        reference operator[]( difference_type n ) const { return *( *this + n ); }
+
+        front_coded_iterator& operator++() noexcept { ++rank_; return *this; }
+        front_coded_iterator& operator--() noexcept { --rank_; return *this; }
+        front_coded_iterator operator++(int) { front_coded_iterator t( *this ); ++*this; return t; }
+        front_coded_iterator operator--(int) { front_coded_iterator t( *this ); --*this; return t; }
+        front_coded_iterator& operator+=( difference_type n ) noexcept { rank_ += n; return *this; }
+        front_coded_iterator& operator-=( difference_type n ) noexcept { rank_ -= n; return *this; }
+        front_coded_iterator operator+( difference_type n ) const { front_coded_iterator t( *this ); return t += n; }
+        front_coded_iterator operator-( difference_type n ) const { front_coded_iterator t( *this ); return t -= n; }
+        friend front_coded_iterator operator+( difference_type n, const front_coded_iterator& i ) { return i + n; }
+        difference_type operator-( const front_coded_iterator& that ) const noexcept { return rank_ - that.rank_; }
+
+        friend bool operator==( const front_coded_iterator& lhs, const front_coded_iterator& rhs ) noexcept { return lhs.rank_ == rhs.rank_; }
+        friend bool operator!=( const front_coded_iterator& lhs, const front_coded_iterator& rhs ) noexcept { return lhs.rank_ != rhs.rank_; }
+        friend bool operator< ( const front_coded_iterator& lhs, const front_coded_iterator& rhs ) noexcept { return lhs.rank_ <  rhs.rank_; }
+        friend bool operator> ( const front_coded_iterator& lhs, const front_coded_iterator& rhs ) noexcept { return lhs.rank_ >  rhs.rank_; }
+        friend bool operator<=( const front_coded_iterator& lhs, const front_coded_iterator& rhs ) noexcept { return lhs.rank_ <= rhs.rank_; }
+        friend bool operator>=( const front_coded_iterator& lhs, const front_coded_iterator& rhs ) noexcept { return lhs.rank_ >= rhs.rank_; }
+    private:
+        template<typename,typename> friend class front_coded_iterator;
+        static const std::size_t none = ~std::size_t(0);
+
+        const Storage* storage_;
+        MappedType*    mapped_;
+        difference_type rank_;
+        // The entry key_ holds, and where the one after it starts
+        mutable std::string key_;
+        mutable std::size_t decoded_;
+        mutable std::size_t next_;
+    };
+
+    // vmap_front_coded: std::string keys, front coded in blocks of
+    // BlockSize. Each block starts with a whole key (its 'head'); every
+    // other key is the length it shares with the one before, and the rest
+    // of it. A lookup binary searches the heads (whose first eight bytes,
+    // as with string_key, are kept to one side, so the search rarely reads
+    // them) and then scans one block, comparing as it decodes. Mapped
+    // values are in a parallel array, as vmap_split.
+    template<typename KeyType, typename MappedType, typename Allocator, std::size_t BlockSize>
+    class front_coded_storage
+    {
+        struct block
+        {
+            uint64_t prefix;    // The head's first eight bytes
+            std::size_t offset; // Where the block starts
+        };
+    public:
+        typedef KeyType key_type;
+        typedef MappedType mapped_type;
+        typedef std::pair<const key_type,mapped_type> value_type;
+        typedef Allocator allocator_type;
+        typedef std::vector<unsigned char,typename rebind_alloc<Allocator,unsigned char>::type> bytes_type;
+        typedef std::vector<block,typename rebind_alloc<Allocator,block>::type> blocks_type;
+        typedef fixed_array<mapped_type,typename rebind_alloc<Allocator,mapped_type>::type> mapped_values_type;
+        typedef std::pair<key_type,mapped_type> entry_type;
+        typedef std::vector<entry_type,typename rebind_alloc<Allocator,entry_type>::type> vector_type;
+        typedef typename mapped_values_type::size_type size_type;
+        typedef front_coded_iterator<front_coded_storage,mapped_type>       iterator;
+        typedef front_coded_iterator<front_coded_storage,const mapped_type> const_iterator;
+        typedef std::reverse_iterator<iterator>       reverse_iterator;
+        typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+        template<typename Predicate> struct search : front_coded_search<Predicate> {};
+        enum { index_copies_keys = false };
+
+        front_coded_storage() {}
+        explicit front_coded_storage( const allocator_type& allocator )
+          : bytes_( allocator )
+          , blocks_( allocator )
+          , values_( allocator )
+        {}
+
+        template<typename ForwardIterator>
+        void assign( ForwardIterator first, ForwardIterator, size_type count )
+        {
+            mapped_values_type values( values_.get_allocator() );
+            values.assign( first, count, select_second() );
+            assign_keys( first, count, values );
+        }
+
+        void adopt( vector_type& entries )
+        {
+            mapped_values_type values( values_.get_allocator() );
+            values.assign_moved( entries.begin(), entries.size(), select_second() );
+            assign_keys( entries.begin(), entries.size(), values );
+            vector_type( entries.get_allocator() ).swap( entries );
+        }
+
+        size_type size() const noexcept     { return values_.size(); }
+        bool empty() const noexcept         { return values_.empty(); }
+        size_type max_size() const noexcept { return values_.max_size(); }
+        allocator_type get_allocator() const noexcept
+        { return allocator_type( values_.get_allocator() ); }
+
+        // (A copy: there's nothing to refer to)
+        key_type key( size_type index ) const
+        {
+            key_type key;
+            size_type decoded = ~size_type(0), next = 0;
+            decode( index, key, decoded, next );
+            return key;
+        }
+
+        // Bytes used by the keys
+        std::size_t key_memory() const noexcept
+        { return bytes_.capacity() + blocks_.capacity() * sizeof(block); }
+
+        // The rank of the first entry which isn't less than key (or, for
+        // upper, which is greater). equal says whether it's key.
+        size_type bound( const key_type& key, bool upper, bool& equal ) const noexcept
+        {
+            const string_key probe( key.data(), key.size() );
+            // The first block whose head comes after key
+            size_type low = 0;
+            size_type count = blocks_.size();
+            while( count > 0 )
+            {
+                const size_type half = count / 2;
+                if( head_before( low + half, probe, upper ) )
+                {
+                    low += half + 1;
+                    count -= half + 1;
+                }
+                else
+                {
+                    count = half;
+                }
+            }
+            if( low == 0 )
+            {
+                equal = head_equal( 0, probe );
+                return 0;
+            }
+            // So it's in block low-1, past the head (or it's the next head)
+            size_type rank = ( low - 1 ) * BlockSize;
+            const size_type last = std::min<size_type>( rank + BlockSize, size() );
+            const unsigned char* bytes = &bytes_[0] + blocks_[low-1].offset;
+            const size_type length = get_varint( bytes );
+            const unsigned char* const wanted = bytes_of( key );
+            size_type match = common_prefix( bytes, length, wanted, key.size() );
+            equal = match == length && match == key.size();
+            bytes += length;
+            for( ++rank ; rank < last ; ++rank )
+            {
+                const size_type shared = get_varint( bytes );
+                const size_type suffix = get_varint( bytes );
+                const unsigned char* const rest = bytes;
+                bytes += suffix;
+                // The entry before matched key for match bytes, and came
+                // before it. If this one shares less with it, it's bigger
+                // than key; if it shares more, it's smaller.
+                if( shared < match )
+                {
+                    equal = false;
+                    return rank;
+                }
+                if( shared > match )
+                    continue;
+                const size_type more = common_prefix( rest, suffix, wanted + match, key.size() - match );
+                match += more;
+                equal = more == suffix && match == key.size();
+                const bool before = more == suffix ? ( match < key.size() || ( upper && equal ) )
+                                                   : ( match < key.size() && rest[more] < wanted[match] );
+                if( !before )
+                    return rank;
+            }
+            equal = head_equal( low, probe );
+            return rank;
+        }
+
+        // Make key entry rank. decoded and next are what's already in key
+        // (entry decoded, with entry decoded+1 at bytes_[next]), or decoded
+        // is ~0 if nothing is.
+        void decode( size_type rank, key_type& key, size_type& decoded, size_type& next ) const
+        {
+            if( rank == decoded )
+                return;
+            if( decoded > rank || rank / BlockSize != decoded / BlockSize )
+            {
+                const unsigned char* bytes = &bytes_[0] + blocks_[rank / BlockSize].offset;
+                const size_type length = get_varint( bytes );
+                key.assign( reinterpret_cast<const char*>( bytes ), length );
+                decoded = rank - rank % BlockSize;
+                next = static_cast<size_type>( bytes + length - &bytes_[0] );
+            }
+            const unsigned char* bytes = &bytes_[0] + next;
+            while( decoded < rank )
+            {
+                const size_type shared = get_varint( bytes );
+                const size_type suffix = get_varint( bytes );
+                key.resize( shared );
+                key.append( reinterpret_cast<const char*>( bytes ), suffix );
+                bytes += suffix;
+                ++decoded;
+            }
+            next = static_cast<size_type>( bytes - &bytes_[0] );
+        }
+
+        iterator begin() noexcept
+        { return iterator( this, values_.begin() ); }
+        iterator end() noexcept
+        { return begin() + values_.size(); }
+        const_iterator begin() const noexcept
+        { return const_iterator( this, values_.begin() ); }
+        const_iterator end() const noexcept
+        { return begin() + values_.size(); }
+        reverse_iterator       rbegin()       noexcept { return reverse_iterator( end() );   }
+        reverse_iterator       rend()         noexcept { return reverse_iterator( begin() ); }
+        const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator( end() );   }
+        const_reverse_iterator rend()   const noexcept { return const_reverse_iterator( begin() ); }
+
+        void swap( front_coded_storage& that ) noexcept
+        {
+            bytes_.swap( that.bytes_ );
+            blocks_.swap( that.blocks_ );
+            values_.swap( that.values_ );
+        }
+    private:
+        // Block b's head < key (or, for upper, <= key)
+        bool head_before( size_type b, const string_key& key, bool upper ) const noexcept
+        {
+            if( blocks_[b].prefix != key.prefix )
+                return blocks_[b].prefix < key.prefix;
+            const unsigned char* bytes = &bytes_[0] + blocks_[b].offset;
+            const size_type length = get_varint( bytes );
+            const int order = key.compare( reinterpret_cast<const char*>( bytes ), length );
+            return upper ? order >= 0 : order > 0;
+        }
+
+        bool head_equal( size_type b, const string_key& key ) const noexcept
+        {
+            if( b == blocks_.size() || blocks_[b].prefix != key.prefix )
+                return false;
+            const unsigned char* bytes = &bytes_[0] + blocks_[b].offset;
+            const size_type length = get_varint( bytes );
+            return key.compare( reinterpret_cast<const char*>( bytes ), length ) == 0;
+        }
+
+        // Encode the keys of count entries from first (two passes: one to
+        // size things, one to fill them in), and install them (and values)
+        template<typename ForwardIterator>
+        void assign_keys( ForwardIterator first, size_type count, mapped_values_type& values )
+        {
+            size_type total = 0;
+            ForwardIterator entry = first;
+            ForwardIterator previous = first;
+            for( size_type i = 0 ; i < count ; previous = entry, ++i, ++entry )
+            {
+                const std::string& key = entry->first;
+                const size_type shared = i % BlockSize == 0 ? 0 : shared_length( previous->first, key );
+                total += ( i % BlockSize == 0 ? 0 : varint_size( shared ) )
+                       + varint_size( key.size() - shared ) + key.size() - shared;
+            }
+            bytes_type bytes( bytes_.get_allocator() );
+            blocks_type blocks( blocks_.get_allocator() );
+            bytes.reserve( total );
+            blocks.reserve( ( count + BlockSize - 1 ) / BlockSize );
+            entry = first;
+            previous = first;
+            for( size_type i = 0 ; i < count ; previous = entry, ++i, ++entry )
+            {
+                const std::string& key = entry->first;
+                size_type shared = 0;
+                if( i % BlockSize == 0 )
+                {
+                    const block head = { string_key::make_prefix( key.data(), key.size() ), bytes.size() };
+                    blocks.push_back( head );
+                }
+                else
+                {
+                    shared = shared_length( previous->first, key );
+                    put_varint( bytes, shared );
+                }
+                put_varint( bytes, key.size() - shared );
+                bytes.insert( bytes.end(), bytes_of( key ) + shared, bytes_of( key ) + key.size() );
+            }
+            bytes_.swap( bytes );
+            blocks_.swap( blocks );
+            values_.swap( values );
+        }
+
+        static size_type shared_length( const std::string& lhs, const std::string& rhs ) noexcept
+        { return common_prefix( bytes_of( lhs ), lhs.size(), bytes_of( rhs ), rhs.size() ); }
+
+        bytes_type bytes_;
+        blocks_type blocks_;
+        mapped_values_type values_;
+    };
+
+    // Bit fields, for vmap_packed: the field (whose bits are set in mask)
+    // at bit of words, which has a word to spare at the end. Both words are
+    // always read, so there's no branch; the second's contribution is
+    // shifted in two steps, so a shift of 0 doesn't become one of 64.
+    inline uint64_t get_bits( const uint64_t* words, uint64_t bit, uint64_t mask ) noexcept
+    {
+        const uint64_t* const word = words + ( bit >> 6 );
+        const unsigned shift = static_cast<unsigned>( bit & 63 );
+        return ( word[0] >> shift | ( word[1] << 1 ) << ( 63 - shift ) ) & mask;
+    }
+
+    inline void put_bits( uint64_t* words, uint64_t bit, unsigned width, uint64_t value ) noexcept
+    {
+        if( width == 0 )
+            return;
+        uint64_t* const word = words + ( bit >> 6 );
+        const unsigned shift = static_cast<unsigned>( bit & 63 );
+        word[0] |= value << shift;
+        if( shift + width > 64 )
+            word[1] |= value >> ( 64 - shift );
+    }
+
+    // The bits it takes to hold value
+    inline unsigned bit_width( uint64_t value ) noexcept
+    {
+        unsigned width = 0;
+        for( ; value ; value >>= 1 )
+            ++width;
+        return width;
+    }
+
+    // The searches all go through packed_storage::bound
+    struct packed_index
+    {
+        template<typename Storage, typename Predicate>
+        void build( const Storage&, const Predicate& )
+        {}
+
+        template<typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type lower_bound( const Storage& storage, const KeyType& key, const Predicate& ) const noexcept
+        {
+            bool equal;
+            return storage.bound( key, false, equal );
+        }
+
+        template<typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type upper_bound( const Storage& storage, const KeyType& key, const Predicate& ) const noexcept
+        {
+            bool equal;
+            return storage.bound( key, true, equal );
+        }
+
+        template<typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type find( const Storage& storage, const KeyType& key, const Predicate& ) const noexcept
+        {
+            bool equal;
+            const typename Storage::size_type rank = storage.bound( key, false, equal );
+            return equal ? rank : storage.size();
+        }
+
+        template<typename Storage, typename KeyType, typename Predicate>
+        void lower_bound_batch( const Storage& storage,
+                                const KeyType* keys,
+                                typename Storage::size_type count,
+                                typename Storage::size_type* ranks,
+                                const Predicate& compare ) const noexcept
+        {
+            for( typename Storage::size_type i = 0 ; i < count ; ++i )
+                ranks[i] = lower_bound( storage, keys[i], compare );
+        }
+
+        std::size_t memory() const noexcept
+        { return 0; }
+
+        void swap( packed_index& ) noexcept
+        {}
+    };
+
+    // vmap_packed does its own searching, whatever the search policy
+    template<typename Predicate> struct packed_search;
+    template<typename KeyType>
+    struct packed_search<std::less<KeyType> > : plain_search<KeyType,std::less<KeyType> >
+    {
+        template<typename Search, typename Allocator, typename Compare = std::less<KeyType> >
+        struct index { typedef packed_index type; };
+    };
+
+    // Random-access iterator over a packed_storage. Keys are made as
+    // they're wanted, from a block's base and a bit field.
+    template<typename Storage, typename KeyType, typename MappedType>
+    class packed_iterator
+    {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef std::pair<KeyType,typename remove_const<MappedType>::type> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef decoded_reference<KeyType,MappedType> reference;
+        typedef arrow_proxy<reference> pointer;
+
+        packed_iterator() noexcept
+          : storage_( 0 )
+          , mapped_( 0 )
+          , rank_( 0 )
+        {}
+        packed_iterator( const Storage* storage, MappedType* mapped ) noexcept
+          : storage_( storage )
+          , mapped_( mapped )
+          , rank_( 0 )
+        {}
+        // iterator -> const_iterator (and, when they're the same, the copy ctor)
+        packed_iterator( const packed_iterator<Storage,KeyType,typename remove_const<MappedType>::type>& that ) noexcept
+          : storage_( that.storage_ )
+          , mapped_( that.mapped_ )
+          , rank_( that.rank_ )
+        {}
+
+        reference operator*() const noexcept
+        { return reference( storage_->key( static_cast<std::size_t>( rank_ ) ), mapped_[rank_] ); }
+        pointer operator->() const noexcept { return pointer( **this ); }
+        reference operator[]( difference_type n ) const noexcept { return *( *this + n ); }
+
+        packed_iterator& operator++() noexcept { ++rank_; return *this; }
+        packed_iterator& operator--() noexcept { --rank_; return *this; }
+        packed_iterator operator++(int) noexcept { packed_iterator t( *this ); ++*this; return t; }
+        packed_iterator operator--(int) noexcept { packed_iterator t( *this ); --*this; return t; }
+        packed_iterator& operator+=( difference_type n ) noexcept { rank_ += n; return *this; }
+        packed_iterator& operator-=( difference_type n ) noexcept { rank_ -= n; return *this; }
+        packed_iterator operator+( difference_type n ) const noexcept { packed_iterator t( *this ); return t += n; }
+        packed_iterator operator-( difference_type n ) const noexcept { packed_iterator t( *this ); return t -= n; }
+        friend packed_iterator operator+( difference_type n, const packed_iterator& i ) noexcept { return i + n; }
+        difference_type operator-( const packed_iterator& that ) const noexcept { return rank_ - that.rank_; }
+
+        friend bool operator==( const packed_iterator& lhs, const packed_iterator& rhs ) noexcept { return lhs.rank_ == rhs.rank_; }
+        friend bool operator!=( const packed_iterator& lhs, const packed_iterator& rhs ) noexcept { return lhs.rank_ != rhs.rank_; }
+        friend bool operator< ( const packed_iterator& lhs, const packed_iterator& rhs ) noexcept { return lhs.rank_ <  rhs.rank_; }
+        friend bool operator> ( const packed_iterator& lhs, const packed_iterator& rhs ) noexcept { return lhs.rank_ >  rhs.rank_; }
+        friend bool operator<=( const packed_iterator& lhs, const packed_iterator& rhs ) noexcept { return lhs.rank_ <= rhs.rank_; }
+        friend bool operator>=( const packed_iterator& lhs, const packed_iterator& rhs ) noexcept { return lhs.rank_ >= rhs.rank_; }
+    private:
+        template<typename,typename,typename> friend class packed_iterator;
+
+        const Storage*  storage_;
+        MappedType*     mapped_;
+        difference_type rank_;
+    };
+
+    // Integers as offsets from a (smaller) base, in modular arithmetic,
+    // so that signed ones work too
+    template<typename T>
+    uint64_t packed_offset( const T& base, const T& value ) noexcept
+    { return static_cast<uint64_t>( value ) - static_cast<uint64_t>( base ); }
+    template<typename T>
+    T unpacked( const T& base, uint64_t offset ) noexcept
+    { return static_cast<T>( static_cast<uint64_t>( base ) + offset ); }
+
+    // The keys of vmap_packed (and vmap_packed_table): integral keys, frame
+    // of reference coded in blocks of BlockSize. Each block's first key
+    // (its 'base') is kept to one side; every key in the block is stored
+    // as its difference from the base, in as few bits as the block's
+    // biggest difference needs. A lookup binary searches the bases, then
+    // the block's bit fields. Keys which are close together (ids,
+    // timestamps) take a byte or two each.
+    template<typename KeyType, typename Allocator, std::size_t BlockSize>
+    class packed_keys
+    {
+    public:
+        typedef KeyType key_type;
+        typedef std::size_t size_type;
+        typedef std::vector<key_type,typename rebind_alloc<Allocator,key_type>::type> bases_type;
+        typedef std::vector<uint64_t,typename rebind_alloc<Allocator,uint64_t>::type> words_type;
+
+        packed_keys()
+          : size_( 0 )
+        {}
+        explicit packed_keys( const Allocator& allocator )
+          : bases_( allocator )
+          , blocks_( allocator )
+          , words_( allocator )
+          , size_( 0 )
+        {}
+
+        // Encode the keys of count entries from first (two passes: one to
+        // size the blocks, one to fill them in)
+        template<typename ForwardIterator>
+        void assign( ForwardIterator first, size_type count )
+        {
+            bases_type bases( bases_.get_allocator() );
+            words_type blocks( blocks_.get_allocator() );
+            bases.reserve( ( count + BlockSize - 1 ) / BlockSize );
+            blocks.reserve( ( count + BlockSize - 1 ) / BlockSize );
+            uint64_t bits = 0;
+            ForwardIterator entry = first;
+            for( size_type i = 0 ; i < count ; i += BlockSize )
+            {
+                const size_type last = std::min<size_type>( i + BlockSize, count );
+                const key_type base = entry->first;
+                // (The last key is the furthest from the base)
+                std::advance( entry, last - i - 1 );
+                const unsigned width = bit_width( packed_offset( base, key_type( entry->first ) ) );
+                ++entry;
+                bases.push_back( base );
+                blocks.push_back( bits << 8 | width );
+                bits += uint64_t( last - i ) * width;
+            }
+            words_type words( static_cast<std::size_t>( bits/64 + 2 ), 0, words_.get_allocator() );
+            entry = first;
+            for( size_type i = 0 ; i < count ; ++i, ++entry )
+            {
+                const size_type b = i / BlockSize;
+                const unsigned width = static_cast<unsigned>( blocks[b] & 0xff );
+                put_bits( &words[0], ( blocks[b] >> 8 ) + ( i % BlockSize ) * width, width,
+                          packed_offset( bases[b], key_type( entry->first ) ) );
+            }
+            bases_.swap( bases );
+            blocks_.swap( blocks );
+            words_.swap( words );
+            size_ = count;
+        }
+
+        size_type size() const noexcept
+        { return size_; }
+
+        // (A copy: there's nothing to refer to)
+        key_type key( size_type index ) const noexcept
+        {
+            const size_type b = index / BlockSize;
+            const unsigned width = width_of( b );
+            const uint64_t mask = width ? ~uint64_t(0) >> ( 64 - width ) : 0;
+            return unpacked( bases_[b], get_bits( &words_[0], bit_of( b ) + ( index % BlockSize ) * width, mask ) );
+        }
+
+        // The rank of the first key which isn't less than key (or, for
+        // upper, which is greater). equal says whether it's key.
+        size_type bound( const key_type& key, bool upper, bool& equal ) const noexcept
+        { return upper ? bound<true>( key, equal ) : bound<false>( key, equal ); }
+
+        std::size_t memory() const noexcept
+        { return ( bases_.capacity() * sizeof(key_type) ) + ( blocks_.capacity() + words_.capacity() ) * sizeof(uint64_t); }
+
+        void swap( packed_keys& that ) noexcept
+        {
+            using std::swap;
+            bases_.swap( that.bases_ );
+            blocks_.swap( that.blocks_ );
+            words_.swap( that.words_ );
+            swap( size_, that.size_ );
+        }
+    private:
+        // (With upper fixed, so that the searches have no branches)
+        template<bool upper>
+        size_type bound( const key_type& key, bool& equal ) const noexcept
+        {
+            equal = false;
+            if( bases_.empty() )
+                return 0;
+            // The first block whose base is after key (branch free, as
+            // branchless_lower_bound)
+            const key_type* base = &bases_[0];
+            for( size_type length = bases_.size() ; length > 1 ; )
+            {
+                const size_type half = length / 2;
+                base = key < base[half] ? base : base + half;
+                length -= half;
+            }
+            if( key < *base )
+                return 0;
+            // So it's in block b
+            const size_type b = static_cast<size_type>( base - &bases_[0] );
+            const uint64_t offset = packed_offset( *base, key );
+            const unsigned width = width_of( b );
+            const uint64_t mask = width ? ~uint64_t(0) >> ( 64 - width ) : 0;
+            const uint64_t* const words = &words_[0];
+            const uint64_t bit = bit_of( b );
+            const size_type count = std::min<size_type>( BlockSize, size_ - b * BlockSize );
+            size_type low = 0;
+            for( size_type length = count ; length > 1 ; )
+            {
+                const size_type half = length / 2;
+                const uint64_t middle = get_bits( words, bit + ( low + half ) * width, mask );
+                low = middle < offset || ( upper && middle == offset ) ? low + half : low;
+                length -= half;
+            }
+            const uint64_t last = get_bits( words, bit + low * width, mask );
+            if( last < offset || ( upper && last == offset ) )
+                ++low;
+            if( !upper && low < count )
+                equal = get_bits( words, bit + low * width, mask ) == offset;
+            return b * BlockSize + low;
+        }
+
+        // Each block's bit fields start at blocks_[b] >> 8, and are
+        // blocks_[b] & 0xff bits wide
+        uint64_t bit_of( size_type b ) const noexcept
+        { return blocks_[b] >> 8; }
+        unsigned width_of( size_type b ) const noexcept
+        { return static_cast<unsigned>( blocks_[b] & 0xff ); }
+
+        bases_type bases_;          // Each block's first key
+        words_type blocks_;         // Each block's bit offset and width
+        words_type words_;          // The bit fields
+        size_type size_;
+    };
+
+    // The mapped values of vmap_packed_table: integral values, each stored
+    // as its difference from the smallest, in as few bits as the biggest
+    // difference needs (one width for them all, so value i is simply at
+    // bit i*width)
+    template<typename MappedType, typename Allocator>
+    class packed_values
+    {
+    public:
+        typedef MappedType mapped_type;
+        typedef std::size_t size_type;
+        typedef std::vector<uint64_t,typename rebind_alloc<Allocator,uint64_t>::type> words_type;
+
+        packed_values()
+          : base_()
+          , width_( 0 )
+        {}
+        explicit packed_values( const Allocator& allocator )
+          : words_( allocator )
+          , base_()
+          , width_( 0 )
+        {}
+
+        // Encode the mapped values of count entries from first
+        template<typename ForwardIterator>
+        void assign( ForwardIterator first, size_type count )
+        {
+            mapped_type low = mapped_type();
+            mapped_type high = mapped_type();
+            ForwardIterator entry = first;
+            for( size_type i = 0 ; i < count ; ++i, ++entry )
+            {
+                const mapped_type value = entry->second;
+                if( i == 0 || value < low )
+                    low = value;
+                if( i == 0 || high < value )
+                    high = value;
+            }
+            const unsigned width = bit_width( packed_offset( low, high ) );
+            words_type words( static_cast<std::size_t>( uint64_t(count) * width / 64 + 2 ), 0, words_.get_allocator() );
+            entry = first;
+            for( size_type i = 0 ; i < count ; ++i, ++entry )
+                put_bits( &words[0], uint64_t(i) * width, width, packed_offset( low, mapped_type( entry->second ) ) );
+            words_.swap( words );
+            base_ = low;
+            width_ = width;
+        }
+
+        // (A copy, again)
+        mapped_type get( size_type index ) const noexcept
+        {
+            const uint64_t mask = width_ ? ~uint64_t(0) >> ( 64 - width_ ) : 0;
+            return unpacked( base_, get_bits( &words_[0], uint64_t(index) * width_, mask ) );
+        }
+
+        std::size_t memory() const noexcept
+        { return words_.capacity() * sizeof(uint64_t); }
+
+        void swap( packed_values& that ) noexcept
+        {
+            using std::swap;
+            words_.swap( that.words_ );
+            swap( base_, that.base_ );
+            swap( width_, that.width_ );
+        }
+    private:
+        words_type words_;      // The bit fields
+        mapped_type base_;      // The smallest value
+        unsigned width_;
+    };
+
+    // vmap_packed: packed_keys, with the mapped values in a parallel array,
+    // as vmap_split, so that they can be handed out by reference
+    template<typename KeyType, typename MappedType, typename Allocator, std::size_t BlockSize>
+    class packed_storage
+    {
+    public:
+        typedef KeyType key_type;
+        typedef MappedType mapped_type;
+        typedef std::pair<const key_type,mapped_type> value_type;
+        typedef Allocator allocator_type;
+        typedef packed_keys<key_type,Allocator,BlockSize> keys_type;
+        typedef fixed_array<mapped_type,typename rebind_alloc<Allocator,mapped_type>::type> mapped_values_type;
+        typedef std::pair<key_type,mapped_type> entry_type;
+        typedef std::vector<entry_type,typename rebind_alloc<Allocator,entry_type>::type> vector_type;
+        typedef typename mapped_values_type::size_type size_type;
+        typedef packed_iterator<packed_storage,key_type,mapped_type>       iterator;
+        typedef packed_iterator<packed_storage,key_type,const mapped_type> const_iterator;
+        typedef std::reverse_iterator<iterator>       reverse_iterator;
+        typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+        template<typename Predicate> struct search : packed_search<Predicate> {};
+        enum { index_copies_keys = false };
+
+        packed_storage() {}
+        explicit packed_storage( const allocator_type& allocator )
+          : keys_( allocator )
+          , values_( allocator )
+        {}
+
+        template<typename ForwardIterator>
+        void assign( ForwardIterator first, ForwardIterator, size_type count )
+        {
+            mapped_values_type values( values_.get_allocator() );
+            values.assign( first, count, select_second() );
+            keys_type keys( get_allocator() );
+            keys.assign( first, count );
+            keys_.swap( keys );
+            values_.swap( values );
+        }
+
+        void adopt( vector_type& entries )
+        {
+            mapped_values_type values( values_.get_allocator() );
+            values.assign_moved( entries.begin(), entries.size(), select_second() );
+            keys_type keys( get_allocator() );
+            keys.assign( entries.begin(), entries.size() );
+            keys_.swap( keys );
+            values_.swap( values );
+            vector_type( entries.get_allocator() ).swap( entries );
+        }
+
+        size_type size() const noexcept     { return values_.size(); }
+        bool empty() const noexcept         { return values_.empty(); }
+        size_type max_size() const noexcept { return values_.max_size(); }
+        allocator_type get_allocator() const noexcept
+        { return allocator_type( values_.get_allocator() ); }
+
+        key_type key( size_type index ) const noexcept
+        { return keys_.key( index ); }
+
+        // Bytes used by the keys
+        std::size_t key_memory() const noexcept
+        { return keys_.memory(); }
+
+        size_type bound( const key_type& key, bool upper, bool& equal ) const noexcept
+        { return keys_.bound( key, upper, equal ); }
+
+        iterator begin() noexcept
+        { return iterator( this, values_.begin() ); }
+        iterator end() noexcept
+        { return begin() + values_.size(); }
+        const_iterator begin() const noexcept
+        { return const_iterator( this, values_.begin() ); }
+        const_iterator end() const noexcept
+        { return begin() + values_.size(); }
+        reverse_iterator       rbegin()       noexcept { return reverse_iterator( end() );   }
+        reverse_iterator       rend()         noexcept { return reverse_iterator( begin() ); }
+        const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator( end() );   }
+        const_reverse_iterator rend()   const noexcept { return const_reverse_iterator( begin() ); }
+
+        void swap( packed_storage& that ) noexcept
+        {
+            keys_.swap( that.keys_ );
+            values_.swap( that.values_ );
+        }
+    private:
+        keys_type keys_;
+        mapped_values_type values_;
+    };
+
+    // Random-access iterator over a vmap_packed_table: entries are made as
+    // they're wanted, and handed out by value
+    template<typename Keys, typename Values>
+    class packed_table_iterator
+    {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef std::pair<typename Keys::key_type,typename Values::mapped_type> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type reference;
+        typedef arrow_proxy<reference> pointer;
+
+        packed_table_iterator() noexcept
+          : keys_( 0 )
+          , values_( 0 )
+          , rank_( 0 )
+        {}
+        packed_table_iterator( const Keys* keys, const Values* values, difference_type rank ) noexcept
+          : keys_( keys )
+          , values_( values )
+          , rank_( rank )
+        {}
+
+        reference operator*() const noexcept
+        {
+            const std::size_t rank = static_cast<std::size_t>( rank_ );
+            return reference( keys_->key( rank ), values_->get( rank ) );
+        }
+        pointer operator->() const noexcept { return pointer( **this ); }
+        reference operator[]( difference_type n ) const noexcept { return *( *this + n ); }
+
+        packed_table_iterator& operator++() noexcept { ++rank_; return *this; }
+        packed_table_iterator& operator--() noexcept { --rank_; return *this; }
+        packed_table_iterator operator++(int) noexcept { packed_table_iterator t( *this ); ++*this; return t; }
+        packed_table_iterator operator--(int) noexcept { packed_table_iterator t( *this ); --*this; return t; }
+        packed_table_iterator& operator+=( difference_type n ) noexcept { rank_ += n; return *this; }
+        packed_table_iterator& operator-=( difference_type n ) noexcept { rank_ -= n; return *this; }
+        packed_table_iterator operator+( difference_type n ) const noexcept { packed_table_iterator t( *this ); return t += n; }
+        packed_table_iterator operator-( difference_type n ) const noexcept { packed_table_iterator t( *this ); return t -= n; }
+        friend packed_table_iterator operator+( difference_type n, const packed_table_iterator& i ) noexcept { return i + n; }
+        difference_type operator-( const packed_table_iterator& that ) const noexcept { return rank_ - that.rank_; }
+
+        friend bool operator==( const packed_table_iterator& lhs, const packed_table_iterator& rhs ) noexcept { return lhs.rank_ == rhs.rank_; }
+        friend bool operator!=( const packed_table_iterator& lhs, const packed_table_iterator& rhs ) noexcept { return lhs.rank_ != rhs.rank_; }
+        friend bool operator< ( const packed_table_iterator& lhs, const packed_table_iterator& rhs ) noexcept { return lhs.rank_ <  rhs.rank_; }
+        friend bool operator> ( const packed_table_iterator& lhs, const packed_table_iterator& rhs ) noexcept { return lhs.rank_ >  rhs.rank_; }
+        friend bool operator<=( const packed_table_iterator& lhs, const packed_table_iterator& rhs ) noexcept { return lhs.rank_ <= rhs.rank_; }
+        friend bool operator>=( const packed_table_iterator& lhs, const packed_table_iterator& rhs ) noexcept { return lhs.rank_ >= rhs.rank_; }
+    private:
+        const Keys*     keys_;
+        const Values*   values_;
+        difference_type rank_;
+    };
+
+    // Binary searches over storage.key(), restricted to [start,start+length)
+    template<typename Storage, typename KeyType, typename Predicate>
+    typename Storage::size_type lower_bound( const Storage& storage,
+                                             typename Storage::size_type start,
+                                             typename Storage::size_type length,
+                                             const KeyType& key,
+                                             const Predicate& compare ) noexcept
+    {
+        typedef typename Storage::size_type size_type;
+        while( length > 0 )
+        {
+            const size_type offset = length / 2;
+            const size_type midpt = start + offset;
+            if( compare( storage.key(midpt), key ) )
+            {
+                // value < key - search the upper half
+                start = midpt + 1;
+                length -= offset+1;
+            }
+            else
+            {
+                // value >= key; search the lower half
+                length = offset;
+            }
+        }
+        return start;
+    }
+
+    template<typename Storage, typename KeyType, typename Predicate>
+    typename Storage::size_type upper_bound( const Storage& storage,
+                                             typename Storage::size_type start,
+                                             typename Storage::size_type length,
+                                             const KeyType& key,
+                                             const Predicate& compare ) noexcept
+    {
+        typedef typename Storage::size_type size_type;
+        while( length > 0 )
+        {
+            const size_type offset = length / 2;
+            const size_type midpt = start + offset;
+            if( !compare( key, storage.key(midpt) ) )
+            {
+                start = midpt+1;
+                length -= offset+1;
+            }
+            else
+            {
+                length = offset;
+            }
+        }
+        return start;
+    }
+
+    // Turn a lower_bound result into a find result (size() for 'not found')
+    template<typename Storage, typename KeyType, typename Predicate>
+    typename Storage::size_type found( const Storage& storage,
+                                       typename Storage::size_type index,
+                                       const KeyType& key,
+                                       const Predicate& compare ) noexcept
+    {
+        if( index != storage.size() && compare( key, storage.key(index) ) )
+            return storage.size();
+        return index;
+    }
+
+    // Lookups of keys which aren't key_type, with a comparator which says
+    // (by having an is_transparent member type) that it can compare them
+    // with key_type. The indices only know about key_type, so these are
+    // binary searches of the entries, whatever the search policy.
+    struct transparent_search
+    {
+        template<typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type lower_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return vmap_detail::lower_bound( storage, 0, storage.size(), key, compare ); }
+
+        template<typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type upper_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return vmap_detail::upper_bound( storage, 0, storage.size(), key, compare ); }
+
+        template<typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type find( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return found( storage, lower_bound( storage, key, compare ), key, compare ); }
+    };
+
+    // lower_bound for a key which isn't before entry 'start': look 1, 2, 4,
+    // 8... entries on, until we pass the key, then binary search the last
+    // step. O(log d) for a key d entries on.
+    template<typename Storage, typename KeyType, typename Predicate>
+    typename Storage::size_type gallop_lower_bound( const Storage& storage,
+                                                    typename Storage::size_type start,
+                                                    const KeyType& key,
+                                                    const Predicate& compare ) noexcept
+    {
+        typedef typename Storage::size_type size_type;
+        const size_type size = storage.size();
+        if( start >= size || !compare( storage.key(start), key ) )
+            return start;
+        size_type low = start;  // Before key
+        for( size_type step = 1 ; ; step *= 2 )
+        {
+            if( size - low <= step )
+                return vmap_detail::lower_bound( storage, low + 1, size - low - 1, key, compare );
+            if( !compare( storage.key( low + step ), key ) )
+                return vmap_detail::lower_bound( storage, low + 1, step - 1, key, compare );
+            low += step;
+        }
+    }
+
+    // The same, as a search policy index (so that vmap's stats see it)
+    template<typename SizeType>
+    struct gallop_search
+    {
+        SizeType start;
+        explicit gallop_search( SizeType from ) : start( from ) {}
+
+        template<typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type lower_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return gallop_lower_bound( storage, start, key, compare ); }
+
+        template<typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type find( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return found( storage, lower_bound( storage, key, compare ), key, compare ); }
+    };
+
+    template<typename T> struct void_type { typedef void type; };
+
+    // Result, if Predicate is transparent (and KeyType, so that it's a
+    // substitution failure rather than an error, if not)
+    template<typename Predicate, typename KeyType, typename Result, typename Enable = void>
+    struct transparent_result {};
+    template<typename Predicate, typename KeyType, typename Result>
+    struct transparent_result<Predicate,KeyType,Result,typename void_type<typename Predicate::is_transparent>::type>
+    { typedef Result type; };
+
+    // What get() returns for a missing key: one value-initialised
+    // mapped_type, rather than a copy each time
+    template<typename MappedType>
+    const MappedType& missing_mapped()
+    {
+        static const MappedType missing = MappedType();
+        return missing;
+    }
+
+    inline void prefetch( const void* address ) noexcept
+    {
+#if defined(__GNUC__)
+        __builtin_prefetch( address );
+#else
+        (void)address;
+#endif
+    }
+
+    // floor(log2(value)), value > 0
+    inline unsigned log2_floor( std::size_t value ) noexcept
+    {
+#if defined(__GNUC__)
+        return static_cast<unsigned>( sizeof(unsigned long long)*8 - 1 - __builtin_clzll( value ) );
+#else
+        unsigned result = 0;
+        while( value >>= 1 )
+            ++result;
+        return result;
+#endif
+    }
+
+    // The number of trailing 1 bits in value
+    inline unsigned trailing_ones( std::size_t value ) noexcept
+    {
+#if defined(__GNUC__)
+        return ~value ? static_cast<unsigned>( __builtin_ctzll( ~static_cast<unsigned long long>(value) ) )
+                      : static_cast<unsigned>( sizeof(value)*8 );
+#else
+        unsigned result = 0;
+        while( value & 1 )
+        {
+            value >>= 1;
+            ++result;
+        }
+        return result;
+#endif
+    }
+
+    // Keys which are cheap to copy and compare, so that the branch-free
+    // search is a win
+    template<typename T> struct trivial_key     { enum { value = false }; };
+    template<typename T> struct trivial_key<T*> { enum { value = true }; };
+    template<> struct trivial_key<char>               { enum { value = true }; };
+    template<> struct trivial_key<signed char>        { enum { value = true }; };
+    template<> struct trivial_key<unsigned char>      { enum { value = true }; };
+    template<> struct trivial_key<wchar_t>            { enum { value = true }; };
+    template<> struct trivial_key<short>              { enum { value = true }; };
+    template<> struct trivial_key<unsigned short>     { enum { value = true }; };
+    template<> struct trivial_key<int>                { enum { value = true }; };
+    template<> struct trivial_key<unsigned int>       { enum { value = true }; };
+    template<> struct trivial_key<long>               { enum { value = true }; };
+    template<> struct trivial_key<unsigned long>      { enum { value = true }; };
+    template<> struct trivial_key<long long>          { enum { value = true }; };
+    template<> struct trivial_key<unsigned long long> { enum { value = true }; };
+    template<> struct trivial_key<float>              { enum { value = true }; };
+    template<> struct trivial_key<double>             { enum { value = true }; };
+    template<> struct trivial_key<long double>        { enum { value = true }; };
+
+    template<typename KeyType, typename Predicate>
+    struct branchless_traits                                 { enum { enabled = false }; };
+    template<typename KeyType>
+    struct branchless_traits<KeyType,std::less<KeyType> >    { enum { enabled = trivial_key<KeyType>::value }; };
+    template<typename KeyType>
+    struct branchless_traits<KeyType,std::greater<KeyType> > { enum { enabled = trivial_key<KeyType>::value }; };
+    // (Counting the comparisons mustn't change the search)
+    template<typename KeyType, typename Predicate>
+    struct branchless_traits<KeyType,counting_compare<Predicate> > : branchless_traits<KeyType,Predicate> {};
+
+    // Branch-free binary searches over [start,start+length). Each step is a
+    // conditional move rather than a (50/50, so mispredicted half the time)
+    // branch, and it prefetches both places the next probe might be.
+    template<typename Storage, typename KeyType, typename Predicate>
+    typename Storage::size_type branchless_lower_bound( const Storage& storage,
+                                                        typename Storage::size_type start,
+                                                        typename Storage::size_type length,
+                                                        const KeyType& key,
+                                                        const Predicate& compare ) noexcept
+    {
+        typedef typename Storage::size_type size_type;
+        if( length == 0 )
+            return start;
+        while( length > 1 )
+        {
+            const size_type half = length / 2;
+            const size_type next = (length - half) / 2;
+            prefetch( &storage.key( start + next ) );
+            prefetch( &storage.key( start + half + next ) );
+            start = compare( storage.key( start + half ), key ) ? start + half : start;
+            length -= half;
+        }
+        return start + ( compare( storage.key( start ), key ) ? 1 : 0 );
+    }
+
+    template<typename Storage, typename KeyType, typename Predicate>
+    typename Storage::size_type branchless_upper_bound( const Storage& storage,
+                                                        typename Storage::size_type start,
+                                                        typename Storage::size_type length,
+                                                        const KeyType& key,
+                                                        const Predicate& compare ) noexcept
+    {
+        typedef typename Storage::size_type size_type;
+        if( length == 0 )
+            return start;
+        while( length > 1 )
+        {
+            const size_type half = length / 2;
+            const size_type next = (length - half) / 2;
+            prefetch( &storage.key( start + next ) );
+            prefetch( &storage.key( start + half + next ) );
+            start = compare( key, storage.key( start + half ) ) ? start : start + half;
+            length -= half;
+        }
+        return start + ( compare( key, storage.key( start ) ) ? 0 : 1 );
+    }
+
+    template<bool Branchless>
+    struct binary_dispatch
+    {
+        template<typename Storage, typename KeyType, typename Predicate>
+        static typename Storage::size_type lower_bound( const Storage& storage,
+                                                        typename Storage::size_type start,
+                                                        typename Storage::size_type length,
+                                                        const KeyType& key, const Predicate& compare ) noexcept
+        { return vmap_detail::lower_bound( storage, start, length, key, compare ); }
+
+        template<typename Storage, typename KeyType, typename Predicate>
+        static typename Storage::size_type upper_bound( const Storage& storage,
+                                                        typename Storage::size_type start,
+                                                        typename Storage::size_type length,
+                                                        const KeyType& key, const Predicate& compare ) noexcept
+        { return vmap_detail::upper_bound( storage, start, length, key, compare ); }
+    };
+
+    template<>
+    struct binary_dispatch<true>
+    {
+        template<typename Storage, typename KeyType, typename Predicate>
+        static typename Storage::size_type lower_bound( const Storage& storage,
+                                                        typename Storage::size_type start,
+                                                        typename Storage::size_type length,
+                                                        const KeyType& key, const Predicate& compare ) noexcept
+        { return branchless_lower_bound( storage, start, length, key, compare ); }
+
+        template<typename Storage, typename KeyType, typename Predicate>
+        static typename Storage::size_type upper_bound( const Storage& storage,
+                                                        typename Storage::size_type start,
+                                                        typename Storage::size_type length,
+                                                        const KeyType& key, const Predicate& compare ) noexcept
+        { return branchless_upper_bound( storage, start, length, key, compare ); }
+    };
+
+    // How many searches the batch lookups run side by side
+    const std::size_t batch_size = 32;
+
+    // Batch lookup for indices which have nothing cleverer to do
+    template<typename Index, typename Storage, typename KeyType, typename Predicate>
+    void lower_bound_each( const Index& index,
+                           const Storage& storage,
+                           const KeyType* keys,
+                           typename Storage::size_type count,
+                           typename Storage::size_type* ranks,
+                           const Predicate& compare ) noexcept
+    {
+        for( typename Storage::size_type i = 0 ; i < count ; ++i )
+            ranks[i] = index.lower_bound( storage, keys[i], compare );
+    }
+
+    // vmap_binary_search: binary search over the sorted entries. Trivial
+    // keys (arithmetic types and pointers, with std::less or std::greater)
+    // get the branch-free version.
+    template<typename KeyType, typename Predicate, typename Allocator>
+    class binary_index
+    {
+        typedef binary_dispatch<branchless_traits<KeyType,Predicate>::enabled> dispatch;
+    public:
+        template<typename Storage>
+        void build( const Storage&, const Predicate& )
+        {}
+
+        template<typename Storage>
+        typename Storage::size_type lower_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return dispatch::lower_bound( storage, 0, storage.size(), key, compare ); }
+
+        template<typename Storage>
+        typename Storage::size_type upper_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return dispatch::upper_bound( storage, 0, storage.size(), key, compare ); }
+
+        template<typename Storage>
+        typename Storage::size_type find( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return found( storage, lower_bound( storage, key, compare ), key, compare ); }
+
+        // lower_bound for count (<= batch_size) keys at once. The searches
+        // all take the same number of steps, so we run them in lock-step:
+        // each one prefetches its next probe, and by the time we come back
+        // round to it, that has (hopefully) arrived.
+        template<typename Storage>
+        void lower_bound_batch( const Storage& storage,
+                                const KeyType* keys,
+                                typename Storage::size_type count,
+                                typename Storage::size_type* ranks,
+                                const Predicate& compare ) const noexcept
+        {
+            typedef typename Storage::size_type size_type;
+            size_type length = storage.size();
+            for( size_type i = 0 ; i < count ; ++i )
+                ranks[i] = 0;
+            if( length == 0 )
+                return;
+            while( length > 1 )
+            {
+                const size_type half = length / 2;
+                const size_type next = (length - half) / 2;
+                for( size_type i = 0 ; i < count ; ++i )
+                {
+                    const size_type start = compare( storage.key( ranks[i] + half ), keys[i] ) ? ranks[i] + half : ranks[i];
+                    prefetch( &storage.key( start + next ) );
+                    ranks[i] = start;
+                }
+                length -= half;
+            }
+            for( size_type i = 0 ; i < count ; ++i )
+                ranks[i] += compare( storage.key( ranks[i] ), keys[i] ) ? 1 : 0;
+        }
+
+        // Bytes used over and above the entries
+        std::size_t memory() const noexcept
+        { return 0; }
+
+        void swap( binary_index& ) noexcept
+        {}
+    };
+
+    // vmap_eytzinger_search: a copy of the keys, in BFS order of the implicit
+    // binary search tree. Node k (1-based) has children 2k and 2k+1, so the
+    // first few levels of the tree share cache lines, and the descendants a
+    // few levels down are adjacent and can be prefetched.
+    template<typename KeyType, typename Predicate, typename Allocator>
+    class eytzinger_index
+    {
+    public:
+        typedef std::vector<KeyType,typename rebind_alloc<Allocator,KeyType>::type> tree_type;
+        typedef typename tree_type::size_type size_type;
+
+        eytzinger_index()
+          : bottom_( 0 )
+          , depth_( 0 )
+        {}
+
+        template<typename Storage>
+        void build( const Storage& storage, const Predicate& )
+        {
+            tree_type tree( tree_.get_allocator() );
+            const size_type count = storage.size();
+            if( count > 0 )
+            {
+                // Slot 0 is unused; we simply copy the first key into it
+                tree.resize( count + 1, storage.key(0) );
+                size_type rank = 0;
+                fill( storage, tree, rank, 1 );
+                depth_ = log2_floor( count );
+                bottom_ = count - ((size_type(1) << depth_) - 1);
+            }
+            else
+            {
+                depth_ = 0;
+                bottom_ = 0;
+            }
+            tree_.swap( tree );
+        }
+
+        template<typename Storage>
+        size_type lower_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        {
+            const size_type count = storage.size();
+            size_type node = 1;
+            while( node <= count )
+            {
+                prefetch_descendants( node );
+                node = 2*node + ( compare( tree_[node], key ) ? 1 : 0 );
+            }
+            return rank( node, count );
+        }
+
+        template<typename Storage>
+        size_type upper_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        {
+            const size_type count = storage.size();
+            size_type node = 1;
+            while( node <= count )
+            {
+                prefetch_descendants( node );
+                node = 2*node + ( compare( key, tree_[node] ) ? 0 : 1 );
+            }
+            return rank( node, count );
+        }
+
+        template<typename Storage>
+        size_type find( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return found( storage, lower_bound( storage, key, compare ), key, compare ); }
+
+        // Interleaved lower_bounds; the searches go down the tree together,
+        // each prefetching its next node.
+        template<typename Storage>
+        void lower_bound_batch( const Storage& storage,
+                                const KeyType* keys,
+                                size_type count,
+                                size_type* ranks,
+                                const Predicate& compare ) const noexcept
+        {
+            const size_type size = storage.size();
+            for( size_type i = 0 ; i < count ; ++i )
+                ranks[i] = 1;
+            // Every search ends on the bottom level, or the one below it
+            for( unsigned level = 0 ; size > 0 && level <= depth_ ; ++level )
+            {
+                for( size_type i = 0 ; i < count ; ++i )
+                {
+                    const size_type node = ranks[i];
+                    if( node <= size )
+                    {
+                        ranks[i] = 2*node + ( compare( tree_[node], keys[i] ) ? 1 : 0 );
+                        prefetch( reinterpret_cast<const char*>( &tree_[0] ) + ranks[i] * sizeof(KeyType) );
+                    }
+                }
+            }
+            for( size_type i = 0 ; i < count ; ++i )
+                ranks[i] = rank( ranks[i], size );
+        }
+
+        std::size_t memory() const noexcept
+        { return tree_.capacity() * sizeof(KeyType); }
+
+        void swap( eytzinger_index& that ) noexcept
+        {
+            using std::swap;
+            tree_.swap( that.tree_ );
+            swap( bottom_, that.bottom_ );
+            swap( depth_, that.depth_ );
+        }
+    private:
+        // In-order walk of the implicit tree, handing out the sorted keys
+        template<typename Storage>
+        static void fill( const Storage& storage, tree_type& tree, size_type& rank, size_type node )
+        {
+            if( node < tree.size() )
+            {
+                fill( storage, tree, rank, 2*node );
+                tree[node] = storage.key( rank++ );
+                fill( storage, tree, rank, 2*node+1 );
+            }
+        }
+
+        void prefetch_descendants( size_type node ) const noexcept
+        {
+            // The 2^levels descendants of node, 'levels' levels down, are
+            // contiguous; fetch the line they start on. (prefetch won't fault,
+            // so we don't care if that's off the end of the tree.)
+            const size_type levels = sizeof(KeyType) <= 4 ? 4 : sizeof(KeyType) <= 8 ? 3 : 2;
+            prefetch( reinterpret_cast<const char*>( &tree_[0] ) + (node << levels) * sizeof(KeyType) );
+        }
+
+        // Map the end-of-search position to a rank in the sorted entries.
+        size_type rank( size_type node, size_type count ) const noexcept
+        {
+            // Strip the trailing right-turns (and the final left turn), which
+            // leaves the last node where the search went left: the answer.
+            node >>= trailing_ones( node ) + 1;
+            if( node == 0 )
+                return count;
+            // Position in the in-order walk of a perfect tree of depth_
+            // levels, less the missing bottom-level nodes that would
+            // precede it.
+            const unsigned level = log2_floor( node );
+            const size_type index = node - (size_type(1) << level);
+            const size_type perfect = ((2*index + 1) << (depth_ - level)) - 1;
+            const size_type before = (perfect + 1) / 2;
+            return before > bottom_ ? perfect - (before - bottom_) : perfect;
+        }
+
+        tree_type tree_;
+        size_type bottom_;  // Number of nodes on the bottom level
+        unsigned depth_;    // Level of the bottom nodes (the root is level 0)
+    };
+
+    // SIMD kernels for the k-ary search. Each counts how many of a block of
+    // 'width' keys are less than (or not greater than) the probe key; the
+    // instruction set is picked at runtime.
+    namespace simd
+    {
+        const unsigned width = 16;
+
+        enum isa { isa_scalar, isa_sse2, isa_avx2 };
+
+        inline isa detect() noexcept
+        {
+#if VMAP_SIMD_X86
+            __builtin_cpu_init();
+            if( __builtin_cpu_supports("avx2") )
+                return isa_avx2;
+            if( __builtin_cpu_supports("sse2") )
+                return isa_sse2;
+#endif
+            return isa_scalar;
+        }
+
+        inline isa level() noexcept
+        {
+            static const isa result = detect();
+            return result;
+        }
+
+        template<typename T>
+        unsigned count_less_scalar( const T* keys, T key ) noexcept
+        {
+            unsigned count = 0;
+            for( unsigned i = 0 ; i < width ; ++i )
+                count += keys[i] < key ? 1 : 0;
+            return count;
+        }
+
+        template<typename T>
+        unsigned count_less_equal_scalar( const T* keys, T key ) noexcept
+        {
+            unsigned count = 0;
+            for( unsigned i = 0 ; i < width ; ++i )
+                count += key < keys[i] ? 0 : 1;
+            return count;
+        }
+
+#if VMAP_SIMD_X86
+        inline unsigned popcount( unsigned mask ) noexcept
+        { return static_cast<unsigned>( __builtin_popcount( mask ) ); }
+
+        // 32-bit lanes. Unsigned compares are done as signed, after flipping
+        // the sign bits.
+        __attribute__((target("avx2")))
+        inline unsigned greater_mask_avx2( const void* keys, int32_t key, int32_t bias, bool keys_greater ) noexcept
+        {
+            const __m256i flip = _mm256_set1_epi32( bias );
+            const __m256i probe = _mm256_xor_si256( _mm256_set1_epi32( key ), flip );
+            const __m256i* block = static_cast<const __m256i*>( keys );
+            const __m256i lo = _mm256_xor_si256( _mm256_loadu_si256( block ), flip );
+            const __m256i hi = _mm256_xor_si256( _mm256_loadu_si256( block+1 ), flip );
+            const __m256i clo = keys_greater ? _mm256_cmpgt_epi32( lo, probe ) : _mm256_cmpgt_epi32( probe, lo );
+            const __m256i chi = keys_greater ? _mm256_cmpgt_epi32( hi, probe ) : _mm256_cmpgt_epi32( probe, hi );
+            return static_cast<unsigned>( _mm256_movemask_ps( _mm256_castsi256_ps( clo ) ) )
+                | static_cast<unsigned>( _mm256_movemask_ps( _mm256_castsi256_ps( chi ) ) ) << 8;
+        }
+
+        __attribute__((target("sse2")))
+        inline unsigned greater_mask_sse2( const void* keys, int32_t key, int32_t bias, bool keys_greater ) noexcept
+        {
+            const __m128i flip = _mm_set1_epi32( bias );
+            const __m128i probe = _mm_xor_si128( _mm_set1_epi32( key ), flip );
+            const __m128i* block = static_cast<const __m128i*>( keys );
+            unsigned mask = 0;
+            for( unsigned i = 0 ; i < 4 ; ++i )
+            {
+                const __m128i lane = _mm_xor_si128( _mm_loadu_si128( block+i ), flip );
+                const __m128i c = keys_greater ? _mm_cmpgt_epi32( lane, probe ) : _mm_cmpgt_epi32( probe, lane );
+                mask |= static_cast<unsigned>( _mm_movemask_ps( _mm_castsi128_ps( c ) ) ) << (4*i);
+            }
+            return mask;
+        }
+
+        // 64-bit lanes (SSE2 has no 64-bit compare, so AVX2 only)
+        __attribute__((target("avx2")))
+        inline unsigned greater_mask_avx2( const void* keys, int64_t key, int64_t bias, bool keys_greater ) noexcept
+        {
+            const __m256i flip = _mm256_set1_epi64x( bias );
+            const __m256i probe = _mm256_xor_si256( _mm256_set1_epi64x( key ), flip );
+            const __m256i* block = static_cast<const __m256i*>( keys );
+            unsigned mask = 0;
+            for( unsigned i = 0 ; i < 4 ; ++i )
+            {
+                const __m256i lane = _mm256_xor_si256( _mm256_loadu_si256( block+i ), flip );
+                const __m256i c = keys_greater ? _mm256_cmpgt_epi64( lane, probe ) : _mm256_cmpgt_epi64( probe, lane );
+                mask |= static_cast<unsigned>( _mm256_movemask_pd( _mm256_castsi256_pd( c ) ) ) << (4*i);
+            }
+            return mask;
+        }
+
+        __attribute__((target("avx2")))
+        inline unsigned less_mask_avx2( const float* keys, float key, bool or_equal ) noexcept
+        {
+            const __m256 probe = _mm256_set1_ps( key );
+            const __m256 lo = _mm256_loadu_ps( keys );
+            const __m256 hi = _mm256_loadu_ps( keys+8 );
+            const __m256 clo = or_equal ? _mm256_cmp_ps( lo, probe, _CMP_LE_OQ ) : _mm256_cmp_ps( lo, probe, _CMP_LT_OQ );
+            const __m256 chi = or_equal ? _mm256_cmp_ps( hi, probe, _CMP_LE_OQ ) : _mm256_cmp_ps( hi, probe, _CMP_LT_OQ );
+            return static_cast<unsigned>( _mm256_movemask_ps( clo ) )
+                | static_cast<unsigned>( _mm256_movemask_ps( chi ) ) << 8;
+        }
+
+        __attribute__((target("sse2")))
+        inline unsigned less_mask_sse2( const float* keys, float key, bool or_equal ) noexcept
+        {
+            const __m128 probe = _mm_set1_ps( key );
+            unsigned mask = 0;
+            for( unsigned i = 0 ; i < 4 ; ++i )
+            {
+                const __m128 lane = _mm_loadu_ps( keys + 4*i );
+                const __m128 c = or_equal ? _mm_cmple_ps( lane, probe ) : _mm_cmplt_ps( lane, probe );
+                mask |= static_cast<unsigned>( _mm_movemask_ps( c ) ) << (4*i);
+            }
+            return mask;
+        }
+
+        __attribute__((target("avx2")))
+        inline unsigned less_mask_avx2( const double* keys, double key, bool or_equal ) noexcept
+        {
+            const __m256d probe = _mm256_set1_pd( key );
+            unsigned mask = 0;
+            for( unsigned i = 0 ; i < 4 ; ++i )
+            {
+                const __m256d lane = _mm256_loadu_pd( keys + 4*i );
+                const __m256d c = or_equal ? _mm256_cmp_pd( lane, probe, _CMP_LE_OQ ) : _mm256_cmp_pd( lane, probe, _CMP_LT_OQ );
+                mask |= static_cast<unsigned>( _mm256_movemask_pd( c ) ) << (4*i);
+            }
+            return mask;
+        }
+
+        __attribute__((target("sse2")))
+        inline unsigned less_mask_sse2( const double* keys, double key, bool or_equal ) noexcept
+        {
+            const __m128d probe = _mm_set1_pd( key );
+            unsigned mask = 0;
+            for( unsigned i = 0 ; i < 8 ; ++i )
+            {
+                const __m128d lane = _mm_loadu_pd( keys + 2*i );
+                const __m128d c = or_equal ? _mm_cmple_pd( lane, probe ) : _mm_cmplt_pd( lane, probe );
+                mask |= static_cast<unsigned>( _mm_movemask_pd( c ) ) << (2*i);
+            }
+            return mask;
+        }
+
+        template<typename T, int32_t Bias>
+        unsigned count_less_sse2_32( const T* keys, T key ) noexcept
+        { return popcount( greater_mask_sse2( keys, static_cast<int32_t>(key), Bias, false ) ); }
+        template<typename T, int32_t Bias>
+        unsigned count_less_equal_sse2_32( const T* keys, T key ) noexcept
+        { return width - popcount( greater_mask_sse2( keys, static_cast<int32_t>(key), Bias, true ) ); }
+        template<typename T, int32_t Bias>
+        unsigned count_less_avx2_32( const T* keys, T key ) noexcept
+        { return popcount( greater_mask_avx2( keys, static_cast<int32_t>(key), Bias, false ) ); }
+        template<typename T, int32_t Bias>
+        unsigned count_less_equal_avx2_32( const T* keys, T key ) noexcept
+        { return width - popcount( greater_mask_avx2( keys, static_cast<int32_t>(key), Bias, true ) ); }
+
+        template<typename T, int64_t Bias>
+        unsigned count_less_avx2_64( const T* keys, T key ) noexcept
+        { return popcount( greater_mask_avx2( keys, static_cast<int64_t>(key), Bias, false ) ); }
+        template<typename T, int64_t Bias>
+        unsigned count_less_equal_avx2_64( const T* keys, T key ) noexcept
+        { return width - popcount( greater_mask_avx2( keys, static_cast<int64_t>(key), Bias, true ) ); }
+
+        template<typename T>
+        unsigned count_less_sse2_fp( const T* keys, T key ) noexcept
+        { return popcount( less_mask_sse2( keys, key, false ) ); }
+        template<typename T>
+        unsigned count_less_equal_sse2_fp( const T* keys, T key ) noexcept
+        { return popcount( less_mask_sse2( keys, key, true ) ); }
+        template<typename T>
+        unsigned count_less_avx2_fp( const T* keys, T key ) noexcept
+        { return popcount( less_mask_avx2( keys, key, false ) ); }
+        template<typename T>
+        unsigned count_less_equal_avx2_fp( const T* keys, T key ) noexcept
+        { return popcount( less_mask_avx2( keys, key, true ) ); }
+#endif
+
+        // kernel<T>::less() and less_equal() return the best counting
+        // function for this machine.
+        template<typename T>
+        struct kernel
+        {
+            typedef unsigned (*function)( const T*, T );
+            static function less() noexcept       { return &count_less_scalar<T>; }
+            static function less_equal() noexcept { return &count_less_equal_scalar<T>; }
+        };
+
+#if VMAP_SIMD_X86
+        template<typename T, int32_t Bias>
+        struct kernel32
+        {
+            typedef unsigned (*function)( const T*, T );
+            static function less() noexcept
+            {
+                switch( level() )
+                {
+                case isa_avx2: return &count_less_avx2_32<T,Bias>;
+                case isa_sse2: return &count_less_sse2_32<T,Bias>;
+                default:       return &count_less_scalar<T>;
+                }
+            }
+            static function less_equal() noexcept
+            {
+                switch( level() )
+                {
+                case isa_avx2: return &count_less_equal_avx2_32<T,Bias>;
+                case isa_sse2: return &count_less_equal_sse2_32<T,Bias>;
+                default:       return &count_less_equal_scalar<T>;
+                }
+            }
+        };
+
+        template<typename T, int64_t Bias>
+        struct kernel64
+        {
+            typedef unsigned (*function)( const T*, T );
+            static function less() noexcept
+            { return level() == isa_avx2 ? &count_less_avx2_64<T,Bias> : &count_less_scalar<T>; }
+            static function less_equal() noexcept
+            { return level() == isa_avx2 ? &count_less_equal_avx2_64<T,Bias> : &count_less_equal_scalar<T>; }
+        };
+
+        template<typename T>
+        struct kernel_fp
+        {
+            typedef unsigned (*function)( const T*, T );
+            static function less() noexcept
+            {
+                switch( level() )
+                {
+                case isa_avx2: return &count_less_avx2_fp<T>;
+                case isa_sse2: return &count_less_sse2_fp<T>;
+                default:       return &count_less_scalar<T>;
+                }
+            }
+            static function less_equal() noexcept
+            {
+                switch( level() )
+                {
+                case isa_avx2: return &count_less_equal_avx2_fp<T>;
+                case isa_sse2: return &count_less_equal_sse2_fp<T>;
+                default:       return &count_less_equal_scalar<T>;
+                }
+            }
+        };
+
+        template<> struct kernel<int32_t>  : kernel32<int32_t,0> {};
+        template<> struct kernel<uint32_t> : kernel32<uint32_t,INT32_MIN> {};
+        template<> struct kernel<int64_t>  : kernel64<int64_t,0> {};
+        template<> struct kernel<uint64_t> : kernel64<uint64_t,INT64_MIN> {};
+        template<> struct kernel<float>    : kernel_fp<float> {};
+        template<> struct kernel<double>   : kernel_fp<double> {};
+#endif
+
+        // Which keys we have kernels for, and the lane type they use
+        template<std::size_t Size, bool Signed> struct int_lane { enum { enabled = false }; };
+        template<> struct int_lane<4,true>  { enum { enabled = true }; typedef int32_t  type; };
+        template<> struct int_lane<4,false> { enum { enabled = true }; typedef uint32_t type; };
+        template<> struct int_lane<8,true>  { enum { enabled = true }; typedef int64_t  type; };
+        template<> struct int_lane<8,false> { enum { enabled = true }; typedef uint64_t type; };
+
+        template<typename T> struct lane { enum { enabled = false }; };
+        template<> struct lane<int>                : int_lane<sizeof(int),true> {};
+        template<> struct lane<unsigned int>       : int_lane<sizeof(unsigned int),false> {};
+        template<> struct lane<long>               : int_lane<sizeof(long),true> {};
+        template<> struct lane<unsigned long>      : int_lane<sizeof(unsigned long),false> {};
+        template<> struct lane<long long>          : int_lane<sizeof(long long),true> {};
+        template<> struct lane<unsigned long long> : int_lane<sizeof(unsigned long long),false> {};
+        template<> struct lane<float>              { enum { enabled = true }; typedef float  type; };
+        template<> struct lane<double>             { enum { enabled = true }; typedef double type; };
+    }
+
+    template<bool Enabled, typename KeyType>
+    struct select_lane { typedef KeyType type; };
+    template<typename KeyType>
+    struct select_lane<true,KeyType> { typedef typename simd::lane<KeyType>::type type; };
+
+    template<typename KeyType, typename Predicate>
+    struct kary_traits
+    {
+        enum { enabled = false };
+        typedef KeyType lane_type;
+    };
+
+    template<typename KeyType>
+    struct kary_traits<KeyType,std::less<KeyType> >
+    {
+        enum { enabled = simd::lane<KeyType>::enabled };
+        typedef typename select_lane<simd::lane<KeyType>::enabled,KeyType>::type lane_type;
+    };
+
+    template<typename KeyType, typename Predicate>
+    struct kary_traits<KeyType,counting_compare<Predicate> > : kary_traits<KeyType,Predicate> {};
+
+    // vmap_kary_search: a k-ary search tree over a copy of the keys. The
+    // bottom level is the sorted keys, in blocks of simd::width; each level
+    // above has one node per width+1 nodes below, holding the largest key
+    // under each of its first 'width' children. A node is one SIMD compare
+    // (and one or two cache lines), so a search is one compare per level.
+    //
+    // Only keys with a SIMD kernel, compared with std::less, get the tree;
+    // anything else falls back to binary search.
+    template<typename KeyType, typename Predicate, typename Allocator,
+             bool Enabled = kary_traits<KeyType,Predicate>::enabled>
+    class kary_index : public binary_index<KeyType,Predicate,Allocator>
+    {
+    public:
+        void swap( kary_index& ) noexcept
+        {}
+    };
+
+    template<typename KeyType, typename Predicate, typename Allocator>
+    class kary_index<KeyType,Predicate,Allocator,true>
+    {
+        typedef typename kary_traits<KeyType,Predicate>::lane_type lane_type;
+        typedef simd::kernel<lane_type> kernel;
+    public:
+        typedef std::vector<lane_type,typename rebind_alloc<Allocator,lane_type>::type> tree_type;
+        typedef std::vector<std::size_t,typename rebind_alloc<Allocator,std::size_t>::type> levels_type;
+        typedef std::size_t size_type;
+
+        template<typename Storage>
+        void build( const Storage& storage, const Predicate& )
+        {
+            const size_type width = simd::width;
+            const size_type count = storage.size();
+            const lane_type biggest = largest();
+            tree_type tree( tree_.get_allocator() );
+            levels_type levels( levels_.get_allocator() );
+            if( count > 0 )
+            {
+                // Node counts for each level, bottom-up. 'span' is the number
+                // of keys under a node.
+                std::vector<size_type> nodes( 1, (count + width - 1) / width );
+                while( nodes.back() > 1 )
+                    nodes.push_back( (nodes.back() + width) / (width+1) );
+                size_type total = 0;
+                for( size_type level = 0 ; level < nodes.size() ; ++level )
+                    total += nodes[level];
+                tree.resize( total*width, biggest );
+
+                // Store the levels root first; levels[i] is the offset of level i
+                levels.resize( nodes.size() );
+                size_type offset = 0;
+                for( size_type level = nodes.size() ; level-- > 0 ; )
+                {
+                    levels[nodes.size()-1-level] = offset;
+                    offset += nodes[level]*width;
+                }
+
+                // The leaves
+                lane_type* leaves = &tree[levels.back()];
+                for( size_type i = 0 ; i < count ; ++i )
+                    leaves[i] = static_cast<lane_type>( storage.key(i) );
+
+                // Each node above holds the last key under each child
+                size_type span = width;
+                for( size_type level = 1 ; level < nodes.size() ; ++level )
+                {
+                    lane_type* node = &tree[levels[nodes.size()-1-level]];
+                    for( size_type i = 0 ; i < nodes[level]*width ; ++i )
+                    {
+                        // Child i/width*(width+1) + i%width
+                        const size_type child = (i / width)*(width+1) + i % width;
+                        const size_type last = (child+1)*span;
+                        if( last - span < count )
+                            node[i] = leaves[ (last < count ? last : count) - 1 ];
+                    }
+                    span *= width+1;
+                }
+            }
+            tree_.swap( tree );
+            levels_.swap( levels );
+        }
+
+        template<typename Storage>
+        typename Storage::size_type lower_bound( const Storage& storage, const KeyType& key, const Predicate& ) const noexcept
+        { return search( false, storage.size(), key ); }
+
+        template<typename Storage>
+        typename Storage::size_type upper_bound( const Storage& storage, const KeyType& key, const Predicate& ) const noexcept
+        { return search( true, storage.size(), key ); }
+
+        template<typename Storage>
+        typename Storage::size_type find( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return found( storage, lower_bound( storage, key, compare ), key, compare ); }
+
+        template<typename Storage>
+        void lower_bound_batch( const Storage& storage,
+                                const KeyType* keys,
+                                size_type count,
+                                size_type* ranks,
+                                const Predicate& compare ) const noexcept
+        { lower_bound_each( *this, storage, keys, count, ranks, compare ); }
+
+        std::size_t memory() const noexcept
+        { return tree_.capacity() * sizeof(lane_type) + levels_.capacity() * sizeof(std::size_t); }
+
+        void swap( kary_index& that ) noexcept
+        {
+            tree_.swap( that.tree_ );
+            levels_.swap( that.levels_ );
+        }
+    private:
+        // The padding. Nothing compares greater than it.
+        static lane_type largest() noexcept
+        {
+            return std::numeric_limits<lane_type>::has_infinity ? std::numeric_limits<lane_type>::infinity()
+                                                                : std::numeric_limits<lane_type>::max();
+        }
+
+        size_type search( bool upper, size_type size, const KeyType& key ) const noexcept
+        {
+            const size_type width = simd::width;
+            const lane_type probe = static_cast<lane_type>( key );
+            if( size == 0 )
+                return 0;
+            // Anything past the last key bounds at the end; catch it here,
+            // since the descent would count every separator in a partial
+            // node and step into a child that isn't there.
+            const lane_type* tree = &tree_[0];
+            const lane_type last = tree[levels_.back() + size - 1];
+            if( upper ? !( probe < last ) : last < probe )
+                return size;
+            const typename kernel::function count = upper ? kernel::less_equal() : kernel::less();
+            size_type node = 0;
+            for( size_type level = 0 ; level+1 < levels_.size() ; ++level )
+                node = node*(width+1) + count( tree + levels_[level] + node*width, probe );
+            const size_type index = node*width + count( tree + levels_.back() + node*width, probe );
+            // The padding compares as the largest key, so we might have
+            // counted some of it.
+            return index < size ? index : size;
+        }
+
+        tree_type tree_;
+        levels_type levels_;
+    };
+
+    // vmap_btree_search: an implicit static B+tree (S+tree) whose leaves
+    // are the entries themselves, in blocks of 'width' keys. Above them
+    // are levels of nodes of NodeBytes, each holding 'width' separators
+    // (the largest key under each of its first 'width' children; the last
+    // child needs none). A search reads one node per level, then binary
+    // searches one leaf block: about log(N)/log(width+1) misses rather
+    // than log2(N). Only the separators are copied, about 1/width of the
+    // keys. Works for any key and predicate; trivial keys count the
+    // separators below the key branch-free, others binary search the node.
+    template<typename KeyType, typename Predicate, typename Allocator, std::size_t NodeBytes>
+    class btree_index
+    {
+    public:
+        typedef std::vector<KeyType,typename rebind_alloc<Allocator,KeyType>::type> tree_type;
+        typedef std::vector<std::size_t,typename rebind_alloc<Allocator,std::size_t>::type> levels_type;
+        typedef std::size_t size_type;
+        enum { width = NodeBytes / sizeof(KeyType) > 1 ? NodeBytes / sizeof(KeyType) : 2 };
+
+        template<typename Storage>
+        void build( const Storage& storage, const Predicate& )
+        {
+            const size_type count = storage.size();
+            tree_type tree( tree_.get_allocator() );
+            levels_type levels( levels_.get_allocator() );
+            // Node counts for the levels above the leaves, bottom-up
+            std::vector<size_type> nodes;
+            size_type below = ( count + width - 1 ) / width;
+            while( below > 1 )
+            {
+                below = ( below + width ) / ( width + 1 );
+                nodes.push_back( below );
+            }
+            if( !nodes.empty() )
+            {
+                size_type total = 0;
+                for( size_type level = 0 ; level < nodes.size() ; ++level )
+                    total += nodes[level];
+                // The padding is the last key, which is never counted:
+                // anything after it is dealt with before the descent.
+                // Start the nodes on a cache line, if the keys fit neatly.
+                // (A copy of the index may not be, but still works.)
+                const size_type spare = 64 % sizeof(KeyType) == 0 ? 64/sizeof(KeyType) - 1 : 0;
+                tree.resize( spare + total*width, storage.key( count-1 ) );
+                size_type offset = 0;
+                if( spare > 0 )
+                    offset = ( 64 - reinterpret_cast<uintptr_t>( &tree[0] ) % 64 ) % 64 / sizeof(KeyType);
+
+                // Root first; levels[i] is the offset of level i
+                levels.resize( nodes.size() );
+                for( size_type level = nodes.size() ; level-- > 0 ; )
+                {
+                    levels[nodes.size()-1-level] = offset;
+                    offset += nodes[level]*width;
+                }
+
+                // Each separator is the last key under its child
+                size_type span = width;
+                for( size_type level = 0 ; level < nodes.size() ; ++level )
+                {
+                    const size_type first = levels[nodes.size()-1-level];
+                    for( size_type i = 0 ; i < nodes[level]*width ; ++i )
+                    {
+                        const size_type child = (i / width)*(width+1) + i % width;
+                        const size_type last = (child+1)*span;
+                        if( last - span < count )
+                            tree[first + i] = storage.key( (last < count ? last : count) - 1 );
+                    }
+                    span *= width+1;
+                }
+            }
+            tree_.swap( tree );
+            levels_.swap( levels );
+        }
+
+        template<typename Storage>
+        typename Storage::size_type lower_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return search( storage, false, key, compare ); }
+
+        template<typename Storage>
+        typename Storage::size_type upper_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return search( storage, true, key, compare ); }
+
+        template<typename Storage>
+        typename Storage::size_type find( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return found( storage, lower_bound( storage, key, compare ), key, compare ); }
+
+        template<typename Storage>
+        void lower_bound_batch( const Storage& storage,
+                                const KeyType* keys,
+                                size_type count,
+                                size_type* ranks,
+                                const Predicate& compare ) const noexcept
+        { lower_bound_each( *this, storage, keys, count, ranks, compare ); }
+
+        std::size_t memory() const noexcept
+        { return tree_.capacity() * sizeof(KeyType) + levels_.capacity() * sizeof(std::size_t); }
+
+        void swap( btree_index& that ) noexcept
+        {
+            tree_.swap( that.tree_ );
+            levels_.swap( that.levels_ );
+        }
+    private:
+        template<typename Storage>
+        size_type search( const Storage& storage, bool upper, const KeyType& key, const Predicate& compare ) const noexcept
+        {
+            const size_type size = storage.size();
+            if( size == 0 )
+                return 0;
+            // Past the last key? (The descent can't tell: see the padding.)
+            const KeyType& last = storage.key( size-1 );
+            if( upper ? !compare( key, last ) : compare( last, key ) )
+                return size;
+            size_type node = 0;
+            for( size_type level = 0 ; level < levels_.size() ; ++level )
+                node = node*(width+1) + count( &tree_[levels_[level] + node*width], upper, key, compare );
+            const size_type start = node*width;
+            const size_type length = size - start < size_type(width) ? size - start : size_type(width);
+            return upper ? vmap_detail::upper_bound( storage, start, length, key, compare )
+                         : vmap_detail::lower_bound( storage, start, length, key, compare );
+        }
+
+        // How many of a node's separators are < key (or, for upper, <= key)
+        static size_type count( const KeyType* node, bool upper, const KeyType& key, const Predicate& compare ) noexcept
+        {
+            if( trivial_key<KeyType>::value )
+            {
+                size_type result = 0;
+                for( size_type i = 0 ; i < size_type(width) ; ++i )
+                    result += ( upper ? !compare( key, node[i] ) : compare( node[i], key ) ) ? 1 : 0;
+                return result;
+            }
+            size_type start = 0;
+            size_type length = width;
+            while( length > 0 )
+            {
+                const size_type half = length / 2;
+                if( upper ? !compare( key, node[start+half] ) : compare( node[start+half], key ) )
+                {
+                    start += half + 1;
+                    length -= half + 1;
+                }
+                else
+                {
+                    length = half;
+                }
+            }
+            return start;
+        }
+
+        tree_type tree_;
+        levels_type levels_;
+    };
+
+    // Keys we can fit a line to: anything numeric, compared with std::less
+    template<typename KeyType, typename Predicate>
+    struct learned_traits                              { enum { enabled = false }; };
+    template<typename KeyType>
+    struct learned_traits<KeyType,std::less<KeyType> > { enum { enabled = std::numeric_limits<KeyType>::is_specialized }; };
+    template<typename KeyType, typename Predicate>
+    struct learned_traits<KeyType,counting_compare<Predicate> > : learned_traits<KeyType,Predicate> {};
+
+    // vmap_learned_search: a piecewise linear model of rank against key.
+    // Each segment covers a run of keys whose ranks are all within Epsilon
+    // of a straight line through its first key. A search finds the segment
+    // (by binary search of the segments' first keys, of which there are
+    // few if the keys are anything like evenly spread), predicts the rank,
+    // and finishes with a binary search of the 2*Epsilon+3 entries around
+    // the prediction.
+    //
+    // Anything other than numeric keys compared with std::less falls back
+    // to binary search.
+    template<typename KeyType, typename Predicate, typename Allocator, std::size_t Epsilon,
+             bool Enabled = learned_traits<KeyType,Predicate>::enabled>
+    class learned_index : public binary_index<KeyType,Predicate,Allocator>
+    {
+    public:
+        void swap( learned_index& ) noexcept
+        {}
+    };
+
+    template<typename KeyType, typename Predicate, typename Allocator, std::size_t Epsilon>
+    class learned_index<KeyType,Predicate,Allocator,Epsilon,true>
+    {
+        typedef binary_dispatch<branchless_traits<KeyType,Predicate>::enabled> dispatch;
+    public:
+        typedef std::size_t size_type;
+        struct segment
+        {
+            double    slope;
+            size_type rank;   // of the segment's first key
+        };
+        typedef std::vector<KeyType,typename rebind_alloc<Allocator,KeyType>::type> keys_type;
+        typedef std::vector<segment,typename rebind_alloc<Allocator,segment>::type> segments_type;
+
+        // One pass over the keys. Each segment keeps the range of slopes
+        // which put every key so far within Epsilon of its rank, and ends
+        // when that range is empty.
+        template<typename Storage>
+        void build( const Storage& storage, const Predicate& )
+        {
+            const size_type count = storage.size();
+            const double epsilon = static_cast<double>( Epsilon );
+            keys_type firsts( firsts_.get_allocator() );
+            segments_type segments( segments_.get_allocator() );
+            size_type start = 0;
+            while( start < count )
+            {
+                const double origin = static_cast<double>( storage.key(start) );
+                double low = 0;
+                double high = std::numeric_limits<double>::max();
+                size_type end = start + 1;
+                for( ; end < count ; ++end )
+                {
+                    const double dx = static_cast<double>( storage.key(end) ) - origin;
+                    const double dy = static_cast<double>( end - start );
+                    if( !( dx > 0 ) )
+                    {
+                        // Distinct keys can round to the same double
+                        if( dy > epsilon )
+                            break;
+                        continue;
+                    }
+                    const double lo = (dy - epsilon) / dx;
+                    const double hi = (dy + epsilon) / dx;
+                    if( lo > high || hi < low )
+                        break;
+                    low = std::max( low, lo );
+                    high = std::min( high, hi );
+                }
+                segment seg;
+                seg.slope = high == std::numeric_limits<double>::max() ? 0 : (low + high) / 2;
+                seg.rank = start;
+                firsts.push_back( storage.key(start) );
+                segments.push_back( seg );
+                start = end;
+            }
+            firsts_.swap( firsts );
+            segments_.swap( segments );
+        }
+
+        // The model's only guaranteed for the keys it was built from (and
+        // doubles aren't exact), so if the answer's at the edge of the
+        // window we check it, and search everything if it's wrong.
+        template<typename Storage>
+        size_type lower_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        {
+            size_type low, high;
+            window( storage.size(), key, low, high );
+            const size_type index = dispatch::lower_bound( storage, low, high - low, key, compare );
+            if( ( index == low && low > 0 && !compare( storage.key(low-1), key ) )
+             || ( index == high && high < storage.size() && compare( storage.key(high), key ) ) )
+                return dispatch::lower_bound( storage, 0, storage.size(), key, compare );
+            return index;
+        }
+
+        template<typename Storage>
+        size_type upper_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        {
+            size_type low, high;
+            window( storage.size(), key, low, high );
+            const size_type index = dispatch::upper_bound( storage, low, high - low, key, compare );
+            if( ( index == low && low > 0 && compare( key, storage.key(low-1) ) )
+             || ( index == high && high < storage.size() && !compare( key, storage.key(high) ) ) )
+                return dispatch::upper_bound( storage, 0, storage.size(), key, compare );
+            return index;
+        }
+
+        template<typename Storage>
+        size_type find( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return found( storage, lower_bound( storage, key, compare ), key, compare ); }
+
+        template<typename Storage>
+        void lower_bound_batch( const Storage& storage,
+                                const KeyType* keys,
+                                size_type count,
+                                size_type* ranks,
+                                const Predicate& compare ) const noexcept
+        { lower_bound_each( *this, storage, keys, count, ranks, compare ); }
+
+        std::size_t memory() const noexcept
+        { return firsts_.capacity() * sizeof(KeyType) + segments_.capacity() * sizeof(segment); }
+
+        void swap( learned_index& that ) noexcept
+        {
+            firsts_.swap( that.firsts_ );
+            segments_.swap( that.segments_ );
+        }
+    private:
+        // [low,high): where the model says key's bounds are
+        void window( size_type size, const KeyType& key, size_type& low, size_type& high ) const noexcept
+        {
+            low = 0;
+            high = size;
+            if( segments_.empty() )
+                return;
+            // The last segment starting at or before key. If there isn't
+            // one, key is before everything.
+            const size_type s = std::upper_bound( firsts_.begin(), firsts_.end(), key ) - firsts_.begin();
+            if( s == 0 )
+            {
+                high = 0;
+                return;
+            }
+            // key is before the next segment's first key, so that's as far
+            // as its bounds can be
+            const segment& seg = segments_[s-1];
+            const size_type end = s < segments_.size() ? segments_[s].rank : size;
+            const double span = static_cast<double>( end - seg.rank );
+            const double predicted = seg.slope * ( static_cast<double>(key) - static_cast<double>(firsts_[s-1]) );
+            const double from = predicted - static_cast<double>( Epsilon + 1 );
+            const double to = predicted + static_cast<double>( Epsilon + 2 );
+            low = seg.rank + ( from > 0 ? ( from < span ? static_cast<size_type>( from ) : end - seg.rank ) : 0 );
+            high = seg.rank + ( to > 0 ? ( to < span ? static_cast<size_type>( to ) : end - seg.rank ) : 0 );
+        }
+
+        keys_type firsts_;        // The first key of each segment
+        segments_type segments_;
+    };
+
+    // The hash vmap_hashed_search uses unless told otherwise. (Before
+    // C++11, there's no std::hash, so it only copes with integer keys.)
+#if __cplusplus >= 201103L
+    template<typename KeyType>
+    struct key_hash : std::hash<KeyType> {};
+#else
+    template<typename KeyType>
+    struct key_hash
+    {
+        std::size_t operator()( const KeyType& key ) const noexcept
+        { return static_cast<std::size_t>( key ); }
+    };
+#endif
+
+    // vmap_string_keys' keys: FNV-1a over the characters
+    template<>
+    struct key_hash<string_key>
+    {
+        std::size_t operator()( const string_key& key ) const noexcept
+        {
+            uint64_t hash = 0xcbf29ce484222325ULL;
+            for( std::size_t i = 0 ; i < key.size() ; ++i )
+                hash = ( hash ^ static_cast<unsigned char>( key[i] ) ) * 0x100000001b3ULL;
+            return static_cast<std::size_t>( hash );
+        }
+    };
+
+    template<typename Hash, typename KeyType> struct select_hash       { typedef Hash type; };
+    template<typename KeyType>                struct select_hash<void,KeyType> { typedef key_hash<KeyType> type; };
+
+    // splitmix64's finaliser
+    inline uint64_t mix64( uint64_t value ) noexcept
+    {
+        value ^= value >> 30;
+        value *= 0xbf58476d1ce4e5b9ULL;
+        value ^= value >> 27;
+        value *= 0x94d049bb133111ebULL;
+        value ^= value >> 31;
+        return value;
+    }
+
+    // value (32 bits) scaled to [0,range), without a division
+    inline uint32_t scale32( uint64_t value, uint32_t range ) noexcept
+    { return static_cast<uint32_t>( ( (value & 0xffffffffULL) * range ) >> 32 ); }
+
+    // A slot with no key in it
+    const uint32_t empty_slot = 0xffffffffu;
+
+    // vmap_hashed_search: a perfect hash of the keys (PTHash style) for
+    // find, alongside another search policy for everything else.
+    //
+    // The keys are hashed into about count/2 buckets. Each bucket has a
+    // 'pilot', chosen when the table is built (biggest buckets first) so
+    // that hash^mix(pilot) sends each of its keys to a slot nobody else
+    // has; the slot holds the key's rank. A find is a hash, a pilot and a
+    // slot, and one key comparison to confirm it - whatever the size of
+    // the table. The slot table has 1/64 more slots than keys, so it costs
+    // a little over 4 bytes per key, plus 2 bytes per bucket: about 5 bytes
+    // per key all told.
+    //
+    // Hash must agree with Predicate: keys which compare equivalent must
+    // hash the same. If no perfect hash turns up (which really only happens
+    // if Hash gives distinct keys the same value) find uses Search instead.
+    template<typename KeyType, typename Predicate, typename Allocator, typename Search, typename Hash>
+    class hashed_index
+    {
+    public:
+        typedef std::size_t size_type;
+        typedef std::vector<uint16_t,typename rebind_alloc<Allocator,uint16_t>::type> pilots_type;
+        typedef std::vector<uint32_t,typename rebind_alloc<Allocator,uint32_t>::type> slots_type;
+
+        hashed_index()
+          : seed_( 0 )
+        {}
+
+        template<typename Storage>
+        void build( const Storage& storage, const Predicate& compare )
+        {
+            search_.build( storage, compare );
+            pilots_type pilots( pilots_.get_allocator() );
+            slots_type slots( slots_.get_allocator() );
+            uint64_t seed = 0;
+            // (Ranks, and 'no key', have to fit in a slot)
+            if( storage.size() < (size_type(1) << 31) )
+            {
+                for( unsigned attempt = 1 ; attempt <= 8 ; ++attempt )
+                {
+                    seed = mix64( attempt );
+                    if( place( storage, seed, pilots, slots ) )
+                        break;
+                    pilots_type( pilots_.get_allocator() ).swap( pilots );
+                    slots_type( slots_.get_allocator() ).swap( slots );
+                }
+            }
+            pilots_.swap( pilots );
+            slots_.swap( slots );
+            seed_ = seed;
+        }
+
+        template<typename Storage>
+        size_type lower_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return search_.lower_bound( storage, key, compare ); }
+
+        template<typename Storage>
+        size_type upper_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return search_.upper_bound( storage, key, compare ); }
+
+        template<typename Storage>
+        size_type find( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        {
+            if( pilots_.empty() )
+                return search_.find( storage, key, compare );
+            const uint64_t hash = mix64( static_cast<uint64_t>( hash_( key ) ) ^ seed_ );
+            const uint16_t pilot = pilots_[ scale32( hash >> 32, static_cast<uint32_t>( pilots_.size() ) ) ];
+            const uint32_t rank = slots_[ scale32( hash ^ mix64( pilot ), static_cast<uint32_t>( slots_.size() ) ) ];
+            if( rank == empty_slot || compare( key, storage.key(rank) ) || compare( storage.key(rank), key ) )
+                return storage.size();
+            return rank;
+        }
+
+        template<typename Storage>
+        void lower_bound_batch( const Storage& storage,
+                                const KeyType* keys,
+                                size_type count,
+                                size_type* ranks,
+                                const Predicate& compare ) const noexcept
+        { search_.lower_bound_batch( storage, keys, count, ranks, compare ); }
+
+        std::size_t memory() const noexcept
+        {
+            return pilots_.capacity() * sizeof(uint16_t) + slots_.capacity() * sizeof(uint32_t)
+                 + search_.memory();
+        }
+
+        void swap( hashed_index& that ) noexcept
+        {
+            using std::swap;
+            search_.swap( that.search_ );
+            pilots_.swap( that.pilots_ );
+            slots_.swap( that.slots_ );
+            swap( seed_, that.seed_ );
+        }
+    private:
+        // Try to find a pilot for every bucket. False if one of them has
+        // no pilot which works.
+        template<typename Storage>
+        bool place( const Storage& storage, uint64_t seed, pilots_type& pilots, slots_type& slots ) const
+        {
+            const size_type count = storage.size();
+            if( count == 0 )
+                return true;
+            const uint32_t buckets = static_cast<uint32_t>( count/2 + 1 );
+            const uint32_t table = static_cast<uint32_t>( count + count/64 + 1 );
+            pilots.assign( buckets, 0 );
+            slots.assign( table, empty_slot );
+
+            // Counting sort of the keys by bucket...
+            std::vector<uint64_t> hashes( count );
+            std::vector<uint32_t> starts( buckets + 1, 0 );
+            for( size_type i = 0 ; i < count ; ++i )
+            {
+                hashes[i] = mix64( static_cast<uint64_t>( hash_( storage.key(i) ) ) ^ seed );
+                ++starts[ scale32( hashes[i] >> 32, buckets ) + 1 ];
+            }
+            for( uint32_t b = 0 ; b < buckets ; ++b )
+                starts[b+1] += starts[b];
+            std::vector<uint32_t> members( count );
+            {
+                std::vector<uint32_t> next( starts.begin(), starts.end() - 1 );
+                for( size_type i = 0 ; i < count ; ++i )
+                    members[ next[ scale32( hashes[i] >> 32, buckets ) ]++ ] = static_cast<uint32_t>( i );
+            }
+            // ...and of the buckets by size, biggest first
+            uint32_t biggest = 0;
+            for( uint32_t b = 0 ; b < buckets ; ++b )
+                biggest = std::max( biggest, starts[b+1] - starts[b] );
+            std::vector<uint32_t> order;
+            order.reserve( buckets );
+            for( uint32_t size = biggest ; size > 0 ; --size )
+                for( uint32_t b = 0 ; b < buckets ; ++b )
+                    if( starts[b+1] - starts[b] == size )
+                        order.push_back( b );
+
+            std::vector<uint32_t> trial;
+            for( size_type o = 0 ; o < order.size() ; ++o )
+            {
+                const uint32_t b = order[o];
+                bool placed = false;
+                for( uint32_t pilot = 0 ; pilot <= 0xffff && !placed ; ++pilot )
+                {
+                    const uint64_t mixed = mix64( pilot );
+                    trial.clear();
+                    placed = true;
+                    for( uint32_t m = starts[b] ; m < starts[b+1] && placed ; ++m )
+                    {
+                        const uint32_t slot = scale32( hashes[ members[m] ] ^ mixed, table );
+                        placed = slots[slot] == empty_slot
+                              && std::find( trial.begin(), trial.end(), slot ) == trial.end();
+                        trial.push_back( slot );
+                    }
+                    if( placed )
+                    {
+                        pilots[b] = static_cast<uint16_t>( pilot );
+                        for( uint32_t m = starts[b] ; m < starts[b+1] ; ++m )
+                            slots[ trial[m - starts[b]] ] = members[m];
+                    }
+                }
+                if( !placed )
+                    return false;
+            }
+            return true;
+        }
+
+        Search search_;
+        Hash hash_;
+        pilots_type pilots_;  // One per bucket; empty if there's no hash
+        slots_type slots_;    // Rank of the key in each slot
+        uint64_t seed_;
+    };
+
+    // Indexes with a membership filter in front of find derive from this,
+    // and have a find which says whether the filter turned the key away,
+    // so that vmap_lookup_stats can count the false positives
+    struct filter_index {};
+    enum filter_outcome { unfiltered, filtered_out, filtered_in };
+
+    template<typename Index, typename Storage, typename KeyType, typename Predicate>
+    typename Storage::size_type filtered_find( const Index& index, const void*, const Storage& storage,
+                                               const KeyType& key, const Predicate& compare,
+                                               filter_outcome& outcome ) noexcept
+    {
+        outcome = unfiltered;
+        return index.find( storage, key, compare );
+    }
+
+    template<typename Index, typename Storage, typename KeyType, typename Predicate>
+    typename Storage::size_type filtered_find( const Index& index, const filter_index*, const Storage& storage,
+                                               const KeyType& key, const Predicate& compare,
+                                               filter_outcome& outcome ) noexcept
+    { return index.find( storage, key, compare, outcome ); }
+
+    // vmap_filtered_search: a blocked Bloom filter of the keys in front of
+    // another search policy's find. Each key sets probes bits in one 512
+    // bit block (a cache line) chosen by its hash, so a find for a key
+    // which isn't there is usually turned away after one cache line and no
+    // comparisons at all. Keys which get past it are searched for as usual.
+    //
+    // BitsPerKey sizes it, and so sets the false positive rate: about 2%
+    // at 8 bits a key, 1% at 10, 0.1% at 16 (a little more than an
+    // unblocked filter's, for the sake of the one cache line). Hash must
+    // agree with Predicate, as for vmap_hashed_search.
+    template<typename KeyType, typename Predicate, typename Allocator, typename Search, std::size_t BitsPerKey, typename Hash>
+    class filtered_index : public filter_index
+    {
+    public:
+        typedef std::size_t size_type;
+        typedef std::vector<uint64_t,typename rebind_alloc<Allocator,uint64_t>::type> words_type;
+        enum { block_words = 8 };
+        // Bits set per key: ln 2 * BitsPerKey is best, for an unblocked
+        // filter
+        enum { probes = BitsPerKey < 2 ? 1 : ( BitsPerKey * 69 + 50 ) / 100 > 16 ? 16 : ( BitsPerKey * 69 + 50 ) / 100 };
+
+        filtered_index()
+          : blocks_( 0 )
+        {}
+        // Copies start their blocks on a cache line of their own, which
+        // needn't be as far into the words as ours are
+        filtered_index( const filtered_index& that )
+          : search_( that.search_ )
+          , hash_( that.hash_ )
+          , words_( that.words_.size(), 0, that.words_.get_allocator() )
+          , blocks_( that.blocks_ )
+        {
+            if( blocks_ )
+                std::copy( that.first_block(), that.first_block() + std::size_t(blocks_) * block_words, first_block() );
+        }
+        filtered_index& operator=( const filtered_index& that )
+        {
+            filtered_index copy( that );
+            swap( copy );
+            return *this;
+        }
+#ifdef VMAP_CONFIG_MOVE
+        // A moved-from index has no blocks, rather than a count of blocks
+        // it no longer has
+        filtered_index( filtered_index&& that ) noexcept
+          : search_( std::move(that.search_) )
+          , hash_( std::move(that.hash_) )
+          , words_( std::move(that.words_) )
+          , blocks_( that.blocks_ )
+        {
+            that.blocks_ = 0;
+        }
+        filtered_index& operator=( filtered_index&& that ) noexcept
+        {
+            filtered_index( std::move(that) ).swap( *this );
+            return *this;
+        }
+#endif
+
+        template<typename Storage>
+        void build( const Storage& storage, const Predicate& compare )
+        {
+            search_.build( storage, compare );
+            const size_type count = storage.size();
+            const uint32_t blocks = count == 0 ? 0 : static_cast<uint32_t>( ( uint64_t(count) * BitsPerKey + 511 ) / 512 );
+            // (A block to spare, to start the first on a cache line)
+            words_type words( ( std::size_t(blocks) + 1 ) * block_words, 0, words_.get_allocator() );
+            words_.swap( words );
+            blocks_ = blocks;
+            for( size_type i = 0 ; i < count ; ++i )
+            {
+                const uint64_t hash = hash_of( storage.key(i) );
+                uint64_t* const block = block_of( hash );
+                const uint32_t a = static_cast<uint32_t>( hash );
+                const uint32_t b = probe_step( hash );
+                for( unsigned p = 0 ; p < probes ; ++p )
+                {
+                    const uint32_t bit = ( a + p * b ) >> 23;
+                    block[bit >> 6] |= uint64_t(1) << ( bit & 63 );
+                }
+            }
+        }
+
+        template<typename Storage>
+        size_type lower_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return search_.lower_bound( storage, key, compare ); }
+
+        template<typename Storage>
+        size_type upper_bound( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return search_.upper_bound( storage, key, compare ); }
+
+        template<typename Storage>
+        size_type find( const Storage& storage, const KeyType& key, const Predicate& compare ) const noexcept
+        { return may_contain( key ) ? search_.find( storage, key, compare ) : storage.size(); }
+
+        // (See filtered_find)
+        template<typename Storage>
+        size_type find( const Storage& storage, const KeyType& key, const Predicate& compare,
+                        filter_outcome& outcome ) const noexcept
+        {
+            if( !may_contain( key ) )
+            {
+                outcome = filtered_out;
+                return storage.size();
+            }
+            outcome = filtered_in;
+            return search_.find( storage, key, compare );
+        }
+
+        template<typename Storage>
+        void lower_bound_batch( const Storage& storage,
+                                const KeyType* keys,
+                                size_type count,
+                                size_type* ranks,
+                                const Predicate& compare ) const noexcept
+        { search_.lower_bound_batch( storage, keys, count, ranks, compare ); }
+
+        // False if key certainly isn't there
+        bool may_contain( const KeyType& key ) const noexcept
+        {
+            if( blocks_ == 0 )
+                return false;
+            const uint64_t hash = hash_of( key );
+            const uint64_t* const block = block_of( hash );
+            const uint32_t a = static_cast<uint32_t>( hash );
+            const uint32_t b = probe_step( hash );
+            // (All of them, without branches: they're in the same line)
+            uint64_t missing = 0;
+            for( unsigned p = 0 ; p < probes ; ++p )
+            {
+                const uint32_t bit = ( a + p * b ) >> 23;
+                missing |= ~block[bit >> 6] >> ( bit & 63 );
+            }
+            return ( missing & 1 ) == 0;
+        }
+
+        std::size_t memory() const noexcept
+        { return words_.capacity() * sizeof(uint64_t) + search_.memory(); }
+
+        void swap( filtered_index& that ) noexcept
+        {
+            using std::swap;
+            search_.swap( that.search_ );
+            words_.swap( that.words_ );
+            swap( blocks_, that.blocks_ );
+        }
+    private:
+        uint64_t hash_of( const KeyType& key ) const noexcept
+        { return mix64( static_cast<uint64_t>( hash_( key ) ) ); }
+
+        // The first block, at the first cache line boundary in words_
+        const uint64_t* first_block() const noexcept
+        {
+            const uintptr_t address = reinterpret_cast<uintptr_t>( &words_[0] );
+            return reinterpret_cast<const uint64_t*>( ( address + 63 ) & ~uintptr_t(63) );
+        }
+        uint64_t* first_block() noexcept
+        { return const_cast<uint64_t*>( static_cast<const filtered_index*>( this )->first_block() ); }
+
+        // The block for a hash: its top 32 bits pick it...
+        const uint64_t* block_of( uint64_t hash ) const noexcept
+        { return first_block() + std::size_t( scale32( hash >> 32, blocks_ ) ) * block_words; }
+        uint64_t* block_of( uint64_t hash ) noexcept
+        { return const_cast<uint64_t*>( static_cast<const filtered_index*>( this )->block_of( hash ) ); }
+
+        // ...and the bits are the top nine of a + p*b, for p < probes
+        // (double hashing), where a is the bottom 32 and b is odd
+        static uint32_t probe_step( uint64_t hash ) noexcept
+        { return ( ( static_cast<uint32_t>( hash ) * 0x9e3779b9u ) ^ static_cast<uint32_t>( hash >> 17 ) ) | 1u; }
+
+        Search search_;
+        Hash hash_;
+        words_type words_;   // The blocks, from the first cache line boundary
+        uint32_t blocks_;
+    };
+
+    // Order (key,mapped) pairs by key
+    template<typename Predicate>
+    struct entry_compare
+    {
+        Predicate compare;
+        explicit entry_compare( const Predicate& predicate ) : compare( predicate ) {}
+        template<typename Entry>
+        bool operator()( const Entry& lhs, const Entry& rhs ) const
+        { return compare( lhs.first, rhs.first ); }
+    };
+
+    // ...and whether the first isn't before the second: for
+    // std::adjacent_find, to spot anything out of order, and (given that
+    // they're sorted, so that it means equal) for std::unique
+    template<typename Predicate>
+    struct entry_not_before
+    {
+        Predicate compare;
+        explicit entry_not_before( const Predicate& predicate ) : compare( predicate ) {}
+        template<typename Entry>
+        bool operator()( const Entry& lhs, const Entry& rhs ) const
+        { return !compare( lhs.first, rhs.first ); }
+    };
+
+#ifdef VMAP_CONFIG_THREADS
+    // Below this, it's not worth starting threads
+    const std::size_t parallel_sort_threshold = 1 << 16;
+
+    // Sort each half on its own thread (splitting up to 2^depth ways), then
+    // merge.
+    template<typename RandomIterator, typename Compare>
+    void parallel_stable_sort( RandomIterator first, RandomIterator last, const Compare& compare, unsigned depth )
+    {
+        if( depth == 0 || static_cast<std::size_t>(last - first) < parallel_sort_threshold )
+        {
+            std::stable_sort( first, last, compare );
+            return;
+        }
+        const RandomIterator middle = first + (last - first)/2;
+        std::thread lower( [=]{ parallel_stable_sort( first, middle, compare, depth-1 ); } );
+        parallel_stable_sort( middle, last, compare, depth-1 );
+        lower.join();
+        std::inplace_merge( first, middle, last, compare );
+    }
+#endif
+
+    // ...and to spot anything out of order, repeats allowed
+    template<typename Predicate>
+    struct entry_after
+    {
+        Predicate compare;
+        explicit entry_after( const Predicate& predicate ) : compare( predicate ) {}
+        template<typename Entry>
+        bool operator()( const Entry& lhs, const Entry& rhs ) const
+        { return compare( rhs.first, lhs.first ); }
+    };
+
+    // Sort entries by key, keeping repeated keys in the order they came
+    template<typename Vector, typename Predicate>
+    void stable_sort_entries( Vector& entries, const Predicate& compare )
+    {
+#ifdef VMAP_CONFIG_THREADS
+        const unsigned threads = std::thread::hardware_concurrency();
+        parallel_stable_sort( entries.begin(), entries.end(), entry_compare<Predicate>( compare ),
+                              threads > 1 ? log2_floor( threads ) : 0 );
+#else
+        std::stable_sort( entries.begin(), entries.end(), entry_compare<Predicate>( compare ) );
+#endif
+    }
+
+    // Sort entries by key, and drop all but the first of any repeated keys
+    // (so we do what std::map's range ctor would)
+    template<typename Vector, typename Predicate>
+    void sort_unique( Vector& entries, const Predicate& compare )
+    {
+        // Quite often, they're already in order
+        if( std::adjacent_find( entries.begin(), entries.end(), entry_not_before<Predicate>( compare ) ) == entries.end() )
+            return;
+        stable_sort_entries( entries, compare );
+        entries.erase( std::unique( entries.begin(), entries.end(), entry_not_before<Predicate>( compare ) ), entries.end() );
+    }
+
+    // Sort entries by key, as std::multimap's range ctor would: repeated
+    // keys are kept, in the order they came
+    template<typename Vector, typename Predicate>
+    void sort_runs( Vector& entries, const Predicate& compare )
+    {
+        if( std::adjacent_find( entries.begin(), entries.end(), entry_after<Predicate>( compare ) ) != entries.end() )
+            stable_sort_entries( entries, compare );
+    }
+}
+
+// Tag for the constructors which take entries that are already sorted by
+// key, with no repeats
+struct vmap_sorted_unique_t {};
+const vmap_sorted_unique_t vmap_sorted_unique = vmap_sorted_unique_t();
+
+// What a vmap with vmap_lookup_stats has seen (see vmap::stats())
+struct vmap_stats
+{
+    enum { histogram_size = 64 };
+
+    uint64_t searches;     // Searches of the index: lower_bound, upper_bound and
+                           // find, and everything built on them
+    uint64_t comparisons;  // Calls of the comparator by those searches
+    uint64_t hits;         // find (and at, get, equal_range...) found the key
+    uint64_t misses;       // ...or didn't
+    uint64_t at_misses;    // at() (or operator[]) threw std::out_of_range
+    // With vmap_filtered_search: misses the filter turned away without a
+    // search, and misses it let through (its false positives)
+    uint64_t filter_rejects;
+    uint64_t filter_false_positives;
+
+    // comparison_histogram[i] is how many searches made i comparisons (the
+    // last bucket, that many or more). Batch searches aren't in it.
+    uint64_t comparison_histogram[histogram_size];
+    // position_histogram[i] is how many hits were in the i'th 64th of the
+    // entries (in key order)
+    uint64_t position_histogram[histogram_size];
+
+    vmap_stats()
+      : searches( 0 )
+      , comparisons( 0 )
+      , hits( 0 )
+      , misses( 0 )
+      , at_misses( 0 )
+      , filter_rejects( 0 )
+      , filter_false_positives( 0 )
+    {
+        std::fill( comparison_histogram, comparison_histogram + histogram_size, uint64_t(0) );
+        std::fill( position_histogram, position_histogram + histogram_size, uint64_t(0) );
+    }
+
+    double comparisons_per_search() const noexcept
+    { return searches ? double(comparisons) / double(searches) : 0.0; }
+    double miss_rate() const noexcept
+    { return hits + misses ? double(misses) / double(hits + misses) : 0.0; }
+    // The fraction of the keys that weren't there which the filter let by
+    double false_positive_rate() const noexcept
+    {
+        const uint64_t absent = filter_rejects + filter_false_positives;
+        return absent ? double(filter_false_positives) / double(absent) : 0.0;
+    }
+};
+
+namespace vmap_detail
+{
+    // The keys as the search policies see them under vmap_lookup_stats:
+    // as usual, but the comparator counts its calls
+    template<typename Traits>
+    struct counted_search : Traits
+    {
+        typedef counting_compare<typename Traits::compare_type> compare_type;
+        template<typename Search, typename Allocator>
+        struct index { typedef typename Traits::template index<Search,Allocator,compare_type>::type type; };
+    };
+
+#ifdef VMAP_CONFIG_THREADS
+    // Lookups on a const vmap may come from any number of threads at once
+    class stat_counter
+    {
+    public:
+        stat_counter() : value_( 0 ) {}
+        void add( uint64_t count ) noexcept { value_.fetch_add( count, std::memory_order_relaxed ); }
+        uint64_t get() const noexcept { return value_.load( std::memory_order_relaxed ); }
+        void reset() noexcept { value_.store( 0, std::memory_order_relaxed ); }
+    private:
+        std::atomic<uint64_t> value_;
+    };
+#else
+    class stat_counter
+    {
+    public:
+        stat_counter() : value_( 0 ) {}
+        void add( uint64_t count ) noexcept { value_ += count; }
+        uint64_t get() const noexcept { return value_; }
+        void reset() noexcept { value_ = 0; }
+    private:
+        uint64_t value_;
+    };
+#endif
+
+    // vmap_no_stats: vmap's searches go straight through to the index
+    template<typename Traits>
+    struct null_recorder
+    {
+        typedef Traits search_traits;
+
+        template<typename Index, typename Storage, typename Predicate>
+        void build( Index& index, const Storage& storage, const Predicate& compare )
+        { index.build( storage, Traits::compare( compare ) ); }
+
+        template<typename Index, typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type lower_bound( const Index& index, const Storage& storage,
+                                                 const KeyType& key, const Predicate& compare ) noexcept
+        { return index.lower_bound( storage, key, Traits::compare( compare ) ); }
+
+        template<typename Index, typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type upper_bound( const Index& index, const Storage& storage,
+                                                 const KeyType& key, const Predicate& compare ) noexcept
+        { return index.upper_bound( storage, key, Traits::compare( compare ) ); }
+
+        template<typename Index, typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type find( const Index& index, const Storage& storage,
+                                          const KeyType& key, const Predicate& compare ) noexcept
+        { return index.find( storage, key, Traits::compare( compare ) ); }
+
+        template<typename Index, typename Storage, typename KeyType, typename Predicate>
+        void lower_bound_batch( const Index& index, const Storage& storage,
+                                const KeyType* keys, typename Storage::size_type count,
+                                typename Storage::size_type* ranks, const Predicate& compare ) noexcept
+        { index.lower_bound_batch( storage, keys, count, ranks, Traits::compare( compare ) ); }
+
+        // Turn one of lower_bound_batch's results into a find result
+        template<typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type found( const Storage& storage, typename Storage::size_type rank,
+                                           const KeyType& key, const Predicate& compare ) noexcept
+        { return vmap_detail::found( storage, rank, key, Traits::compare( compare ) ); }
+
+        void at_miss() noexcept
+        {}
+
+        vmap_stats snapshot() const
+        { return vmap_stats(); }
+        void reset() noexcept
+        {}
+    };
+
+    // vmap_lookup_stats: as above, but counting
+    template<typename Traits>
+    class lookup_recorder
+    {
+    public:
+        typedef counted_search<Traits> search_traits;
+        typedef typename search_traits::compare_type compare_type;
+
+        lookup_recorder() {}
+        // The counts belong to the vmap object: a copy starts from zero,
+        // and assignment leaves them alone
+        lookup_recorder( const lookup_recorder& ) {}
+        lookup_recorder& operator=( const lookup_recorder& ) { return *this; }
+
+        template<typename Index, typename Storage, typename Predicate>
+        void build( Index& index, const Storage& storage, const Predicate& compare )
+        {
+            std::size_t ignored = 0;
+            index.build( storage, compare_type( Traits::compare( compare ), ignored ) );
+        }
+
+        template<typename Index, typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type lower_bound( const Index& index, const Storage& storage,
+                                                 const KeyType& key, const Predicate& compare ) noexcept
+        {
+            std::size_t count = 0;
+            const typename Storage::size_type rank = index.lower_bound( storage, key, compare_type( Traits::compare( compare ), count ) );
+            searched( count );
+            return rank;
+        }
+
+        template<typename Index, typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type upper_bound( const Index& index, const Storage& storage,
+                                                 const KeyType& key, const Predicate& compare ) noexcept
+        {
+            std::size_t count = 0;
+            const typename Storage::size_type rank = index.upper_bound( storage, key, compare_type( Traits::compare( compare ), count ) );
+            searched( count );
+            return rank;
+        }
+
+        template<typename Index, typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type find( const Index& index, const Storage& storage,
+                                          const KeyType& key, const Predicate& compare ) noexcept
+        {
+            std::size_t count = 0;
+            filter_outcome outcome;
+            const typename Storage::size_type rank = filtered_find( index, &index, storage, key,
+                                                                    compare_type( Traits::compare( compare ), count ),
+                                                                    outcome );
+            searched( count );
+            looked_up( rank, storage.size() );
+            if( outcome == filtered_out )
+                filter_rejects_.add( 1 );
+            else if( outcome == filtered_in && rank == storage.size() )
+                filter_false_positives_.add( 1 );
+            return rank;
+        }
+
+        template<typename Index, typename Storage, typename KeyType, typename Predicate>
+        void lower_bound_batch( const Index& index, const Storage& storage,
+                                const KeyType* keys, typename Storage::size_type count,
+                                typename Storage::size_type* ranks, const Predicate& compare ) noexcept
+        {
+            std::size_t comparisons = 0;
+            index.lower_bound_batch( storage, keys, count, ranks, compare_type( Traits::compare( compare ), comparisons ) );
+            searches_.add( count );
+            comparisons_.add( comparisons );
+        }
+
+        template<typename Storage, typename KeyType, typename Predicate>
+        typename Storage::size_type found( const Storage& storage, typename Storage::size_type rank,
+                                           const KeyType& key, const Predicate& compare ) noexcept
+        {
+            std::size_t count = 0;
+            rank = vmap_detail::found( storage, rank, key, compare_type( Traits::compare( compare ), count ) );
+            comparisons_.add( count );
+            looked_up( rank, storage.size() );
+            return rank;
+        }
+
+        void at_miss() noexcept
+        { at_misses_.add( 1 ); }
+
+        vmap_stats snapshot() const
+        {
+            vmap_stats stats;
+            stats.searches = searches_.get();
+            stats.comparisons = comparisons_.get();
+            stats.hits = hits_.get();
+            stats.misses = misses_.get();
+            stats.at_misses = at_misses_.get();
+            stats.filter_rejects = filter_rejects_.get();
+            stats.filter_false_positives = filter_false_positives_.get();
+            for( std::size_t i = 0 ; i < vmap_stats::histogram_size ; ++i )
+            {
+                stats.comparison_histogram[i] = comparison_histogram_[i].get();
+                stats.position_histogram[i] = position_histogram_[i].get();
+            }
+            return stats;
+        }
+
+        void reset() noexcept
+        {
+            searches_.reset();
+            comparisons_.reset();
+            hits_.reset();
+            misses_.reset();
+            at_misses_.reset();
+            filter_rejects_.reset();
+            filter_false_positives_.reset();
+            for( std::size_t i = 0 ; i < vmap_stats::histogram_size ; ++i )
+            {
+                comparison_histogram_[i].reset();
+                position_histogram_[i].reset();
+            }
+        }
+    private:
+        void searched( std::size_t comparisons ) noexcept
+        {
+            searches_.add( 1 );
+            comparisons_.add( comparisons );
+            const std::size_t last = vmap_stats::histogram_size - 1;
+            comparison_histogram_[ comparisons < last ? comparisons : last ].add( 1 );
+        }
+
+        void looked_up( std::size_t rank, std::size_t size ) noexcept
+        {
+            if( rank == size )
+            {
+                misses_.add( 1 );
+                return;
+            }
+            hits_.add( 1 );
+            position_histogram_[ static_cast<std::size_t>( uint64_t(rank) * vmap_stats::histogram_size / size ) ].add( 1 );
+        }
+
+        stat_counter searches_;
+        stat_counter comparisons_;
+        stat_counter hits_;
+        stat_counter misses_;
+        stat_counter at_misses_;
+        stat_counter filter_rejects_;
+        stat_counter filter_false_positives_;
+        stat_counter comparison_histogram_[vmap_stats::histogram_size];
+        stat_counter position_histogram_[vmap_stats::histogram_size];
+    };
+}
+
+// Storage layout policies
+struct vmap_pairs
+{
+    template<typename KeyType, typename MappedType, typename Allocator>
+    struct storage { typedef vmap_detail::pair_storage<KeyType,MappedType,Allocator> type; };
+};
+
+struct vmap_split
+{
+    template<typename KeyType, typename MappedType, typename Allocator>
+    struct storage { typedef vmap_detail::split_storage<KeyType,MappedType,Allocator> type; };
+};
+
+// For std::string keys compared with std::less
+struct vmap_string_keys
+{
+    template<typename KeyType, typename MappedType, typename Allocator>
+    struct storage { typedef vmap_detail::string_storage<KeyType,MappedType,Allocator> type; };
+};
+
+// For std::string keys compared with std::less: front coded in blocks of
+// BlockSize keys. The search policy is ignored.
+template<std::size_t BlockSize = 32>
+struct vmap_front_coded
+{
+    template<typename KeyType, typename MappedType, typename Allocator>
+    struct storage { typedef vmap_detail::front_coded_storage<KeyType,MappedType,Allocator,BlockSize> type; };
+};
+
+// For integral keys compared with std::less: frame of reference coded in
+// blocks of BlockSize keys, each in as few bits as its block needs. The
+// search policy is ignored.
+template<std::size_t BlockSize = 64>
+struct vmap_packed
+{
+    template<typename KeyType, typename MappedType, typename Allocator>
+    struct storage { typedef vmap_detail::packed_storage<KeyType,MappedType,Allocator,BlockSize> type; };
+};
+
+// Search policies
+struct vmap_binary_search
+{
+    template<typename KeyType, typename Predicate, typename Allocator>
+    struct index { typedef vmap_detail::binary_index<KeyType,Predicate,Allocator> type; };
+};
+
+struct vmap_eytzinger_search
+{
+    template<typename KeyType, typename Predicate, typename Allocator>
+    struct index { typedef vmap_detail::eytzinger_index<KeyType,Predicate,Allocator> type; };
+};
+
+struct vmap_kary_search
+{
+    template<typename KeyType, typename Predicate, typename Allocator>
+    struct index { typedef vmap_detail::kary_index<KeyType,Predicate,Allocator> type; };
+};
+
+// NodeBytes is the size of a node: a cache line, or a pair of them
+template<std::size_t NodeBytes = 64>
+struct vmap_btree_search
+{
+    template<typename KeyType, typename Predicate, typename Allocator>
+    struct index { typedef vmap_detail::btree_index<KeyType,Predicate,Allocator,NodeBytes> type; };
+};
+
+// Epsilon is the most the model's guess at a rank may be out by
+template<std::size_t Epsilon = 16>
+struct vmap_learned_search
+{
+    template<typename KeyType, typename Predicate, typename Allocator>
+    struct index { typedef vmap_detail::learned_index<KeyType,Predicate,Allocator,Epsilon> type; };
+};
+
+// A perfect hash for find, with Search doing everything else. Hash
+// defaults to std::hash<key_type>.
+template<typename Search = vmap_binary_search, typename Hash = void>
+struct vmap_hashed_search
+{
+    template<typename KeyType, typename Predicate, typename Allocator>
+    struct index
+    {
+        typedef vmap_detail::hashed_index<KeyType,Predicate,Allocator,
+                                          typename Search::template index<KeyType,Predicate,Allocator>::type,
+                                          typename vmap_detail::select_hash<Hash,KeyType>::type> type;
+    };
+};
+
+// A blocked Bloom filter of the keys in front of Search's find, so that
+// most finds for keys which aren't there stop after one cache line.
+// BitsPerKey sets the false positive rate (about 1% at 10). Hash defaults
+// to std::hash<key_type>.
+template<typename Search = vmap_binary_search, std::size_t BitsPerKey = 10, typename Hash = void>
+struct vmap_filtered_search
+{
+    template<typename KeyType, typename Predicate, typename Allocator>
+    struct index
+    {
+        typedef vmap_detail::filtered_index<KeyType,Predicate,Allocator,
+                                            typename Search::template index<KeyType,Predicate,Allocator>::type,
+                                            BitsPerKey,
+                                            typename vmap_detail::select_hash<Hash,KeyType>::type> type;
+    };
+};
+
+// Stats policies (the seventh template parameter)
+struct vmap_no_stats
+{
+    template<typename SearchTraits>
+    struct recorder { typedef vmap_detail::null_recorder<SearchTraits> type; };
+};
+
+// Counts searches, comparisons, hits and misses, and where the hits were;
+// see vmap::stats()
+struct vmap_lookup_stats
+{
+    template<typename SearchTraits>
+    struct recorder { typedef vmap_detail::lookup_recorder<SearchTraits> type; };
+};
+
+template<typename KeyType
+        ,typename MappedType
+        ,typename Predicate = std::less<KeyType>
+        ,typename Allocator = std::allocator<std::pair<KeyType,MappedType> >
+        ,typename Layout = vmap_pairs
+        ,typename Search = vmap_binary_search
+        ,typename Stats = vmap_no_stats
+        >
+class vmap
+{
+public:
+    typedef KeyType key_type;
+    typedef MappedType mapped_type;
+    typedef Predicate key_compare;
+    typedef Allocator allocator_type;
+    typedef Layout layout_type;
+    typedef Search search_type;
+    typedef Stats stats_type;
+
+    // FIXME: Implementation details: Probably ought to privatise these...
+    typedef vmap<key_type,mapped_type,key_compare,allocator_type,layout_type,search_type,stats_type> this_type;
+    typedef typename layout_type::template storage<key_type,mapped_type,allocator_type>::type impl_type;
+    // The searches go through this, which may count them
+    typedef typename stats_type::template recorder<typename impl_type::template search<key_compare> >::type recorder_type;
+    // What the search policy sees: usually key_type and key_compare
+    typedef typename recorder_type::search_traits search_traits;
+    typedef typename search_traits::template index<search_type,allocator_type>::type index_type;
+
+    typedef typename impl_type::value_type value_type;
+    typedef typename impl_type::size_type size_type;
+    // The std::vector which the vmap_sorted_unique ctors accept
+    typedef typename impl_type::vector_type vector_type;
+
+    // The keys are const, but the mapped values may be updated in place
+    typedef typename impl_type::iterator               iterator;
+    typedef typename impl_type::const_iterator         const_iterator;
+    typedef typename impl_type::reverse_iterator       reverse_iterator;
+    typedef typename impl_type::const_reverse_iterator const_reverse_iterator;
+
+    // defaults are ok for:
+    // - dtor
+
+    // - default ctor
+    vmap() {}
+
+    explicit vmap( const allocator_type& allocator )
+    : storage_( allocator )
+    {}
+#ifdef VMAP_CONFIG_MOVE
+    explicit vmap( allocator_type&& allocator )
+    : storage_( std::move(allocator) )
+    {}
+#endif
+
+    // Copies. The index is rebuilt if it holds copies of keys which point
+    // into the original's storage (vmap_string_keys)
+    vmap( const vmap& that )
+      : storage_( that.storage_ )
+      , index_( that.index_ )
+      , compare_( that.compare_ )
+      , stats_( that.stats_ )
+    {
+        if( impl_type::index_copies_keys )
+            stats_.build( index_, storage_, compare_ );
+    }
+    vmap& operator=( const vmap& that )
+    {
+        vmap copy( that );
+        swap( copy );
+        return *this;
+    }
+
+    // Copy a std::map (whose allocator needn't be ours)
+    template<typename MapAllocator>
+    explicit vmap( const std::map<key_type,mapped_type,key_compare,MapAllocator>& map,
+                   const allocator_type& allocator = allocator_type() )
+      : storage_( allocator )
+      , compare_( map.key_comp() )
+    {
+        storage_.assign( map.begin(), map.end(), map.size() );
+        stats_.build( index_, storage_, compare_ );
+    }
+
+    // Entries from an arbitrary range of (key,mapped) pairs. They're
+    // sorted, and where a key is repeated, the first one wins.
+    template<typename InputIterator>
+    vmap( InputIterator first, InputIterator last,
+          const key_compare& compare = key_compare(),
+          const allocator_type& allocator = allocator_type() )
+      : storage_( allocator )
+      , compare_( compare )
+    {
+        vector_type entries( first, last, typename vector_type::allocator_type( allocator ) );
+        vmap_detail::sort_unique( entries, compare_ );
+        storage_.adopt( entries );
+        stats_.build( index_, storage_, compare_ );
+    }
+
+    // Entries which are already sorted by key, with no repeats. (This
+    // isn't checked.)
+    vmap( vmap_sorted_unique_t,
+          const vector_type& entries,
+          const key_compare& compare = key_compare(),
+          const allocator_type& allocator = allocator_type() )
+      : storage_( allocator )
+      , compare_( compare )
+    {
+        storage_.assign( entries.begin(), entries.end(), entries.size() );
+        stats_.build( index_, storage_, compare_ );
+    }
+
+#ifdef VMAP_CONFIG_MOVE
+    // As above, but we take over the vector: the entries are moved, not
+    // copied.
+    vmap( vmap_sorted_unique_t,
+          vector_type&& entries,
+          const key_compare& compare = key_compare() )
+      : storage_( allocator_type( entries.get_allocator() ) )
+      , compare_( compare )
+    {
+        storage_.adopt( entries );
+        stats_.build( index_, storage_, compare_ );
+    }
+
+    // Take over an unsorted vector; sorted (and de-duplicated) in place.
+    explicit vmap( vector_type&& entries,
+                   const key_compare& compare = key_compare() )
+      : storage_( allocator_type( entries.get_allocator() ) )
+      , compare_( compare )
+    {
+        vmap_detail::sort_unique( entries, compare_ );
+        storage_.adopt( entries );
+        stats_.build( index_, storage_, compare_ );
+    }
+
+    // Plunder a std::map. The mapped values are moved out; so are the keys,
+    // if the library lets us extract nodes (C++17), otherwise they're copied.
+    template<typename MapAllocator>
+    explicit vmap( std::map<key_type,mapped_type,key_compare,MapAllocator>&& map,
+                   const allocator_type& allocator = allocator_type() )
+      : storage_( allocator )
+      , compare_( map.key_comp() )
+    {
+        const typename vector_type::allocator_type entries_allocator( allocator );
+        vector_type entries( entries_allocator );
+        entries.reserve( map.size() );
+#if defined(__cpp_lib_node_extract)
+        while( !map.empty() )
+        {
+            typename std::map<key_type,mapped_type,key_compare,MapAllocator>::node_type node = map.extract( map.begin() );
+            entries.push_back( typename vector_type::value_type( std::move(node.key()), std::move(node.mapped()) ) );
+        }
+#else
+        for( typename std::map<key_type,mapped_type,key_compare,MapAllocator>::iterator iter = map.begin() ;
+             iter != map.end() ;
+             ++iter )
+        {
+            entries.push_back( typename vector_type::value_type( iter->first, std::move(iter->second) ) );
+        }
+        map.clear();
+#endif
+        storage_.adopt( entries );
+        stats_.build( index_, storage_, compare_ );
+    }
+
+    // Move ctor
+    vmap( vmap&& that )
+      : storage_( std::move(that.storage_) )
+      , index_( std::move(that.index_) )
+      , compare_( std::move(that.compare_))
+    {
+    }
+    // Move-assignment
+    vmap& operator=( vmap&& that )
+    {
+        storage_ = std::move(that.storage_);
+        index_ = std::move(that.index_);
+        compare_ = std::move(that.compare_);
+        return *this;
+    }
+#endif
+
+
+    // The usual suspects...
+    size_type size() const noexcept
+    { return storage_.size(); }
+    bool empty() const noexcept
+    { return storage_.empty(); }
+    size_type max_size() const noexcept
+    { return storage_.max_size(); }
+
+    allocator_type get_allocator() const noexcept
+    { return storage_.get_allocator(); }
+    key_compare key_comp() const noexcept
+    { return compare_; }
+
+    iterator               begin()          noexcept { return storage_.begin();  }
+    iterator               end()            noexcept { return storage_.end();    }
+    reverse_iterator       rbegin()         noexcept { return storage_.rbegin(); }
+    reverse_iterator       rend()           noexcept { return storage_.rend();   }
+
+    const_iterator         begin()    const noexcept { return storage_.begin();  }
+    const_iterator         end()      const noexcept { return storage_.end();    }
+    const_reverse_iterator rbegin()   const noexcept { return storage_.rbegin(); }
+    const_reverse_iterator rend()     const noexcept { return storage_.rend();   }
+
+    const_iterator         cbegin()   const noexcept { return storage_.begin();  }
+    const_iterator         cend()     const noexcept { return storage_.end();    }
+    const_reverse_iterator crbegin()  const noexcept { return storage_.rbegin(); }
+    const_reverse_iterator crend()    const noexcept { return storage_.rend();   }
+
+    iterator lower_bound( const key_type& key ) noexcept
+    {
+        return begin() + stats_.lower_bound( index_, storage_, search_traits::probe( key ), compare_ );
+    }
+    const_iterator lower_bound( const key_type& key ) const noexcept
+    {
+        return begin() + stats_.lower_bound( index_, storage_, search_traits::probe( key ), compare_ );
+    }
+
+    iterator upper_bound( const key_type& key ) noexcept
+    {
+        return begin() + stats_.upper_bound( index_, storage_, search_traits::probe( key ), compare_ );
+    }
+    const_iterator upper_bound( const key_type& key ) const noexcept
+    {
+        return begin() + stats_.upper_bound( index_, storage_, search_traits::probe( key ), compare_ );
+    }
+
+    std::pair<iterator,iterator> equal_range( const key_type& key ) noexcept
+    {
+        const iterator iter = find(key);
+        if( iter == end() )
+            return std::make_pair(end(),end());
+        return std::make_pair(iter,iter+1);
+    }
+    std::pair<const_iterator,const_iterator> equal_range( const key_type& key ) const noexcept
+    {
+        const const_iterator iter = find(key);
+        if( iter == end() )
+            return std::make_pair(end(),end());
+        return std::make_pair(iter,iter+1);
+    }
+
+    iterator find( const key_type& key ) noexcept
+    {
+        return begin() + stats_.find( index_, storage_, search_traits::probe( key ), compare_ );
+    }
+    const_iterator find( const key_type& key ) const noexcept
+    {
+        return begin() + stats_.find( index_, storage_, search_traits::probe( key ), compare_ );
+    }
+
+    size_type count( const key_type& key ) const noexcept
+    { return find( key ) == end() ? 0 : 1; }
+
+    // lower_bound and find for a key which isn't before start: the search
+    // gallops forward from there (see vmap_cursor), whatever the search
+    // policy, in O(log d) for a key d entries on.
+    const_iterator lower_bound_from( const_iterator start, const key_type& key ) const noexcept
+    {
+        const vmap_detail::gallop_search<size_type> search( static_cast<size_type>( start - begin() ) );
+        return begin() + stats_.lower_bound( search, storage_, search_traits::probe( key ), compare_ );
+    }
+    const_iterator find_from( const_iterator start, const key_type& key ) const noexcept
+    {
+        const vmap_detail::gallop_search<size_type> search( static_cast<size_type>( start - begin() ) );
+        return begin() + stats_.find( search, storage_, search_traits::probe( key ), compare_ );
+    }
+
+    // Batch lookups: write lower_bound(key)/find(key) for each key in
+    // [first,last) to out. The searches are interleaved, so that one
+    // search's cache misses overlap with the others'. Worthwhile for lots
+    // of keys on tables which don't fit in cache.
+    template<typename InputIterator, typename OutputIterator>
+    OutputIterator lower_bound_many( InputIterator first, InputIterator last, OutputIterator out ) const
+    {
+        return lookup_many( first, last, out, false );
+    }
+
+    template<typename InputIterator, typename OutputIterator>
+    OutputIterator find_many( InputIterator first, InputIterator last, OutputIterator out ) const
+    {
+        return lookup_many( first, last, out, true );
+    }
+
+    // Return the mapped value, or throw std::out_of_range
+    mapped_type& at( const key_type& key )
+    {
+        const iterator iter = find(key);
+        if( iter == end() )
+        {
+            stats_.at_miss();
+            throw std::out_of_range("vmap: key not found");
+        }
+        return iter->second;
+    }
+    const mapped_type& at( const key_type& key ) const
+    {
+        const const_iterator iter = find(key);
+        if( iter == end() )
+        {
+            stats_.at_miss();
+            throw std::out_of_range("vmap: key not found");
+        }
+        return iter->second;
+    }
+
+    // Unlike std::map, we can't insert - so the key must already be there.
+    // If not, this throws std::out_of_range (same as at()).
+    mapped_type& operator[]( const key_type& key )
+    {
+        return at(key);
+    }
+
+    // I find these to be handy:
+
+    // Return the mapped value for key, or defalt if non present
+    const mapped_type& get( const key_type& key, const mapped_type& defalt ) const noexcept
+    {
+        const_iterator iter = find(key);
+        return ( iter == end() ) ? defalt : iter->second;
+    }
+    // Return the mapped value for key, or a (shared) mapped_type() if
+    // non present
+    const mapped_type& get( const key_type& key ) const noexcept
+    {
+        const_iterator iter = find(key);
+        return ( iter == end() ) ? vmap_detail::missing_mapped<mapped_type>() : iter->second;
+    }
+
+    // Lookups by anything the comparator can compare with key_type, if it
+    // has an is_transparent member type (as std::less<> does), so there's
+    // no key_type to make. These are binary searches of the entries,
+    // whatever the search policy.
+    template<typename KeyLike>
+    typename vmap_detail::transparent_result<key_compare,KeyLike,iterator>::type
+    lower_bound( const KeyLike& key ) noexcept
+    { return begin() + stats_.lower_bound( vmap_detail::transparent_search(), storage_, key, compare_ ); }
+    template<typename KeyLike>
+    typename vmap_detail::transparent_result<key_compare,KeyLike,const_iterator>::type
+    lower_bound( const KeyLike& key ) const noexcept
+    { return begin() + stats_.lower_bound( vmap_detail::transparent_search(), storage_, key, compare_ ); }
+
+    template<typename KeyLike>
+    typename vmap_detail::transparent_result<key_compare,KeyLike,iterator>::type
+    upper_bound( const KeyLike& key ) noexcept
+    { return begin() + stats_.upper_bound( vmap_detail::transparent_search(), storage_, key, compare_ ); }
+    template<typename KeyLike>
+    typename vmap_detail::transparent_result<key_compare,KeyLike,const_iterator>::type
+    upper_bound( const KeyLike& key ) const noexcept
+    { return begin() + stats_.upper_bound( vmap_detail::transparent_search(), storage_, key, compare_ ); }
+
+    template<typename KeyLike>
+    typename vmap_detail::transparent_result<key_compare,KeyLike,iterator>::type
+    find( const KeyLike& key ) noexcept
+    { return begin() + stats_.find( vmap_detail::transparent_search(), storage_, key, compare_ ); }
+    template<typename KeyLike>
+    typename vmap_detail::transparent_result<key_compare,KeyLike,const_iterator>::type
+    find( const KeyLike& key ) const noexcept
+    { return begin() + stats_.find( vmap_detail::transparent_search(), storage_, key, compare_ ); }
+
+    template<typename KeyLike>
+    typename vmap_detail::transparent_result<key_compare,KeyLike,std::pair<iterator,iterator> >::type
+    equal_range( const KeyLike& key ) noexcept
+    {
+        const iterator iter = find(key);
+        if( iter == end() )
+            return std::make_pair(end(),end());
+        return std::make_pair(iter,iter+1);
+    }
+    template<typename KeyLike>
+    typename vmap_detail::transparent_result<key_compare,KeyLike,std::pair<const_iterator,const_iterator> >::type
+    equal_range( const KeyLike& key ) const noexcept
+    {
+        const const_iterator iter = find(key);
+        if( iter == end() )
+            return std::make_pair(end(),end());
+        return std::make_pair(iter,iter+1);
+    }
+
+    template<typename KeyLike>
+    typename vmap_detail::transparent_result<key_compare,KeyLike,mapped_type&>::type
+    at( const KeyLike& key )
+    {
+        const iterator iter = find(key);
+        if( iter == end() )
+        {
+            stats_.at_miss();
+            throw std::out_of_range("vmap: key not found");
+        }
+        return iter->second;
+    }
+    template<typename KeyLike>
+    typename vmap_detail::transparent_result<key_compare,KeyLike,const mapped_type&>::type
+    at( const KeyLike& key ) const
+    {
+        const const_iterator iter = find(key);
+        if( iter == end() )
+        {
+            stats_.at_miss();
+            throw std::out_of_range("vmap: key not found");
+        }
+        return iter->second;
+    }
+
+    template<typename KeyLike>
+    typename vmap_detail::transparent_result<key_compare,KeyLike,const mapped_type&>::type
+    get( const KeyLike& key, const mapped_type& defalt ) const noexcept
+    {
+        const_iterator iter = find(key);
+        return ( iter == end() ) ? defalt : iter->second;
+    }
+    template<typename KeyLike>
+    typename vmap_detail::transparent_result<key_compare,KeyLike,const mapped_type&>::type
+    get( const KeyLike& key ) const noexcept
+    {
+        const_iterator iter = find(key);
+        return ( iter == end() ) ? vmap_detail::missing_mapped<mapped_type>() : iter->second;
+    }
+
+
+    // Bytes used by the search policy, over and above the entries
+    std::size_t index_memory() const noexcept
+    { return index_.memory(); }
+
+    // What this vmap's lookups have been up to, with vmap_lookup_stats (with
+    // vmap_no_stats, it's all zeroes). The counts belong to the object:
+    // they're not copied, moved or swapped along with the entries.
+    vmap_stats stats() const
+    { return stats_.snapshot(); }
+    void reset_stats() noexcept
+    { stats_.reset(); }
+
+    void swap( vmap& that )
+    {
+        using std::swap;
+        storage_.swap(that.storage_);
+        index_.swap(that.index_);
+        swap( compare_, that.compare_ );
+    }
+private:
+    template<typename InputIterator, typename OutputIterator>
+    OutputIterator lookup_many( InputIterator first, InputIterator last, OutputIterator out, bool exact ) const
+    {
+        const size_type batch_size = vmap_detail::batch_size;
+        std::vector<key_type> keys;
+        std::vector<typename search_traits::key_type> probes;
+        keys.reserve( batch_size );
+        size_type ranks[batch_size];
+        while( first != last )
+        {
+            keys.clear();
+            for( ; first != last && keys.size() < batch_size ; ++first )
+                keys.push_back( *first );
+            const typename search_traits::key_type* batch = search_traits::probes( keys, probes );
+            stats_.lower_bound_batch( index_, storage_, batch, keys.size(), ranks, compare_ );
+            for( size_type i = 0 ; i < keys.size() ; ++i )
+            {
+                const size_type rank = exact ? stats_.found( storage_, ranks[i], batch[i], compare_ ) : ranks[i];
+                *out = begin() + rank;
+                ++out;
+            }
+        }
+        return out;
+    }
+
+    impl_type storage_;
+    index_type index_;
+    key_compare compare_;
+    mutable recorder_type stats_;
+};
+
+namespace vmap_detail
+{
+    // Order (key,mapped) pairs against keys, for std::lower_bound and co.
+    template<typename Predicate>
+    struct entry_key_compare
+    {
+        Predicate compare;
+        explicit entry_key_compare( const Predicate& predicate ) : compare( predicate ) {}
+        template<typename Entry, typename KeyType>
+        bool operator()( const Entry& lhs, const KeyType& rhs ) const
+        { return compare( lhs.first, rhs ); }
+    };
+
+    // ...and the other way round, for std::upper_bound
+    template<typename Predicate>
+    struct key_entry_compare
+    {
+        Predicate compare;
+        explicit key_entry_compare( const Predicate& predicate ) : compare( predicate ) {}
+        template<typename KeyType, typename Entry>
+        bool operator()( const KeyType& lhs, const Entry& rhs ) const
+        { return compare( lhs, rhs.first ); }
+    };
+
+    // Forward iterator over a vmap_delta: the base vmap's entries, less the
+    // erased ones, merged with the (disjoint) buffered ones.
+    template<typename Delta>
+    class delta_iterator
+    {
+        typedef typename Delta::vmap_type::const_iterator base_iterator;
+        typedef typename Delta::buffer_type::const_iterator buffer_iterator;
+        typedef typename Delta::tombstones_type::const_iterator tombstone_iterator;
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<typename Delta::key_type,typename Delta::mapped_type> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef pair_reference<typename Delta::key_type,const typename Delta::mapped_type> reference;
+        typedef arrow_proxy<reference> pointer;
+
+        delta_iterator() noexcept : delta_( 0 ) {}
+        delta_iterator( const Delta* delta, base_iterator base, tombstone_iterator tombstone, buffer_iterator buffer ) noexcept
+          : delta_( delta )
+          , base_( base )
+          , tombstone_( tombstone )
+          , buffer_( buffer )
+        {
+            skip_erased();
+        }
+
+        reference operator*() const noexcept
+        { return from_base() ? reference( base_->first, base_->second ) : reference( buffer_->first, buffer_->second ); }
+        pointer operator->() const noexcept { return pointer( **this ); }
+
+        delta_iterator& operator++() noexcept
+        {
+            if( from_base() )
+            {
+                ++base_;
+                skip_erased();
+            }
+            else
+            {
+                ++buffer_;
+            }
+            return *this;
+        }
+        delta_iterator operator++(int) noexcept { delta_iterator t( *this ); ++*this; return t; }
+
+        friend bool operator==( const delta_iterator& lhs, const delta_iterator& rhs ) noexcept
+        { return lhs.base_ == rhs.base_ && lhs.buffer_ == rhs.buffer_; }
+        friend bool operator!=( const delta_iterator& lhs, const delta_iterator& rhs ) noexcept
+        { return !( lhs == rhs ); }
+    private:
+        bool from_base() const noexcept
+        {
+            return base_ != delta_->base_.end()
+                && ( buffer_ == delta_->buffer_.end() || delta_->compare_( base_->first, buffer_->first ) );
+        }
+
+        // Step over any base entries which have been erased
+        void skip_erased() noexcept
+        {
+            while( base_ != delta_->base_.end() && tombstone_ != delta_->tombstones_.end() )
+            {
+                if( delta_->compare_( *tombstone_, base_->first ) )
+                {
+                    ++tombstone_;
+                }
+                else if( delta_->compare_( base_->first, *tombstone_ ) )
+                {
+                    break;
+                }
+                else
+                {
+                    ++base_;
+                    ++tombstone_;
+                }
+            }
+        }
+
+        const Delta* delta_;
+        base_iterator base_;
+        tombstone_iterator tombstone_;
+        buffer_iterator buffer_;
+    };
+}
+
+// Lookups of keys which come in ascending order (repeats allowed), as
+// when replaying a log, or merging a sorted list against a table. Each
+// search starts where the last one left off (with lower_bound_from and
+// find_from), so m ascending keys cost O(m log(n/m)) all told, rather
+// than O(m log n).
+//
+// Map is a vmap (any layout or search policy) or a vmap_view. The map
+// mustn't change while the cursor's in use.
+template<typename Map>
+class vmap_cursor
+{
+public:
+    typedef typename Map::key_type key_type;
+    typedef typename Map::key_compare key_compare;
+    typedef typename Map::const_iterator const_iterator;
+
+    explicit vmap_cursor( const Map& map )
+      : map_( &map )
+      , compare_( map.key_comp() )
+      , position_( map.begin() )
+    {}
+
+    // The first entry not before key. key mustn't be before the previous
+    // key looked up.
+    const_iterator lower_bound( const key_type& key )
+    {
+        position_ = map_->lower_bound_from( position_, key );
+        return position_;
+    }
+
+    // The entry for key, or end() if there isn't one. key mustn't be
+    // before the previous key looked up. (One search: the lower_bound is
+    // it, if it isn't after key.)
+    const_iterator find( const key_type& key )
+    {
+        position_ = map_->lower_bound_from( position_, key );
+        if( position_ != map_->end() && !compare_( key, position_->first ) )
+            return position_;
+        return map_->end();
+    }
+
+    // Start again from the first entry (for keys which go back down)
+    void reset()
+    { position_ = map_->begin(); }
+
+    const_iterator end() const
+    { return map_->end(); }
+private:
+    const Map* map_;
+    key_compare compare_;
+    const_iterator position_;  // The last lower_bound
+};
+
+// Joins against a map (as vmap_cursor) of a range of keys in ascending
+// order, in O(m log(n/m)) for m keys and n entries.
+//
+// vmap_intersect writes the map's const_iterator for each key in
+// [first,last) which the map has; vmap_semi_join writes the keys
+// themselves. Both return the end of the output.
+template<typename Map, typename InputIterator, typename OutputIterator>
+OutputIterator vmap_intersect( const Map& map, InputIterator first, InputIterator last, OutputIterator out )
+{
+    vmap_cursor<Map> cursor( map );
+    for( ; first != last ; ++first )
+    {
+        const typename Map::const_iterator iter = cursor.find( *first );
+        if( iter != cursor.end() )
+        {
+            *out = iter;
+            ++out;
+        }
+    }
+    return out;
+}
+
+template<typename Map, typename InputIterator, typename OutputIterator>
+OutputIterator vmap_semi_join( const Map& map, InputIterator first, InputIterator last, OutputIterator out )
+{
+    vmap_cursor<Map> cursor( map );
+    for( ; first != last ; ++first )
+    {
+        if( cursor.find( *first ) != cursor.end() )
+        {
+            *out = *first;
+            ++out;
+        }
+    }
+    return out;
+}
+
+// The inner join of two maps with the same key type and order: writes a
+// std::pair of const_iterators (left's, right's) for each key in both, in
+// key order. Walks the smaller map, galloping through the bigger one, so
+// it's O(m log(n/m)) for sizes m <= n.
+template<typename LeftMap, typename RightMap, typename OutputIterator>
+OutputIterator vmap_join( const LeftMap& left, const RightMap& right, OutputIterator out )
+{
+    typedef std::pair<typename LeftMap::const_iterator,typename RightMap::const_iterator> result_type;
+    if( left.size() <= right.size() )
+    {
+        vmap_cursor<RightMap> cursor( right );
+        for( typename LeftMap::const_iterator iter = left.begin() ; iter != left.end() ; ++iter )
+        {
+            const typename RightMap::const_iterator match = cursor.find( iter->first );
+            if( match != cursor.end() )
+            {
+                *out = result_type( iter, match );
+                ++out;
+            }
+        }
+    }
+    else
+    {
+        vmap_cursor<LeftMap> cursor( left );
+        for( typename RightMap::const_iterator iter = right.begin() ; iter != right.end() ; ++iter )
+        {
+            const typename LeftMap::const_iterator match = cursor.find( iter->first );
+            if( match != cursor.end() )
+            {
+                *out = result_type( match, iter );
+                ++out;
+            }
+        }
+    }
+    return out;
+}
+
+// Duplicate policies for vmap_merge: called as duplicates(kept,repeat)
+// when a key turns up again, with the mapped value merged so far and the
+// repeat's. Sources count as coming in the order they're given, and
+// entries with one key in one source in their own order.
+struct vmap_keep_first
+{
+    template<typename Mapped>
+    void operator()( Mapped&, const Mapped& ) const {}
+};
+
+struct vmap_keep_last
+{
+    template<typename Mapped>
+    void operator()( Mapped& kept, const Mapped& repeat ) const
+    { kept = repeat; }
+};
+
+// kept = combine(kept,repeat): vmap_combine<std::plus<int> > adds them up
+template<typename Combine>
+struct vmap_combine
+{
+    Combine combine;
+    explicit vmap_combine( const Combine& combiner = Combine() ) : combine( combiner ) {}
+    template<typename Mapped>
+    void operator()( Mapped& kept, const Mapped& repeat ) const
+    { kept = combine( kept, repeat ); }
+};
+
+namespace vmap_detail
+{
+    // One of vmap_merge's sources, with its entries numbered. That's free
+    // with random access iterators; for the rest (std::map), mark() walks
+    // the source once, keeping an iterator every merge_mark_step entries.
+    const std::size_t merge_mark_step = 32;
+
+    template<typename Iterator>
+    class merge_run
+    {
+    public:
+        typedef Iterator iterator;
+        typedef typename std::iterator_traits<Iterator>::iterator_category category;
+
+        template<typename Source>
+        explicit merge_run( const Source& source )
+          : first_( source.begin() )
+          , last_( source.end() )
+          , size_( source.size() )
+        {}
+
+        void mark()
+        { mark( category() ); }
+
+        std::size_t size() const
+        { return size_; }
+        iterator at( std::size_t rank ) const
+        { return rank == size_ ? last_ : at( rank, category() ); }
+
+        // The first rank in [low,high) whose key isn't before key (or
+        // high, if there isn't one)...
+        template<typename Key, typename Compare>
+        std::size_t lower_bound( std::size_t low, std::size_t high, const Key& key, const Compare& compare ) const
+        {
+            while( low < high )
+            {
+                const std::size_t middle = low + (high - low)/2;
+                if( compare( at( middle )->first, key ) )
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            return low;
+        }
+        // ...and that's after key
+        template<typename Key, typename Compare>
+        std::size_t upper_bound( std::size_t low, std::size_t high, const Key& key, const Compare& compare ) const
+        {
+            while( low < high )
+            {
+                const std::size_t middle = low + (high - low)/2;
+                if( compare( key, at( middle )->first ) )
+                    high = middle;
+                else
+                    low = middle + 1;
+            }
+            return low;
+        }
+    private:
+        void mark( std::random_access_iterator_tag )
+        {}
+        void mark( std::input_iterator_tag )
+        {
+            marks_.reserve( size_/merge_mark_step + 1 );
+            iterator iter = first_;
+            for( std::size_t rank = 0 ; rank < size_ ; ++rank, ++iter )
+                if( rank % merge_mark_step == 0 )
+                    marks_.push_back( iter );
+        }
+        iterator at( std::size_t rank, std::random_access_iterator_tag ) const
+        { return first_ + rank; }
+        iterator at( std::size_t rank, std::input_iterator_tag ) const
+        {
+            iterator iter = marks_[rank/merge_mark_step];
+            std::advance( iter, rank % merge_mark_step );
+            return iter;
+        }
+
+        iterator first_;
+        iterator last_;
+        std::size_t size_;
+        std::vector<iterator> marks_;
+    };
+
+    // Where to split the runs so that about rank entries come before the
+    // split: the merge path's crossing of that diagonal, found by a k-way
+    // selection. Every entry with a given key stays on one side, so
+    // repeats are resolved within a part. O(k^2 log^2 n) for k runs.
+    template<typename KeyType, typename Run, typename Compare>
+    void merge_split( const std::vector<Run>& runs, std::size_t rank, const Compare& compare,
+                      std::vector<std::size_t>& split )
+    {
+        const std::size_t count = runs.size();
+        // The split is somewhere in [low[i],high[i]] in each run
+        std::vector<std::size_t> low( count, 0 ), high( count ), lower( count ), upper( count );
+        for( std::size_t i = 0 ; i < count ; ++i )
+            high[i] = runs[i].size();
+        for( ;; )
+        {
+            // Halve the widest range, by the key in its middle
+            std::size_t widest = 0;
+            for( std::size_t i = 1 ; i < count ; ++i )
+                if( high[i] - low[i] > high[widest] - low[widest] )
+                    widest = i;
+            if( high[widest] == low[widest] )
+            {
+                split = low;
+                return;
+            }
+            const KeyType pivot = runs[widest].at( low[widest] + (high[widest] - low[widest])/2 )->first;
+            std::size_t before = 0;
+            std::size_t through = 0;
+            for( std::size_t i = 0 ; i < count ; ++i )
+            {
+                lower[i] = runs[i].lower_bound( low[i], high[i], pivot, compare );
+                upper[i] = runs[i].upper_bound( lower[i], high[i], pivot, compare );
+                before += lower[i];
+                through += upper[i];
+            }
+            if( rank < before )
+                high.swap( lower );
+            else if( rank > through )
+                low.swap( upper );
+            else
+            {
+                split = lower;
+                return;
+            }
+        }
+    }
+
+    // The next entry from one of the runs being merged...
+    template<typename Iterator>
+    struct merge_head
+    {
+        Iterator next;
+        Iterator last;
+        std::size_t run;
+    };
+
+    // ...and the order of the merge's heap of them
+    template<typename Compare>
+    struct merge_head_after
+    {
+        const Compare* compare;
+        explicit merge_head_after( const Compare& predicate ) : compare( &predicate ) {}
+        template<typename Head>
+        bool operator()( const Head& lhs, const Head& rhs ) const
+        {
+            if( (*compare)( rhs.next->first, lhs.next->first ) )
+                return true;
+            return !(*compare)( lhs.next->first, rhs.next->first ) && rhs.run < lhs.run;
+        }
+    };
+
+    // One part of a merge: the runs' entries [first[i],last[i]), merged
+    // into out, with repeats resolved by duplicates. Returns the number
+    // of entries written.
+    template<typename Run, typename OutputIterator, typename Compare, typename Duplicates>
+    std::size_t merge_part( const std::vector<Run>& runs,
+                            const std::vector<std::size_t>& first, const std::vector<std::size_t>& last,
+                            OutputIterator out, const Compare& compare, const Duplicates& duplicates )
+    {
+        typedef typename Run::iterator iterator;
+        typedef typename std::iterator_traits<OutputIterator>::value_type entry_type;
+        typedef merge_head<iterator> head;
+        // The next entry from each run, with the least key (and of those,
+        // the first run's) on top
+        std::vector<head> heap;
+        for( std::size_t i = 0 ; i < runs.size() ; ++i )
+        {
+            if( first[i] != last[i] )
+            {
+                const head next = { runs[i].at( first[i] ), runs[i].at( last[i] ), i };
+                heap.push_back( next );
+            }
+        }
+        const merge_head_after<Compare> order( compare );
+        std::make_heap( heap.begin(), heap.end(), order );
+
+        std::size_t written = 0;
+        while( !heap.empty() )
+        {
+            std::pop_heap( heap.begin(), heap.end(), order );
+            head& next = heap.back();
+            if( written != 0 && !compare( out[-1].first, next.next->first ) )
+                duplicates( out[-1].second, next.next->second );
+            else
+            {
+                *out = entry_type( next.next->first, next.next->second );
+                ++out;
+                ++written;
+            }
+            if( ++next.next == next.last )
+                heap.pop_back();
+            else
+                std::push_heap( heap.begin(), heap.end(), order );
+        }
+        return written;
+    }
+}
+
+// Replace result's entries with the merge of some sorted sources: the
+// containers in [first,last), all of one type - std::maps, vmaps, or
+// std::vectors of (key,mapped) pairs sorted by key - in result's order.
+// Where a key is in more than one of them (or repeated in one), the
+// duplicates policy sorts it out. The key and mapped types must be
+// default constructible.
+//
+// The merge is split into parts at merge path partition points, and each
+// part is merged straight into its place in the entries. With
+// VMAP_CONFIG_THREADS the parts are merged at the same time, by that many
+// threads; there's one per core for a big merge, unless threads says.
+template<typename Vmap, typename SourceIterator, typename Duplicates>
+void vmap_merge( SourceIterator first, SourceIterator last, Vmap& result, const Duplicates& duplicates,
+                 std::size_t threads = 0 )
+{
+    typedef typename std::iterator_traits<SourceIterator>::value_type source_type;
+    typedef vmap_detail::merge_run<typename source_type::const_iterator> run_type;
+    typedef typename Vmap::vector_type vector_type;
+    typedef typename Vmap::key_compare key_compare;
+
+    const key_compare compare = result.key_comp();
+    std::vector<run_type> runs;
+    std::size_t total = 0;
+    for( ; first != last ; ++first )
+    {
+        if( !first->empty() )
+        {
+            runs.push_back( run_type( *first ) );
+            total += runs.back().size();
+        }
+    }
+
+    std::size_t parts = threads ? threads : 1;
+#ifdef VMAP_CONFIG_THREADS
+    if( !threads && runs.size() > 1 && total >= vmap_detail::parallel_sort_threshold )
+        parts = std::max( std::thread::hardware_concurrency(), 1u );
+    if( parts > 1 )
+    {
+        std::vector<std::thread> marking;
+        for( std::size_t i = 0 ; i < runs.size() ; ++i )
+            marking.push_back( std::thread( [&runs,i]{ runs[i].mark(); } ) );
+        for( std::size_t i = 0 ; i < marking.size() ; ++i )
+            marking[i].join();
+    }
+    else
+#endif
+    {
+        for( std::size_t i = 0 ; i < runs.size() ; ++i )
+            runs[i].mark();
+    }
+
+    // Part p merges the runs' entries from splits[p] to splits[p+1] into
+    // entries, starting at offsets[p]
+    std::vector<std::vector<std::size_t> > splits( parts + 1, std::vector<std::size_t>( runs.size(), 0 ) );
+    for( std::size_t i = 0 ; i < runs.size() ; ++i )
+        splits[parts][i] = runs[i].size();
+    for( std::size_t part = 1 ; part < parts ; ++part )
+        vmap_detail::merge_split<typename Vmap::key_type>( runs, total/parts*part, compare, splits[part] );
+    std::vector<std::size_t> offsets( parts + 1, 0 );
+    for( std::size_t part = 1 ; part <= parts ; ++part )
+        offsets[part] = std::accumulate( splits[part].begin(), splits[part].end(), std::size_t(0) );
+
+    vector_type entries( total, typename vector_type::value_type(),
+                         typename vector_type::allocator_type( result.get_allocator() ) );
+    std::vector<std::size_t> written( parts, 0 );
+#ifdef VMAP_CONFIG_THREADS
+    if( parts > 1 )
+    {
+        std::vector<std::thread> merging;
+        for( std::size_t part = 0 ; part < parts ; ++part )
+        {
+            merging.push_back( std::thread( [&,part]{
+                written[part] = vmap_detail::merge_part( runs, splits[part], splits[part+1],
+                                                         entries.begin() + offsets[part], compare, duplicates );
+            } ) );
+        }
+        for( std::size_t part = 0 ; part < parts ; ++part )
+            merging[part].join();
+    }
+    else
+#endif
+    {
+        for( std::size_t part = 0 ; part < parts ; ++part )
+            written[part] = vmap_detail::merge_part( runs, splits[part], splits[part+1],
+                                                     entries.begin() + offsets[part], compare, duplicates );
+    }
+
+    // Close up the gaps left by repeated keys
+    std::size_t size = written[0];
+    for( std::size_t part = 1 ; part < parts ; ++part )
+    {
+        if( offsets[part] != size )
+        {
+            const typename vector_type::iterator from = entries.begin() + offsets[part];
+#ifdef VMAP_CONFIG_MOVE
+            std::move( from, from + written[part], entries.begin() + size );
+#else
+            std::copy( from, from + written[part], entries.begin() + size );
+#endif
+        }
+        size += written[part];
+    }
+    entries.erase( entries.begin() + size, entries.end() );
+
+#ifdef VMAP_CONFIG_MOVE
+    Vmap( vmap_sorted_unique, std::move(entries), compare ).swap( result );
+#else
+    Vmap( vmap_sorted_unique, entries, compare, result.get_allocator() ).swap( result );
+#endif
+}
+
+// ...where the first source's entry wins
+template<typename Vmap, typename SourceIterator>
+void vmap_merge( SourceIterator first, SourceIterator last, Vmap& result )
+{ vmap_merge( first, last, result, vmap_keep_first() ); }
+
+// A small set-associative cache in front of a map's find, for lookups
+// which mostly want the same few keys. Each set is a cache line of Ways
+// (tag,position) slots, picked by the key's hash; a hit costs that line
+// and the entry's, rather than a search. Hash (std::hash by default) must
+// agree with the map's comparator.
+//
+// find is const, and writes nothing at all: one seeded cache may be
+// shared by any number of threads. find_caching learns as it goes
+// (keeping the most recently used Ways keys in each set), and counts its
+// hits and misses, so it's for a cache per thread; a copy of a cache
+// which has learned from the traffic is a way to seed a shared one. The
+// map mustn't change (it's positions that are cached), nor have 2^32-1 or
+// more entries (when nothing is).
+template<typename Map, std::size_t Ways = 8, typename Hash = void>
+class vmap_hot_cache
+{
+public:
+    typedef typename Map::key_type key_type;
+    typedef typename Map::mapped_type mapped_type;
+    typedef typename Map::key_compare key_compare;
+    typedef typename Map::const_iterator const_iterator;
+    typedef typename vmap_detail::select_hash<Hash,key_type>::type hasher;
+
+    // sets is rounded up to a power of two
+    explicit vmap_hot_cache( const Map& map, std::size_t sets = 256 )
+      : map_( &map )
+      , compare_( map.key_comp() )
+      , hits_( 0 )
+      , misses_( 0 )
+    { allocate( sets ); }
+
+    // Seeded with the keys in [first,last), hottest first: a key which
+    // finds its set full is left out, and each set's hottest key is its
+    // most recently used.
+    template<typename InputIterator>
+    vmap_hot_cache( const Map& map, InputIterator first, InputIterator last, std::size_t sets = 256 )
+      : map_( &map )
+      , compare_( map.key_comp() )
+      , hits_( 0 )
+      , misses_( 0 )
+    {
+        allocate( sets );
+        for( ; first != last ; ++first )
+            place( *first, false );
+    }
+
+    // Copies have the same slots, but their own hit and miss counts
+    vmap_hot_cache( const vmap_hot_cache& that )
+      : map_( that.map_ )
+      , compare_( that.compare_ )
+      , hash_( that.hash_ )
+      , hits_( 0 )
+      , misses_( 0 )
+    {
+        allocate( that.mask_ + 1 );
+        std::copy( that.sets(), that.sets() + (mask_ + 1) * Ways, sets() );
+    }
+    vmap_hot_cache& operator=( const vmap_hot_cache& that )
+    {
+        if( this != &that )
+        {
+            map_ = that.map_;
+            compare_ = that.compare_;
+            hash_ = that.hash_;
+            allocate( that.mask_ + 1 );
+            std::copy( that.sets(), that.sets() + (mask_ + 1) * Ways, sets() );
+        }
+        return *this;
+    }
+
+    // As the map's find, but looking in the cache first
+    const_iterator find( const key_type& key ) const
+    {
+        const uint64_t hash = hash_of( key );
+        const slot* set = set_of( hash );
+        for( std::size_t way = 0 ; way < Ways ; ++way )
+        {
+            if( matches( set[way], tag_of( hash ), key ) )
+                return map_->begin() + set[way].position;
+        }
+        return map_->find( key );
+    }
+
+    // As find, but a hit becomes its set's most recently used key, and a
+    // key the map has which missed goes in, in place of the least.
+    const_iterator find_caching( const key_type& key )
+    {
+        const uint64_t hash = hash_of( key );
+        slot* set = set_of( hash );
+        for( std::size_t way = 0 ; way < Ways ; ++way )
+        {
+            if( matches( set[way], tag_of( hash ), key ) )
+            {
+                ++hits_;
+                promote( set, way );
+                return map_->begin() + set[0].position;
+            }
+        }
+        ++misses_;
+        const const_iterator iter = map_->find( key );
+        if( iter != map_->end() )
+            remember( set, Ways, tag_of( hash ), iter - map_->begin() );
+        return iter;
+    }
+
+    const mapped_type& at( const key_type& key ) const
+    {
+        const const_iterator iter = find( key );
+        if( iter == map_->end() )
+            throw std::out_of_range("vmap_hot_cache: key not found");
+        return iter->second;
+    }
+
+    // Put key in the cache, as its set's most recently used. False if the
+    // map hasn't got it.
+    bool insert( const key_type& key )
+    { return place( key, true ); }
+
+    void clear()
+    { std::fill( sets(), sets() + (mask_ + 1) * Ways, empty() ); }
+
+    // find_caching's hits and misses (find, being shared, doesn't count)
+    uint64_t hits() const
+    { return hits_; }
+    uint64_t misses() const
+    { return misses_; }
+    double hit_rate() const
+    { return hits() + misses() ? double(hits()) / double(hits() + misses()) : 0.0; }
+    void reset_stats()
+    {
+        hits_ = 0;
+        misses_ = 0;
+    }
+
+    std::size_t memory() const
+    { return slots_.capacity() * sizeof(slot); }
+private:
+    struct slot
+    {
+        uint32_t tag;
+        uint32_t position;  // vmap_detail::empty_slot if there's no key
+    };
+    enum { line_bytes = 64 };
+
+    static slot empty()
+    {
+        const slot none = { 0, vmap_detail::empty_slot };
+        return none;
+    }
+
+    void allocate( std::size_t sets )
+    {
+        std::size_t count = 1;
+        while( count < sets )
+            count *= 2;
+        mask_ = count - 1;
+        // Room to start the first set on a cache line
+        std::vector<slot>( count * Ways + line_bytes/sizeof(slot), empty() ).swap( slots_ );
+    }
+
+    slot* sets()
+    {
+        const uintptr_t address = reinterpret_cast<uintptr_t>( &slots_[0] );
+        return reinterpret_cast<slot*>( (address + line_bytes - 1) & ~uintptr_t(line_bytes - 1) );
+    }
+    const slot* sets() const
+    { return const_cast<vmap_hot_cache*>( this )->sets(); }
+
+    uint64_t hash_of( const key_type& key ) const
+    { return vmap_detail::mix64( static_cast<uint64_t>( hash_( key ) ) ); }
+    static uint32_t tag_of( uint64_t hash )
+    { return static_cast<uint32_t>( hash >> 32 ); }
+    slot* set_of( uint64_t hash )
+    { return sets() + ( hash & mask_ ) * Ways; }
+    const slot* set_of( uint64_t hash ) const
+    { return sets() + ( hash & mask_ ) * Ways; }
+
+    bool matches( const slot& candidate, uint32_t tag, const key_type& key ) const
+    {
+        if( candidate.tag != tag || candidate.position == vmap_detail::empty_slot )
+            return false;
+        const const_iterator iter = map_->begin() + candidate.position;
+        return !compare_( iter->first, key ) && !compare_( key, iter->first );
+    }
+
+    // Move a set's way to the front (most recently used)...
+    static void promote( slot* set, std::size_t way )
+    {
+        const slot hit = set[way];
+        std::copy_backward( set, set + way, set + way + 1 );
+        set[0] = hit;
+    }
+
+    // ...or put a new position there, dropping the least recently used
+    // (of the ways from set on)
+    void remember( slot* set, std::size_t ways, uint32_t tag, std::size_t position )
+    {
+        if( map_->size() >= vmap_detail::empty_slot )
+            return;
+        std::copy_backward( set, set + ways - 1, set + ways );
+        const slot fresh = { tag, static_cast<uint32_t>( position ) };
+        set[0] = fresh;
+    }
+
+    bool place( const key_type& key, bool evict )
+    {
+        const const_iterator iter = map_->find( key );
+        if( iter == map_->end() )
+            return false;
+        const uint64_t hash = hash_of( key );
+        slot* set = set_of( hash );
+        for( std::size_t way = 0 ; way < Ways ; ++way )
+        {
+            if( matches( set[way], tag_of( hash ), key ) )
+            {
+                if( evict )
+                    promote( set, way );
+                return true;
+            }
+        }
+        if( evict )
+            remember( set, Ways, tag_of( hash ), iter - map_->begin() );
+        else
+        {
+            // Seeds go after the (hotter) ones already there
+            for( std::size_t way = 0 ; way < Ways ; ++way )
+            {
+                if( set[way].position == vmap_detail::empty_slot )
+                {
+                    remember( set + way, Ways - way, tag_of( hash ), iter - map_->begin() );
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
+    const Map* map_;
+    key_compare compare_;
+    hasher hash_;
+    std::size_t mask_;          // Sets, less one
+    std::vector<slot> slots_;   // Ways to a set, from sets()
+    uint64_t hits_;
+    uint64_t misses_;
+};
+
+// A read-only table of integral keys and integral mapped values, both bit
+// packed: the keys as vmap_packed's are, and the values at one fixed width
+// (enough for the biggest difference from the smallest). Since there's no
+// mapped_type to refer to, at, get and the iterators hand out copies, and
+// nothing can be changed; vmap<...,vmap_packed<> > is the mutable version.
+// For vmap<uint64_t,uint32_t> style tables, with keys close together and
+// values of 16-20 bits, that's about 5 bytes an entry rather than 16.
+template<typename KeyType
+        ,typename MappedType
+        ,std::size_t BlockSize = 64
+        ,typename Allocator = std::allocator<std::pair<const KeyType,MappedType> >
+        >
+class vmap_packed_table
+{
+    typedef vmap_detail::packed_keys<KeyType,Allocator,BlockSize> keys_type;
+    typedef vmap_detail::packed_values<MappedType,Allocator>      values_type;
+public:
+    typedef KeyType key_type;
+    typedef MappedType mapped_type;
+    typedef std::less<KeyType> key_compare;
+    typedef std::pair<key_type,mapped_type> value_type;
+    typedef Allocator allocator_type;
+    typedef std::size_t size_type;
+
+    // Everything's read-only
+    typedef vmap_detail::packed_table_iterator<keys_type,values_type> const_iterator;
+    typedef const_iterator                                            iterator;
+    typedef std::reverse_iterator<const_iterator>                     const_reverse_iterator;
+    typedef const_reverse_iterator                                    reverse_iterator;
+
+    vmap_packed_table() {}
+
+    // From a map ordered by std::less: a std::map, or a vmap
+    template<typename Map>
+    explicit vmap_packed_table( const Map& map, const allocator_type& allocator = allocator_type() )
+      : keys_( allocator )
+      , values_( allocator )
+    { assign( map.begin(), static_cast<size_type>( std::distance( map.begin(), map.end() ) ) ); }
+
+    // From a range of (key,mapped) pairs which is already sorted, without
+    // repeated keys
+    template<typename ForwardIterator>
+    vmap_packed_table( vmap_sorted_unique_t,
+                       ForwardIterator first, ForwardIterator last,
+                       const allocator_type& allocator = allocator_type() )
+      : keys_( allocator )
+      , values_( allocator )
+    { assign( first, static_cast<size_type>( std::distance( first, last ) ) ); }
+
+    size_type size() const noexcept
+    { return keys_.size(); }
+    bool empty() const noexcept
+    { return keys_.size() == 0; }
+    key_compare key_comp() const noexcept
+    { return key_compare(); }
+
+    const_iterator         begin()    const noexcept { return const_iterator( &keys_, &values_, 0 ); }
+    const_iterator         end()      const noexcept { return begin() + size(); }
+    const_reverse_iterator rbegin()   const noexcept { return const_reverse_iterator( end() ); }
+    const_reverse_iterator rend()     const noexcept { return const_reverse_iterator( begin() ); }
+    const_iterator         cbegin()   const noexcept { return begin();  }
+    const_iterator         cend()     const noexcept { return end();    }
+    const_reverse_iterator crbegin()  const noexcept { return rbegin(); }
+    const_reverse_iterator crend()    const noexcept { return rend();   }
+
+    const_iterator lower_bound( const key_type& key ) const noexcept
+    {
+        bool equal;
+        return begin() + keys_.bound( key, false, equal );
+    }
+
+    const_iterator upper_bound( const key_type& key ) const noexcept
+    {
+        bool equal;
+        return begin() + keys_.bound( key, true, equal );
+    }
+
+    std::pair<const_iterator,const_iterator> equal_range( const key_type& key ) const noexcept
+    {
+        const const_iterator iter = find(key);
+        if( iter == end() )
+            return std::make_pair(end(),end());
+        return std::make_pair(iter,iter+1);
+    }
+
+    const_iterator find( const key_type& key ) const noexcept
+    {
+        bool equal;
+        const size_type rank = keys_.bound( key, false, equal );
+        return equal ? begin() + rank : end();
+    }
+
+    size_type count( const key_type& key ) const noexcept
+    { return find( key ) == end() ? 0 : 1; }
+
+    // Return (a copy of) the mapped value, or throw std::out_of_range
+    mapped_type at( const key_type& key ) const
+    {
+        bool equal;
+        const size_type rank = keys_.bound( key, false, equal );
+        if( !equal )
+        {
+            throw std::out_of_range("vmap_packed_table: key not found");
+        }
+        return values_.get( rank );
+    }
+
+    // Return the mapped value for key, or defalt if non present
+    mapped_type get( const key_type& key, const mapped_type& defalt = mapped_type() ) const noexcept
+    {
+        bool equal;
+        const size_type rank = keys_.bound( key, false, equal );
+        return equal ? values_.get( rank ) : defalt;
+    }
+
+    // Bytes used by the keys and values together
+    std::size_t memory() const noexcept
+    { return keys_.memory() + values_.memory(); }
+
+    void swap( vmap_packed_table& that ) noexcept
+    {
+        keys_.swap( that.keys_ );
+        values_.swap( that.values_ );
+    }
+private:
+    template<typename ForwardIterator>
+    void assign( ForwardIterator first, size_type count )
+    {
+        keys_.assign( first, count );
+        values_.assign( first, count );
+    }
+
+    keys_type keys_;
+    values_type values_;
+};
+
+// A vmap which takes the occasional insert or erase. Changes go into a
+// small sorted buffer of new entries, and a sorted list of erased keys
+// ('tombstones'), over the top of an ordinary vmap; lookups check both.
+// Changing the mapped value of an existing entry happens in place.
+//
+// When the buffer and tombstones get bigger than merge_threshold() (by
+// default, the square root of the size, but at least 64) they're folded
+// into a new vmap in one linear pass - or call merge() yourself. So an
+// insert or erase costs O(logN) plus an amortised O(sqrt(N)), rather than
+// a rebuild.
+//
+// Iterators are forward iterators, over pair-like proxies; like std::map's,
+// they're invalidated by insert, erase and merge.
+template<typename KeyType
+        ,typename MappedType
+        ,typename Predicate = std::less<KeyType>
+        ,typename Allocator = std::allocator<std::pair<KeyType,MappedType> >
+        ,typename Layout = vmap_pairs
+        ,typename Search = vmap_binary_search
+        >
+class vmap_delta
+{
+public:
+    typedef KeyType key_type;
+    typedef MappedType mapped_type;
+    typedef Predicate key_compare;
+    typedef Allocator allocator_type;
+
+    typedef vmap<key_type,mapped_type,key_compare,allocator_type,Layout,Search> vmap_type;
+    typedef typename vmap_type::size_type size_type;
+    typedef typename vmap_type::vector_type buffer_type;
+    typedef std::vector<key_type,typename vmap_detail::rebind_alloc<allocator_type,key_type>::type> tombstones_type;
+
+    typedef vmap_detail::delta_iterator<vmap_delta> const_iterator;
+    typedef const_iterator                          iterator;
+
+    // merge_threshold = 0 picks the threshold to suit the size
+    explicit vmap_delta( size_type merge_threshold = 0 )
+      : threshold_( merge_threshold )
+    {}
+
+    explicit vmap_delta( const vmap_type& base, size_type merge_threshold = 0 )
+      : base_( base )
+      , compare_( base.key_comp() )
+      , threshold_( merge_threshold )
+    {}
+#ifdef VMAP_CONFIG_MOVE
+    explicit vmap_delta( vmap_type&& base, size_type merge_threshold = 0 )
+      : base_( std::move(base) )
+      , compare_( base_.key_comp() )
+      , threshold_( merge_threshold )
+    {}
+#endif
+
+    size_type size() const noexcept
+    { return base_.size() - tombstones_.size() + buffer_.size(); }
+    bool empty() const noexcept
+    { return size() == 0; }
+    key_compare key_comp() const noexcept
+    { return compare_; }
+
+    // The vmap underneath. Once merged, it's everything.
+    const vmap_type& base() const noexcept
+    { return base_; }
+    // How many inserts and erases are waiting to be merged
+    size_type pending() const noexcept
+    { return buffer_.size() + tombstones_.size(); }
+    size_type merge_threshold() const noexcept
+    {
+        if( threshold_ > 0 )
+            return threshold_;
+        size_type root = 64;
+        while( root * root < base_.size() )
+            root *= 2;
+        return root;
+    }
+
+    const_iterator begin() const noexcept
+    { return const_iterator( this, base_.begin(), tombstones_.begin(), buffer_.begin() ); }
+    const_iterator end() const noexcept
+    { return const_iterator( this, base_.end(), tombstones_.end(), buffer_.end() ); }
+    const_iterator cbegin() const noexcept
+    { return begin(); }
+    const_iterator cend() const noexcept
+    { return end(); }
+
+    const_iterator lower_bound( const key_type& key ) const noexcept
+    {
+        return const_iterator( this, base_.lower_bound( key ), tombstone_bound( key ), buffer_bound( key ) );
+    }
+
+    const_iterator upper_bound( const key_type& key ) const noexcept
+    {
+        return const_iterator( this,
+                               base_.upper_bound( key ),
+                               std::upper_bound( tombstones_.begin(), tombstones_.end(), key, compare_ ),
+                               std::upper_bound( buffer_.begin(), buffer_.end(), key,
+                                                 vmap_detail::key_entry_compare<key_compare>( compare_ ) ) );
+    }
+
+    std::pair<const_iterator,const_iterator> equal_range( const key_type& key ) const noexcept
+    {
+        const const_iterator iter = find(key);
+        if( iter == end() )
+            return std::make_pair(end(),end());
+        const_iterator next = iter;
+        return std::make_pair(iter,++next);
+    }
+
+    const_iterator find( const key_type& key ) const noexcept
+    {
+        const mapped_type* mapped = lookup( key );
+        return mapped ? lower_bound( key ) : end();
+    }
+
+    size_type count( const key_type& key ) const noexcept
+    { return lookup( key ) ? 1 : 0; }
+
+    // Return the mapped value, or throw std::out_of_range
+    mapped_type& at( const key_type& key )
+    {
+        mapped_type* mapped = const_cast<mapped_type*>( lookup( key ) );
+        if( !mapped )
+        {
+            throw std::out_of_range("vmap_delta: key not found");
+        }
+        return *mapped;
+    }
+    const mapped_type& at( const key_type& key ) const
+    {
+        const mapped_type* mapped = lookup( key );
+        if( !mapped )
+        {
+            throw std::out_of_range("vmap_delta: key not found");
+        }
+        return *mapped;
+    }
+
+    // Return the mapped value for key, or defalt if non present
+    const mapped_type& get( const key_type& key, const mapped_type& defalt ) const noexcept
+    {
+        const mapped_type* mapped = lookup( key );
+        return mapped ? *mapped : defalt;
+    }
+    // Return the mapped value for key, or a (shared) mapped_type() if
+    // non present
+    const mapped_type& get( const key_type& key ) const noexcept
+    {
+        const mapped_type* mapped = lookup( key );
+        return mapped ? *mapped : vmap_detail::missing_mapped<mapped_type>();
+    }
+
+    // As std::map: does nothing (and returns false) if key is already there
+    bool insert( const key_type& key, const mapped_type& mapped )
+    {
+        if( lookup( key ) )
+            return false;
+        add( key, mapped );
+        return true;
+    }
+
+    // Returns true if key is new, false if it was there and has been updated
+    bool insert_or_assign( const key_type& key, const mapped_type& mapped )
+    {
+        if( mapped_type* existing = const_cast<mapped_type*>( lookup( key ) ) )
+        {
+            *existing = mapped;
+            return false;
+        }
+        add( key, mapped );
+        return true;
+    }
+
+    // Returns the number of entries erased (0 or 1)
+    size_type erase( const key_type& key )
+    {
+        const typename buffer_type::iterator buffered = buffer_bound( key );
+        if( buffered != buffer_.end() && !compare_( key, buffered->first ) )
+        {
+            buffer_.erase( buffered );
+            return 1;
+        }
+        if( base_.find( key ) == base_.end() )
+            return 0;
+        const typename tombstones_type::iterator tombstone = tombstone_bound( key );
+        if( tombstone != tombstones_.end() && !compare_( key, *tombstone ) )
+            return 0;
+        tombstones_.insert( tombstone, key );
+        merge_if_full();
+        return 1;
+    }
+
+    // Fold the buffer and tombstones into a new vmap
+    void merge()
+    {
+        if( pending() == 0 )
+            return;
+        buffer_type entries( typename buffer_type::allocator_type( base_.get_allocator() ) );
+        entries.reserve( size() );
+        typename tombstones_type::const_iterator tombstone = tombstones_.begin();
+        typename buffer_type::iterator buffered = buffer_.begin();
+        for( typename vmap_type::iterator iter = base_.begin() ; iter != base_.end() ; ++iter )
+        {
+            if( tombstone != tombstones_.end() && !compare_( iter->first, *tombstone ) )
+            {
+                ++tombstone;
+                continue;
+            }
+            for( ; buffered != buffer_.end() && compare_( buffered->first, iter->first ) ; ++buffered )
+                entries.push_back( move_entry( *buffered ) );
+            entries.push_back( typename buffer_type::value_type( iter->first, vmap_detail::move_from( iter->second ) ) );
+        }
+        for( ; buffered != buffer_.end() ; ++buffered )
+            entries.push_back( move_entry( *buffered ) );
+#ifdef VMAP_CONFIG_MOVE
+        vmap_type merged( vmap_sorted_unique, std::move(entries), compare_ );
+#else
+        vmap_type merged( vmap_sorted_unique, entries, compare_, base_.get_allocator() );
+#endif
+        base_.swap( merged );
+        buffer_type( buffer_.get_allocator() ).swap( buffer_ );
+        tombstones_type( tombstones_.get_allocator() ).swap( tombstones_ );
+    }
+
+    void swap( vmap_delta& that )
+    {
+        using std::swap;
+        base_.swap( that.base_ );
+        buffer_.swap( that.buffer_ );
+        tombstones_.swap( that.tombstones_ );
+        swap( compare_, that.compare_ );
+        swap( threshold_, that.threshold_ );
+    }
+private:
+    friend class vmap_detail::delta_iterator<vmap_delta>;
+    typedef vmap_detail::entry_key_compare<key_compare> entry_key_compare;
+
+    static typename buffer_type::value_type move_entry( typename buffer_type::value_type& entry )
+    { return typename buffer_type::value_type( vmap_detail::move_from( entry.first ), vmap_detail::move_from( entry.second ) ); }
+
+    typename buffer_type::const_iterator buffer_bound( const key_type& key ) const noexcept
+    { return std::lower_bound( buffer_.begin(), buffer_.end(), key, entry_key_compare( compare_ ) ); }
+    typename buffer_type::iterator buffer_bound( const key_type& key ) noexcept
+    { return std::lower_bound( buffer_.begin(), buffer_.end(), key, entry_key_compare( compare_ ) ); }
+
+    typename tombstones_type::const_iterator tombstone_bound( const key_type& key ) const noexcept
+    { return std::lower_bound( tombstones_.begin(), tombstones_.end(), key, compare_ ); }
+    typename tombstones_type::iterator tombstone_bound( const key_type& key ) noexcept
+    { return std::lower_bound( tombstones_.begin(), tombstones_.end(), key, compare_ ); }
+
+    bool erased( const key_type& key ) const noexcept
+    {
+        const typename tombstones_type::const_iterator tombstone = tombstone_bound( key );
+        return tombstone != tombstones_.end() && !compare_( key, *tombstone );
+    }
+
+    // The live mapped value for key, or 0
+    const mapped_type* lookup( const key_type& key ) const noexcept
+    {
+        const typename buffer_type::const_iterator buffered = buffer_bound( key );
+        if( buffered != buffer_.end() && !compare_( key, buffered->first ) )
+            return &buffered->second;
+        const typename vmap_type::const_iterator iter = base_.find( key );
+        if( iter == base_.end() || ( !tombstones_.empty() && erased( key ) ) )
+            return 0;
+        return &iter->second;
+    }
+
+    // Add an entry for key, which isn't there
+    void add( const key_type& key, const mapped_type& mapped )
+    {
+        const typename tombstones_type::iterator tombstone = tombstone_bound( key );
+        if( tombstone != tombstones_.end() && !compare_( key, *tombstone ) )
+        {
+            // It's in the base, but erased: bring it back
+            tombstones_.erase( tombstone );
+            base_.at( key ) = mapped;
+            return;
+        }
+        buffer_.insert( buffer_bound( key ), typename buffer_type::value_type( key, mapped ) );
+        merge_if_full();
+    }
+
+    void merge_if_full()
+    {
+        if( pending() > merge_threshold() )
+            merge();
+    }
+
+    vmap_type base_;
+    buffer_type buffer_;          // Entries whose keys aren't in base_
+    tombstones_type tombstones_;  // Keys in base_ which have been erased
+    key_compare compare_;
+    size_type threshold_;
+};
+
+namespace vmap_detail
+{
+    // Input iterator over what a range of iterators point at
+    template<typename Iterator>
+    class deref_iterator
+    {
+    public:
+        explicit deref_iterator( Iterator iter ) noexcept
+          : iter_( iter )
+        {}
+        typename std::iterator_traits<typename std::iterator_traits<Iterator>::value_type>::reference
+        operator*() const noexcept
+        { return **iter_; }
+        deref_iterator& operator++() noexcept
+        {
+            ++iter_;
+            return *this;
+        }
+    private:
+        Iterator iter_;
+    };
+
+    // vmultimap's distinct keys, with where each one's run of mapped values
+    // starts (and, after the last, where the runs end). The search policies
+    // search these.
+    template<typename KeyType, typename Allocator>
+    class key_runs
+    {
+    public:
+        typedef KeyType key_type;
+        typedef std::size_t size_type;
+        typedef fixed_array<key_type,typename rebind_alloc<Allocator,key_type>::type> keys_type;
+        typedef fixed_array<size_type,typename rebind_alloc<Allocator,size_type>::type> starts_type;
+
+        key_runs() {}
+        explicit key_runs( const Allocator& allocator )
+          : keys_( allocator )
+          , starts_( allocator )
+        {}
+
+        // The runs in count (sorted) entries from first. The keys are
+        // copied, or if move, moved.
+        template<typename ForwardIterator, typename Predicate>
+        void assign( ForwardIterator first, size_type count, const Predicate& compare, bool move )
+        {
+            std::vector<ForwardIterator> heads;
+            std::vector<size_type> starts;
+            ForwardIterator previous = first;
+            for( size_type i = 0 ; i < count ; previous = first, ++i, ++first )
+            {
+                if( i == 0 || compare( previous->first, first->first ) )
+                {
+                    heads.push_back( first );
+                    starts.push_back( i );
+                }
+            }
+            starts.push_back( count );
+            typedef deref_iterator<typename std::vector<ForwardIterator>::const_iterator> head_iterator;
+            keys_type keys( keys_.get_allocator() );
+            starts_type offsets( starts_.get_allocator() );
+            if( move )
+                keys.assign_moved( head_iterator( heads.begin() ), heads.size(), select_first() );
+            else
+                keys.assign( head_iterator( heads.begin() ), heads.size(), select_first() );
+            offsets.assign( starts.begin(), starts.size(), select_self() );
+            keys_.swap( keys );
+            starts_.swap( offsets );
+        }
+
+        size_type size() const noexcept { return keys_.size(); }
+        bool empty() const noexcept     { return keys_.empty(); }
+
+        const key_type& key( size_type run ) const noexcept
+        { return keys_[run]; }
+        // Where run starts. (There's one past the last run, but there may
+        // be no runs at all.)
+        size_type start( size_type run, size_type total ) const noexcept
+        { return run < keys_.size() ? starts_[run] : total; }
+
+        const key_type* keys() const noexcept    { return keys_.begin(); }
+        const size_type* starts() const noexcept { return starts_.begin(); }
+
+        void swap( key_runs& that ) noexcept
+        {
+            keys_.swap( that.keys_ );
+            starts_.swap( that.starts_ );
+        }
+    private:
+        keys_type keys_;
+        starts_type starts_;
+    };
+
+    // Bidirectional iterator over a vmultimap: each mapped value, paired
+    // with the key of the run it's in
+    template<typename KeyType, typename MappedType>
+    class run_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<KeyType,typename remove_const<MappedType>::type> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef pair_reference<KeyType,MappedType> reference;
+        typedef arrow_proxy<reference> pointer;
+
+        run_iterator() noexcept
+          : keys_( 0 )
+          , starts_( 0 )
+          , mapped_( 0 )
+          , run_( 0 )
+          , index_( 0 )
+        {}
+        run_iterator( const KeyType* keys, const std::size_t* starts, MappedType* mapped,
+                      std::size_t run, std::size_t index ) noexcept
+          : keys_( keys )
+          , starts_( starts )
+          , mapped_( mapped )
+          , run_( run )
+          , index_( index )
+        {}
+        // iterator -> const_iterator (and, when they're the same, the copy ctor)
+        run_iterator( const run_iterator<KeyType,typename remove_const<MappedType>::type>& that ) noexcept
+          : keys_( that.keys_ )
+          , starts_( that.starts_ )
+          , mapped_( that.mapped_ )
+          , run_( that.run_ )
+          , index_( that.index_ )
+        {}
+
+        reference operator*() const noexcept { return reference( keys_[run_], mapped_[index_] ); }
+        pointer operator->() const noexcept { return pointer( **this ); }
+
+        run_iterator& operator++() noexcept
+        {
+            if( ++index_ == starts_[run_+1] )
+                ++run_;
+            return *this;
+        }
+        run_iterator& operator--() noexcept
+        {
+            if( index_ == starts_[run_] )
+                --run_;
+            --index_;
+            return *this;
+        }
+        run_iterator operator++(int) noexcept { run_iterator t( *this ); ++*this; return t; }
+        run_iterator operator--(int) noexcept { run_iterator t( *this ); --*this; return t; }
+
+        friend bool operator==( const run_iterator& lhs, const run_iterator& rhs ) noexcept { return lhs.index_ == rhs.index_; }
+        friend bool operator!=( const run_iterator& lhs, const run_iterator& rhs ) noexcept { return lhs.index_ != rhs.index_; }
+    private:
+        template<typename,typename> friend class run_iterator;
+
+        const KeyType*     keys_;
+        const std::size_t* starts_;
+        MappedType*        mapped_;
+        std::size_t run_;    // Which key
+        std::size_t index_;  // Which mapped value
+    };
+}
+
+// A read-only (bar the mapped values) std::multimap. Each distinct key is
+// stored once, in a sorted array which the search policy searches; its
+// mapped values are a contiguous run in a second array, in the order they
+// were given. So equal_range (and count) is one search and two array
+// reads, and repeated keys cost nothing.
+//
+// Iterators visit each mapped value in turn, as std::multimap's do, with
+// pair-like proxies for entries; they're bidirectional. mapped_range(key)
+// gives the run itself, as a pair of pointers.
+template<typename KeyType
+        ,typename MappedType
+        ,typename Predicate = std::less<KeyType>
+        ,typename Allocator = std::allocator<std::pair<KeyType,MappedType> >
+        ,typename Search = vmap_binary_search
+        >
+class vmultimap
+{
+public:
+    typedef KeyType key_type;
+    typedef MappedType mapped_type;
+    typedef Predicate key_compare;
+    typedef Allocator allocator_type;
+    typedef Search search_type;
+    typedef std::pair<const key_type,mapped_type> value_type;
+    typedef std::size_t size_type;
+    typedef std::pair<key_type,mapped_type> entry_type;
+    typedef std::vector<entry_type,typename vmap_detail::rebind_alloc<Allocator,entry_type>::type> vector_type;
+
+    typedef vmap_detail::run_iterator<key_type,mapped_type>       iterator;
+    typedef vmap_detail::run_iterator<key_type,const mapped_type> const_iterator;
+    typedef std::reverse_iterator<iterator>                       reverse_iterator;
+    typedef std::reverse_iterator<const_iterator>                 const_reverse_iterator;
+
+    vmultimap() {}
+    explicit vmultimap( const allocator_type& allocator )
+      : runs_( allocator )
+      , values_( allocator )
+    {}
+
+    // Copy a std::multimap (whose allocator needn't be ours)
+    template<typename MapAllocator>
+    explicit vmultimap( const std::multimap<key_type,mapped_type,key_compare,MapAllocator>& map,
+                        const allocator_type& allocator = allocator_type() )
+      : runs_( allocator )
+      , values_( allocator )
+      , compare_( map.key_comp() )
+    {
+        runs_.assign( map.begin(), map.size(), compare_, false );
+        values_.assign( map.begin(), map.size(), vmap_detail::select_second() );
+        index_.build( runs_, compare_ );
+    }
+
+    // Entries from an arbitrary range of (key,mapped) pairs. They're
+    // sorted (unless they already are) by key; a key's mapped values stay
+    // in the order they came.
+    template<typename InputIterator>
+    vmultimap( InputIterator first, InputIterator last,
+               const key_compare& compare = key_compare(),
+               const allocator_type& allocator = allocator_type() )
+      : runs_( allocator )
+      , values_( allocator )
+      , compare_( compare )
+    {
+        vector_type entries( first, last, typename vector_type::allocator_type( allocator ) );
+        adopt( entries );
+    }
+
+#ifdef VMAP_CONFIG_MOVE
+    // Take over a vector of entries; sorted in place, if need be.
+    explicit vmultimap( vector_type&& entries,
+                        const key_compare& compare = key_compare() )
+      : runs_( allocator_type( entries.get_allocator() ) )
+      , values_( allocator_type( entries.get_allocator() ) )
+      , compare_( compare )
+    {
+        adopt( entries );
+    }
+
+    vmultimap( const vmultimap& ) = default;
+    vmultimap& operator=( const vmultimap& ) = default;
+
+    vmultimap( vmultimap&& that )
+      : runs_( std::move(that.runs_) )
+      , values_( std::move(that.values_) )
+      , index_( std::move(that.index_) )
+      , compare_( std::move(that.compare_) )
+    {
+    }
+    vmultimap& operator=( vmultimap&& that )
+    {
+        runs_ = std::move(that.runs_);
+        values_ = std::move(that.values_);
+        index_ = std::move(that.index_);
+        compare_ = std::move(that.compare_);
+        return *this;
+    }
+#endif
+
+    // The number of entries (mapped values), as std::multimap
+    size_type size() const noexcept
+    { return values_.size(); }
+    bool empty() const noexcept
+    { return values_.empty(); }
+    size_type max_size() const noexcept
+    { return values_.max_size(); }
+    // The number of distinct keys
+    size_type key_count() const noexcept
+    { return runs_.size(); }
+
+    allocator_type get_allocator() const noexcept
+    { return allocator_type( values_.get_allocator() ); }
+    key_compare key_comp() const noexcept
+    { return compare_; }
+
+    iterator               begin()          noexcept { return at_run( 0 ); }
+    iterator               end()            noexcept { return at_run( runs_.size() ); }
+    reverse_iterator       rbegin()         noexcept { return reverse_iterator( end() ); }
+    reverse_iterator       rend()           noexcept { return reverse_iterator( begin() ); }
+
+    const_iterator         begin()    const noexcept { return at_run( 0 ); }
+    const_iterator         end()      const noexcept { return at_run( runs_.size() ); }
+    const_reverse_iterator rbegin()   const noexcept { return const_reverse_iterator( end() ); }
+    const_reverse_iterator rend()     const noexcept { return const_reverse_iterator( begin() ); }
+
+    const_iterator         cbegin()   const noexcept { return begin(); }
+    const_iterator         cend()     const noexcept { return end(); }
+    const_reverse_iterator crbegin()  const noexcept { return rbegin(); }
+    const_reverse_iterator crend()    const noexcept { return rend(); }
+
+    iterator lower_bound( const key_type& key ) noexcept
+    { return at_run( index_.lower_bound( runs_, key, compare_ ) ); }
+    const_iterator lower_bound( const key_type& key ) const noexcept
+    { return at_run( index_.lower_bound( runs_, key, compare_ ) ); }
+
+    iterator upper_bound( const key_type& key ) noexcept
+    { return at_run( index_.upper_bound( runs_, key, compare_ ) ); }
+    const_iterator upper_bound( const key_type& key ) const noexcept
+    { return at_run( index_.upper_bound( runs_, key, compare_ ) ); }
+
+    // The first entry for key
+    iterator find( const key_type& key ) noexcept
+    { return at_run( index_.find( runs_, key, compare_ ) ); }
+    const_iterator find( const key_type& key ) const noexcept
+    { return at_run( index_.find( runs_, key, compare_ ) ); }
+
+    std::pair<iterator,iterator> equal_range( const key_type& key ) noexcept
+    {
+        const size_type run = index_.find( runs_, key, compare_ );
+        return std::make_pair( at_run( run ), at_run( run == runs_.size() ? run : run+1 ) );
+    }
+    std::pair<const_iterator,const_iterator> equal_range( const key_type& key ) const noexcept
+    {
+        const size_type run = index_.find( runs_, key, compare_ );
+        return std::make_pair( at_run( run ), at_run( run == runs_.size() ? run : run+1 ) );
+    }
+
+    size_type count( const key_type& key ) const noexcept
+    {
+        const size_type run = index_.find( runs_, key, compare_ );
+        return run == runs_.size() ? 0 : start( run+1 ) - start( run );
+    }
+
+    // key's mapped values, [first,second). Empty if key isn't there.
+    std::pair<mapped_type*,mapped_type*> mapped_range( const key_type& key ) noexcept
+    {
+        const size_type run = index_.find( runs_, key, compare_ );
+        const size_type first = start( run );
+        return std::make_pair( values_.begin() + first,
+                               values_.begin() + ( run == runs_.size() ? first : start( run+1 ) ) );
+    }
+    std::pair<const mapped_type*,const mapped_type*> mapped_range( const key_type& key ) const noexcept
+    {
+        const size_type run = index_.find( runs_, key, compare_ );
+        const size_type first = start( run );
+        return std::make_pair( values_.begin() + first,
+                               values_.begin() + ( run == runs_.size() ? first : start( run+1 ) ) );
+    }
+
+    // Bytes used by the search policy, over and above the entries
+    std::size_t index_memory() const noexcept
+    { return index_.memory(); }
+
+    void swap( vmultimap& that )
+    {
+        using std::swap;
+        runs_.swap( that.runs_ );
+        values_.swap( that.values_ );
+        index_.swap( that.index_ );
+        swap( compare_, that.compare_ );
+    }
+private:
+    typedef vmap_detail::key_runs<key_type,allocator_type> runs_type;
+    typedef vmap_detail::fixed_array<mapped_type,typename vmap_detail::rebind_alloc<Allocator,mapped_type>::type> mapped_values_type;
+    typedef typename search_type::template index<key_type,key_compare,allocator_type>::type index_type;
+
+    // Sort entries, and take them over
+    void adopt( vector_type& entries )
+    {
+        vmap_detail::sort_runs( entries, compare_ );
+        runs_.assign( entries.begin(), entries.size(), compare_, true );
+        values_.assign_moved( entries.begin(), entries.size(), vmap_detail::select_second() );
+        vector_type( entries.get_allocator() ).swap( entries );
+        index_.build( runs_, compare_ );
+    }
+
+    size_type start( size_type run ) const noexcept
+    { return runs_.start( run, values_.size() ); }
+
+    iterator at_run( size_type run ) noexcept
+    { return iterator( runs_.keys(), runs_.starts(), values_.begin(), run, start( run ) ); }
+    const_iterator at_run( size_type run ) const noexcept
+    { return const_iterator( runs_.keys(), runs_.starts(), values_.begin(), run, start( run ) ); }
+
+    runs_type runs_;
+    mapped_values_type values_;
+    index_type index_;
+    key_compare compare_;
+};
+
+#ifdef VMAP_CONFIG_THREADS
+// Publishes successive versions of a table (a vmap, usually) to any number
+// of reader threads, RCU style. Readers never block, never retry, and
+// write only to a cache line of their own; the writer swaps a new table in
+// with one atomic exchange, then waits for any readers still using the old
+// table to finish with it before freeing it.
+//
+// Each reader thread makes itself a 'reader' (registering with the
+// publisher), then takes a 'snapshot' around each bit of work it does:
+//
+//    vmap_publisher<table_type>::reader reader( publisher );
+//    ...
+//    {
+//        vmap_publisher<table_type>::snapshot table( reader );
+//        table->find( key );
+//    }
+//
+// A snapshot pins the table that was current when it was taken, so keep
+// them short: the next publish() waits for it. A reader has one snapshot
+// at a time, and belongs to one thread.
+template<typename Table>
+class vmap_publisher
+{
+    struct node
+    {
+        explicit node( Table&& t ) : table( std::move(t) ) {}
+        Table table;
+    };
+
+    // What a reader tells the writer: the epoch its snapshot started in,
+    // or 0 if it hasn't got one.
+    struct alignas(64) slot
+    {
+        slot() : epoch( 0 ) {}
+        std::atomic<uint64_t> epoch;
+
+        // A cache line to itself, whatever alignment the global new gives
+        // (before C++17, no more than a max_align_t's): over-allocate,
+        // start on the next line, and keep what new returned just before
+        // it, for delete
+        static void* operator new( std::size_t size )
+        {
+            void* const block = ::operator new( size + line_bytes + sizeof(void*) );
+            const uintptr_t address = ( reinterpret_cast<uintptr_t>( block ) + sizeof(void*) + line_bytes - 1 )
+                                    & ~uintptr_t(line_bytes - 1);
+            reinterpret_cast<void**>( address )[-1] = block;
+            return reinterpret_cast<void*>( address );
+        }
+        static void operator delete( void* line ) noexcept
+        {
+            if( line )
+                ::operator delete( static_cast<void**>( line )[-1] );
+        }
+        enum { line_bytes = 64 };
+    };
 public:
-    typedef KeyType key_type;
-    typedef MappedType mapped_type;
-    typedef Predicate key_compare;
-    typedef Allocator allocator_type;
-    // FIXME: This should be const key_type
-    typedef std::pair<key_type,mapped_type> value_type;
+    typedef Table table_type;
 
-    // FIXME: Implementation details: Probably ought to privatise these...
-    typedef vmap<key_type,mapped_type,key_compare,allocator_type> this_type;
-    typedef std::vector<value_type,allocator_type> impl_type;
-    
-    typedef typename impl_type::size_type size_type;
+    class snapshot;
 
-    typedef typename impl_type::const_iterator         iterator;
-    typedef typename impl_type::const_iterator         const_iterator;
-    typedef typename impl_type::const_reverse_iterator reverse_iterator;
-    typedef typename impl_type::const_reverse_iterator const_reverse_iterator;
+    class reader
+    {
+    public:
+        explicit reader( vmap_publisher& publisher )
+          : publisher_( publisher )
+          , slot_( publisher.enrol() )
+        {}
+        ~reader()
+        { publisher_.leave( slot_ ); }
 
-    // defaults are ok for:
-    // - dtor
-    // - copy ctor
-    // - assign
+        reader( const reader& ) = delete;
+        reader& operator=( const reader& ) = delete;
+    private:
+        friend class vmap_publisher::snapshot;
 
-    // - default ctor
-    vmap() {}
+        // Wait-free: announce the epoch, then read the table pointer. If the
+        // writer has moved on to a new epoch by the time we announce, we're
+        // bound to see its table.
+        const Table& acquire() noexcept
+        {
+            slot_->epoch.store( publisher_.epoch_.load( std::memory_order_seq_cst ), std::memory_order_seq_cst );
+            return publisher_.current_.load( std::memory_order_seq_cst )->table;
+        }
+        void release() noexcept
+        { slot_->epoch.store( 0, std::memory_order_release ); }
 
-    explicit vmap( const allocator_type& allocator )
-    : vector_( allocator )
-    {}
-#ifdef VMAP_CONFIG_MOVE
-    explicit vmap( allocator_type&& allocator )
-    : vector_( std::move(allocator) )
+        vmap_publisher& publisher_;
+        slot* slot_;
+    };
+
+    class snapshot
+    {
+    public:
+        explicit snapshot( reader& r ) noexcept
+          : reader_( r )
+          , table_( r.acquire() )
+        {}
+        ~snapshot()
+        { reader_.release(); }
+
+        snapshot( const snapshot& ) = delete;
+        snapshot& operator=( const snapshot& ) = delete;
+
+        const Table& operator*() const noexcept  { return table_; }
+        const Table* operator->() const noexcept { return &table_; }
+    private:
+        reader& reader_;
+        const Table& table_;
+    };
+
+    explicit vmap_publisher( Table table = Table() )
+      : current_( new node( std::move(table) ) )
+      , epoch_( 1 )
     {}
-#endif
 
-    // TODO: templatize on map's Allocator
-    // Q: Should be allow that to differ from vmap's allocator type?
-    // A: Yes.
-    // ... but where do we get the vector's allocator from?
-    // (currently, it's default constructed - which is find for most allocator types, but you never know)
-    explicit vmap( const std::map<key_type,mapped_type,key_compare>& map )
-      : compare_( map.key_comp() )
+    // There mustn't be any readers left
+    ~vmap_publisher()
+    { delete current_.load(); }
+
+    vmap_publisher( const vmap_publisher& ) = delete;
+    vmap_publisher& operator=( const vmap_publisher& ) = delete;
+
+    // Swap in a new table. Returns once no reader can still see the old
+    // one (which is then destroyed). Publishers are serialised.
+    void publish( Table table )
+    {
+        node* fresh = new node( std::move(table) );
+        std::lock_guard<std::mutex> lock( mutex_ );
+        node* stale = current_.exchange( fresh, std::memory_order_seq_cst );
+        const uint64_t epoch = epoch_.fetch_add( 1, std::memory_order_seq_cst ) + 1;
+        for( std::size_t i = 0 ; i < slots_.size() ; ++i )
+        {
+            for( ;; )
+            {
+                const uint64_t seen = slots_[i]->epoch.load( std::memory_order_seq_cst );
+                if( seen == 0 || seen >= epoch )
+                    break;
+                std::this_thread::yield();
+            }
+        }
+        delete stale;
+    }
+private:
+    slot* enrol()
     {
-        vector_.reserve(map.size());
-        vector_.insert(vector_.end(),map.begin(),map.end());
+        std::unique_ptr<slot> fresh( new slot );
+        std::lock_guard<std::mutex> lock( mutex_ );
+        slots_.push_back( fresh.get() );
+        return fresh.release();
     }
-    // TODO: Consider a map&& ctor??
 
-#ifdef VMAP_CONFIG_MOVE
-    // Move ctor
-    vmap( vmap&& that )
-      : vector_( std::move(that.vector_) )
-      , compare_( std::move(that.compare_))
+    void leave( slot* s ) noexcept
     {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        slots_.erase( std::find( slots_.begin(), slots_.end(), s ) );
+        delete s;
     }
-    // Move-assignment
-    vmap& operator=( vmap&& that )
+
+    std::atomic<node*> current_;
+    std::atomic<uint64_t> epoch_;
+    std::mutex mutex_;           // Guards slots_, and serialises publish()
+    std::vector<slot*> slots_;
+};
+#endif
+
+namespace vmap_detail
+{
+    // Allocations of this much or more get huge pages of their own
+    const std::size_t huge_page_size = std::size_t(1) << 21;
+
+    inline std::size_t huge_page_round( std::size_t bytes ) noexcept
+    { return ( bytes + huge_page_size - 1 ) & ~( huge_page_size - 1 ); }
+
+    inline void* huge_allocate( std::size_t bytes )
     {
-        vector_ = std::move(that.vector_);
-        compare_ = std::move(that.compare_);
-        return *this;
+#if VMAP_MMAP && defined(MAP_ANONYMOUS)
+        if( bytes >= huge_page_size )
+        {
+            const std::size_t length = huge_page_round( bytes );
+#ifdef MAP_HUGETLB
+            // Explicit huge pages: only if some have been reserved
+            void* pages = ::mmap( 0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+            if( pages != MAP_FAILED )
+                return pages;
+#endif
+            // Ordinary pages, aligned to a huge page (map a huge page more
+            // than we need, and trim the ends off), so that the kernel can
+            // use transparent huge pages for them
+            void* mapped = ::mmap( 0, length + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if( mapped == MAP_FAILED )
+                throw std::bad_alloc();
+            char* const raw = static_cast<char*>( mapped );
+            char* const aligned = raw + ( huge_page_size - reinterpret_cast<uintptr_t>( raw ) % huge_page_size ) % huge_page_size;
+            if( aligned != raw )
+                ::munmap( raw, static_cast<std::size_t>( aligned - raw ) );
+            ::munmap( aligned + length, static_cast<std::size_t>( raw + huge_page_size - aligned ) );
+#ifdef MADV_HUGEPAGE
+            ::madvise( aligned, length, MADV_HUGEPAGE );
+#endif
+            return aligned;
+        }
+#endif
+        return ::operator new( bytes );
     }
+
+    inline void huge_deallocate( void* pages, std::size_t bytes ) noexcept
+    {
+#if VMAP_MMAP && defined(MAP_ANONYMOUS)
+        if( bytes >= huge_page_size )
+        {
+            ::munmap( pages, huge_page_round( bytes ) );
+            return;
+        }
 #endif
+        ::operator delete( pages );
+    }
+}
+
+// An allocator for big tables: each allocation of a huge page (2MB) or
+// more gets huge pages of its own, so that lookups all over the table
+// don't miss the TLB on every probe. It asks for explicit huge pages
+// (MAP_HUGETLB) first, which works if some have been reserved
+// (vm.nr_hugepages); failing that, ordinary pages aligned to 2MB, with a
+// request for transparent huge pages (MADV_HUGEPAGE), which the kernel
+// may or may not act on. Smaller allocations, and everything on systems
+// without mmap, come from operator new.
+template<typename T>
+class vmap_huge_page_allocator
+{
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    template<typename U> struct rebind { typedef vmap_huge_page_allocator<U> other; };
 
+    vmap_huge_page_allocator() noexcept {}
+    template<typename U>
+    vmap_huge_page_allocator( const vmap_huge_page_allocator<U>& ) noexcept {}
 
-    // The usual suspects...
-    size_type size() const noexcept
-    { return vector_.size(); }
-    bool empty() const noexcept
-    { return vector_.empty(); }
-    size_type max_size() const noexcept
-    { return vector_.max_size(); }
+    pointer allocate( size_type count, const void* = 0 )
+    {
+        if( count > max_size() )
+            throw std::bad_alloc();
+        return static_cast<pointer>( vmap_detail::huge_allocate( count * sizeof(T) ) );
+    }
+    void deallocate( pointer data, size_type count ) noexcept
+    { vmap_detail::huge_deallocate( data, count * sizeof(T) ); }
 
-    allocator_type get_allocator() const noexcept
-    { return vector_.get_allocator(); }
-    key_compare key_comp() const noexcept
-    { return compare_; }
+    size_type max_size() const noexcept
+    { return std::numeric_limits<size_type>::max() / sizeof(T); }
 
-    iterator               begin()          noexcept { return vector_.begin();  }
-    iterator               end()            noexcept { return vector_.end();    }
-    reverse_iterator       rbegin()         noexcept { return vector_.rbegin(); }
-    reverse_iterator       rend()           noexcept { return vector_.rend();   }
-
-    const_iterator         begin()    const noexcept { return vector_.begin();  }
-    const_iterator         end()      const noexcept { return vector_.end();    }
-    const_reverse_iterator rbegin()   const noexcept { return vector_.rbegin(); }
-    const_reverse_iterator rend()     const noexcept { return vector_.rend();   }
-#ifdef VMAP_CONFIG_CBEGIN
-    const_iterator         cbegin()   const noexcept { return vector_.cbegin();  }
-    const_iterator         cend()     const noexcept { return vector_.cend();    }
-    const_reverse_iterator crbegin()  const noexcept { return vector_.crbegin(); }
-    const_reverse_iterator crend()    const noexcept { return vector_.crend();   }
-#else
-    const_iterator         cbegin()   const noexcept { return vector_.begin();  }
-    const_iterator         cend()     const noexcept { return vector_.end();    }
-    const_reverse_iterator crbegin()  const noexcept { return vector_.rbegin(); }
-    const_reverse_iterator crend()    const noexcept { return vector_.rend();   }
+#if __cplusplus < 201103L
+    pointer address( reference value ) const { return &value; }
+    const_pointer address( const_reference value ) const { return &value; }
+    void construct( pointer place, const T& value ) { ::new( static_cast<void*>( place ) ) T( value ); }
+    void destroy( pointer place ) { place->~T(); }
 #endif
+};
 
-    const_iterator lower_bound( const key_type& key ) const noexcept
+template<typename T, typename U>
+bool operator==( const vmap_huge_page_allocator<T>&, const vmap_huge_page_allocator<U>& ) noexcept
+{ return true; }
+template<typename T, typename U>
+bool operator!=( const vmap_huge_page_allocator<T>&, const vmap_huge_page_allocator<U>& ) noexcept
+{ return false; }
+
+namespace vmap_detail
+{
+    // The first line of a (small) file, such as those in /sys; empty if
+    // there's no such file
+    inline std::string read_line( const std::string& path )
     {
-        const_iterator start = begin();
-        size_type length = size();
-        while( length > 0 )
+        std::string line;
+        if( std::FILE* file = std::fopen( path.c_str(), "r" ) )
         {
-            const size_type offset = length / 2;
-            const const_iterator midpt = start + offset;
-            const value_type& value = *midpt;
-            if( compare_( value.first, key ) )
-            {
-                // value < key - search the upper half
-                start = midpt + 1;
-                length -= offset+1;
-            }
-            else
-            {
-                // value >= key; search the lower half
-                length = offset;
-            }
+            char buffer[4096];
+            if( std::fgets( buffer, sizeof(buffer), file ) )
+                line = buffer;
+            std::fclose( file );
         }
-        return start;
+        return line;
     }
 
-    const_iterator upper_bound( const key_type& key ) const noexcept
+    // A kernel CPU or node list, such as "0-3,8,10-11"
+    inline std::vector<unsigned> parse_cpu_list( const std::string& text )
     {
-        const_iterator start = begin();
-        size_type length = size();
-        while( length > 0 )
+        std::vector<unsigned> result;
+        const char* next = text.c_str();
+        for( ;; )
         {
-            const size_type offset = length / 2;
-            const const_iterator midpt = start + offset;
-            const value_type& value = *midpt;
-            if( !compare_( key, value.first ) )
+            char* end;
+            const unsigned long first = std::strtoul( next, &end, 10 );
+            if( end == next )
+                break;
+            unsigned long last = first;
+            next = end;
+            if( *next == '-' )
             {
-                start = midpt+1;
-                length -= offset+1;
-            }
-            else
-            {
-                length = offset;
+                last = std::strtoul( next + 1, &end, 10 );
+                if( end == next + 1 || last < first )
+                    break;
+                next = end;
             }
+            for( unsigned long cpu = first ; cpu <= last ; ++cpu )
+                result.push_back( static_cast<unsigned>( cpu ) );
+            if( *next != ',' )
+                break;
+            ++next;
         }
-        return start;
-    }    
+        return result;
+    }
 
-    std::pair<const_iterator,const_iterator> equal_range( const key_type& key ) const noexcept
+    // The online NUMA nodes' CPUs, from /sys. Empty if there's no telling
+    // (not Linux, or no /sys).
+    inline std::vector<std::vector<unsigned> > numa_node_cpus()
     {
-        const_iterator start = begin();
-        size_type length = size();
-        while( length > 0 )
+        std::vector<std::vector<unsigned> > node_cpus;
+#if VMAP_NUMA
+        const std::vector<unsigned> nodes = parse_cpu_list( read_line( "/sys/devices/system/node/online" ) );
+        for( std::size_t i = 0 ; i < nodes.size() ; ++i )
+        {
+            char path[64];
+            std::sprintf( path, "/sys/devices/system/node/node%u/cpulist", nodes[i] );
+            const std::vector<unsigned> cpus = parse_cpu_list( read_line( path ) );
+            // (Nodes with memory but no CPUs have nobody to be local to)
+            if( !cpus.empty() )
+                node_cpus.push_back( cpus );
+        }
+#endif
+        return node_cpus;
+    }
+
+    // Run this thread on the given CPUs, for as long as we're in scope.
+    // Does nothing if it can't (no CPUs, not Linux, or not allowed).
+    class cpu_pin
+    {
+    public:
+        explicit cpu_pin( const std::vector<unsigned>& cpus )
+          : pinned_( false )
         {
-            const size_type offset = length/2;
-            const const_iterator midpt = start+offset;
-            const value_type& value = *midpt;
-            if( compare_( value.first, key ) )
+#if VMAP_NUMA
+            if( cpus.empty() || sched_getaffinity( 0, sizeof(saved_), &saved_ ) != 0 )
+                return;
+            cpu_set_t wanted;
+            CPU_ZERO( &wanted );
+            for( std::size_t i = 0 ; i < cpus.size() ; ++i )
+                if( cpus[i] < CPU_SETSIZE )
+                    CPU_SET( cpus[i], &wanted );
+            pinned_ = sched_setaffinity( 0, sizeof(wanted), &wanted ) == 0;
+#else
+            (void)cpus;
+#endif
+        }
+        ~cpu_pin()
+        {
+#if VMAP_NUMA
+            if( pinned_ )
+                sched_setaffinity( 0, sizeof(saved_), &saved_ );
+#endif
+        }
+    private:
+        cpu_pin( const cpu_pin& );
+        cpu_pin& operator=( const cpu_pin& );
+
+        bool pinned_;
+#if VMAP_NUMA
+        cpu_set_t saved_;
+#endif
+    };
+}
+
+// A read-only table, copied once for each NUMA node, so that each thread
+// can look things up in memory which is local to it. Each copy is made by
+// this thread while it's running on one of its node's CPUs, so the
+// kernel's usual first-touch policy puts its pages on that node; no
+// libnuma needed. local() picks the copy for the CPU this thread is on.
+//
+// With one node, or if the nodes can't be found (not Linux), there's just
+// the one copy, and local() is it. Table needs a copy constructor; vmap,
+// with any allocator (vmap_huge_page_allocator, say), will do.
+template<typename Table>
+class vmap_replicated
+{
+public:
+    typedef Table table_type;
+
+    explicit vmap_replicated( const Table& table )
+    {
+        const std::vector<std::vector<unsigned> > node_cpus = vmap_detail::numa_node_cpus();
+        try
+        {
+            if( node_cpus.size() < 2 )
             {
-                // value < key - go high
-                start = midpt+1;
-                length -= offset+1;
+                replicas_.push_back( new Table( table ) );
+                return;
             }
-            else if( compare_( key, value.first ) )
+            replicas_.reserve( node_cpus.size() );
+            for( std::size_t node = 0 ; node < node_cpus.size() ; ++node )
             {
-                // key < value - go low
-                length = offset;
+                const vmap_detail::cpu_pin pin( node_cpus[node] );
+                replicas_.push_back( new Table( table ) );
+                for( std::size_t i = 0 ; i < node_cpus[node].size() ; ++i )
+                {
+                    const unsigned cpu = node_cpus[node][i];
+                    if( cpu >= replica_of_cpu_.size() )
+                        replica_of_cpu_.resize( cpu + 1, 0 );
+                    replica_of_cpu_[cpu] = node;
+                }
             }
-            else
+        }
+        catch( ... )
+        {
+            clear();
+            throw;
+        }
+    }
+
+    ~vmap_replicated()
+    { clear(); }
+
+    // The number of copies: one per node
+    std::size_t replicas() const noexcept
+    { return replicas_.size(); }
+
+    const Table& replica( std::size_t index ) const noexcept
+    { return *replicas_[index]; }
+
+    // The copy on this thread's node - the node it's on now, that is:
+    // unless the thread is pinned to a node, it may move, so call this for
+    // each piece of work rather than once per thread.
+    const Table& local() const noexcept
+    {
+#if VMAP_NUMA
+        if( replicas_.size() > 1 )
+        {
+            const int cpu = sched_getcpu();
+            if( cpu >= 0 && static_cast<std::size_t>( cpu ) < replica_of_cpu_.size() )
+                return *replicas_[ replica_of_cpu_[cpu] ];
+        }
+#endif
+        return *replicas_[0];
+    }
+private:
+    // Not copyable: the replicas are ours
+    vmap_replicated( const vmap_replicated& );
+    vmap_replicated& operator=( const vmap_replicated& );
+
+    void clear() noexcept
+    {
+        for( std::size_t i = 0 ; i < replicas_.size() ; ++i )
+            delete replicas_[i];
+        replicas_.clear();
+    }
+
+    std::vector<Table*> replicas_;
+    std::vector<std::size_t> replica_of_cpu_;
+};
+
+namespace vmap_detail
+{
+    // The start of a vmap_save file. The keys start at keys_offset, and the
+    // mapped values at values_offset; both are multiples of file_alignment.
+    struct file_header
+    {
+        char     magic[8];
+        uint32_t byte_order;  // file_byte_order, in the writer's byte order
+        uint32_t version;
+        uint32_t key_size;
+        uint32_t mapped_size;
+        uint64_t count;
+        uint64_t keys_offset;
+        uint64_t values_offset;
+    };
+
+    const char     file_magic[8]   = { 'v', 'm', 'a', 'p', 'f', 'i', 'l', 'e' };
+    const uint32_t file_byte_order = 0x01020304;
+    const uint32_t file_version    = 1;
+    const uint64_t file_alignment  = 64;
+
+    inline uint64_t file_align( uint64_t offset ) noexcept
+    { return (offset + file_alignment - 1) / file_alignment * file_alignment; }
+
+    // Buffered, throwing, write-only file
+    class file_writer
+    {
+    public:
+        explicit file_writer( const char* path )
+          : file_( std::fopen( path, "wb" ) )
+          , offset_( 0 )
+        {
+            if( !file_ )
+                throw std::runtime_error( "vmap_save: can't create file" );
+        }
+        ~file_writer()
+        {
+            if( file_ )
+                std::fclose( file_ );
+        }
+
+        void write( const void* data, std::size_t size )
+        {
+            if( size > 0 && std::fwrite( data, 1, size, file_ ) != size )
+                throw std::runtime_error( "vmap_save: write failed" );
+            offset_ += size;
+        }
+
+        // Zero-fill up to offset
+        void pad( uint64_t offset )
+        {
+            static const char zeros[file_alignment] = {};
+            while( offset_ < offset )
+                write( zeros, static_cast<std::size_t>( std::min<uint64_t>( offset - offset_, file_alignment ) ) );
+        }
+
+        void close()
+        {
+            std::FILE* file = file_;
+            file_ = 0;
+            if( std::fclose( file ) != 0 )
+                throw std::runtime_error( "vmap_save: write failed" );
+        }
+    private:
+        file_writer( const file_writer& );
+        file_writer& operator=( const file_writer& );
+
+        std::FILE* file_;
+        uint64_t offset_;
+    };
+
+    // Write project(*iter) for each iter in [first,last), as raw bytes
+    template<typename T, typename InputIterator, typename Project>
+    void write_column( file_writer& out, InputIterator first, InputIterator last, const Project& project )
+    {
+        const std::size_t chunk = 4096;
+        std::vector<char> buffer( chunk * sizeof(T) );
+        std::size_t used = 0;
+        for( ; first != last ; ++first )
+        {
+            std::memcpy( &buffer[used * sizeof(T)], &project( *first ), sizeof(T) );
+            if( ++used == chunk )
             {
-                // got it
-                return std::make_pair(midpt,midpt+1);
+                out.write( &buffer[0], used * sizeof(T) );
+                used = 0;
             }
         }
-        return std::make_pair(end(),end());
+        out.write( &buffer[0], used * sizeof(T) );
+    }
+
+    // The arrays in a mapped file, as something the searches can use
+    template<typename KeyType, typename MappedType>
+    struct view_storage
+    {
+        typedef std::size_t size_type;
+
+        const KeyType*    keys;
+        const MappedType* values;
+        size_type         count;
+
+        view_storage() noexcept : keys( 0 ), values( 0 ), count( 0 ) {}
+
+        size_type size() const noexcept { return count; }
+        const KeyType& key( size_type index ) const noexcept { return keys[index]; }
+    };
+}
+
+// Write vmap to path, in the form vmap_view reads. The key and mapped types
+// must be trivially copyable. Throws std::runtime_error if the write fails.
+template<typename KeyType, typename MappedType, typename Predicate,
+         typename Allocator, typename Layout, typename Search, typename Stats>
+void vmap_save( const vmap<KeyType,MappedType,Predicate,Allocator,Layout,Search,Stats>& map, const char* path )
+{
+#if __cplusplus >= 201103L
+    static_assert( std::is_trivially_copyable<KeyType>::value && std::is_trivially_copyable<MappedType>::value,
+                   "vmap_save: key and mapped types must be trivially copyable" );
+#endif
+    using namespace vmap_detail;
+    file_header header;
+    std::memset( &header, 0, sizeof(header) );
+    std::memcpy( header.magic, file_magic, sizeof(header.magic) );
+    header.byte_order    = file_byte_order;
+    header.version       = file_version;
+    header.key_size      = sizeof(KeyType);
+    header.mapped_size   = sizeof(MappedType);
+    header.count         = map.size();
+    header.keys_offset   = file_align( sizeof(header) );
+    header.values_offset = file_align( header.keys_offset + header.count * sizeof(KeyType) );
+
+    file_writer out( path );
+    out.write( &header, sizeof(header) );
+    out.pad( header.keys_offset );
+    write_column<KeyType>( out, map.begin(), map.end(), select_first() );
+    out.pad( header.values_offset );
+    write_column<MappedType>( out, map.begin(), map.end(), select_second() );
+    out.close();
+}
+
+// Read-only lookups over a file written by vmap_save, which is mmapped
+// rather than loaded: there's no deserialisation, and processes viewing the
+// same file share the one copy in the page cache. Predicate must order the
+// keys the same way as the vmap's did.
+//
+// Iterators are vmap_split style pair-like proxies.
+template<typename KeyType
+        ,typename MappedType
+        ,typename Predicate = std::less<KeyType>
+        >
+class vmap_view
+{
+    typedef vmap_detail::view_storage<KeyType,MappedType> impl_type;
+    typedef vmap_detail::binary_dispatch<vmap_detail::branchless_traits<KeyType,Predicate>::enabled> dispatch;
+public:
+    typedef KeyType key_type;
+    typedef MappedType mapped_type;
+    typedef Predicate key_compare;
+    typedef std::pair<const key_type,mapped_type> value_type;
+    typedef std::size_t size_type;
+
+    // Everything's read-only
+    typedef vmap_detail::split_iterator<key_type,const mapped_type> const_iterator;
+    typedef const_iterator                                          iterator;
+    typedef std::reverse_iterator<const_iterator>                   const_reverse_iterator;
+    typedef const_reverse_iterator                                  reverse_iterator;
+
+    // An empty view
+    vmap_view()
+      : map_( 0 )
+      , length_( 0 )
+    {}
+
+    // Map the file at path. Throws std::runtime_error if it can't be
+    // mapped, or isn't a vmap_save file with our key and mapped types.
+    explicit vmap_view( const char* path, const key_compare& compare = key_compare() )
+      : map_( 0 )
+      , length_( 0 )
+      , compare_( compare )
+    {
+        open( path );
+    }
+
+    ~vmap_view()
+    { unmap(); }
+
+#ifdef VMAP_CONFIG_MOVE
+    vmap_view( vmap_view&& that )
+      : map_( 0 )
+      , length_( 0 )
+    {
+        swap( that );
+    }
+    vmap_view& operator=( vmap_view&& that )
+    {
+        vmap_view( std::move(that) ).swap( *this );
+        return *this;
+    }
+#endif
+
+    size_type size() const noexcept
+    { return storage_.size(); }
+    bool empty() const noexcept
+    { return storage_.size() == 0; }
+    key_compare key_comp() const noexcept
+    { return compare_; }
+
+    const_iterator         begin()    const noexcept { return const_iterator( storage_.keys, storage_.values ); }
+    const_iterator         end()      const noexcept { return begin() + storage_.size(); }
+    const_reverse_iterator rbegin()   const noexcept { return const_reverse_iterator( end() ); }
+    const_reverse_iterator rend()     const noexcept { return const_reverse_iterator( begin() ); }
+    const_iterator         cbegin()   const noexcept { return begin();  }
+    const_iterator         cend()     const noexcept { return end();    }
+    const_reverse_iterator crbegin()  const noexcept { return rbegin(); }
+    const_reverse_iterator crend()    const noexcept { return rend();   }
+
+    const_iterator lower_bound( const key_type& key ) const noexcept
+    {
+        return begin() + dispatch::lower_bound( storage_, 0, storage_.size(), key, compare_ );
+    }
+
+    const_iterator upper_bound( const key_type& key ) const noexcept
+    {
+        return begin() + dispatch::upper_bound( storage_, 0, storage_.size(), key, compare_ );
+    }
+
+    std::pair<const_iterator,const_iterator> equal_range( const key_type& key ) const noexcept
+    {
+        const const_iterator iter = find(key);
+        if( iter == end() )
+            return std::make_pair(end(),end());
+        return std::make_pair(iter,iter+1);
     }
 
     const_iterator find( const key_type& key ) const noexcept
     {
-        const const_iterator iter = lower_bound(key);
-        if( iter != end() )
-        {
-            if( !compare_(key,iter->first) )
-                return iter;
-        }
-        return end();
+        const size_type index = dispatch::lower_bound( storage_, 0, storage_.size(), key, compare_ );
+        return begin() + vmap_detail::found( storage_, index, key, compare_ );
+    }
+
+    // As vmap's: for a key which isn't before start
+    const_iterator lower_bound_from( const_iterator start, const key_type& key ) const noexcept
+    {
+        return begin() + vmap_detail::gallop_lower_bound( storage_, static_cast<size_type>( start - begin() ), key, compare_ );
+    }
+    const_iterator find_from( const_iterator start, const key_type& key ) const noexcept
+    {
+        const size_type index = vmap_detail::gallop_lower_bound( storage_, static_cast<size_type>( start - begin() ), key, compare_ );
+        return begin() + vmap_detail::found( storage_, index, key, compare_ );
     }
 
     // Return the mapped value, or throw std::out_of_range
@@ -226,35 +7051,110 @@ public:
         const const_iterator iter = find(key);
         if( iter == end() )
         {
-            throw std::out_of_range("vmap: key not found");
+            throw std::out_of_range("vmap_view: key not found");
         }
         return iter->second;
     }
 
-    // I find these to be handy:
-
     // Return the mapped value for key, or defalt if non present
     const mapped_type& get( const key_type& key, const mapped_type& defalt ) const noexcept
     {
         const_iterator iter = find(key);
         return ( iter == end() ) ? defalt : iter->second;
     }
-    // Return the mapped value for key, or mapped_type() if non present
-    mapped_type get( const key_type& key ) const noexcept
+    // Return the mapped value for key, or a (shared) mapped_type() if
+    // non present
+    const mapped_type& get( const key_type& key ) const noexcept
     {
         const_iterator iter = find(key);
-        return ( iter == end() ) ? mapped_type() : iter->second;
+        return ( iter == end() ) ? vmap_detail::missing_mapped<mapped_type>() : iter->second;
     }
 
-
-    void swap( vmap& that )
+    void swap( vmap_view& that ) noexcept
     {
         using std::swap;
-        vector_.swap(that.vector_);
+        swap( map_, that.map_ );
+        swap( length_, that.length_ );
+        swap( storage_, that.storage_ );
         swap( compare_, that.compare_ );
     }
 private:
-    impl_type vector_;
+    // Not copyable: the mapping is ours
+    vmap_view( const vmap_view& );
+    vmap_view& operator=( const vmap_view& );
+
+    void open( const char* path )
+    {
+#if VMAP_MMAP
+        const int fd = ::open( path, O_RDONLY );
+        if( fd < 0 )
+            throw std::runtime_error( "vmap_view: can't open file" );
+        struct stat info;
+        if( ::fstat( fd, &info ) != 0 || info.st_size < static_cast<off_t>( sizeof(vmap_detail::file_header) ) )
+        {
+            ::close( fd );
+            throw std::runtime_error( "vmap_view: not a vmap file" );
+        }
+        void* map = ::mmap( 0, static_cast<std::size_t>( info.st_size ), PROT_READ, MAP_SHARED, fd, 0 );
+        ::close( fd );
+        if( map == MAP_FAILED )
+            throw std::runtime_error( "vmap_view: can't map file" );
+        map_ = map;
+        length_ = static_cast<std::size_t>( info.st_size );
+        const char* error = check();
+        if( error )
+        {
+            unmap();
+            throw std::runtime_error( error );
+        }
+#else
+        (void)path;
+        throw std::runtime_error( "vmap_view: mmap isn't supported here" );
+#endif
+    }
+
+    // Validate the header, and find the arrays. Returns an error message,
+    // or 0 if the file's good.
+    const char* check() noexcept
+    {
+        using namespace vmap_detail;
+        file_header header;
+        std::memcpy( &header, map_, sizeof(header) );
+        if( std::memcmp( header.magic, file_magic, sizeof(header.magic) ) != 0 )
+            return "vmap_view: not a vmap file";
+        if( header.byte_order != file_byte_order )
+            return "vmap_view: file has the wrong byte order";
+        if( header.version != file_version )
+            return "vmap_view: unsupported file version";
+        if( header.key_size != sizeof(key_type) || header.mapped_size != sizeof(mapped_type) )
+            return "vmap_view: file has different key or mapped types";
+        const uint64_t length = length_;
+        if( header.keys_offset % file_alignment != 0 || header.values_offset % file_alignment != 0
+         || header.keys_offset > length || header.values_offset > length
+         || header.count > (length - header.keys_offset) / sizeof(key_type)
+         || header.count > (length - header.values_offset) / sizeof(mapped_type) )
+            return "vmap_view: file is truncated or corrupt";
+        const char* base = static_cast<const char*>( map_ );
+        storage_.keys = reinterpret_cast<const key_type*>( base + header.keys_offset );
+        storage_.values = reinterpret_cast<const mapped_type*>( base + header.values_offset );
+        storage_.count = static_cast<size_type>( header.count );
+        return 0;
+    }
+
+    void unmap() noexcept
+    {
+#if VMAP_MMAP
+        if( map_ )
+            ::munmap( map_, length_ );
+#endif
+        map_ = 0;
+        length_ = 0;
+        storage_ = impl_type();
+    }
+
+    void* map_;
+    std::size_t length_;
+    impl_type storage_;
     key_compare compare_;
 };
 